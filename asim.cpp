@@ -0,0 +1,24 @@
+#include <cstddef>
+#include "asim.h"
+#include "guest_mem.h"
+
+void reportRuntimeError(const char *format, ...);
+
+__thread AsmSimulator *AsmSimulator::currentSim = NULL;
+__thread MemPool *node_pool = NULL;
+__thread MemPool *tk_pool = NULL;
+
+/* Reports the error when the programs cannot call native functions */
+bool AsmSimulator::checkNativeCalls()
+{
+    if (!nativeCalls) {
+        reportRuntimeError("Native calls are disabled in this mode.\n");
+        return false;
+    }
+    if (!GMEM_NATIVE_CALLS) {
+        reportRuntimeError(GMEM_NO_NATIVE_CALLS_MSG);
+        return false;
+    }
+
+    return true;
+}
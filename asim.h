@@ -0,0 +1,90 @@
+/* 
+ * File:   asim.h
+ *
+ * Common interface of the simulators and the state of the calling thread.
+ */
+
+#ifndef ASIM_H
+#define ASIM_H
+
+#include <cstdio>
+
+class MemPool;
+
+/* The state of a simulator hangs off its object.  The nodes and the tokens
+ * are allocated with operator new, which cannot take the simulator, and
+ * reportRuntimeError takes the line from the simulator that is running, so
+ * the thread keeps which simulator and which pools it is working with.
+ * They are bound with scopes that restore the previous binding when they
+ * end, so #exec can nest and each thread can drive its own simulator.
+ */
+class AsmSimulator
+{
+public:
+    AsmSimulator() {
+        output = stdout;
+        errorOutput = NULL;
+        nativeCalls = true;
+    }
+
+    virtual ~AsmSimulator() { }
+    virtual int getSourceLine() = 0;
+
+    FILE *getOutput() { return output; }
+    void setOutput(FILE *out) { output = out; }
+    FILE *getErrorOutput() { return errorOutput; }
+    void setErrorOutput(FILE *out) { errorOutput = out; }
+    /* The native functions write to the process stdout, past the output
+     * set here, so the runners that capture the output turn them off.
+     */
+    bool getNativeCalls() { return nativeCalls; }
+    void setNativeCalls(bool enabled) { nativeCalls = enabled; }
+    bool checkNativeCalls();
+
+    static AsmSimulator *current() { return currentSim; }
+
+    static __thread AsmSimulator *currentSim;
+
+protected:
+    FILE *output;       //Output of the program and of #show
+    FILE *errorOutput;  //Errors of the simulator, NULL leaves them to reportRuntimeError
+    bool nativeCalls;   //The programs can call native functions
+};
+
+extern __thread MemPool *node_pool;     //Nodes of the syntax trees
+extern __thread MemPool *tk_pool;       //Tokens given to the parser
+
+/* Sets a pointer of the thread until the end of the scope */
+template <typename T>
+class ThreadBinding
+{
+public:
+    ThreadBinding(T *&slot, T *value): slot(slot) {
+        saved = slot;
+        slot = value;
+    }
+
+    ~ThreadBinding() { slot = saved; }
+
+private:
+    T *&slot;
+    T *saved;
+};
+
+/* The simulator the runtime errors of the thread belong to */
+class SimScope: public ThreadBinding<AsmSimulator>
+{
+public:
+    SimScope(AsmSimulator *sim): ThreadBinding<AsmSimulator>(AsmSimulator::currentSim, sim) { }
+};
+
+/* The nodes parsed in the thread are taken from pool, a program keeps its
+ * nodes until the pool is released.
+ */
+class NodePoolScope: public ThreadBinding<MemPool>
+{
+public:
+    NodePoolScope(MemPool *pool): ThreadBinding<MemPool>(node_pool, pool) { }
+};
+
+#endif /* ASIM_H */
@@ -0,0 +1,234 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "batch.h"
+#include "work_pool.h"
+#include "mips32_sim.h"
+#include "x86_sim.h"
+#include "util.h"
+
+BatchRunner::BatchRunner(const BatchOptions &options, FILE *out)
+{
+    this->options = options;
+    this->out = out;
+    nextRecord = 0;
+    failed = 0;
+    elapsed = 0;
+    pthread_mutex_init(&recordLock, NULL);
+}
+
+BatchRunner::~BatchRunner()
+{
+    pthread_mutex_destroy(&recordLock);
+}
+
+const char *BatchRunner::statusName(int status)
+{
+    switch (status) {
+        case BATCH_OK: return "ok";
+        case BATCH_LOAD_ERROR: return "load_error";
+        case BATCH_STEP_LIMIT: return "step_limit";
+        default: return "runtime_error";
+    }
+}
+
+/* The files of a directory are taken in name order, the list has a path
+ * per line, the empty lines and the ones starting with '#' are skipped.
+ */
+bool BatchRunner::addPath(const string &path)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path.c_str());
+        vector<string> names;
+        struct dirent *entry;
+
+        if (dir == NULL)
+            return false;
+
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+
+            if (len > 4 && strcmp(entry->d_name + len - 4, ".asm") == 0)
+                names.push_back(entry->d_name);
+        }
+        closedir(dir);
+
+        sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); i++)
+            files.push_back(path + "/" + names[i]);
+    } else if (!readListFile(path, files)) {
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t BatchRunner::run()
+{
+    WorkPool pool((options.threads > 0)? options.threads : WorkPool::getCoreCount());
+    struct timeval start, end;
+
+    results.assign(files.size(), BatchResult());
+    for (size_t i = 0; i < results.size(); i++)
+        results[i].done = false;
+    nextRecord = 0;
+    failed = 0;
+
+    gettimeofday(&start, NULL);
+    pool.run(files.size(), runJob, this);
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    fflush(out);
+
+    return failed;
+}
+
+void BatchRunner::runJob(void *arg, uint32_t job)
+{
+    BatchRunner *runner = (BatchRunner *)arg;
+
+    runner->execute(job);
+    runner->finish(job);
+}
+
+template <typename Sim, typename Inst>
+static int runProgram(Sim &sim, istream *in)
+{
+    vector<Inst> code;
+    map<string, uint32_t> labelMap;
+
+    if (!sim.loadFile(in, code, labelMap))
+        return BATCH_LOAD_ERROR;
+
+    if (sim.run(code, labelMap))
+        return BATCH_OK;
+
+    return sim.stepLimitReached()? BATCH_STEP_LIMIT : BATCH_RUNTIME_ERROR;
+}
+
+/* Each program has its own simulator, pool of nodes and output streams */
+void BatchRunner::execute(uint32_t job)
+{
+    BatchResult &result = results[job];
+    const string &file = files[job];
+    OutputCapture out_cap(BATCH_MAX_OUTPUT), err_cap(BATCH_MAX_OUTPUT);
+    FILE *prog_out = out_cap.open();
+    FILE *prog_err = err_cap.open();
+    uint64_t max_steps = (options.maxSteps != 0)? options.maxSteps : BATCH_DEFAULT_MAX_STEPS;
+    int input = open((file + BATCH_INPUT_SUFFIX).c_str(), O_RDONLY);
+    ifstream in(file.c_str());
+    MemPool pool;
+    NodePoolScope nodes(&pool);
+
+    if (input < 0)
+        input = open("/dev/null", O_RDONLY);
+
+    result.steps = 0;
+    result.exitCode = 0;
+
+    if (prog_out == NULL || prog_err == NULL) {
+        result.status = BATCH_RUNTIME_ERROR;
+        result.errors = "Cannot capture the output of the program\n";
+    } else if (!in.is_open()) {
+        result.status = BATCH_LOAD_ERROR;
+        fprintf(prog_err, "Cannot open file '%s'\n", file.c_str());
+    } else if (options.mips32) {
+        MIPS32Sim sim;
+
+        sim.setOutput(prog_out);
+        sim.setErrorOutput(prog_err);
+        sim.setNativeCalls(false);
+        sim.setInputFd(input);
+        sim.setThreadedDispatch(options.threadedDispatch);
+        if (options.jit)
+            sim.setJit(true);
+        if (options.flatMem)
+            sim.getMemory()->setFlat();
+        if (!options.cacheDir.empty())
+            sim.setCacheDirectory(options.cacheDir);
+        sim.setMaxSteps(max_steps);
+
+        result.status = runProgram<MIPS32Sim, MDecodedInst>(sim, &in);
+        result.steps = sim.getInstructionCount();
+        result.exitCode = sim.getExitCode();
+    } else {
+        X86Sim sim;
+
+        sim.setOutput(prog_out);
+        sim.setErrorOutput(prog_err);
+        sim.setNativeCalls(false);
+        sim.setThreadedDispatch(options.threadedDispatch);
+        sim.setLazyFlags(options.lazyFlags);
+        if (options.flatMem)
+            sim.getMemory()->setFlat();
+        if (!options.cacheDir.empty())
+            sim.setCacheDirectory(options.cacheDir);
+        sim.setMaxSteps(max_steps);
+
+        result.status = runProgram<X86Sim, XMicroOp>(sim, &in);
+        result.steps = sim.getInstructionCount();
+    }
+
+    if (prog_out != NULL) {
+        fclose(prog_out);
+        result.output.swap(out_cap.data);
+    }
+    if (prog_err != NULL) {
+        fclose(prog_err);
+        result.errors.append(err_cap.data);
+    }
+    result.truncated = out_cap.truncated || err_cap.truncated;
+    if (input >= 0)
+        close(input);
+}
+
+/* Writes the records that are ready, in order */
+void BatchRunner::finish(uint32_t job)
+{
+    pthread_mutex_lock(&recordLock);
+
+    results[job].done = true;
+    if (results[job].status != BATCH_OK)
+        failed++;
+
+    while (nextRecord < results.size() && results[nextRecord].done) {
+        writeRecord(nextRecord);
+
+        //The output is not needed anymore
+        string().swap(results[nextRecord].output);
+        string().swap(results[nextRecord].errors);
+        nextRecord++;
+    }
+
+    pthread_mutex_unlock(&recordLock);
+}
+
+void BatchRunner::writeRecord(uint32_t job)
+{
+    BatchResult &result = results[job];
+
+    fputs("{\"file\":", out);
+    writeJsonString(out, files[job]);
+    fprintf(out, ",\"status\":\"%s\",\"steps\":%llu", statusName(result.status),
+            (unsigned long long)result.steps);
+    if (options.mips32)
+        fprintf(out, ",\"exit_code\":%d", result.exitCode);
+    fputs(",\"output\":", out);
+    writeJsonString(out, result.output);
+    fputs(",\"errors\":", out);
+    writeJsonString(out, result.errors);
+    if (result.truncated)
+        fputs(",\"truncated\":true", out);
+    fputs("}\n", out);
+}
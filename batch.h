@@ -0,0 +1,101 @@
+/*
+ * File:   batch.h
+ *
+ * Runs many programs at once, each one in its own simulator.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Status of a program, the same values as the exit status of --run */
+#define BATCH_OK                0
+#define BATCH_LOAD_ERROR        2
+#define BATCH_RUNTIME_ERROR     3
+#define BATCH_STEP_LIMIT        4
+
+#define BATCH_DEFAULT_MAX_STEPS 100000000ULL   //Used when no limit is given
+#define BATCH_INPUT_SUFFIX      ".in"          //Input of the read system calls
+#define BATCH_MAX_OUTPUT        (1 << 20)      //Output and errors kept of each program
+
+/* Settings of the simulator of each program */
+struct BatchOptions {
+    bool mips32;
+    bool threadedDispatch;
+    bool jit;
+    bool lazyFlags;
+    bool flatMem;
+    string cacheDir;
+    uint64_t maxSteps;
+    int threads;
+
+    BatchOptions() {
+        mips32 = true;
+        threadedDispatch = jit = lazyFlags = flatMem = false;
+        maxSteps = 0;
+        threads = 0;
+    }
+};
+
+struct BatchResult {
+    int status;
+    uint64_t steps;
+    int exitCode;
+    string output;      //Standard output of the program
+    string errors;      //Errors reported while loading or running it
+    bool truncated;     //The output or the errors went over BATCH_MAX_OUTPUT
+    bool done;
+};
+
+/* The programs run on a WorkPool and their output is captured.  A record
+ * is written for each program in the order they were added, as soon as it
+ * and the ones before it are done.  A record is a line with a JSON object:
+ *
+ *   {"file":"a.asm","status":"ok","steps":120,"exit_code":0,"output":"...","errors":""}
+ *
+ * exit_code is written in MIPS32 mode only.  Only the first
+ * BATCH_MAX_OUTPUT bytes of the output and of the errors are kept, when
+ * more were written the record ends with "truncated":true.  If the file
+ * "<program>.in" exists it's the input of the program, otherwise the
+ * input is empty.
+ */
+class BatchRunner
+{
+public:
+    BatchRunner(const BatchOptions &options, FILE *out);
+    ~BatchRunner();
+
+    bool addPath(const string &path);   //A directory or a file with a program per line
+    void addFile(const string &file) { files.push_back(file); }
+    uint32_t getFileCount() { return files.size(); }
+
+    //Returns the number of programs that didn't end normally
+    uint32_t run();
+    double getElapsedTime() { return elapsed; }
+
+    static const char *statusName(int status);
+
+private:
+    static void runJob(void *arg, uint32_t job);
+    void execute(uint32_t job);
+    void finish(uint32_t job);
+    void writeRecord(uint32_t job);
+
+    BatchOptions options;
+    FILE *out;
+    vector<string> files;
+    vector<BatchResult> results;
+    uint32_t nextRecord;        //First record not written yet
+    uint32_t failed;
+    pthread_mutex_t recordLock;
+    double elapsed;
+};
+
+#endif /* BATCH_H */
@@ -0,0 +1,65 @@
+/* Measures the throughput of the batch runner from 1 thread up to the
+ * number of cores (or the given maximum).  Each sample directory is added
+ * many times so the runs are long enough, the records are discarded.
+ *
+ * Usage: batch_bench [max threads]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include "asim.h"
+#include "batch.h"
+#include "work_pool.h"
+#include "bench_util.h"
+
+#define BENCH_COPIES    200
+
+static double runBatch(const char *dir, bool mips32, int threads, FILE *records, uint32_t &count)
+{
+    BatchOptions options;
+
+    options.mips32 = mips32;
+    options.threads = threads;
+
+    BatchRunner runner(options, records);
+
+    for (int i = 0; i < BENCH_COPIES; i++) {
+        if (!runner.addPath(dir)) {
+            fprintf(stderr, "Cannot read '%s', run the bench from the source directory\n", dir);
+            exit(1);
+        }
+    }
+    runner.run();
+    count = runner.getFileCount();
+
+    return runner.getElapsedTime();
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = (argc > 1)? atoi(argv[1]) : WorkPool::getCoreCount();
+    FILE *records = fopen("/dev/null", "w");
+    double base = 0;
+
+    if (records == NULL || max_threads < 1) {
+        fprintf(stderr, "Usage: batch_bench [max threads]\n");
+        return 1;
+    }
+
+    printf("%d cores\n", WorkPool::getCoreCount());
+    for (int threads = 1; threads <= max_threads; ) {
+        uint32_t mips_count, x86_count;
+        double elapsed = runBatch("asm_mips32_samples", true, threads, records, mips_count) +
+                         runBatch("asm_x86_samples", false, threads, records, x86_count);
+        double pps = (mips_count + x86_count) / elapsed;
+
+        if (threads == 1)
+            base = pps;
+        printf("%3d threads %10.1f programs/s  %.2fx\n", threads, pps, pps / base);
+
+        //Powers of two and then the maximum
+        threads = (threads < max_threads && threads * 2 > max_threads)? max_threads : threads * 2;
+    }
+    fclose(records);
+
+    return 0;
+}
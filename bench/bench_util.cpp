@@ -0,0 +1,37 @@
+#include <cstdio>
+#include <cstdarg>
+#include <sys/time.h>
+#include "asim.h"
+#include "bench_util.h"
+
+void reportRuntimeError(const char *format, ...)
+{
+    AsmSimulator *sim = AsmSimulator::current();
+    FILE *out = (sim != NULL && sim->getErrorOutput() != NULL)? sim->getErrorOutput() : stderr;
+    va_list args;
+
+    if (sim != NULL)
+        fprintf(out, "Line %d: ", sim->getSourceLine());
+
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+}
+
+void reportError(const char *format, ...)
+{
+    AsmSimulator *sim = AsmSimulator::current();
+    va_list args;
+
+    va_start(args, format);
+    vfprintf((sim != NULL && sim->getErrorOutput() != NULL)? sim->getErrorOutput() : stderr, format, args);
+    va_end(args);
+}
+
+double now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,19 @@
+/*
+ * File:   bench_util.h
+ *
+ * Helpers shared by the benchmarks, bench_util.cpp is linked into each one.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+/* The errors go to the error output of the simulator running in the
+ * thread, or to stderr.
+ */
+void reportRuntimeError(const char *format, ...);
+void reportError(const char *format, ...);
+
+/* Wall clock time in seconds */
+double now();
+
+#endif /* BENCH_UTIL_H */
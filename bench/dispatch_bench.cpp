@@ -0,0 +1,133 @@
+/* Measures the instructions per second of the execution engines (switch
+ * dispatch, threaded dispatch, MIPS32 JIT and x86 lazy flags), running a
+ * sample program many times.
+ *
+ * Usage: dispatch_bench [mips32 program] [x86 program]
+ */
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include "mips32_sim.h"
+#include "x86_sim.h"
+#include "bench_util.h"
+
+#define BENCH_SECONDS 0.5
+
+/* The sample programs print their results, keep that out of the way */
+static int silenceStdout()
+{
+    int saved;
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+
+    return saved;
+}
+
+static void restoreStdout(int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+template <class Sim, class Code>
+static bool runBench(Sim &sim, Code &code, map<string, uint32_t> &labelMap, double &ips)
+{
+    uint64_t start_count = sim.getInstructionCount();
+    double start, elapsed;
+    int saved = silenceStdout();
+
+    start = now();
+    do {
+        if (!sim.run(code, labelMap)) {
+            restoreStdout(saved);
+            return false;
+        }
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    restoreStdout(saved);
+    ips = (sim.getInstructionCount() - start_count) / elapsed;
+
+    return true;
+}
+
+static void report(const char *isa, const char *file, const char *engine, double ips, double base_ips)
+{
+    printf("%-7s %-36s %-9s %8.2f Minst/s  %.2fx\n", isa, file, engine, ips / 1e6, ips / base_ips);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mips_file = (argc > 1)? argv[1] : "asm_mips32_samples/selectionSort.asm";
+    const char *x86_file = (argc > 2)? argv[2] : "asm_x86_samples/quicksort.asm";
+    double switch_ips, ips;
+
+    {
+        MemPool pool;
+        MIPS32Sim sim;
+        vector<MDecodedInst> code;
+        map<string, uint32_t> labelMap;
+        ifstream in(mips_file);
+
+        NodePoolScope scope(&pool);
+        if (!in.is_open() || !sim.loadFile(&in, code, labelMap)) {
+            fprintf(stderr, "Cannot load '%s'\n", mips_file);
+            return 1;
+        }
+        if (!runBench(sim, code, labelMap, switch_ips)) {
+            fprintf(stderr, "Error running '%s'\n", mips_file);
+            return 1;
+        }
+        report("MIPS32", mips_file, "switch", switch_ips, switch_ips);
+
+        sim.setThreadedDispatch(true);
+        runBench(sim, code, labelMap, ips);
+        report("MIPS32", mips_file, "threaded", ips, switch_ips);
+        sim.setThreadedDispatch(false);
+
+        if (sim.setJit(true)) {
+            runBench(sim, code, labelMap, ips);
+            report("MIPS32", mips_file, "jit", ips, switch_ips);
+        }
+    }
+
+    {
+        MemPool pool;
+        X86Sim sim;
+        vector<XMicroOp> code;
+        map<string, uint32_t> labelMap;
+        ifstream in(x86_file);
+
+        NodePoolScope scope(&pool);
+        if (!in.is_open() || !sim.loadFile(&in, code, labelMap)) {
+            fprintf(stderr, "Cannot load '%s'\n", x86_file);
+            return 1;
+        }
+        if (!runBench(sim, code, labelMap, switch_ips)) {
+            fprintf(stderr, "Error running '%s'\n", x86_file);
+            return 1;
+        }
+        report("x86", x86_file, "switch", switch_ips, switch_ips);
+
+        sim.setThreadedDispatch(true);
+        runBench(sim, code, labelMap, ips);
+        report("x86", x86_file, "threaded", ips, switch_ips);
+
+        uint64_t start_avoided = sim.getAvoidedFlagComputations();
+
+        sim.setThreadedDispatch(false);
+        sim.setLazyFlags(true);
+        runBench(sim, code, labelMap, ips);
+        report("x86", x86_file, "lazyflags", ips, switch_ips);
+        printf("%-7s %-36s %-9s %8.2f M flag computations avoided\n", "x86", x86_file, "lazyflags",
+               (sim.getAvoidedFlagComputations() - start_avoided) / 1e6);
+    }
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* Compares the lockstep lanes with separate runs of the interpreter.
+ * Each lane of a program reads a different seed, the program is run once
+ * per seed with MIPS32Sim (load and run, like exec) and once with all the
+ * seeds as lanes of MIPS32LaneSim.  The "straight" program has no branch
+ * that depends on the seed, so the lanes never split, the "branchy" one
+ * takes a branch on a bit of the seed each iteration.
+ *
+ * Usage: lane_bench
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <unistd.h>
+#include "mips32_sim.h"
+#include "mips32_lanes.h"
+#include "bench_util.h"
+
+#define BENCH_ITERATIONS    20000
+#define BENCH_MAX_LANES     256
+
+/* A xorshift loop, the branchy version counts the odd values */
+static string makeProgram(bool branchy)
+{
+    ostringstream src;
+
+    src << "addi $v0, $zero, 5\n"
+        << "syscall\n"
+        << "move $s0, $v0\n"
+        << "addi $s1, $zero, " << BENCH_ITERATIONS << "\n"
+        << "loop:\n"
+        << "sll $t0, $s0, 13\n"
+        << "xor $s0, $s0, $t0\n"
+        << "srl $t0, $s0, 17\n"
+        << "xor $s0, $s0, $t0\n"
+        << "sll $t0, $s0, 5\n"
+        << "xor $s0, $s0, $t0\n"
+        << "addu $s2, $s2, $s0\n"
+        << "andi $t1, $s0, 1\n";
+    if (branchy) {
+        src << "beq $t1, $zero, even\n"
+            << "addiu $s3, $s3, 1\n"
+            << "even:\n";
+    } else {
+        src << "addu $s3, $s3, $t1\n";
+    }
+    src << "addi $s1, $s1, -1\n"
+        << "bne $s1, $zero, loop\n"
+        << "move $a0, $s3\n"
+        << "addi $v0, $zero, 1\n"
+        << "syscall\n";
+
+    return src.str();
+}
+
+static double runSeparate(const string &src, const vector<int> &inputs, FILE *out)
+{
+    double start = now();
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MIPS32Sim sim;
+        istringstream in(src);
+
+        lseek(inputs[i], 0, SEEK_SET);
+        sim.setInputFd(inputs[i]);
+        sim.setOutput(out);
+        if (!sim.exec(&in))
+            return 0;
+    }
+
+    return now() - start;
+}
+
+static double runLanes(const string &src, const vector<int> &inputs, FILE *out, double &converged)
+{
+    double start = now();
+    MIPS32LaneSim sim;
+    istringstream in(src);
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        lseek(inputs[i], 0, SEEK_SET);
+        sim.addLane(inputs[i], out, NULL);
+    }
+    if (!sim.loadFile(&in) || sim.run() != 0)
+        return 0;
+
+    double elapsed = now() - start;
+    uint64_t steps = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++)
+        steps += sim.getLaneSteps(i);
+    converged = (double)sim.getConvergedSteps() * inputs.size() / steps;
+
+    return elapsed;
+}
+
+int main()
+{
+    FILE *out = fopen("/dev/null", "w");
+    vector<int> seeds;
+
+    if (out == NULL)
+        return 1;
+
+    for (int i = 0; i < BENCH_MAX_LANES; i++) {
+        FILE *f = tmpfile();
+
+        if (f == NULL)
+            return 1;
+        fprintf(f, "%d\n", rand() | 1);
+        fflush(f);
+        seeds.push_back(fileno(f));
+    }
+
+    printf("%s kernels\n", MIPS32LaneSim::getVectorIsa());
+    for (int branchy = 0; branchy <= 1; branchy++) {
+        string src = makeProgram(branchy != 0);
+
+        for (int lanes = 8; lanes <= BENCH_MAX_LANES; lanes *= 4) {
+            vector<int> inputs(seeds.begin(), seeds.begin() + lanes);
+            double converged = 0;
+            double separate = runSeparate(src, inputs, out);
+            double lockstep = runLanes(src, inputs, out, converged);
+
+            if (separate == 0 || lockstep == 0) {
+                fprintf(stderr, "The program failed\n");
+                return 1;
+            }
+            printf("%-8s %3d lanes  separate %8.2f ms  lanes %8.2f ms  %5.2fx  %5.1f%% converged\n",
+                   branchy? "branchy" : "straight", lanes, separate * 1e3, lockstep * 1e3,
+                   separate / lockstep, converged * 100);
+        }
+    }
+    fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/* Measures the throughput (MB/s) of the x86 and MIPS32 lexers on large
+ * synthesized source files.
+ *
+ * Usage: lexer_bench [size in MB]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include "x86_lexer.h"
+#include "mips32_lexer.h"
+#include "bench_util.h"
+
+#define BENCH_ROUNDS 5
+
+static string generateX86(size_t size)
+{
+    static const char *lines[] = {
+        "loop_%d:",
+        "    mov eax, dword ptr [ebp + 8] ; load the argument",
+        "    movzx ecx, byte [esi + edi*4 - 12]",
+        "    cmp eax, 0x7FFF",
+        "    jge done_%d",
+        "    setnle al",
+        "    imul eax, ebx",
+        "    add eax, counter_%d",
+        "    push edx",
+        "    call @libc.printf",
+        "    #show eax hex",
+    };
+    stringstream ss;
+    char line[128];
+    int i = 0;
+
+    while ((size_t)ss.tellp() < size) {
+        snprintf(line, sizeof(line), lines[i % 11], i);
+        ss << line << "\n";
+        i++;
+    }
+
+    return ss.str();
+}
+
+static string generateMips(size_t size)
+{
+    static const char *lines[] = {
+        "loop_%d:",
+        "    lw $t0, 4($sp) ; load the argument",
+        "    addiu $t1, $t0, 0x7FF",
+        "    slt $t2, $t1, $r17",
+        "    bne $t2, $zero, done_%d",
+        "    sll $s0, $s1, 2",
+        "    jal @libc.printf",
+        "    #show $t0 hex",
+        "    sw $ra, counter_%d($gp)",
+    };
+    stringstream ss;
+    char line[128];
+    int i = 0;
+
+    while ((size_t)ss.tellp() < size) {
+        snprintf(line, sizeof(line), lines[i % 9], i);
+        ss << line << "\n";
+        i++;
+    }
+
+    return ss.str();
+}
+
+template <class Lexer>
+static double lexBench(const string &source, int eof_token, uint64_t &tokens)
+{
+    double start = now();
+
+    tokens = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        istringstream in(source);
+        Lexer lexer(&in);
+
+        while (lexer.getNextToken() != eof_token)
+            tokens++;
+    }
+
+    return (double)BENCH_ROUNDS * source.length() / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = ((argc > 1)? atoi(argv[1]) : 8) * 1024 * 1024;
+    uint64_t tokens;
+    double bps;
+
+    string x86_source = generateX86(size);
+    bps = lexBench<X86Lexer>(x86_source, XTK_EOF, tokens);
+    printf("%-7s %8.2f MB/s  %llu tokens\n", "x86", bps / (1024 * 1024), (unsigned long long)tokens / BENCH_ROUNDS);
+
+    string mips_source = generateMips(size);
+    bps = lexBench<Mips32Lexer>(mips_source, MTK_EOF, tokens);
+    printf("%-7s %8.2f MB/s  %llu tokens\n", "MIPS32", bps / (1024 * 1024), (unsigned long long)tokens / BENCH_ROUNDS);
+
+    return 0;
+}
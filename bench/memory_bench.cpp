@@ -0,0 +1,167 @@
+/* Compares the guest memory models: the fixed array used before the paged
+ * memory (globals and stack only), the page table with its software TLB and
+ * the flat reservation.  The loops read and write words through the
+ * translation like the simulators do, then an x86 program is run with the
+ * page table and with the flat backend.
+ *
+ * Usage: memory_bench [x86 program]
+ */
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include "guest_mem.h"
+#include "x86_sim.h"
+#include "bench_util.h"
+
+#define BENCH_ACCESSES      (64 * 1024 * 1024)
+#define BENCH_SECONDS       0.5
+#define SMALL_SET_WORDS     256                 //Fits in the old array
+#define LARGE_SET_WORDS     (4 * 1024 * 1024)   //16 MiB of heap
+#define OLD_GLOBAL_WORDS    256
+#define OLD_STACK_WORDS     256
+
+/* The memory of the simulators before the paged memory */
+class ArrayMemory
+{
+public:
+    ArrayMemory() {
+        stackStart = X_VIRTUAL_STACK_END_ADDR - OLD_STACK_WORDS * 4;
+        memset(mem, 0, sizeof(mem));
+    }
+
+    uint8_t *getPtr(uint32_t vaddr) {
+        uint32_t paddr;
+
+        if (vaddr >= X_VIRTUAL_GLOBAL_START_ADDR && vaddr < X_VIRTUAL_GLOBAL_START_ADDR + OLD_GLOBAL_WORDS * 4)
+            paddr = vaddr - X_VIRTUAL_GLOBAL_START_ADDR;
+        else if (vaddr >= stackStart && vaddr < X_VIRTUAL_STACK_END_ADDR)
+            paddr = (vaddr - stackStart) + OLD_GLOBAL_WORDS * 4;
+        else
+            return NULL;
+
+        return (uint8_t *)mem + paddr;
+    }
+
+private:
+    uint32_t stackStart;
+    uint32_t mem[OLD_GLOBAL_WORDS + OLD_STACK_WORDS];
+};
+
+/* Adds each word of the working set to the next one, the addresses
+ * alternate between the globals and the stack (or the heap).
+ */
+template <class Memory>
+static double accessBench(Memory &memory, uint32_t base1, uint32_t base2, uint32_t words)
+{
+    double start = now();
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < BENCH_ACCESSES / 2; i++) {
+        uint32_t offset = (i % words) * 4;
+        uint32_t *p1 = (uint32_t *)memory.getPtr(base1 + offset);
+        uint32_t *p2 = (uint32_t *)memory.getPtr(base2 - offset - 4);
+
+        if (p1 == NULL || p2 == NULL)
+            return 0;
+
+        sum += *p1;
+        *p2 = sum;
+    }
+
+    return BENCH_ACCESSES / (now() - start);
+}
+
+static void report(const char *test, const char *model, double aps, double base_aps)
+{
+    printf("%-30s %-10s %8.2f Maccess/s  %.2fx\n", test, model, aps / 1e6, aps / base_aps);
+}
+
+static double programBench(const char *file, bool flat)
+{
+    MemPool pool;
+    X86Sim sim;
+    vector<XMicroOp> code;
+    map<string, uint32_t> labelMap;
+    ifstream in(file);
+    double start, elapsed;
+
+    if (flat && !sim.getMemory()->setFlat())
+        return 0;
+
+    NodePoolScope scope(&pool);
+    if (!in.is_open() || !sim.loadFile(&in, code, labelMap))
+        return 0;
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), fd = open("/dev/null", O_WRONLY);
+
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+
+    start = now();
+    do {
+        if (!sim.run(code, labelMap))
+            break;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    return sim.getInstructionCount() / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *x86_file = (argc > 1)? argv[1] : "asm_x86_samples/quicksort.asm";
+    uint32_t heap_end = X_VIRTUAL_HEAP_START_ADDR + LARGE_SET_WORDS * 4;
+    double array_aps, aps;
+
+    {
+        ArrayMemory memory;
+
+        array_aps = accessBench(memory, X_VIRTUAL_GLOBAL_START_ADDR, X_VIRTUAL_STACK_END_ADDR, SMALL_SET_WORDS / 2);
+        report("globals+stack 1 KiB", "array", array_aps, array_aps);
+    }
+    {
+        X86Sim sim;
+        GuestMemory *memory = sim.getMemory();
+
+        aps = accessBench(*memory, X_VIRTUAL_GLOBAL_START_ADDR, X_VIRTUAL_STACK_END_ADDR, SMALL_SET_WORDS / 2);
+        report("globals+stack 1 KiB", "paged", aps, array_aps);
+
+        memory->resetTlbStats();
+        double paged_aps = accessBench(*memory, X_VIRTUAL_HEAP_START_ADDR, heap_end, LARGE_SET_WORDS / 2);
+        report("heap 16 MiB", "paged", paged_aps, paged_aps);
+        printf("%-30s %-10s %8.2f %% TLB hits\n", "heap 16 MiB", "paged",
+               memory->getTlbHits() * 100.0 / (memory->getTlbHits() + memory->getTlbMisses()));
+
+        X86Sim flat_sim;
+        memory = flat_sim.getMemory();
+        if (memory->setFlat()) {
+            aps = accessBench(*memory, X_VIRTUAL_GLOBAL_START_ADDR, X_VIRTUAL_STACK_END_ADDR, SMALL_SET_WORDS / 2);
+            report("globals+stack 1 KiB", "flat", aps, array_aps);
+            aps = accessBench(*memory, X_VIRTUAL_HEAP_START_ADDR, heap_end, LARGE_SET_WORDS / 2);
+            report("heap 16 MiB", "flat", aps, paged_aps);
+        } else
+            printf("The flat backend is not supported in this host.\n");
+    }
+
+    double paged_ips = programBench(x86_file, false);
+
+    if (paged_ips == 0) {
+        fprintf(stderr, "Cannot run '%s'\n", x86_file);
+        return 1;
+    }
+    printf("%-30s %-10s %8.2f Minst/s    %.2fx\n", x86_file, "paged", paged_ips / 1e6, 1.0);
+
+    double flat_ips = programBench(x86_file, true);
+
+    if (flat_ips != 0)
+        printf("%-30s %-10s %8.2f Minst/s    %.2fx\n", x86_file, "flat", flat_ips / 1e6, flat_ips / paged_ips);
+
+    return 0;
+}
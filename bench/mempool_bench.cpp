@@ -0,0 +1,118 @@
+/* Compares the arena MemPool with the previous pool, which kept every
+ * block in a std::set, allocating and releasing blocks with the sizes of
+ * the tokens and AST nodes.  It also measures the load time of a large
+ * generated x86 program.
+ *
+ * Usage: mempool_bench [line count]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include "mempool.h"
+#include "parser_common.h"
+#include "x86_sim.h"
+#include "bench_util.h"
+
+#define BENCH_ROUNDS        50
+#define BLOCKS_PER_ROUND    100000
+
+/* The previous MemPool implementation */
+class SetMemPool
+{
+public:
+    ~SetMemPool() { freeAll(); }
+
+    void *memAlloc(size_t size) {
+        void *result = ::operator new (size);
+
+        nodes.insert(result);
+        return result;
+    }
+
+    void freeAll() {
+        set<void *>::iterator it;
+
+        for (it = nodes.begin(); it != nodes.end(); it++)
+            ::operator delete (*it);
+
+        nodes.clear();
+    }
+
+private:
+    set<void *> nodes;
+};
+
+template <class Pool>
+static double allocBench(Pool &pool)
+{
+    static const size_t sizes[] = { sizeof(TokenInfo), 24, 40, 56, 16, 32 };
+    double start = now();
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BLOCKS_PER_ROUND; i++) {
+            char *p = (char *)pool.memAlloc(sizes[i % 6]);
+            *p = (char)i;
+        }
+        pool.freeAll();
+    }
+
+    return (double)BENCH_ROUNDS * BLOCKS_PER_ROUND / (now() - start);
+}
+
+static string generateProgram(int lines)
+{
+    stringstream ss;
+
+    ss << "mov ecx, " << lines << endl;
+    for (int i = 0; i < lines; i++) {
+        if (i % 8 == 0)
+            ss << "l" << i << ":" << endl;
+        switch (i % 4) {
+            case 0: ss << "add eax, dword [ebp + " << (i % 64) * 4 << "]" << endl; break;
+            case 1: ss << "cmp eax, ecx" << endl; break;
+            case 2: ss << "jl l" << (i / 8) * 8 << endl; break;
+            case 3: ss << "mov byte [esp - 4], al" << endl; break;
+        }
+    }
+
+    return ss.str();
+}
+
+int main(int argc, char *argv[])
+{
+    int lines = (argc > 1)? atoi(argv[1]) : 20000;
+    double set_aps, arena_aps;
+
+    {
+        SetMemPool pool;
+        set_aps = allocBench(pool);
+    }
+    {
+        MemPool pool;
+        arena_aps = allocBench(pool);
+    }
+    printf("%-8s %8.2f Malloc/s  %.2fx\n", "set", set_aps / 1e6, 1.0);
+    printf("%-8s %8.2f Malloc/s  %.2fx\n", "arena", arena_aps / 1e6, arena_aps / set_aps);
+
+    string source = generateProgram(lines);
+    MemPool pool;
+    X86Sim sim;
+    double start = now();
+
+    NodePoolScope scope(&pool);
+    for (int r = 0; r < 5; r++) {
+        vector<XMicroOp> code;
+        map<string, uint32_t> labelMap;
+        istringstream in(source);
+
+        if (!sim.loadFile(&in, code, labelMap)) {
+            fprintf(stderr, "Cannot load the generated program\n");
+            return 1;
+        }
+        pool.freeAll();
+    }
+    printf("load     %8.2f Klines/s (x86, %d lines)\n", 5 * lines / (now() - start) / 1e3, lines);
+
+    return 0;
+}
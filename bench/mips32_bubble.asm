@@ -0,0 +1,34 @@
+; Bubble sort of 64 pseudo random words, used to benchmark the execution engines
+    move $s0, $gp
+    addi $s1, $zero, 64
+    addi $t0, $zero, 0
+    addi $t1, $zero, 12345
+fill:
+    sll $t2, $t0, 2
+    add $t2, $s0, $t2
+    sll $t3, $t1, 5
+    xor $t1, $t1, $t3
+    srl $t3, $t1, 7
+    xor $t1, $t1, $t3
+    andi $t4, $t1, 0x7FFF
+    sw $t4, 0($t2)
+    addi $t0, $t0, 1
+    bne $t0, $s1, fill
+
+    addi $t0, $s1, -1
+outer:
+    addi $t1, $zero, 0
+    move $t2, $s0
+inner:
+    lw $t3, 0($t2)
+    lw $t4, 4($t2)
+    slt $t5, $t4, $t3
+    beq $t5, $zero, no_swap
+    sw $t4, 0($t2)
+    sw $t3, 4($t2)
+no_swap:
+    addi $t2, $t2, 4
+    addi $t1, $t1, 1
+    bne $t1, $t0, inner
+    addi $t0, $t0, -1
+    bgtz $t0, outer
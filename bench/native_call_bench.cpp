@@ -0,0 +1,192 @@
+/* Measures the MIPS32 calls to native functions.  The first test compares
+ * the cost of finding the function and building its frame, with the map
+ * and the spill through the guest stack used before the slot table, and
+ * with the slot table.  The second one runs a program that calls
+ * @libc.abs in a loop and reports the calls per second, the native calls
+ * switch the stack with inline assembly that needs a 32-bit host.  Before
+ * them, a buffer that crosses a page of the globals is filled through its
+ * host address, with memset from the host and with @libc.memset from a
+ * program on a 32-bit host, and read back through the guest addresses.
+ *
+ * Usage: native_call_bench
+ */
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include "mips32_sim.h"
+#include "bench_util.h"
+
+#define BENCH_LOOKUPS       (16 * 1024 * 1024)
+#define BENCH_FUNCTIONS     16
+#define BENCH_CALLS         1000000
+#define CROSS_ADDR          (M_VIRTUAL_DATA_START_ADDR + GMEM_PAGE_SIZE - 16)
+#define CROSS_SIZE          32
+
+static volatile uintptr_t sink;    //Keeps the loops from being removed
+
+/* Before the slot table: the function comes from a map and $a0..$a3 are
+ * written to the guest stack, copied to the host stack and read back.
+ */
+static double mapLookup(GuestMemory &memory, uint32_t regs[4])
+{
+    map<uint32_t, void *> funcs;
+    uint32_t sp = M_VIRTUAL_STACK_END_ADDR;
+    uintptr_t sum = 0;
+    double start;
+
+    for (int i = 0; i < BENCH_FUNCTIONS; i++)
+        funcs[M_VIRTUAL_EXTFUNC_START_ADDR + i * 4] = (void *)(uintptr_t)(i + 1);
+
+    start = now();
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        uint32_t addr = M_VIRTUAL_EXTFUNC_START_ADDR + (i % BENCH_FUNCTIONS) * 4;
+
+        for (int j = 0; j < 4; j++)
+            *(uint32_t *)memory.getWritePtr(sp - 16 + j * 4) = regs[j];
+
+        uint32_t *frame = (uint32_t *)memory.nativeStack(sp - 16);
+
+        for (int j = 0; j < 4; j++)
+            regs[j] = *(uint32_t *)memory.getPtr(sp - 16 + j * 4);
+
+        sum += (uintptr_t)funcs[addr] + frame[0];
+    }
+    sink = sum;
+
+    return BENCH_LOOKUPS / (now() - start);
+}
+
+/* The slot is indexed by the address and only the arguments are copied */
+static double slotLookup(GuestMemory &memory, uint32_t regs[4])
+{
+    vector<MNativeSlot> slots(BENCH_FUNCTIONS);
+    uintptr_t sum = 0;
+    double start;
+
+    for (int i = 0; i < BENCH_FUNCTIONS; i++) {
+        slots[i].hfunc = (HFUNC)(uintptr_t)(i + 1);
+        slots[i].arity = 1;
+    }
+
+    start = now();
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        uint32_t addr = M_VIRTUAL_EXTFUNC_START_ADDR + (i % BENCH_FUNCTIONS) * 4;
+        const MNativeSlot &slot = slots[(addr - M_VIRTUAL_EXTFUNC_START_ADDR) / 4];
+        uint32_t *frame = memory.nativeFrame();
+
+        memcpy(frame, regs, slot.arity * 4);
+        sum += (uintptr_t)slot.hfunc + frame[0];
+    }
+    sink = sum;
+
+    return BENCH_LOOKUPS / (now() - start);
+}
+
+static double callBench()
+{
+    MemPool pool;
+    MIPS32Sim sim;
+    vector<MDecodedInst> code;
+    map<string, uint32_t> labelMap;
+    ostringstream src;
+    double start;
+
+    src << "lui $s1, " << (BENCH_CALLS >> 16) << "\n"
+        << "ori $s1, $s1, " << (BENCH_CALLS & 0xFFFF) << "\n"
+        << "loop:\n"
+        << "addi $a0, $s0, -5\n"
+        << "jal @libc.abs\n"
+        << "addi $s0, $s0, 1\n"
+        << "bne $s0, $s1, loop\n";
+
+    istringstream in(src.str());
+
+    NodePoolScope scope(&pool);
+    if (!sim.loadFile(&in, code, labelMap))
+        return 0;
+
+    start = now();
+    if (!sim.run(code, labelMap))
+        return 0;
+
+    return BENCH_CALLS / (now() - start);
+}
+
+/* True if the CROSS_SIZE bytes at CROSS_ADDR hold value, read a word at a
+ * time through the guest addresses.
+ */
+static bool checkCross(MIPS32Sim &sim, uint8_t value)
+{
+    for (uint32_t offset = 0; offset < CROSS_SIZE; offset += 4) {
+        uint32_t word;
+
+        if (!sim.readWord(CROSS_ADDR + offset, word) || word != value * 0x01010101U)
+            return false;
+    }
+
+    return true;
+}
+
+/* The host address of the buffer has to be valid past the end of its page */
+static bool pageCrossCheck()
+{
+    MIPS32Sim sim;
+
+    memset(sim.getMemory()->getWritePtr(CROSS_ADDR), 0x5A, CROSS_SIZE);
+    if (!checkCross(sim, 0x5A))
+        return false;
+
+    if (sizeof(void *) != 4)
+        return true;
+
+    MemPool pool;
+    vector<MDecodedInst> code;
+    map<string, uint32_t> labelMap;
+    ostringstream src;
+
+    src << "#set $a0 = #paddr(" << CROSS_ADDR << ")\n"
+        << "addi $a1, $zero, 0xA5\n"
+        << "addi $a2, $zero, " << CROSS_SIZE << "\n"
+        << "jal @libc.memset\n";
+
+    istringstream in(src.str());
+
+    NodePoolScope scope(&pool);
+    if (!sim.loadFile(&in, code, labelMap) || !sim.run(code, labelMap))
+        return false;
+
+    return checkCross(sim, 0xA5);
+}
+
+int main()
+{
+    MIPS32Sim sim;
+    uint32_t regs[4] = {1, 2, 3, 4};
+    double map_lps, slot_lps;
+
+    if (!pageCrossCheck()) {
+        fprintf(stderr, "The buffer that crosses a page doesn't match\n");
+        return 1;
+    }
+    printf("%-28s %8s\n", "buffer across a page", "ok");
+
+    map_lps = mapLookup(*sim.getMemory(), regs);
+    printf("%-28s %8.2f Mcalls/s  %.2fx\n", "lookup+frame, map", map_lps / 1e6, 1.0);
+    slot_lps = slotLookup(*sim.getMemory(), regs);
+    printf("%-28s %8.2f Mcalls/s  %.2fx\n", "lookup+frame, slot table", slot_lps / 1e6, slot_lps / map_lps);
+
+    if (sizeof(void *) != 4) {
+        printf("The native calls need a 32-bit host, build with -m32 to run @libc.abs.\n");
+        return 0;
+    }
+
+    double cps = callBench();
+
+    if (cps == 0) {
+        fprintf(stderr, "Cannot run the @libc.abs loop\n");
+        return 1;
+    }
+    printf("%-28s %8.2f Mcalls/s\n", "jal @libc.abs", cps / 1e6);
+
+    return 0;
+}
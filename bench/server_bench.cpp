@@ -0,0 +1,322 @@
+/* Client of the simulation server (EasyASM --serve).
+ *
+ * With a socket and a program it sends one request to a running server and
+ * prints the reply, the program is sent again by its hash as many times as
+ * given.  Without arguments it starts a server on a temporary socket and
+ * runs many clients at once: each client sends a MIPS32 program with its
+ * source the first time and by its hash after that, with a different input
+ * in each request, and checks the output of every reply.  The requests per
+ * second are compared with loading and running the program in a new
+ * simulator for each request, like a process per request does.
+ *
+ * Usage: server_bench [<socket> <program> [<input> [<repeat>]] [--x86]]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "bench_util.h"
+
+#define BENCH_CLIENTS       8
+#define BENCH_REQUESTS      2000    //Per client
+#define BENCH_PIPELINE      4       //Requests sent before waiting for the replies
+
+static int connectTo(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool sendFrame(int fd, const string &payload)
+{
+    uint32_t length = htonl(payload.length());
+    string frame((const char *)&length, 4);
+
+    frame += payload;
+    for (size_t pos = 0; pos < frame.length(); ) {
+        ssize_t n = send(fd, frame.data() + pos, frame.length() - pos, MSG_NOSIGNAL);
+
+        if (n <= 0)
+            return false;
+        pos += n;
+    }
+
+    return true;
+}
+
+static bool recvAll(int fd, char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = recv(fd, buf, size, 0);
+
+        if (n <= 0)
+            return false;
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool recvFrame(int fd, string &payload)
+{
+    uint32_t length;
+
+    if (!recvAll(fd, (char *)&length, 4))
+        return false;
+
+    payload.resize(ntohl(length));
+
+    return payload.empty() || recvAll(fd, &payload[0], payload.length());
+}
+
+static string makeRequest(const char *isa, const string &source, uint64_t hash, const string &input)
+{
+    ostringstream req;
+    char hex[17];
+
+    req << "isa " << isa << "\n";
+    if (source.empty()) {
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+        req << "program " << hex << "\n";
+    } else {
+        req << "source " << source.length() << "\n" << source;
+    }
+    req << "input " << input.length() << "\n" << input;
+
+    return req.str();
+}
+
+static uint64_t replyHash(const string &reply)
+{
+    size_t pos = reply.find("\"program\":\"");
+
+    return (pos == string::npos)? 0 : strtoull(reply.c_str() + pos + 11, NULL, 16);
+}
+
+/* Sends one program to a running server */
+static int runClient(int argc, char *argv[])
+{
+    const char *isa = "mips32";
+    vector<const char *> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--x86") == 0)
+            isa = "x86";
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() < 2)
+        return 1;
+
+    ifstream prog(args[1]);
+    stringstream source, input;
+
+    if (!prog.is_open()) {
+        fprintf(stderr, "Cannot open file '%s'\n", args[1]);
+        return 1;
+    }
+    source << prog.rdbuf();
+    if (args.size() > 2) {
+        ifstream in(args[2]);
+
+        input << in.rdbuf();
+    }
+
+    int repeat = (args.size() > 3)? atoi(args[3]) : 1;
+    int fd = connectTo(args[0]);
+    string reply;
+
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to '%s'\n", args[0]);
+        return 1;
+    }
+
+    uint64_t hash = 0;
+    double start = now();
+
+    for (int i = 0; i < repeat; i++) {
+        if (!sendFrame(fd, makeRequest(isa, (i == 0)? source.str() : "", hash, input.str())) || !recvFrame(fd, reply)) {
+            fprintf(stderr, "The server closed the connection\n");
+            return 1;
+        }
+        hash = replyHash(reply);
+    }
+    printf("%s\n", reply.c_str());
+    if (repeat > 1)
+        fprintf(stderr, "%d requests, %.1f requests/s\n", repeat, repeat / (now() - start));
+    close(fd);
+
+    return 0;
+}
+
+//Sums the numbers from 1 to the input
+static const char *benchProgram =
+    "addi $v0, $zero, 5\n"
+    "syscall\n"
+    "move $t0, $v0\n"
+    "move $a0, $zero\n"
+    "loop:\n"
+    "beq $t0, $zero, done\n"
+    "add $a0, $a0, $t0\n"
+    "addi $t0, $t0, -1\n"
+    "j loop\n"
+    "done:\n"
+    "addi $v0, $zero, 1\n"
+    "syscall\n";
+
+struct BenchClient {
+    const char *path;
+    int index;
+    int errors;
+};
+
+static void *clientMain(void *arg)
+{
+    BenchClient *client = (BenchClient *)arg;
+    int fd = connectTo(client->path);
+    uint64_t hash = 0;
+    string reply;
+
+    if (fd < 0) {
+        client->errors = BENCH_REQUESTS;
+        return NULL;
+    }
+
+    //The first request loads the program, the rest only name it
+    for (int sent = 0, received = 0; received < BENCH_REQUESTS; ) {
+        while (sent < BENCH_REQUESTS && (sent == 0 || (hash != 0 && sent - received < BENCH_PIPELINE))) {
+            char input[32];
+
+            snprintf(input, sizeof(input), "%d\n", (client->index * 131 + sent) % 1000);
+            if (!sendFrame(fd, makeRequest("mips32", (sent == 0)? benchProgram : "", hash, input))) {
+                client->errors += BENCH_REQUESTS - received;
+                close(fd);
+                return NULL;
+            }
+            sent++;
+        }
+
+        if (!recvFrame(fd, reply)) {
+            client->errors += BENCH_REQUESTS - received;
+            break;
+        }
+
+        int n = (client->index * 131 + received) % 1000;
+        char expected[64];
+
+        snprintf(expected, sizeof(expected), "\"output\":\"%d\"", n * (n + 1) / 2);
+        if (reply.find("\"status\":\"ok\"") == string::npos || reply.find(expected) == string::npos) {
+            if (client->errors++ == 0)
+                fprintf(stderr, "Unexpected reply: %s\n", reply.c_str());
+        }
+        hash = replyHash(reply);
+        received++;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+static void *serverMain(void *arg)
+{
+    ((SimServer *)arg)->run();
+
+    return NULL;
+}
+
+/* Loads and runs the program in a new simulator for each request */
+static double runCold(int count, FILE *out)
+{
+    double start = now();
+
+    for (int i = 0; i < count; i++) {
+        MIPS32Sim sim;
+        istringstream in(benchProgram);
+        FILE *input = tmpfile();
+
+        if (input == NULL)
+            return 0;
+        fprintf(input, "%d\n", i % 1000);
+        fflush(input);
+        rewind(input);
+        sim.setInputFd(fileno(input));
+        sim.setOutput(out);
+        sim.setThreadedDispatch(true);
+        sim.exec(&in);
+        fclose(input);
+    }
+
+    return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        return runClient(argc, argv);
+
+    char path[64];
+    BatchOptions options;
+
+    snprintf(path, sizeof(path), "/tmp/easyasm-bench-%d.sock", (int)getpid());
+    options.threadedDispatch = true;
+
+    SimServer server(options);
+    pthread_t server_thread;
+
+    if (!server.listen(path) || pthread_create(&server_thread, NULL, serverMain, &server) != 0) {
+        fprintf(stderr, "Cannot start the server on '%s'\n", path);
+        return 1;
+    }
+
+    BenchClient clients[BENCH_CLIENTS];
+    pthread_t threads[BENCH_CLIENTS];
+    int errors = 0;
+    double start = now();
+
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        clients[i].path = path;
+        clients[i].index = i;
+        clients[i].errors = 0;
+        pthread_create(&threads[i], NULL, clientMain, &clients[i]);
+    }
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += clients[i].errors;
+    }
+
+    double served = now() - start;
+    int total = BENCH_CLIENTS * BENCH_REQUESTS;
+
+    server.stop();
+    pthread_join(server_thread, NULL);
+
+    FILE *out = fopen("/dev/null", "w");
+    int cold_count = total / 4;
+    double cold = (out != NULL)? runCold(cold_count, out) : 0;
+
+    printf("server  %d clients  %6d requests  %8.2f ms  %9.1f requests/s  %d errors\n", BENCH_CLIENTS, total,
+           served * 1e3, total / served, errors);
+    if (cold > 0)
+        printf("cold    1 client   %6d requests  %8.2f ms  %9.1f requests/s\n", cold_count, cold * 1e3,
+               cold_count / cold);
+
+    return (errors == 0)? 0 : 1;
+}
@@ -0,0 +1,65 @@
+/* Measures the snapshot restore of the guest memory.  A large working set
+ * is written once and saved, then each round writes a few pages and
+ * restores the snapshot, so the restore time should follow the pages
+ * written and not the size of the memory.
+ *
+ * Usage: snapshot_bench
+ */
+#include <cstdio>
+#include "guest_mem.h"
+#include "bench_util.h"
+
+#define BENCH_BASE          0x10000000
+#define BENCH_SET_PAGES     16384       //64 MiB written before the snapshot
+#define BENCH_ROUNDS        2000
+
+static void writePages(GuestMemory &memory, uint32_t pages, uint32_t value)
+{
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t vaddr = BENCH_BASE + i * GMEM_PAGE_SIZE;
+
+        *(uint32_t *)memory.getWritePtr(vaddr) = value;
+        *(uint32_t *)memory.getWritePtr(vaddr + GMEM_PAGE_SIZE - 4) = value;
+    }
+}
+
+static void bench(const char *model, bool flat)
+{
+    GuestMemory memory;
+    double start;
+
+    memory.mapRegion(BENCH_BASE, BENCH_SET_PAGES * GMEM_PAGE_SIZE);
+    if (flat && !memory.setFlat()) {
+        printf("The flat backend is not supported in this host.\n");
+        return;
+    }
+
+    writePages(memory, BENCH_SET_PAGES, 1);
+
+    start = now();
+    memory.saveSnapshot("base");
+    printf("%-6s save of %d pages          %10.2f ms\n", model, BENCH_SET_PAGES, (now() - start) * 1e3);
+
+    for (uint32_t dirty = 1; dirty <= BENCH_SET_PAGES; dirty *= 16) {
+        double restore = 0;
+
+        for (int i = 0; i < BENCH_ROUNDS; i++) {
+            writePages(memory, dirty, i + 2);
+            start = now();
+            memory.restoreSnapshot("base");
+            restore += now() - start;
+        }
+        printf("%-6s restore, %5u pages written %10.2f us\n", model, dirty, restore / BENCH_ROUNDS * 1e6);
+    }
+
+    if (*(uint32_t *)memory.getPtr(BENCH_BASE) != 1)
+        printf("%-6s the restore didn't work\n", model);
+}
+
+int main()
+{
+    bench("paged", false);
+    bench("flat", true);
+
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * File:   easyasm.cpp
+ *
+ * C API of libeasyasm.
+ */
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "easyasm.h"
+#include "mips32_sim.h"
+#include "x86_sim.h"
+#include "x86_tree.h"
+
+#define EASM_RESET_SNAPSHOT     "easm.reset"   //Saved by easm_create
+#define EASM_MIPS32_REGISTERS   34
+#define EASM_X86_REGISTERS      (R_EFLAGS + 1)
+
+/* Target of the output stream or the error stream of a simulator */
+struct EasmStream {
+    easm_sim *sim;
+    int stream;
+};
+
+struct easm_sim {
+    int isa;
+    AsmSimulator *sim;
+    MIPS32Sim *msim;
+    X86Sim *xsim;
+    MemPool *pool;          //Nodes of the loaded program
+    vector<MDecodedInst> mcode;
+    vector<XMicroOp> xcode;
+    map<string, uint32_t> labelMap;
+    bool loaded;
+    uint64_t steps;
+    int inputFd;
+    easm_output_fn outputFn;
+    void *outputUser;
+    EasmStream outStream, errStream;
+    FILE *out, *err;
+};
+
+/* The errors go to the simulator that reported them, the library doesn't
+ * write anything to stderr.
+ */
+void reportRuntimeError(const char *format, ...)
+{
+    AsmSimulator *sim = AsmSimulator::current();
+    va_list args;
+
+    if (sim == NULL || sim->getErrorOutput() == NULL)
+        return;
+
+    fprintf(sim->getErrorOutput(), "Line %d: ", sim->getSourceLine());
+    va_start(args, format);
+    vfprintf(sim->getErrorOutput(), format, args);
+    va_end(args);
+}
+
+void reportError(const char *format, ...)
+{
+    AsmSimulator *sim = AsmSimulator::current();
+    va_list args;
+
+    if (sim == NULL || sim->getErrorOutput() == NULL)
+        return;
+
+    va_start(args, format);
+    vfprintf(sim->getErrorOutput(), format, args);
+    va_end(args);
+}
+
+static ssize_t writeStream(void *cookie, const char *buf, size_t size)
+{
+    EasmStream *stream = (EasmStream *)cookie;
+    easm_sim *sim = stream->sim;
+
+    if (sim->outputFn != NULL)
+        sim->outputFn(sim->outputUser, stream->stream, buf, size);
+
+    return size;
+}
+
+static FILE *openStream(EasmStream *stream)
+{
+    cookie_io_functions_t io;
+
+    memset(&io, 0, sizeof(io));
+    io.write = writeStream;
+
+    return fopencookie(stream, "w", io);
+}
+
+static void flushStreams(easm_sim *sim)
+{
+    fflush(sim->out);
+    fflush(sim->err);
+}
+
+/* A file in memory with a copy of the data, read from the start */
+static int createInputFd(const char *data, size_t size)
+{
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("easyasm-input", MFD_CLOEXEC);
+#else
+    FILE *tmp = tmpfile();
+    int fd = (tmp != NULL)? dup(fileno(tmp)) : -1;
+
+    if (tmp != NULL)
+        fclose(tmp);
+#endif
+
+    if (fd < 0)
+        return -1;
+
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+
+        if (written <= 0) {
+            close(fd);
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+/* The pages of the range are mapped */
+static bool isRangeMapped(GuestMemory *memory, uint32_t vaddr, size_t size)
+{
+    if (size == 0)
+        return true;
+    if (size - 1 > UINT32_MAX - vaddr)
+        return false;
+
+    uint32_t last = vaddr + (size - 1);
+
+    for (uint32_t page = vaddr >> GMEM_PAGE_BITS; page <= (last >> GMEM_PAGE_BITS); page++) {
+        uint32_t addr = (page == (vaddr >> GMEM_PAGE_BITS))? vaddr : (page << GMEM_PAGE_BITS);
+
+        if (!memory->isMapped(addr))
+            return false;
+    }
+
+    return true;
+}
+
+static GuestMemory *getMemory(easm_sim *sim)
+{
+    return (sim->msim != NULL)? sim->msim->getMemory() : sim->xsim->getMemory();
+}
+
+int easm_api_version(void)
+{
+    return EASM_API_VERSION;
+}
+
+const char *easm_status_name(int status)
+{
+    switch (status) {
+        case EASM_OK: return "ok";
+        case EASM_ERR_ARGUMENT: return "invalid_argument";
+        case EASM_ERR_LOAD: return "load_error";
+        case EASM_ERR_RUNTIME: return "runtime_error";
+        case EASM_ERR_STEP_LIMIT: return "step_limit";
+        case EASM_ERR_NO_PROGRAM: return "no_program";
+        case EASM_ERR_SYSTEM: return "system_error";
+        default: return "unknown";
+    }
+}
+
+easm_sim *easm_create(int isa)
+{
+    if (isa != EASM_ISA_MIPS32 && isa != EASM_ISA_X86)
+        return NULL;
+
+    easm_sim *sim = new easm_sim;
+
+    sim->isa = isa;
+    sim->msim = NULL;
+    sim->xsim = NULL;
+    sim->pool = new MemPool();
+    sim->loaded = false;
+    sim->steps = 0;
+    sim->inputFd = -1;
+    sim->outputFn = NULL;
+    sim->outputUser = NULL;
+    sim->outStream.sim = sim;
+    sim->outStream.stream = EASM_STREAM_OUTPUT;
+    sim->errStream.sim = sim;
+    sim->errStream.stream = EASM_STREAM_ERROR;
+    sim->out = openStream(&sim->outStream);
+    sim->err = openStream(&sim->errStream);
+
+    if (sim->out == NULL || sim->err == NULL) {
+        easm_destroy(sim);
+        return NULL;
+    }
+
+    if (isa == EASM_ISA_MIPS32) {
+        sim->msim = new MIPS32Sim();
+        sim->msim->setThreadedDispatch(true);
+        sim->msim->setInputFd(-1);  //No input until easm_set_input
+        sim->msim->saveSnapshot(EASM_RESET_SNAPSHOT);
+        sim->sim = sim->msim;
+    } else {
+        sim->xsim = new X86Sim();
+        sim->xsim->setThreadedDispatch(true);
+        sim->xsim->saveSnapshot(EASM_RESET_SNAPSHOT);
+        sim->sim = sim->xsim;
+    }
+    sim->sim->setOutput(sim->out);
+    sim->sim->setErrorOutput(sim->err);
+    sim->sim->setNativeCalls(false);
+
+    return sim;
+}
+
+void easm_destroy(easm_sim *sim)
+{
+    if (sim == NULL)
+        return;
+
+    //The program goes before the pool that holds its nodes
+    delete sim->msim;
+    delete sim->xsim;
+    sim->mcode.clear();
+    sim->xcode.clear();
+    delete sim->pool;
+    if (sim->out != NULL)
+        fclose(sim->out);
+    if (sim->err != NULL)
+        fclose(sim->err);
+    if (sim->inputFd >= 0)
+        close(sim->inputFd);
+    delete sim;
+}
+
+int easm_get_isa(easm_sim *sim)
+{
+    return sim->isa;
+}
+
+void easm_set_output(easm_sim *sim, easm_output_fn fn, void *user)
+{
+    flushStreams(sim);
+    sim->outputFn = fn;
+    sim->outputUser = user;
+}
+
+int easm_set_input(easm_sim *sim, const char *data, size_t size)
+{
+    if (sim->msim == NULL || (data == NULL && size != 0))
+        return EASM_ERR_ARGUMENT;
+
+    int fd = createInputFd(data, size);
+
+    if (fd < 0)
+        return EASM_ERR_SYSTEM;
+
+    if (sim->inputFd >= 0)
+        close(sim->inputFd);
+    sim->inputFd = fd;
+    sim->msim->setInputFd(fd);
+
+    return EASM_OK;
+}
+
+void easm_set_native_calls(easm_sim *sim, int enabled)
+{
+    sim->sim->setNativeCalls(enabled != 0);
+}
+
+int easm_load(easm_sim *sim, const char *source, size_t size)
+{
+    if (source == NULL && size != 0)
+        return EASM_ERR_ARGUMENT;
+
+    istringstream in(string((source != NULL)? source : "", size));
+
+    //The nodes of the previous program are released with its pool
+    sim->loaded = false;
+    sim->mcode.clear();
+    sim->xcode.clear();
+    sim->labelMap.clear();
+    delete sim->pool;
+    sim->pool = new MemPool();
+
+    NodePoolScope nodes(sim->pool);
+
+    if (sim->msim != NULL)
+        sim->loaded = sim->msim->loadFile(&in, sim->mcode, sim->labelMap);
+    else
+        sim->loaded = sim->xsim->loadFile(&in, sim->xcode, sim->labelMap);
+    flushStreams(sim);
+
+    return sim->loaded? EASM_OK : EASM_ERR_LOAD;
+}
+
+int easm_run(easm_sim *sim, uint64_t max_steps)
+{
+    bool result, step_limit;
+
+    if (!sim->loaded)
+        return EASM_ERR_NO_PROGRAM;
+
+    NodePoolScope nodes(sim->pool);
+
+    if (sim->msim != NULL) {
+        uint64_t start = sim->msim->getInstructionCount();
+
+        sim->msim->setMaxSteps(max_steps);
+        result = sim->msim->run(sim->mcode, sim->labelMap);
+        step_limit = sim->msim->stepLimitReached();
+        sim->steps = sim->msim->getInstructionCount() - start;
+    } else {
+        uint64_t start = sim->xsim->getInstructionCount();
+
+        sim->xsim->setMaxSteps(max_steps);
+        result = sim->xsim->run(sim->xcode, sim->labelMap);
+        step_limit = sim->xsim->stepLimitReached();
+        sim->steps = sim->xsim->getInstructionCount() - start;
+    }
+    flushStreams(sim);
+
+    if (result)
+        return EASM_OK;
+
+    return step_limit? EASM_ERR_STEP_LIMIT : EASM_ERR_RUNTIME;
+}
+
+uint64_t easm_get_steps(easm_sim *sim)
+{
+    return sim->steps;
+}
+
+int easm_get_exit_code(easm_sim *sim)
+{
+    return (sim->msim != NULL)? sim->msim->getExitCode() : 0;
+}
+
+int easm_reset(easm_sim *sim)
+{
+    bool result;
+
+    if (sim->msim != NULL)
+        result = sim->msim->restoreSnapshot(EASM_RESET_SNAPSHOT);
+    else
+        result = sim->xsim->restoreSnapshot(EASM_RESET_SNAPSHOT);
+
+    if (sim->inputFd >= 0)
+        lseek(sim->inputFd, 0, SEEK_SET);
+    sim->steps = 0;
+
+    return result? EASM_OK : EASM_ERR_SYSTEM;
+}
+
+unsigned easm_register_count(int isa)
+{
+    switch (isa) {
+        case EASM_ISA_MIPS32: return EASM_MIPS32_REGISTERS;
+        case EASM_ISA_X86: return EASM_X86_REGISTERS;
+        default: return 0;
+    }
+}
+
+const char *easm_register_name(int isa, unsigned index)
+{
+    if (index >= easm_register_count(isa))
+        return NULL;
+
+    if (isa == EASM_ISA_X86)
+        return xreg[index];
+
+    switch (index) {
+        case EASM_MIPS32_HI: return "hi";
+        case EASM_MIPS32_LO: return "lo";
+        default: return MIPS32Sim::getRegisterName(index);
+    }
+}
+
+int easm_read_registers(easm_sim *sim, unsigned first, unsigned count, uint32_t *values)
+{
+    unsigned total = easm_register_count(sim->isa);
+
+    if (first > total || count > total - first || (values == NULL && count != 0))
+        return EASM_ERR_ARGUMENT;
+
+    for (unsigned i = 0; i < count; i++) {
+        unsigned index = first + i;
+
+        if (sim->xsim != NULL)
+            sim->xsim->getRegValue(index, values[i]);
+        else if (index == EASM_MIPS32_HI)
+            values[i] = (uint32_t)(sim->msim->getHiLo() >> 32);
+        else if (index == EASM_MIPS32_LO)
+            values[i] = (uint32_t)sim->msim->getHiLo();
+        else
+            values[i] = sim->msim->reg[index];
+    }
+
+    return EASM_OK;
+}
+
+int easm_write_registers(easm_sim *sim, unsigned first, unsigned count, const uint32_t *values)
+{
+    unsigned total = easm_register_count(sim->isa);
+
+    if (first > total || count > total - first || (values == NULL && count != 0))
+        return EASM_ERR_ARGUMENT;
+
+    for (unsigned i = 0; i < count; i++) {
+        unsigned index = first + i;
+
+        if (sim->xsim != NULL) {
+            sim->xsim->setRegValue(index, values[i]);
+        } else if (index == EASM_MIPS32_HI) {
+            uint64_t hi_lo = sim->msim->getHiLo();
+
+            sim->msim->setHiLo(((uint64_t)values[i] << 32) | (uint32_t)hi_lo);
+        } else if (index == EASM_MIPS32_LO) {
+            uint64_t hi_lo = sim->msim->getHiLo();
+
+            sim->msim->setHiLo((hi_lo & 0xFFFFFFFF00000000ULL) | values[i]);
+        } else {
+            sim->msim->reg[index] = values[i];
+        }
+    }
+
+    return EASM_OK;
+}
+
+/* The MIPS32 words are kept in host order, byte 0 of a word is its most
+ * significant byte.  The x86 memory has the same order as the guest.
+ */
+int easm_read_memory(easm_sim *sim, uint32_t vaddr, void *buf, size_t size)
+{
+    GuestMemory *memory = getMemory(sim);
+    uint8_t *dst = (uint8_t *)buf;
+
+    if ((buf == NULL && size != 0) || !isRangeMapped(memory, vaddr, size))
+        return EASM_ERR_ARGUMENT;
+
+    for (size_t i = 0; i < size; i++) {
+        uint32_t addr = vaddr + i;
+
+        if (sim->msim != NULL) {
+            uint32_t word = *(uint32_t *)memory->getPtr(addr & ~3);
+
+            dst[i] = (uint8_t)(word >> ((3 - (addr & 3)) * 8));
+        } else {
+            dst[i] = *memory->getPtr(addr);
+        }
+    }
+
+    return EASM_OK;
+}
+
+int easm_write_memory(easm_sim *sim, uint32_t vaddr, const void *buf, size_t size)
+{
+    GuestMemory *memory = getMemory(sim);
+    const uint8_t *src = (const uint8_t *)buf;
+
+    if ((buf == NULL && size != 0) || !isRangeMapped(memory, vaddr, size))
+        return EASM_ERR_ARGUMENT;
+
+    for (size_t i = 0; i < size; i++) {
+        uint32_t addr = vaddr + i;
+
+        if (sim->msim != NULL) {
+            uint32_t *word = (uint32_t *)memory->getWritePtr(addr & ~3);
+            int shift = (3 - (addr & 3)) * 8;
+
+            *word = (*word & ~(0xFFu << shift)) | ((uint32_t)src[i] << shift);
+        } else {
+            *memory->getWritePtr(addr) = src[i];
+        }
+    }
+
+    return EASM_OK;
+}
@@ -0,0 +1,109 @@
+/*
+ * File:   easyasm.h
+ *
+ * C API of libeasyasm, the simulators without the command line.
+ *
+ * A simulator is created for an ISA, a program is loaded from a buffer and
+ * run as many times as needed.  The output of the program and the errors
+ * go to a callback, the library doesn't write to stdout or stderr.  The
+ * only exception are the native functions, which are off unless
+ * easm_set_native_calls turns them on.  The simulators are independent,
+ * different threads can use different simulators at the same time.
+ */
+
+#ifndef EASYASM_H
+#define EASYASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EASM_API_VERSION        1
+
+#define EASM_ISA_MIPS32         0
+#define EASM_ISA_X86            1
+
+/* Results, the values 2 to 4 are the exit status of EasyASM --run */
+#define EASM_OK                 0
+#define EASM_ERR_ARGUMENT       1   /* Invalid ISA, register, address or size */
+#define EASM_ERR_LOAD           2   /* The program has errors */
+#define EASM_ERR_RUNTIME        3
+#define EASM_ERR_STEP_LIMIT     4
+#define EASM_ERR_NO_PROGRAM     5   /* Run before a program was loaded */
+#define EASM_ERR_SYSTEM         6   /* Out of memory or a system call failed */
+
+/* Streams given to the output callback */
+#define EASM_STREAM_OUTPUT      1   /* Output of the program and of #show */
+#define EASM_STREAM_ERROR       2   /* Errors while loading or running */
+
+/* Registers.  MIPS32: 0 to 31 are $zero to $ra, then hi and lo.  x86: eax,
+ * ebx, ecx, edx, esi, edi, esp, ebp and eflags.
+ */
+#define EASM_MIPS32_HI          32
+#define EASM_MIPS32_LO          33
+
+typedef struct easm_sim easm_sim;
+
+typedef void (*easm_output_fn)(void *user, int stream, const char *data, size_t size);
+
+int easm_api_version(void);
+const char *easm_status_name(int status);
+
+/* NULL if the ISA is invalid or there's no memory */
+easm_sim *easm_create(int isa);
+void easm_destroy(easm_sim *sim);
+int easm_get_isa(easm_sim *sim);
+
+/* The callback gets the data before easm_load or easm_run return, with
+ * no callback the output is discarded.
+ */
+void easm_set_output(easm_sim *sim, easm_output_fn fn, void *user);
+
+/* Input of the read system calls (MIPS32 only), a copy is made.  Each run
+ * goes on reading where the previous one stopped, easm_set_input starts
+ * again from the beginning.
+ */
+int easm_set_input(easm_sim *sim, const char *data, size_t size);
+
+/* Lets the program call native functions (@lib.function), they are a
+ * load or runtime error by default.  Their output goes to the stdout of
+ * the process, not to the callback.
+ */
+void easm_set_native_calls(easm_sim *sim, int enabled);
+
+/* Parses a program, it replaces the previous one */
+int easm_load(easm_sim *sim, const char *source, size_t size);
+
+/* Runs the loaded program from the start with the current registers and
+ * memory.  max_steps is the instruction budget, 0 for no limit.  Faults of
+ * the program, like a division by zero, return EASM_ERR_RUNTIME.
+ */
+int easm_run(easm_sim *sim, uint64_t max_steps);
+uint64_t easm_get_steps(easm_sim *sim);     /* Instructions of the last run */
+int easm_get_exit_code(easm_sim *sim);      /* Set by the exit syscalls (MIPS32) */
+
+/* Registers and memory back to the state after easm_create and the input
+ * back to its beginning, the program is kept.  Only the pages written
+ * since then are copied.
+ */
+int easm_reset(easm_sim *sim);
+
+unsigned easm_register_count(int isa);
+const char *easm_register_name(int isa, unsigned index);
+int easm_read_registers(easm_sim *sim, unsigned first, unsigned count, uint32_t *values);
+int easm_write_registers(easm_sim *sim, unsigned first, unsigned count, const uint32_t *values);
+
+/* Bytes in guest order.  Nothing is copied if part of the range is not
+ * mapped.
+ */
+int easm_read_memory(easm_sim *sim, uint32_t vaddr, void *buf, size_t size);
+int easm_write_memory(easm_sim *sim, uint32_t vaddr, const void *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EASYASM_H */
@@ -0,0 +1,853 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "guest_mem.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static __thread GuestMemory *faultMemory = NULL; //Memory with a fault target in this thread
+#ifdef __unix__
+static struct sigaction oldFaultAction;         //SIGSEGV handler of the process before ours
+#endif
+
+/* Zeroed host block of a region, the host backs its pages when they are
+ * touched.
+ */
+static uint8_t *allocBlock(size_t size)
+{
+#ifdef __unix__
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (block == MAP_FAILED)
+        throw bad_alloc();
+#else
+    void *block = calloc(1, size);
+
+    if (block == NULL)
+        throw bad_alloc();
+#endif
+
+    return (uint8_t *)block;
+}
+
+static void freeBlock(uint8_t *block, size_t size)
+{
+#ifdef __unix__
+    munmap(block, size);
+#else
+    free(block);
+#endif
+}
+
+static size_t regionSize(uint32_t firstPage, uint32_t lastPage)
+{
+    return (size_t)(lastPage - firstPage + 1) << GMEM_PAGE_BITS;
+}
+
+GuestMemory::GuestMemory()
+{
+    memset(dir, 0, sizeof(dir));
+    pageCount = 0;
+    for (int i = 0; i < GMEM_TLB_SIZE; i++) {
+        tlb[i].page = writeTlb[i].page = GMEM_NO_PAGE;
+        tlb[i].host = writeTlb[i].host = NULL;
+    }
+    tlbHits = tlbMisses = 0;
+    nativeStackMem = NULL;
+    flatBase = NULL;
+    faultTarget = NULL;
+    faultAddr = 0;
+    faultReadOnly = false;
+    unchecked = false;
+    baseline = NULL;
+    dirtyBits = NULL;
+}
+
+GuestMemory::~GuestMemory()
+{
+    map<string, Snapshot *>::iterator it;
+
+    for (it = snapshots.begin(); it != snapshots.end(); it++) {
+        if (it->second != baseline)
+            freeSnapshot(it->second);
+    }
+    if (baseline != NULL)
+        freeSnapshot(baseline);
+    free(dirtyBits);
+
+    for (int i = 0; i < GMEM_DIR_SIZE; i++) {
+        if (dir[i] == NULL)
+            continue;
+
+        free(dir[i]);
+    }
+    freeRegions();
+    free(nativeStackMem);
+
+#ifdef __unix__
+    if (flatBase != NULL)
+        munmap(flatBase, GMEM_FLAT_SIZE);
+    else {
+        for (unsigned i = 0; i < fileMaps.size(); i++)
+            munmap(fileMaps[i].host, fileMaps[i].length);
+    }
+#endif
+    if (faultMemory == this)
+        faultMemory = NULL;
+}
+
+void GuestMemory::mapRegion(uint32_t start, uint32_t size)
+{
+    Region region;
+
+    if (size == 0)
+        return;
+
+    region.firstPage = start >> GMEM_PAGE_BITS;
+    region.lastPage = (uint32_t)(((uint64_t)start + size - 1) >> GMEM_PAGE_BITS);
+    region.host = NULL;
+    region.file = false;
+    regions.push_back(region);
+
+    if (flatBase != NULL)
+        protectRegion(region);
+}
+
+bool GuestMemory::protectRegion(const Region &region)
+{
+#ifdef GMEM_FLAT_SUPPORTED
+    uint64_t start = (uint64_t)region.firstPage << GMEM_PAGE_BITS;
+    uint64_t size = ((uint64_t)(region.lastPage - region.firstPage) + 1) << GMEM_PAGE_BITS;
+
+    return mprotect(flatBase + start, size, PROT_READ | PROT_WRITE) == 0;
+#else
+    return false;
+#endif
+}
+
+/* Switches to the flat backend, the pages allocated so far are copied to the
+ * reservation.  Returns false if the host cannot reserve 4 GiB.
+ */
+bool GuestMemory::setFlat()
+{
+#ifdef GMEM_FLAT_SUPPORTED
+    if (flatBase != NULL)
+        return true;
+
+    void *base = mmap(NULL, GMEM_FLAT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED)
+        return false;
+
+    flatBase = (uint8_t *)base;
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (!protectRegion(regions[i])) {
+            munmap(base, GMEM_FLAT_SIZE);
+            flatBase = NULL;
+            return false;
+        }
+    }
+
+    installFaultHandler();
+
+    for (int i = 0; i < GMEM_DIR_SIZE; i++) {
+        if (dir[i] == NULL)
+            continue;
+
+        for (int j = 0; j < GMEM_TABLE_SIZE; j++) {
+            if (dir[i][j] != NULL) {
+                uint64_t page = ((uint64_t)i << GMEM_TABLE_BITS) | j;
+
+                memcpy(flatBase + (page << GMEM_PAGE_BITS), dir[i][j], GMEM_PAGE_SIZE);
+            }
+        }
+        free(dir[i]);
+        dir[i] = NULL;
+    }
+    freeRegions();
+    pageCount = 0;
+    flushTlb();
+
+    //The files mapped before are copies now
+    for (unsigned i = 0; i < fileMaps.size(); i++)
+        munmap(fileMaps[i].host, fileMaps[i].length);
+    fileMaps.clear();
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* The region that holds the block of the page, NULL if it's not mapped */
+GuestMemory::Region *GuestMemory::findRegion(uint32_t page)
+{
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (!regions[i].file && page >= regions[i].firstPage && page <= regions[i].lastPage)
+            return &regions[i];
+    }
+
+    return NULL;
+}
+
+void GuestMemory::freeRegions()
+{
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (regions[i].host != NULL) {
+            freeBlock(regions[i].host, regionSize(regions[i].firstPage, regions[i].lastPage));
+            regions[i].host = NULL;
+        }
+    }
+}
+
+bool GuestMemory::isFilePage(uint32_t page)
+{
+    for (unsigned i = 0; i < fileMaps.size(); i++) {
+        if (page >= fileMaps[i].firstPage && page <= fileMaps[i].lastPage)
+            return true;
+    }
+
+    return false;
+}
+
+/* Drops the pages of the mapped files in the range, the rest of each
+ * mapping is kept.  The page table entries of the dropped pages are cleared,
+ * the TLB has to be flushed after.
+ */
+void GuestMemory::unmapFiles(uint32_t firstPage, uint32_t lastPage)
+{
+    vector<FileMapping> kept;
+
+    for (unsigned i = 0; i < fileMaps.size(); i++) {
+        FileMapping map = fileMaps[i];
+
+        if (map.lastPage < firstPage || map.firstPage > lastPage) {
+            kept.push_back(map);
+            continue;
+        }
+
+        uint32_t first = (map.firstPage > firstPage)? map.firstPage : firstPage;
+        uint32_t last = (map.lastPage < lastPage)? map.lastPage : lastPage;
+
+        //The flat backend maps the new file over the old one
+        if (flatBase == NULL) {
+#ifdef __unix__
+            munmap(map.host + ((uint64_t)(first - map.firstPage) << GMEM_PAGE_BITS),
+                   (size_t)(last - first + 1) << GMEM_PAGE_BITS);
+#endif
+            for (uint32_t page = first; page <= last; page++)
+                dir[page >> GMEM_TABLE_BITS][page & (GMEM_TABLE_SIZE - 1)] = NULL;
+        }
+
+        //The region of the mapping is replaced by the pieces left
+        for (unsigned j = 0; j < regions.size(); j++) {
+            if (regions[j].file && regions[j].firstPage == map.firstPage && regions[j].lastPage == map.lastPage) {
+                regions.erase(regions.begin() + j);
+                break;
+            }
+        }
+
+        if (map.firstPage < first) {
+            FileMapping head = map;
+            Region region;
+
+            head.lastPage = first - 1;
+            head.length = (size_t)(head.lastPage - head.firstPage + 1) << GMEM_PAGE_BITS;
+            region.firstPage = head.firstPage;
+            region.lastPage = head.lastPage;
+            region.host = NULL;
+            region.file = true;
+            regions.push_back(region);
+            kept.push_back(head);
+        }
+        if (map.lastPage > last) {
+            FileMapping tail = map;
+            Region region;
+
+            tail.firstPage = last + 1;
+            tail.host = map.host + ((uint64_t)(tail.firstPage - map.firstPage) << GMEM_PAGE_BITS);
+            tail.length = (size_t)(tail.lastPage - tail.firstPage + 1) << GMEM_PAGE_BITS;
+            region.firstPage = tail.firstPage;
+            region.lastPage = tail.lastPage;
+            region.host = NULL;
+            region.file = true;
+            regions.push_back(region);
+            kept.push_back(tail);
+        }
+    }
+    fileMaps.swap(kept);
+}
+
+void GuestMemory::flushTlb()
+{
+    for (int i = 0; i < GMEM_TLB_SIZE; i++)
+        tlb[i].page = writeTlb[i].page = GMEM_NO_PAGE;
+}
+
+/* Maps the file at vaddr, which must be aligned to a page.  The pages of the
+ * file replace the guest pages in the range, and the pages of the files
+ * mapped there before.
+ */
+int GuestMemory::mapFile(const char *path, uint32_t vaddr, bool readOnly)
+{
+#ifdef __unix__
+    struct stat st;
+    int fd;
+
+    if ((vaddr & GMEM_PAGE_MASK) != 0)
+        return GMEM_MAP_UNALIGNED;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return GMEM_MAP_CANNOT_OPEN;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return GMEM_MAP_EMPTY;
+    }
+
+    uint64_t length = ((uint64_t)st.st_size + GMEM_PAGE_MASK) & ~(uint64_t)GMEM_PAGE_MASK;
+
+    if ((uint64_t)vaddr + length > GMEM_FLAT_SIZE) {
+        close(fd);
+        return GMEM_MAP_TOO_LARGE;
+    }
+
+    int prot = readOnly? PROT_READ : (PROT_READ | PROT_WRITE);
+    void *host;
+
+    if (flatBase != NULL)
+        host = mmap(flatBase + vaddr, length, prot, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    else
+        host = mmap(NULL, length, prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (host == MAP_FAILED)
+        return GMEM_MAP_FAILED;
+
+    FileMapping map;
+    Region region;
+
+    map.firstPage = region.firstPage = vaddr >> GMEM_PAGE_BITS;
+    map.lastPage = region.lastPage = (uint32_t)(((uint64_t)vaddr + length - 1) >> GMEM_PAGE_BITS);
+    map.host = (uint8_t *)host;
+    map.length = length;
+    map.readOnly = readOnly;
+    region.host = NULL;
+    region.file = true;
+
+    unmapFiles(map.firstPage, map.lastPage);
+    if (flatBase == NULL) {
+        for (uint32_t page = map.firstPage; page <= map.lastPage; page++) {
+            uint8_t **table = dir[page >> GMEM_TABLE_BITS];
+
+            if (table == NULL) {
+                table = (uint8_t **)calloc(GMEM_TABLE_SIZE, sizeof(uint8_t *));
+                if (table == NULL)
+                    throw bad_alloc();
+
+                dir[page >> GMEM_TABLE_BITS] = table;
+            }
+
+            uint8_t *&entry = table[page & (GMEM_TABLE_SIZE - 1)];
+
+            //The host can drop the page of the region block
+            if (entry != NULL && !isFilePage(page)) {
+                madvise(entry, GMEM_PAGE_SIZE, MADV_DONTNEED);
+                pageCount--;
+            }
+            entry = map.host + ((uint64_t)(page - map.firstPage) << GMEM_PAGE_BITS);
+        }
+    }
+    flushTlb();
+
+    regions.push_back(region);
+    fileMaps.push_back(map);
+    if (readOnly)
+        installFaultHandler();
+
+    return GMEM_MAP_OK;
+#else
+    return GMEM_MAP_FAILED;
+#endif
+}
+
+/* The faults of the flat backend jump to target.  Returns the previous
+ * target, which has to be restored when target goes out of scope.
+ */
+sigjmp_buf *GuestMemory::setFaultTarget(sigjmp_buf *target)
+{
+    sigjmp_buf *old_target = faultTarget;
+
+    faultTarget = target;
+    faultMemory = (target != NULL)? this : NULL;
+
+    return old_target;
+}
+
+const char *GuestMemory::getFaultMessage()
+{
+    if (faultReadOnly)
+        return "Runtime exception: write to read only memory 0x%x\n";
+    else
+        return "Runtime exception: fetch address out of limit 0x%x\n";
+}
+
+void GuestMemory::installFaultHandler()
+{
+#ifdef __unix__
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, setFaultHandler);
+#endif
+}
+
+void GuestMemory::setFaultHandler()
+{
+#ifdef __unix__
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = faultHandler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &oldFaultAction);
+#endif
+}
+
+void GuestMemory::faultHandler(int sig, siginfo_t *info, void *context)
+{
+    GuestMemory *mem = faultMemory;
+    uint8_t *addr = (uint8_t *)info->si_addr;
+
+    if (mem != NULL && mem->faultTarget != NULL) {
+        bool guest_access = false;
+
+        if (mem->flatBase != NULL && addr >= mem->flatBase && addr < mem->flatBase + GMEM_FLAT_SIZE) {
+            mem->faultAddr = (uint32_t)(addr - mem->flatBase);
+            guest_access = true;
+        }
+
+        //Only the writes to read only files fault inside a file mapping
+        mem->faultReadOnly = false;
+        for (unsigned i = 0; i < mem->fileMaps.size(); i++) {
+            FileMapping &map = mem->fileMaps[i];
+            uint8_t *host = (mem->flatBase != NULL)? mem->flatBase + ((uint64_t)map.firstPage << GMEM_PAGE_BITS) : map.host;
+
+            if (map.readOnly && addr >= host && addr < host + map.length) {
+                mem->faultAddr = (map.firstPage << GMEM_PAGE_BITS) + (uint32_t)(addr - host);
+                mem->faultReadOnly = true;
+                guest_access = true;
+            }
+        }
+
+        if (guest_access)
+            siglongjmp(*mem->faultTarget, 1);
+    }
+
+    //Not a guest access, it goes to the handler installed before ours
+    if ((oldFaultAction.sa_flags & SA_SIGINFO) != 0 && oldFaultAction.sa_sigaction != NULL)
+        oldFaultAction.sa_sigaction(sig, info, context);
+    else if ((oldFaultAction.sa_flags & SA_SIGINFO) == 0 && oldFaultAction.sa_handler != SIG_DFL &&
+             oldFaultAction.sa_handler != SIG_IGN)
+        oldFaultAction.sa_handler(sig);
+    else {
+        //No handler, the access faults again and crashes as usual
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+const char *GuestMemory::mapErrorMessage(int error)
+{
+    switch (error) {
+        case GMEM_MAP_CANNOT_OPEN: return "Cannot open file '%s'\n";
+        case GMEM_MAP_EMPTY: return "File '%s' is empty\n";
+        case GMEM_MAP_UNALIGNED: return "Cannot map file '%s', the address must be a multiple of 4096\n";
+        case GMEM_MAP_TOO_LARGE: return "Cannot map file '%s', it doesn't fit in the address space\n";
+        default:
+            return "Cannot map file '%s'\n";
+    }
+}
+
+bool GuestMemory::checkRegions(uint32_t vaddr, bool write)
+{
+    uint32_t page = vaddr >> GMEM_PAGE_BITS;
+
+    faultAddr = vaddr;
+    faultReadOnly = false;
+    if (!isMapped(vaddr))
+        return false;
+
+    for (unsigned i = 0; write && i < fileMaps.size(); i++) {
+        if (fileMaps[i].readOnly && page >= fileMaps[i].firstPage && page <= fileMaps[i].lastPage) {
+            faultReadOnly = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool GuestMemory::isMapped(uint32_t vaddr)
+{
+    uint32_t page = vaddr >> GMEM_PAGE_BITS;
+
+    for (unsigned i = 0; i < regions.size(); i++) {
+        if (page >= regions[i].firstPage && page <= regions[i].lastPage)
+            return true;
+    }
+
+    return false;
+}
+
+uint8_t *GuestMemory::lookup(uint32_t vaddr)
+{
+    uint32_t page = vaddr >> GMEM_PAGE_BITS;
+    uint8_t **table = dir[page >> GMEM_TABLE_BITS];
+    uint8_t *host = (table != NULL)? table[page & (GMEM_TABLE_SIZE - 1)] : NULL;
+
+    tlbMisses++;
+    if (host == NULL) {
+        Region *region = findRegion(page);
+
+        if (region == NULL)
+            return NULL;
+
+        if (table == NULL) {
+            table = (uint8_t **)calloc(GMEM_TABLE_SIZE, sizeof(uint8_t *));
+            if (table == NULL)
+                throw bad_alloc();
+
+            dir[page >> GMEM_TABLE_BITS] = table;
+        }
+
+        if (region->host == NULL)
+            region->host = allocBlock(regionSize(region->firstPage, region->lastPage));
+
+        host = region->host + ((size_t)(page - region->firstPage) << GMEM_PAGE_BITS);
+        table[page & (GMEM_TABLE_SIZE - 1)] = host;
+        pageCount++;
+    }
+
+    TlbEntry &entry = tlb[page & (GMEM_TLB_SIZE - 1)];
+
+    entry.page = page;
+    entry.host = host;
+
+    return host + (vaddr & GMEM_PAGE_MASK);
+}
+
+/* Records the page as written when there is a snapshot */
+uint8_t *GuestMemory::lookupWrite(uint32_t vaddr)
+{
+    uint32_t page = vaddr >> GMEM_PAGE_BITS;
+    uint8_t *host;
+
+    if (flatBase != NULL) {
+        tlbMisses++;
+        host = pageHost(page);
+    } else {
+        host = lookup(vaddr);
+        if (host == NULL)
+            return NULL;
+
+        host -= vaddr & GMEM_PAGE_MASK;
+    }
+
+    //Only the pages that a restore can write are recorded
+    if (baseline != NULL && (dirtyBits[page >> 3] & (1 << (page & 7))) == 0 &&
+        isMapped(vaddr) && !isFilePage(page)) {
+        dirtyBits[page >> 3] |= 1 << (page & 7);
+        dirtyPages.push_back(page);
+    }
+
+    TlbEntry &entry = writeTlb[page & (GMEM_TLB_SIZE - 1)];
+
+    entry.page = page;
+    entry.host = host;
+
+    return host + (vaddr & GMEM_PAGE_MASK);
+}
+
+/* Host address of a page, NULL if it's not allocated */
+uint8_t *GuestMemory::pageHost(uint32_t page)
+{
+    if (flatBase != NULL)
+        return flatBase + ((uint64_t)page << GMEM_PAGE_BITS);
+
+    uint8_t **table = dir[page >> GMEM_TABLE_BITS];
+
+    return (table != NULL)? table[page & (GMEM_TABLE_SIZE - 1)] : NULL;
+}
+
+GuestMemory::PageCopy *GuestMemory::copyPage(uint32_t page)
+{
+    PageCopy *copy = (PageCopy *)malloc(sizeof(PageCopy));
+
+    if (copy == NULL)
+        throw bad_alloc();
+
+    copy->refs = 1;
+    memcpy(copy->data, pageHost(page), GMEM_PAGE_SIZE);
+
+    return copy;
+}
+
+/* Copies every allocated page, it's done by the first snapshot */
+void GuestMemory::capturePages(PageCopyMap &pages)
+{
+    if (flatBase == NULL) {
+        for (int i = 0; i < GMEM_DIR_SIZE; i++) {
+            if (dir[i] == NULL)
+                continue;
+
+            for (int j = 0; j < GMEM_TABLE_SIZE; j++) {
+                uint32_t page = (i << GMEM_TABLE_BITS) | j;
+
+                if (dir[i][j] != NULL && !isFilePage(page))
+                    pages[page] = copyPage(page);
+            }
+        }
+        return;
+    }
+
+#ifdef GMEM_FLAT_SUPPORTED
+    //The pages that were never touched are not resident in the host, they hold zeros
+    for (unsigned i = 0; i < regions.size(); i++) {
+        uint32_t count = regions[i].lastPage - regions[i].firstPage + 1;
+        vector<unsigned char> resident(count, 1);
+
+        mincore(pageHost(regions[i].firstPage), (size_t)count << GMEM_PAGE_BITS, &resident[0]);
+        for (uint32_t k = 0; k < count; k++) {
+            uint32_t page = regions[i].firstPage + k;
+
+            if ((resident[k] & 1) != 0 && !isFilePage(page) && pages.find(page) == pages.end())
+                pages[page] = copyPage(page);
+        }
+    }
+#endif
+}
+
+/* Sets the page to its contents in the snapshot, the pages that the
+ * snapshot doesn't have were zero.
+ */
+void GuestMemory::restorePage(uint32_t page, Snapshot *snap)
+{
+    PageCopyMap::iterator it = snap->pages.find(page);
+    uint8_t *host = pageHost(page);
+
+    if (isFilePage(page))
+        return;
+
+    if (it != snap->pages.end()) {
+        if (host == NULL)
+            host = lookup(page << GMEM_PAGE_BITS);
+
+        memcpy(host, it->second->data, GMEM_PAGE_SIZE);
+    } else if (host != NULL)
+        memset(host, 0, GMEM_PAGE_SIZE);
+}
+
+/* The pages written from now on are relative to snap */
+void GuestMemory::setBaseline(Snapshot *snap)
+{
+    Snapshot *old_baseline = baseline;
+
+    if (dirtyBits == NULL) {
+        dirtyBits = (uint8_t *)calloc(GMEM_PAGE_COUNT / 8, 1);
+        if (dirtyBits == NULL)
+            throw bad_alloc();
+    }
+
+    for (unsigned i = 0; i < dirtyPages.size(); i++)
+        dirtyBits[dirtyPages[i] >> 3] &= ~(1 << (dirtyPages[i] & 7));
+    dirtyPages.clear();
+
+    //The next write to each page has to be recorded again
+    for (int i = 0; i < GMEM_TLB_SIZE; i++)
+        writeTlb[i].page = GMEM_NO_PAGE;
+
+    baseline = snap;
+    if (old_baseline != NULL && old_baseline != snap && !old_baseline->named)
+        freeSnapshot(old_baseline);
+}
+
+void GuestMemory::freeSnapshot(Snapshot *snap)
+{
+    PageCopyMap::iterator it;
+
+    for (it = snap->pages.begin(); it != snap->pages.end(); it++) {
+        if (--it->second->refs == 0)
+            free(it->second);
+    }
+
+    delete snap;
+}
+
+/* Saves the memory, a snapshot with the same name is replaced.  Only the
+ * pages written since the baseline are copied.
+ */
+void GuestMemory::saveSnapshot(const string &name)
+{
+    Snapshot *snap = new Snapshot;
+
+    snap->named = true;
+    if (baseline == NULL)
+        capturePages(snap->pages);
+    else {
+        PageCopyMap::iterator it;
+
+        snap->pages = baseline->pages;
+        for (it = snap->pages.begin(); it != snap->pages.end(); it++)
+            it->second->refs++;
+
+        for (unsigned i = 0; i < dirtyPages.size(); i++) {
+            PageCopy *&copy = snap->pages[dirtyPages[i]];
+
+            if (copy != NULL && --copy->refs == 0)
+                free(copy);
+
+            copy = copyPage(dirtyPages[i]);
+        }
+    }
+
+    map<string, Snapshot *>::iterator old = snapshots.find(name);
+
+    if (old != snapshots.end()) {
+        old->second->named = false;
+        if (old->second != baseline)
+            freeSnapshot(old->second);
+    }
+
+    snapshots[name] = snap;
+    setBaseline(snap);
+}
+
+/* Restores the memory saved in the snapshot.  The pages written since the
+ * baseline are copied back, and the pages that differ between the baseline
+ * and the snapshot when they are not the same.
+ */
+bool GuestMemory::restoreSnapshot(const string &name)
+{
+    map<string, Snapshot *>::iterator found = snapshots.find(name);
+
+    if (found == snapshots.end())
+        return false;
+
+    Snapshot *snap = found->second;
+
+    if (snap != baseline) {
+        PageCopyMap::iterator a = baseline->pages.begin(), b = snap->pages.begin();
+
+        while (a != baseline->pages.end() || b != snap->pages.end()) {
+            if (b == snap->pages.end() || (a != baseline->pages.end() && a->first < b->first)) {
+                restorePage(a->first, snap);
+                a++;
+            } else if (a == baseline->pages.end() || b->first < a->first) {
+                restorePage(b->first, snap);
+                b++;
+            } else {
+                if (a->second != b->second)
+                    restorePage(a->first, snap);
+                a++;
+                b++;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < dirtyPages.size(); i++)
+        restorePage(dirtyPages[i], snap);
+
+    setBaseline(snap);
+
+    return true;
+}
+
+bool GuestMemory::deleteSnapshot(const string &name)
+{
+    map<string, Snapshot *>::iterator it = snapshots.find(name);
+
+    if (it == snapshots.end())
+        return false;
+
+    //The baseline is released when it's replaced
+    it->second->named = false;
+    if (it->second != baseline)
+        freeSnapshot(it->second);
+    snapshots.erase(it);
+
+    return true;
+}
+
+/* Native functions run on a host stack, the guest stack may be too small for
+ * the frames of the native code.  The words at the top
+ * of the guest stack (the arguments) are copied to it, the pointers passed
+ * as arguments still point to the guest pages.
+ */
+void *GuestMemory::nativeStack(uint32_t vaddr)
+{
+    uint32_t *frame = nativeFrame();
+
+    for (int i = 0; i < GMEM_NATIVE_ARG_WORDS; i++, vaddr += 4) {
+        uint8_t *p = isMapped(vaddr)? getPtr(vaddr) : NULL;
+
+        if (p != NULL && (vaddr & GMEM_PAGE_MASK) <= GMEM_PAGE_SIZE - 4)
+            memcpy(&frame[i], p, 4);
+        else
+            frame[i] = 0;
+    }
+
+    return frame;
+}
+
+/* The GMEM_NATIVE_ARG_WORDS words at the top of the host stack, the caller
+ * fills the arguments.
+ */
+uint32_t *GuestMemory::nativeFrame()
+{
+    if (nativeStackMem == NULL) {
+        nativeStackMem = (uint8_t *)malloc(GMEM_NATIVE_STACK_SIZE);
+        if (nativeStackMem == NULL)
+            throw bad_alloc();
+    }
+
+    return (uint32_t *)(nativeStackMem + GMEM_NATIVE_STACK_SIZE) - GMEM_NATIVE_ARG_WORDS;
+}
+
+/* Copies a block into the guest memory, a page at a time unless the memory
+ * is flat and there are no snapshots.
+ */
+bool GuestMemory::write(uint32_t vaddr, const void *src, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)src;
+
+    if (flatBase != NULL && baseline == NULL) {
+        memcpy(flatBase + vaddr, p, size);
+        return true;
+    }
+
+    while (size > 0) {
+        uint8_t *host = isMapped(vaddr)? getWritePtr(vaddr) : NULL;
+        size_t count = GMEM_PAGE_SIZE - (vaddr & GMEM_PAGE_MASK);
+
+        if (host == NULL)
+            return false;
+
+        if (count > size)
+            count = size;
+
+        memcpy(host, p, count);
+        vaddr += count;
+        p += count;
+        size -= count;
+    }
+
+    return true;
+}
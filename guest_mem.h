@@ -0,0 +1,239 @@
+/*
+ * File:   guest_mem.h
+ *
+ * Sparse 32-bit guest memory shared by the simulators.
+ */
+
+#ifndef GUEST_MEM_H
+#define GUEST_MEM_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <csetjmp>
+#include <signal.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+#if defined(__unix__) && defined(__SIZEOF_POINTER__) && (__SIZEOF_POINTER__ == 8)
+#define GMEM_FLAT_SUPPORTED
+#endif
+
+#define GMEM_PAGE_BITS          12
+#define GMEM_PAGE_SIZE          (1 << GMEM_PAGE_BITS)
+#define GMEM_PAGE_MASK          (GMEM_PAGE_SIZE - 1)
+#define GMEM_TABLE_BITS         10  //Pages covered by a second level table
+#define GMEM_TABLE_SIZE         (1 << GMEM_TABLE_BITS)
+#define GMEM_DIR_SIZE           (1 << (32 - GMEM_PAGE_BITS - GMEM_TABLE_BITS))
+#define GMEM_PAGE_COUNT         (1 << (32 - GMEM_PAGE_BITS))
+#define GMEM_NO_PAGE            0xFFFFFFFF
+#define GMEM_TLB_BITS           6
+#define GMEM_TLB_SIZE           (1 << GMEM_TLB_BITS)
+#define GMEM_NATIVE_STACK_SIZE  (256 * 1024)
+#define GMEM_NATIVE_ARG_WORDS   16  //Stack words copied for a native call
+#define GMEM_FLAT_SIZE          (1ULL << 32)
+
+/* The native calls pass the arguments as 32-bit words on the host stack
+ * and #paddr gives the host address of guest memory in a 32-bit value, so
+ * they need a 32-bit host.  The 64-bit build (native64) rejects them.
+ */
+#if defined(__i386__) || defined(_WIN32)
+#define GMEM_NATIVE_CALLS       1
+#else
+#define GMEM_NATIVE_CALLS       0
+#endif
+#define GMEM_NO_NATIVE_CALLS_MSG "Native calls and #paddr need the 32-bit build of EasyASM.\n"
+
+/* Results of mapFile */
+#define GMEM_MAP_OK             0
+#define GMEM_MAP_CANNOT_OPEN    1
+#define GMEM_MAP_EMPTY          2
+#define GMEM_MAP_UNALIGNED      3
+#define GMEM_MAP_TOO_LARGE      4
+#define GMEM_MAP_FAILED         5
+
+/* Guest address space made of 4 KiB pages, only the pages inside a mapped
+ * region can be touched.  Each region is one host block, reserved the first
+ * time one of its pages is touched, and the host only backs the pages in use,
+ * which hold zeros at first.  So a host pointer given to native code is
+ * valid up to the end of its region.  The translations go through a direct
+ * mapped TLB of host page pointers, so a hit is a tag compare and an add.
+ *
+ * The flat backend reserves the whole guest address space in the host instead
+ * and makes the mapped regions accessible, a translation is an add.  Accesses
+ * outside the regions raise SIGSEGV, which jumps to the target set with
+ * setFaultTarget.  The jump skips the destructors, so the code between the
+ * sigsetjmp of the target (MIPS32Sim::run and X86Sim::run) and the guest
+ * accesses must not hold objects with non-trivial destructors.  The faults
+ * that are not guest accesses go to the SIGSEGV handler installed before.
+ *
+ * Files are mapped with a private host mapping, the guest pages point into
+ * it.  A writable mapping is copy on write, the writes to a read only mapping
+ * fault like the accesses outside the regions.
+ *
+ * A snapshot keeps a copy of each page, the pages that didn't change since
+ * the previous snapshot share its copies.  The writes go through a second
+ * TLB that records the pages written since the last snapshot saved or
+ * restored, so a restore only copies those pages back.  The mapped files are
+ * not part of the snapshots.
+ */
+class GuestMemory
+{
+public:
+    GuestMemory();
+    ~GuestMemory();
+
+    void mapRegion(uint32_t start, uint32_t size);
+    bool isMapped(uint32_t vaddr);
+
+    bool setFlat();
+    bool isFlat() { return flatBase != NULL; }
+    sigjmp_buf *setFaultTarget(sigjmp_buf *target);
+    uint32_t getFaultAddress() { return faultAddr; }
+    const char *getFaultMessage();
+
+    /* False if the access would fault, the fault address and message are
+     * set as if it did.  The unchecked accesses are left to the fault
+     * handler.
+     */
+    bool checkAccess(uint32_t vaddr, bool write) {
+        if (unchecked || (flatBase == NULL && (!write || fileMaps.empty())))
+            return true;
+
+        return checkRegions(vaddr, write);
+    }
+    bool setUnchecked(bool value) {
+        bool old = unchecked;
+
+        unchecked = value;
+        return old;
+    }
+
+    int mapFile(const char *path, uint32_t vaddr, bool readOnly);
+    static const char *mapErrorMessage(int error);
+
+    /* Host address of a guest address, NULL if it's not mapped.  The flat
+     * backend doesn't check the address.
+     */
+    uint8_t *getPtr(uint32_t vaddr) {
+        if (flatBase != NULL)
+            return flatBase + vaddr;
+
+        uint32_t page = vaddr >> GMEM_PAGE_BITS;
+        TlbEntry &entry = tlb[page & (GMEM_TLB_SIZE - 1)];
+
+        if (entry.page == page) {
+            tlbHits++;
+            return entry.host + (vaddr & GMEM_PAGE_MASK);
+        }
+
+        return lookup(vaddr);
+    }
+
+    bool write(uint32_t vaddr, const void *src, size_t size);
+    /* Host address of a guest address that is going to be written.  The
+     * flat backend skips the TLB while there are no snapshots.
+     */
+    uint8_t *getWritePtr(uint32_t vaddr) {
+        if (flatBase != NULL && baseline == NULL)
+            return flatBase + vaddr;
+
+        uint32_t page = vaddr >> GMEM_PAGE_BITS;
+        TlbEntry &entry = writeTlb[page & (GMEM_TLB_SIZE - 1)];
+
+        if (entry.page == page) {
+            tlbHits++;
+            return entry.host + (vaddr & GMEM_PAGE_MASK);
+        }
+
+        return lookupWrite(vaddr);
+    }
+
+    void saveSnapshot(const string &name);
+    bool restoreSnapshot(const string &name);
+    bool deleteSnapshot(const string &name);
+    size_t getDirtyPageCount() { return dirtyPages.size(); }
+
+    void *nativeStack(uint32_t vaddr);
+    uint32_t *nativeFrame();
+    size_t getPageCount() { return pageCount; }
+    uint64_t getTlbHits() { return tlbHits; }
+    uint64_t getTlbMisses() { return tlbMisses; }
+    void resetTlbStats() { tlbHits = tlbMisses = 0; }
+
+private:
+    struct Region {
+        uint32_t firstPage;
+        uint32_t lastPage;
+        uint8_t *host;  //Block of the pages, NULL until one is touched
+        bool file;      //Pages of a mapped file, they have no block
+    };
+
+    struct FileMapping {
+        uint32_t firstPage;
+        uint32_t lastPage;
+        uint8_t *host;
+        size_t length;
+        bool readOnly;
+    };
+
+    struct TlbEntry {
+        uint32_t page;  //GMEM_NO_PAGE when the entry is empty
+        uint8_t *host;
+    };
+
+    struct PageCopy {
+        int refs;       //Snapshots that share the copy
+        uint8_t data[GMEM_PAGE_SIZE];
+    };
+
+    typedef map<uint32_t, PageCopy *> PageCopyMap;
+
+    struct Snapshot {
+        PageCopyMap pages;  //Copies of the allocated pages, by page number
+        bool named;         //False once it's deleted or replaced
+    };
+
+    uint8_t *lookup(uint32_t vaddr);
+    uint8_t *lookupWrite(uint32_t vaddr);
+    uint8_t *pageHost(uint32_t page);
+    PageCopy *copyPage(uint32_t page);
+    void capturePages(PageCopyMap &pages);
+    void restorePage(uint32_t page, Snapshot *snap);
+    void setBaseline(Snapshot *snap);
+    void freeSnapshot(Snapshot *snap);
+    bool protectRegion(const Region &region);
+    Region *findRegion(uint32_t page);
+    void freeRegions();
+    bool isFilePage(uint32_t page);
+    bool checkRegions(uint32_t vaddr, bool write);
+    void unmapFiles(uint32_t firstPage, uint32_t lastPage);
+    void flushTlb();
+    static void installFaultHandler();
+    static void setFaultHandler();
+    static void faultHandler(int sig, siginfo_t *info, void *context);
+
+    vector<Region> regions;
+    vector<FileMapping> fileMaps;
+    uint8_t **dir[GMEM_DIR_SIZE]; //Second level tables, indexed by the upper bits of the page
+    size_t pageCount;
+    TlbEntry tlb[GMEM_TLB_SIZE];
+    TlbEntry writeTlb[GMEM_TLB_SIZE];   //Pages recorded as written
+    uint64_t tlbHits;
+    uint64_t tlbMisses;
+    uint8_t *nativeStackMem;
+    uint8_t *flatBase;          //Reservation of the flat backend
+    sigjmp_buf *faultTarget;
+    uint32_t faultAddr;         //Guest address of the last fault
+    bool faultReadOnly;         //The last fault was a write to a read only mapping
+    bool unchecked;             //The accesses are made without checkAccess
+    map<string, Snapshot *> snapshots;
+    Snapshot *baseline;         //Last snapshot saved or restored
+    vector<uint32_t> dirtyPages;//Pages written since the baseline
+    uint8_t *dirtyBits;         //Bitmap of the pages in dirtyPages
+};
+
+#endif // GUEST_MEM_H
@@ -2,6 +2,11 @@
 #include <cstdlib>		/* for free() */
 #include <cstring>
 #include <cstdarg>
+#include <cerrno>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include <editline/readline.h>
 #include <iostream>
 #include <fstream>
@@ -14,8 +19,21 @@
 #include "x86_dbg.h"
 #include "mips32_sim.h"
 #include "mips32_parser.h"
+#include "batch.h"
+#include "mips32_lanes.h"
+#include "server.h"
+#include "util.h"
+
+/* Exit status of the headless mode */
+#define EXIT_RUN_OK         0
+#define EXIT_USAGE          1
+#define EXIT_LOAD_ERROR     2   //The file cannot be read or has errors
+#define EXIT_RUNTIME_ERROR  3
+#define EXIT_STEP_LIMIT     4
+#define EXIT_BATCH_ERRORS   5   //Some programs of the batch or lanes didn't end normally
 
 bool simMips32 = true;
+bool headless = false;  //The errors go to stderr, stdout belongs to the program
 MIPS32Sim msim;
 X86Sim xsim;
 
@@ -25,19 +43,27 @@ using namespace std;
 #define snprintf _snprintf
 #endif
 
+//The errors go to the simulator that reported them if it captures them
+static FILE *errorOutput(AsmSimulator *sim)
+{
+    if (sim != NULL && sim->getErrorOutput() != NULL)
+        return sim->getErrorOutput();
+
+    return headless? stderr : stdout;
+}
+
 //Report runtime errors
 void reportRuntimeError(const char *format, ...)
 {
+    AsmSimulator *sim = AsmSimulator::current();
+    FILE *out = errorOutput(sim);
     va_list args;
 
-    if (simMips32) {
-        printf("Line %d: ", msim.getSourceLine());
-    } else {
-        printf("Line %d: ", xsim.getSourceLine());
-    }
+    if (sim != NULL)
+        fprintf(out, "Line %d: ", sim->getSourceLine());
 
     va_start(args, format);
-    vprintf(format, args);
+    vfprintf(out, format, args);
     va_end(args);
 }
 
@@ -46,10 +72,27 @@ void reportError(const char *format, ...)
     va_list args;
 
     va_start(args, format);
-    vprintf(format, args);
+    vfprintf(errorOutput(AsmSimulator::current()), format, args);
     va_end(args);
 }
 
+void showMemoryStats()
+{
+    GuestMemory *memory = simMips32? msim.getMemory() : xsim.getMemory();
+    uint64_t hits = memory->getTlbHits(), misses = memory->getTlbMisses();
+
+    if (memory->isFlat()) {
+        printf("The guest address space is reserved in the host, the pages are allocated by the host.\n");
+        return;
+    }
+    printf("Pages allocated = %u (%u KiB)\n", (unsigned)memory->getPageCount(),
+           (unsigned)(memory->getPageCount() * GMEM_PAGE_SIZE / 1024));
+    printf("TLB hits        = %llu\n", (unsigned long long)hits);
+    printf("TLB misses      = %llu\n", (unsigned long long)misses);
+    if (hits + misses != 0)
+        printf("TLB hit rate    = %.2f%%\n", (double)hits * 100.0 / (hits + misses));
+}
+
 void debugSession()
 {
     AsmDebugger *dbg;
@@ -108,6 +151,8 @@ void debugSession()
                 dbg->addBreakpoint(lineNumber);
                 cout << "Breakpoint set at line " << lineNumber << endl;
             }
+        } else if (strcmp(strList[0].c_str(), "#memstats") == 0) {
+            showMemoryStats();
         } else if (strcmp(strList[0].c_str(), "#show") == 0 ||
                    strcmp(strList[0].c_str(), "#set") == 0) {
             dbg->doSimCommand(curr_command);
@@ -185,6 +230,242 @@ void processLines(list<string> &lines)
     }
 }
 
+static int lastOutputChar = '\n';  //Last character written by the program in the headless mode
+
+static ssize_t writeProgramOutput(void *cookie, const char *buf, size_t size)
+{
+    size_t written = fwrite(buf, 1, size, stdout);
+
+    if (written > 0)
+        lastOutputChar = (unsigned char)buf[written - 1];
+
+    return written;
+}
+
+/* The output of the program goes through a stream that keeps its last
+ * character, so the final state starts on its own line.
+ */
+static FILE *redirectProgramOutput()
+{
+    cookie_io_functions_t io;
+    FILE *out;
+
+    memset(&io, 0, sizeof(io));
+    io.write = writeProgramOutput;
+    out = fopencookie(NULL, "w", io);
+    if (out != NULL) {
+        msim.setOutput(out);
+        xsim.setOutput(out);
+    }
+
+    return out;
+}
+
+/* Final state of the headless mode, one "name=value" pair per line */
+void dumpRegisters(const char *status)
+{
+    fflush(stdout);
+    if (lastOutputChar != '\n')
+        printf("\n");
+    printf("status=%s\n", status);
+    if (simMips32) {
+        printf("steps=%llu\n", (unsigned long long)msim.getInstructionCount());
+        printf("exit_code=%d\n", msim.getExitCode());
+        for (int i = 0; i < 32; i++)
+            printf("%s=0x%08X\n", mips32_getRegisterName(i).c_str(), msim.reg[i]);
+        printf("hi=0x%08X\n", (uint32_t)(msim.getHiLo() >> 32));
+        printf("lo=0x%08X\n", (uint32_t)msim.getHiLo());
+    } else {
+        printf("steps=%llu\n", (unsigned long long)xsim.getInstructionCount());
+        for (int i = R_EAX; i <= R_EFLAGS; i++) {
+            uint32_t value;
+
+            xsim.getRegValue(i, value);
+            printf("%s=0x%08X\n", xreg[i], value);
+        }
+    }
+}
+
+/* Runs a file without the command line, the result is the exit status */
+int runHeadless(const char *file, bool dump_regs)
+{
+    ifstream in(file);
+    MemPool pool;
+    NodePoolScope nodes(&pool);
+    FILE *out = NULL;
+    bool result;
+
+    if (!in.is_open()) {
+        cerr << "Cannot open file '" << file << "'" << endl;
+        return EXIT_LOAD_ERROR;
+    }
+
+    if (simMips32) {
+        vector<MDecodedInst> code;
+        map<string, uint32_t> labelMap;
+
+        if (!msim.loadFile(&in, code, labelMap))
+            return EXIT_LOAD_ERROR;
+        if (dump_regs)
+            out = redirectProgramOutput();
+        result = msim.run(code, labelMap);
+    } else {
+        vector<XMicroOp> code;
+        map<string, uint32_t> labelMap;
+
+        if (!xsim.loadFile(&in, code, labelMap))
+            return EXIT_LOAD_ERROR;
+        if (dump_regs)
+            out = redirectProgramOutput();
+        result = xsim.run(code, labelMap);
+    }
+
+    bool step_limit = simMips32? msim.stepLimitReached() : xsim.stepLimitReached();
+    int status = result? EXIT_RUN_OK : (step_limit? EXIT_STEP_LIMIT : EXIT_RUNTIME_ERROR);
+
+    if (out != NULL) {
+        fclose(out);
+        msim.setOutput(stdout);
+        xsim.setOutput(stdout);
+    }
+    if (dump_regs)
+        dumpRegisters((status == EXIT_RUN_OK)? "ok" : (status == EXIT_STEP_LIMIT)? "step_limit" : "runtime_error");
+    fflush(stdout);
+
+    return status;
+}
+
+/* Runs the programs of a directory or a list, the records go to stdout
+ * and a summary to stderr.
+ */
+int runBatch(const char *path, const BatchOptions &options)
+{
+    BatchRunner runner(options, stdout);
+
+    if (!runner.addPath(path)) {
+        cerr << "Cannot read the directory or list '" << path << "'" << endl;
+        return EXIT_USAGE;
+    }
+
+    uint32_t failed = runner.run();
+    double elapsed = runner.getElapsedTime();
+
+    fprintf(stderr, "%u programs, %u failed, %.3f s, %.1f programs/s\n", runner.getFileCount(), failed,
+            elapsed, (elapsed > 0)? runner.getFileCount() / elapsed : 0.0);
+
+    return (failed == 0)? EXIT_RUN_OK : EXIT_BATCH_ERRORS;
+}
+
+/* Serves the requests of the clients of a Unix domain socket until
+ * SIGINT or SIGTERM
+ */
+int runServer(const char *path, const BatchOptions &options)
+{
+    SimServer server(options);
+
+    if (!server.listen(path)) {
+        cerr << "Cannot listen on the socket '" << path << "': " << strerror(errno) << endl;
+        return EXIT_USAGE;
+    }
+
+    fprintf(stderr, "Listening on %s\n", path);
+
+    return server.run()? EXIT_RUN_OK : EXIT_RUNTIME_ERROR;
+}
+
+struct LaneOutput {
+    int input;
+    FILE *out;
+    FILE *err;
+    char *outBuf;
+    char *errBuf;
+    size_t outSize;
+    size_t errSize;
+};
+
+/* Runs a MIPS32 program once for each input of the list, with all the
+ * copies in lockstep.  A record is written to stdout for each lane:
+ *
+ *   {"lane":0,"input":"a.in","status":"ok","steps":120,"exit_code":0,"output":"...","errors":""}
+ *
+ * With --dump-regs the record has a "regs" object with the registers.
+ */
+int runLanes(const char *file, const char *list, uint64_t max_steps, bool dump_regs)
+{
+    MIPS32LaneSim sim;
+    vector<string> inputs;
+    ifstream in(file);
+    struct timeval start, end;
+
+    if (!readListFile(list, inputs)) {
+        cerr << "Cannot read the list of inputs '" << list << "'" << endl;
+        return EXIT_USAGE;
+    }
+
+    vector<LaneOutput> lanes(inputs.size());
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        LaneOutput &lane = lanes[i];
+
+        lane.input = open(inputs[i].c_str(), O_RDONLY);
+        if (lane.input < 0) {
+            cerr << "Cannot open the input file '" << inputs[i] << "'" << endl;
+            return EXIT_USAGE;
+        }
+        lane.out = open_memstream(&lane.outBuf, &lane.outSize);
+        lane.err = open_memstream(&lane.errBuf, &lane.errSize);
+        sim.addLane(lane.input, lane.out, lane.err);
+    }
+
+    if (!in.is_open()) {
+        cerr << "Cannot open file '" << file << "'" << endl;
+        return EXIT_LOAD_ERROR;
+    }
+    if (!sim.loadFile(&in))
+        return EXIT_LOAD_ERROR;
+
+    sim.setMaxSteps((max_steps != 0)? max_steps : BATCH_DEFAULT_MAX_STEPS);
+
+    gettimeofday(&start, NULL);
+    uint32_t failed = sim.run();
+    gettimeofday(&end, NULL);
+
+    for (uint32_t i = 0; i < inputs.size(); i++) {
+        LaneOutput &lane = lanes[i];
+        MIPS32Sim *lsim = sim.getLaneSim(i);
+
+        fclose(lane.out);
+        fclose(lane.err);
+        close(lane.input);
+
+        printf("{\"lane\":%u,\"input\":", i);
+        writeJsonString(stdout, inputs[i]);
+        printf(",\"status\":\"%s\",\"steps\":%llu,\"exit_code\":%d", BatchRunner::statusName(sim.getLaneStatus(i)),
+               (unsigned long long)sim.getLaneSteps(i), lsim->getExitCode());
+        fputs(",\"output\":", stdout);
+        writeJsonString(stdout, string(lane.outBuf, lane.outSize));
+        fputs(",\"errors\":", stdout);
+        writeJsonString(stdout, string(lane.errBuf, lane.errSize));
+        if (dump_regs) {
+            fputs(",\"regs\":{", stdout);
+            for (int r = 0; r < 32; r++)
+                printf("\"%s\":\"0x%08X\",", mips32_getRegisterName(r).c_str(), lsim->reg[r]);
+            printf("\"hi\":\"0x%08X\",\"lo\":\"0x%08X\"}", (uint32_t)(lsim->getHiLo() >> 32), (uint32_t)lsim->getHiLo());
+        }
+        fputs("}\n", stdout);
+        free(lane.outBuf);
+        free(lane.errBuf);
+    }
+    fflush(stdout);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    fprintf(stderr, "%u lanes, %u failed, %.3f s, %llu steps converged, %s kernels\n", (uint32_t)inputs.size(), failed,
+            elapsed, (unsigned long long)sim.getConvergedSteps(), MIPS32LaneSim::getVectorIsa());
+
+    return (failed == 0)? EXIT_RUN_OK : EXIT_BATCH_ERRORS;
+}
+
 int main(int argc, char *argv[])
 {
     const char *prompt1 = "ASM> ";
@@ -193,17 +474,116 @@ int main(int argc, char *argv[])
     list<string> lines;
     int line_count;
     char buffer[16];
-
-    if (argc > 1) {
-        ++argv, --argc; /* The first argument is the program name */
+    const char *run_file = NULL;
+    const char *batch_path = NULL;
+    const char *lanes_path = NULL;
+    const char *serve_path = NULL;
+    BatchOptions batch_opts;
+    bool dump_regs = false;
+
+    ++argv, --argc; /* The first argument is the program name */
+    while (argc > 0) {
         if (strcmp(argv[0], "--mips32") == 0)
             simMips32 = true;
         else if (strcmp(argv[0], "--x86") == 0)
             simMips32 = false;
-        else {
+        else if (strcmp(argv[0], "--threaded") == 0) {
+            msim.setThreadedDispatch(true);
+            xsim.setThreadedDispatch(true);
+            batch_opts.threadedDispatch = true;
+        } else if (strcmp(argv[0], "--jit") == 0) {
+            batch_opts.jit = msim.setJit(true);
+            if (!batch_opts.jit)
+                cerr << "The JIT compiler is not supported in this host, using the interpreter." << endl;
+        } else if (strcmp(argv[0], "--lazy-flags") == 0) {
+            xsim.setLazyFlags(true);
+            batch_opts.lazyFlags = true;
+        } else if (strcmp(argv[0], "--flat-mem") == 0) {
+            batch_opts.flatMem = msim.getMemory()->setFlat() && xsim.getMemory()->setFlat();
+            if (!batch_opts.flatMem)
+                cerr << "The flat memory backend is not supported in this host, using the page table." << endl;
+        } else if (strcmp(argv[0], "--cache") == 0 && argc > 1) {
+            ++argv, --argc;
+            if (mkdir(argv[0], 0755) != 0 && errno != EEXIST) {
+                cerr << "Cannot create the cache directory '" << argv[0] << "'" << endl;
+                exit(1);
+            }
+            msim.setCacheDirectory(argv[0]);
+            xsim.setCacheDirectory(argv[0]);
+            batch_opts.cacheDir = argv[0];
+        } else if (strcmp(argv[0], "--run") == 0 && argc > 1) {
+            ++argv, --argc;
+            run_file = argv[0];
+        } else if (strcmp(argv[0], "--input") == 0 && argc > 1) {
+            ++argv, --argc;
+            int fd = open(argv[0], O_RDONLY);
+
+            if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+                cerr << "Cannot open the input file '" << argv[0] << "'" << endl;
+                exit(EXIT_USAGE);
+            }
+            close(fd);
+        } else if (strcmp(argv[0], "--dump-regs") == 0) {
+            dump_regs = true;
+        } else if (strcmp(argv[0], "--max-steps") == 0 && argc > 1) {
+            ++argv, --argc;
+            char *end;
+            unsigned long long steps = strtoull(argv[0], &end, 10);
+
+            if (*end != '\0' || steps == 0) {
+                cerr << "Invalid number of steps '" << argv[0] << "'" << endl;
+                exit(EXIT_USAGE);
+            }
+            msim.setMaxSteps(steps);
+            xsim.setMaxSteps(steps);
+            batch_opts.maxSteps = steps;
+        } else if (strcmp(argv[0], "--batch") == 0 && argc > 1) {
+            ++argv, --argc;
+            batch_path = argv[0];
+        } else if (strcmp(argv[0], "--lanes") == 0 && argc > 1) {
+            ++argv, --argc;
+            lanes_path = argv[0];
+        } else if (strcmp(argv[0], "--serve") == 0 && argc > 1) {
+            ++argv, --argc;
+            serve_path = argv[0];
+        } else if (strcmp(argv[0], "--threads") == 0 && argc > 1) {
+            ++argv, --argc;
+            batch_opts.threads = atoi(argv[0]);
+            if (batch_opts.threads <= 0) {
+                cerr << "Invalid number of threads '" << argv[0] << "'" << endl;
+                exit(EXIT_USAGE);
+            }
+        } else {
             cerr << "Invalid option '" << argv[0] << "'" << endl;
-            exit(1);
+            exit(EXIT_USAGE);
+        }
+        ++argv, --argc;
+    }
+
+    if (serve_path != NULL) {
+        headless = true;
+        batch_opts.mips32 = simMips32;
+        return runServer(serve_path, batch_opts);
+    }
+
+    if (lanes_path != NULL) {
+        if (run_file == NULL || !simMips32) {
+            cerr << "--lanes needs a MIPS32 program given with --run" << endl;
+            return EXIT_USAGE;
         }
+        headless = true;
+        return runLanes(run_file, lanes_path, batch_opts.maxSteps, dump_regs);
+    }
+
+    if (run_file != NULL) {
+        headless = true;
+        return runHeadless(run_file, dump_regs);
+    }
+
+    if (batch_path != NULL) {
+        headless = true;
+        batch_opts.mips32 = simMips32;
+        return runBatch(batch_path, batch_opts);
     }
 
     if (simMips32) {
@@ -211,12 +591,16 @@ int main(int argc, char *argv[])
         cout << "Global base address = 0x" << hex << M_VIRTUAL_GLOBAL_START_ADDR << dec << endl;
         cout << "Stack pointer address = 0x" << hex << M_VIRTUAL_STACK_END_ADDR << dec << endl;
         cout << "Global memory size = " << M_GLOBAL_MEM_WORD_COUNT << " words" << endl;
+        cout << "Heap base address  = 0x" << hex << M_VIRTUAL_HEAP_START_ADDR << dec << endl;
+        cout << "Heap size          = " << M_HEAP_SIZE_WORDS << " words" << endl;
         cout << "Stack size         = " << M_STACK_SIZE_WORDS << " words" << endl << endl;
     } else {
         cout << "--- EasyASM x86 mode (little endian) ----" << endl << endl;
         cout << "Global base address = 0x" << hex << X_VIRTUAL_GLOBAL_START_ADDR << dec << endl;
         cout << "Stack pointer address = 0x" << hex << X_VIRTUAL_STACK_END_ADDR << dec << endl;
         cout << "Global memory size = " << X_GLOBAL_MEM_WORD_COUNT << " dwords" << endl;
+        cout << "Heap base address  = 0x" << hex << X_VIRTUAL_HEAP_START_ADDR << dec << endl;
+        cout << "Heap size          = " << X_HEAP_SIZE_WORDS << " dwords" << endl;
         cout << "Stack size         = " << X_STACK_SIZE_WORDS << " dwords" << endl << endl;
     }
 
@@ -231,6 +615,13 @@ int main(int argc, char *argv[])
             break;
         }
         
+        if (strcmp(line, "#memstats") == 0) {
+            add_history(line);
+            showMemoryStats();
+            free(line);
+            continue;
+        }
+
         if (strncmp(line, "#debug", 6) == 0) {
             vector<string> strList;
             
@@ -1,44 +1,71 @@
 #include <cstdlib>
-#include <iostream>
+#include <new>
 #include "mempool.h"
 
 using namespace std;
 
+#define CHUNK_HEADER_SIZE ((sizeof(Chunk) + MEMPOOL_ALIGNMENT - 1) & ~((size_t)MEMPOOL_ALIGNMENT - 1))
+
 MemPool::MemPool()
 {
-    nodes.clear();
+    chunks = NULL;
+    chunkCount = 0;
+    cur = end = NULL;
 }
 
-void *MemPool::memAlloc(size_t size)
+MemPool::~MemPool()
 {
-    void *result = ::operator new (size);
-    
-    if (result != NULL) {
-        nodes.insert(result);
-    }
+    releaseChunks(chunks);
+}
+
+void *MemPool::allocChunk(size_t size)
+{
+    size_t chunk_size = (chunks != NULL)? chunks->size * 2 : MEMPOOL_CHUNK_SIZE;
+
+    if (chunk_size > MEMPOOL_MAX_CHUNK_SIZE)
+        chunk_size = MEMPOOL_MAX_CHUNK_SIZE;
+    if (chunk_size < size)
+        chunk_size = size;
+
+    Chunk *chunk = (Chunk *)malloc(CHUNK_HEADER_SIZE + chunk_size);
+
+    if (chunk == NULL)
+        throw bad_alloc();
+
+    chunk->size = chunk_size;
+    chunk->next = chunks;
+    chunks = chunk;
+    chunkCount++;
+
+    cur = (char *)chunk + CHUNK_HEADER_SIZE;
+    end = cur + chunk_size;
+
+    void *result = cur;
+    cur += size;
 
     return result;
 }
 
-void MemPool::memFree(void *ptrb)
+void MemPool::releaseChunks(Chunk *chunk)
 {
-    if (nodes.find(ptrb) != nodes.end()) {
-        nodes.erase(ptrb);
-        ::operator delete (ptrb);
+    while (chunk != NULL) {
+        Chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
     }
 }
 
 void MemPool::freeAll()
 {
-    set<void *>::iterator it = nodes.begin();
-
-    while (it != nodes.end()) {
-        void *ptr = *it;
+    if (chunks == NULL)
+        return;
 
-        //cout << hex << "Freeing " << ptr << dec << endl;
-        ::operator delete (ptr);
-        it++;
-    }
+    //Keep the newest (biggest) chunk, it's reused by the next allocations
+    releaseChunks(chunks->next);
+    chunks->next = NULL;
+    chunkCount = 1;
 
-    nodes.clear();
+    cur = (char *)chunks + CHUNK_HEADER_SIZE;
+    end = cur + chunks->size;
 }
@@ -1,21 +1,53 @@
 #ifndef XALLOCPOOL_H
 #define XALLOCPOOL_H
 
-#include <set>
+#include <cstddef>
 
 using namespace  std;
 
+#define MEMPOOL_ALIGNMENT       16
+#define MEMPOOL_CHUNK_SIZE      (16 * 1024)     //Size of the first chunk
+#define MEMPOOL_MAX_CHUNK_SIZE  (1024 * 1024)   //Chunks double their size up to this limit
+
+/* Bump pointer arena.  The memory is carved from chunks that grow as needed,
+ * individual blocks are never released, freeAll releases everything at once.
+ * Destructors are not called by freeAll.
+ */
 class MemPool
 {
 public:
     MemPool();
-    ~MemPool() { freeAll(); }
+    ~MemPool();
+
+    void *memAlloc(std::size_t size) {
+        size = (size + MEMPOOL_ALIGNMENT - 1) & ~((size_t)MEMPOOL_ALIGNMENT - 1);
+
+        if (size > (size_t)(end - cur))
+            return allocChunk(size);
+
+        void *result = cur;
+        cur += size;
 
-    void *memAlloc(std::size_t size);
-    void memFree(void *ptrb);
+        return result;
+    }
+
+    void memFree(void *ptrb) { }
     void freeAll();
+    size_t getChunkCount() { return chunkCount; }
+
 private:
-    set<void *> nodes;
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+    };
+
+    void *allocChunk(size_t size);
+    void releaseChunks(Chunk *chunk);
+
+    Chunk *chunks;  //Most recent chunk first
+    size_t chunkCount;
+    char *cur;
+    char *end;
 };
 
 #endif // XALLOCPOOL_H
@@ -7,9 +7,9 @@ using namespace std;
 void MIPS32Debugger::showStatus()
 {
     MRtContext *ctx = sim->runtimeCtx;
-    MInstruction *inst = instList[ctx->pc];
+    const MDecodedInst &di = code[ctx->pc];
     
-    cout << inst->line << ": " <<  sourceLines[inst->line - 1] << endl;
+    cout << di.line << ": " <<  sourceLines[di.line - 1] << endl;
 }
 
 void MIPS32Debugger::start()
@@ -20,14 +20,16 @@ void MIPS32Debugger::start()
 
 bool MIPS32Debugger::next()
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     MRtContext *ctx = sim->runtimeCtx;
-    MInstruction *inst = instList[ctx->pc];
-    unsigned count = instList.size();
+    const MDecodedInst &di = code[ctx->pc];
+    unsigned count = code.size();
         
-    ctx->line = inst->line;
+    ctx->line = di.line;
     ctx->pc ++;
     
-    if (!sim->execInstruction(inst)) {
+    if (!sim->execDecoded(di)) {
         return false;
     }
         
@@ -40,27 +42,29 @@ bool MIPS32Debugger::next()
 
 bool MIPS32Debugger::run()
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     MRtContext *ctx = sim->runtimeCtx;
-    unsigned count = instList.size();
+    unsigned count = code.size();
         
     while (1) {
-        MInstruction *inst = instList[ctx->pc];
+        const MDecodedInst &di = code[ctx->pc];
         
-        if (breakpoints.find(inst->line) != breakpoints.end()) {
+        if (breakpoints.find(di.line) != breakpoints.end()) {
             if (inBreakpoint)
                 inBreakpoint = false;
             else {
-                cout << "Program paused due to breakpoint at line " << inst->line << endl;
+                cout << "Program paused due to breakpoint at line " << di.line << endl;
                 
                 inBreakpoint = true;
                 return false;
             }
         }
         
-        ctx->line = inst->line;
+        ctx->line = di.line;
         ctx->pc ++;
 
-        if (!sim->execInstruction(inst)) {
+        if (!sim->execDecoded(di)) {
             return false;
         }
 
@@ -89,6 +93,8 @@ void MIPS32Debugger::stop()
 
 bool MIPS32Debugger::doSimCommand(string cmd)
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     stringstream in;
             
     in.str(cmd);
@@ -15,19 +15,18 @@
 #include <map>
 #include <set>
 #include "adbg.h"
+#include "mips32_sim.h"
 
 using namespace std;
 
 class MemPool;
-class MInstruction;
-class MIPS32Sim;
 
 class MIPS32Debugger: public AsmDebugger
 {
 public:    
-    MIPS32Debugger(MIPS32Sim *sim, vector<MInstruction *> instList, MemPool *mPool) {
+    MIPS32Debugger(MIPS32Sim *sim, vector<MDecodedInst> &code, MemPool *mPool) {
         this->sim = sim;
-        this->instList = instList;
+        this->code = code;
         this->mPool = mPool;
         inBreakpoint = false;
         finished = false;
@@ -50,7 +49,7 @@ private:
     bool inBreakpoint;
     bool finished;
     vector<string> sourceLines;
-    vector<MInstruction *> instList;
+    vector<MDecodedInst> code;
     set<int> breakpoints;
     MIPS32Sim *sim;
     MemPool *mPool;
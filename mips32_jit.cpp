@@ -0,0 +1,555 @@
+/*
+ * File:   mips32_jit.cpp
+ *
+ * Basic block compiler from decoded MIPS32 instructions to host x86 code.
+ *
+ * A block starts at a hot guest pc and runs until the first branch or
+ * jump, or until an instruction that is left to the interpreter.  The
+ * compiled code keeps the address of MIPS32Sim::reg in ebx (rbx) and the
+ * simulator in ebp (rbp), simple ALU instructions and branches are
+ * emitted inline, memory accesses and native calls go through helper
+ * functions.  Block exits with a constant target are chained to the
+ * target block as soon as it gets compiled.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "mips32_jit.h"
+#include "mips32_tree.h"
+
+#ifdef MJIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+/* Host registers */
+#define H_EAX   0
+#define H_ECX   1
+#define H_EDX   2
+
+/* compileInstruction results */
+#define MJIT_INST_NONE  0   //The instruction is left to the interpreter
+#define MJIT_INST_NEXT  1   //Continue with the next instruction
+#define MJIT_INST_END   2   //The instruction ends the block
+
+#define IS_NATIVE_ADDR(addr) (((addr) >= M_VIRTUAL_EXTFUNC_START_ADDR) && ((addr) < M_VIRTUAL_GLOBAL_START_ADDR))
+
+MIPS32Jit::MIPS32Jit(MIPS32Sim *sim)
+{
+    this->sim = sim;
+    hiloDisp = (uint8_t *)&sim->hi_lo - (uint8_t *)sim->reg;
+    instCountDisp = (uint8_t *)&sim->instCount - (uint8_t *)sim->reg;
+    lastPcDisp = (uint8_t *)&sim->jitLastPc - (uint8_t *)sim->reg;
+    prologueSize = 0;
+    buffer = NULL;
+    chaining = true;
+
+#ifdef MJIT_SUPPORTED
+    void *mem = mmap(NULL, MJIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem != MAP_FAILED)
+        buffer = (uint8_t *)mem;
+#endif
+
+    reset();
+}
+
+MIPS32Jit::~MIPS32Jit()
+{
+#ifdef MJIT_SUPPORTED
+    if (buffer != NULL)
+        munmap(buffer, MJIT_CODE_BUFFER_SIZE);
+#endif
+}
+
+/* Forget the compiled code and the program it belongs to */
+void MIPS32Jit::reset()
+{
+    codeBase = NULL;
+    codeSize = 0;
+    hits.clear();
+    flush();
+}
+
+/* Without chaining every block returns to MIPS32Sim::runJit, which checks
+ * the step limit.
+ */
+void MIPS32Jit::setChaining(bool enable)
+{
+    chaining = enable;
+    flush();
+}
+
+/* Drop every compiled block, the hit counters are kept */
+void MIPS32Jit::flush()
+{
+    blocks.assign(codeSize, (uint8_t *)NULL);
+    pendingExits.clear();
+
+    if (buffer == NULL)
+        return;
+
+    cur = buffer;
+
+    errorExit = cur;
+    emit8(0xB8); emit32(MJIT_ERROR);        // mov eax, MJIT_ERROR
+
+    epilogue = cur;
+#if defined(__x86_64__)
+    emit8(0x48); emit8(0x83); emit8(0xC4); emit8(0x08); // add rsp, 8
+#else
+    emit8(0x83); emit8(0xC4); emit8(0x14);  // add esp, 20
+#endif
+    emit8(0x5D);                            // pop ebp
+    emit8(0x5B);                            // pop ebx
+    emit8(0xC3);                            // ret
+}
+
+MJitBlockFn MIPS32Jit::getBlock(vector<MDecodedInst> &code, uint32_t pc)
+{
+    if (buffer == NULL)
+        return NULL;
+
+    if ((&code[0] != codeBase) || (code.size() != codeSize)) {
+        reset();
+        codeBase = &code[0];
+        codeSize = code.size();
+        blocks.assign(codeSize, (uint8_t *)NULL);
+        hits.assign(codeSize, 0);
+    }
+
+    if (blocks[pc] == NULL) {
+        if ((hits[pc] == MJIT_NO_BLOCK) || (++hits[pc] < MJIT_HOT_THRESHOLD))
+            return NULL;
+
+        if (!compile(pc)) {
+            hits[pc] = MJIT_NO_BLOCK;
+            return NULL;
+        }
+    }
+
+    return (MJitBlockFn)(void *)blocks[pc];
+}
+
+bool MIPS32Jit::compile(uint32_t pc)
+{
+    if ((buffer + MJIT_CODE_BUFFER_SIZE - cur) < (MJIT_MAX_BLOCK_INSTS + 2) * MJIT_MAX_INST_BYTES)
+        flush();
+
+    uint8_t *start = cur;
+
+#if defined(__x86_64__)
+    emit8(0x53);                                        // push rbx
+    emit8(0x55);                                        // push rbp
+    emit8(0x48); emit8(0x83); emit8(0xEC); emit8(0x08); // sub rsp, 8
+    emit8(0x48); emit8(0x89); emit8(0xFD);              // mov rbp, rdi
+    emit8(0x48); emit8(0x89); emit8(0xF3);              // mov rbx, rsi
+#else
+    emit8(0x53);                                        // push ebx
+    emit8(0x55);                                        // push ebp
+    emit8(0x83); emit8(0xEC); emit8(0x14);              // sub esp, 20
+    emit8(0x8B); emit8(0x6C); emit8(0x24); emit8(0x20); // mov ebp, [esp+32]
+    emit8(0x8B); emit8(0x5C); emit8(0x24); emit8(0x24); // mov ebx, [esp+36]
+#endif
+    prologueSize = cur - start;
+
+    uint32_t i = pc;
+
+    blockInstCount = 0;
+    while (1) {
+        if ((i >= codeSize) || (blockInstCount == MJIT_MAX_BLOCK_INSTS)) {
+            emitExit(i, i - 1, blockInstCount);
+            break;
+        }
+
+        int result = compileInstruction(i);
+
+        if (result == MJIT_INST_NONE) {
+            if (blockInstCount == 0) {
+                cur = start;
+                return false;
+            }
+            emitExit(i, i - 1, blockInstCount);
+            break;
+        }
+
+        i++;
+        if (result == MJIT_INST_END)
+            break;
+    }
+
+    blocks[pc] = start;
+
+    //Chain the exits already waiting for this block
+    pair<multimap<uint32_t, uint8_t *>::iterator, multimap<uint32_t, uint8_t *>::iterator> range;
+
+    range = pendingExits.equal_range(pc);
+    for (multimap<uint32_t, uint8_t *>::iterator it = range.first; it != range.second; it++) {
+        uint8_t *stub = it->second;
+
+        stub[0] = 0xE9;
+        patchJump(stub + 1, start + prologueSize);
+    }
+    pendingExits.erase(pc);
+
+    return true;
+}
+
+int MIPS32Jit::compileInstruction(uint32_t pc)
+{
+    const MDecodedInst *di = &codeBase[pc];
+    uint8_t *rel;
+
+    switch (di->opcode) {
+        case FN_ADDU: case FN_SUBU: case FN_SUB: case FN_AND:
+        case FN_OR: case FN_XOR: case FN_NOR: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emitLoadReg(H_ECX, di->r2);
+            switch (di->opcode) {
+                case FN_ADDU: emit8(0x01); break;           // add eax, ecx
+                case FN_SUBU: case FN_SUB: emit8(0x29); break; // sub eax, ecx
+                case FN_AND: emit8(0x21); break;            // and eax, ecx
+                case FN_OR: case FN_NOR: emit8(0x09); break; // or eax, ecx
+                case FN_XOR: emit8(0x31); break;            // xor eax, ecx
+            }
+            emit8(0xC8);
+            if (di->opcode == FN_NOR) {
+                emit8(0xF7); emit8(0xD0);                   // not eax
+            }
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+        }
+        case FN_ADD: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emitRegMem(0x03, H_EAX, di->r2 * 4);            // add eax, [r2]
+            rel = emitJump(0x0F, 0x80);                     // jo overflow
+            emitStoreReg(H_EAX, di->r0);
+            uint8_t *done = emitJump(0xE9, 0);
+            patchJump(rel, cur);
+            emitCall((const void *)addOverflowHelper, false, 0, di);
+            patchJump(done, cur);
+            return MJIT_INST_NEXT;
+        }
+        case FN_SLT: case FN_SLTU:
+        case FN_SLTI: case FN_SLTIU: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            if ((di->opcode == FN_SLT) || (di->opcode == FN_SLTU)) {
+                emitRegMem(0x3B, H_EAX, di->r2 * 4);        // cmp eax, [r2]
+            } else {
+                emit8(0x3D); emit32(di->imm);               // cmp eax, imm
+            }
+            emit8(0x0F);
+            emit8(((di->opcode == FN_SLT) || (di->opcode == FN_SLTI))? 0x9C : 0x92); // setl/setb al
+            emit8(0xC0);
+            emit8(0x0F); emit8(0xB6); emit8(0xC0);          // movzx eax, al
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+        }
+        case FN_SLL: case FN_SRL: case FN_SRA: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emit8(0xC1);
+            emit8((di->opcode == FN_SLL)? 0xE0 : (di->opcode == FN_SRL)? 0xE8 : 0xF8);
+            emit8(di->imm & 0x1F);
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+        }
+        case FN_SLLV: case FN_SRLV: case FN_SRAV: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emitLoadReg(H_ECX, di->r2);
+            emit8(0xD3);
+            emit8((di->opcode == FN_SLLV)? 0xE0 : (di->opcode == FN_SRLV)? 0xE8 : 0xF8);
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+        }
+        case FN_ADDI: case FN_ADDIU: case FN_ANDI:
+        case FN_ORI: case FN_XORI: {
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            switch (di->opcode) {
+                case FN_ADDI: case FN_ADDIU: emit8(0x05); break; // add eax, imm
+                case FN_ANDI: emit8(0x25); break;           // and eax, imm
+                case FN_ORI: emit8(0x0D); break;            // or eax, imm
+                case FN_XORI: emit8(0x35); break;           // xor eax, imm
+            }
+            emit32(di->imm);
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+        }
+        case FN_LUI:
+            blockInstCount++;
+            emitRegMem(0xC7, 0, di->r0 * 4);                // mov [r0], imm
+            emit32(di->imm);
+            return MJIT_INST_NEXT;
+
+        case FN_MOVE:
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+
+        case FN_MFHI: case FN_MFLO:
+            blockInstCount++;
+            emitRegMem(0x8B, H_EAX, hiloDisp + ((di->opcode == FN_MFHI)? 4 : 0));
+            emitStoreReg(H_EAX, di->r0);
+            return MJIT_INST_NEXT;
+
+        case FN_MULT: case FN_MULTU:
+            //The product is 32 bits wide, like in the interpreter
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r0);
+            emit8(0x0F);
+            emitRegMem(0xAF, H_EAX, di->r1 * 4);            // imul eax, [r1]
+            emitRegMem(0x89, H_EAX, hiloDisp);
+            if (di->opcode == FN_MULT) {
+                emit8(0x99);                                // cdq
+                emitRegMem(0x89, H_EDX, hiloDisp + 4);
+            } else {
+                emitRegMem(0xC7, 0, hiloDisp + 4);
+                emit32(0);
+            }
+            return MJIT_INST_NEXT;
+
+        case FN_BREAK: case FN_MTHI:
+        case FN_MTLO: case FN_LWC1: case FN_SWC1:
+            blockInstCount++;
+            return MJIT_INST_NEXT;
+
+        case FN_LW: case FN_SW:
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r1);
+            emit8(0x05); emit32(di->imm);                   // add eax, imm
+            emitCheckedCall((di->opcode == FN_LW)? (const void *)readWordHelper : (const void *)writeWordHelper,
+                            true, 0, di);
+            return MJIT_INST_NEXT;
+
+        case FN_DIV: case FN_DIVU: case FN_LB: case FN_LBU:
+        case FN_LH: case FN_LHU: case FN_SB: case FN_SH:
+            blockInstCount++;
+            emitCheckedCall((const void *)execHelper, false, 0, di);
+            return MJIT_INST_NEXT;
+
+        case FN_BEQ: case FN_BNE:
+        case FN_BLEZ: case FN_BGTZ: case FN_BLTZ: case FN_BGEZ: {
+            uint8_t cc;
+
+            blockInstCount++;
+            if ((di->opcode == FN_BEQ) || (di->opcode == FN_BNE)) {
+                emitLoadReg(H_EAX, di->r0);
+                emitRegMem(0x3B, H_EAX, di->r1 * 4);        // cmp eax, [r1]
+            } else {
+                emitRegMem(0x83, 7, di->r0 * 4);            // cmp dword [r0], 0
+                emit8(0);
+            }
+            switch (di->opcode) {
+                case FN_BEQ: cc = 0x84; break;  // je
+                case FN_BNE: cc = 0x85; break;  // jne
+                case FN_BLEZ: cc = 0x8E; break; // jle
+                case FN_BGTZ: cc = 0x8F; break; // jg
+                case FN_BLTZ: cc = 0x8C; break; // jl
+                default: cc = 0x8D; break;      // jge
+            }
+            rel = emitJump(0x0F, cc);
+            emitExit(pc + 1, pc, blockInstCount);
+            patchJump(rel, cur);
+            emitExit(di->imm, pc, blockInstCount);
+            return MJIT_INST_END;
+        }
+        case FN_J:
+            if (IS_NATIVE_ADDR(di->imm))
+                return MJIT_INST_NONE;
+
+            blockInstCount++;
+            emitExit(di->imm, pc, blockInstCount);
+            return MJIT_INST_END;
+
+        case FN_JAL:
+            blockInstCount++;
+            emitRegMem(0xC7, 0, RA_INDEX * 4);              // mov [ra], pc + 1
+            emit32(pc + 1);
+            if (IS_NATIVE_ADDR(di->imm)) {
+                emitCheckedCall((const void *)nativeCallHelper, false, di->imm, di);
+                emitExit(pc + 1, pc, blockInstCount);
+            } else {
+                emitExit(di->imm, pc, blockInstCount);
+            }
+            return MJIT_INST_END;
+
+        case FN_JR:
+            blockInstCount++;
+            emitLoadReg(H_EAX, di->r0);
+            emit8(0x89); emit8(0xC1);                       // mov ecx, eax
+            emit8(0x81); emit8(0xE9); emit32(M_VIRTUAL_EXTFUNC_START_ADDR); // sub ecx, start
+            emit8(0x81); emit8(0xF9);                       // cmp ecx, size
+            emit32(M_VIRTUAL_GLOBAL_START_ADDR - M_VIRTUAL_EXTFUNC_START_ADDR);
+            rel = emitJump(0x0F, 0x83);                     // jae target_ok
+            emitCall((const void *)execHelper, false, 0, di); // Reports the error
+            patchJump(emitJump(0xE9, 0), errorExit);
+            patchJump(rel, cur);
+            emitDynamicExit(pc, blockInstCount);
+            return MJIT_INST_END;
+
+        default:
+            //Commands, FN_GENERIC, JALR and SYSCALL
+            return MJIT_INST_NONE;
+    }
+}
+
+/* opcode reg, [ebx + disp32] */
+void MIPS32Jit::emitRegMem(uint8_t opcode, uint8_t hostReg, int32_t disp)
+{
+    emit8(opcode);
+    emit8(0x80 | (hostReg << 3) | 3);
+    emit32(disp);
+}
+
+void MIPS32Jit::emitLoadReg(uint8_t hostReg, unsigned mipsReg)
+{
+    emitRegMem(0x8B, hostReg, mipsReg * 4);
+}
+
+void MIPS32Jit::emitStoreReg(uint8_t hostReg, unsigned mipsReg)
+{
+    emitRegMem(0x89, hostReg, mipsReg * 4);
+}
+
+/* Emits a jump with a 32 bit displacement, opcode2 is 0 for one byte opcodes.
+ * Returns the address of the displacement.
+ */
+uint8_t *MIPS32Jit::emitJump(uint8_t opcode1, uint8_t opcode2)
+{
+    uint8_t *rel;
+
+    emit8(opcode1);
+    if (opcode2 != 0)
+        emit8(opcode2);
+
+    rel = cur;
+    emit32(0);
+
+    return rel;
+}
+
+void MIPS32Jit::patchJump(uint8_t *rel, uint8_t *target)
+{
+    *(int32_t *)rel = (int32_t)(target - (rel + 4));
+}
+
+/* Calls func(sim, arg2, arg3), arg2 is taken from eax when arg2InEax is true */
+void MIPS32Jit::emitCall(const void *func, bool arg2InEax, uint32_t arg2, const void *arg3)
+{
+#if defined(__x86_64__)
+    emit8(0x48); emit8(0x89); emit8(0xEF);          // mov rdi, rbp
+    if (arg2InEax) {
+        emit8(0x89); emit8(0xC6);                   // mov esi, eax
+    } else {
+        emit8(0xBE); emit32(arg2);                  // mov esi, arg2
+    }
+    emit8(0x48); emit8(0xBA); emitPtr(arg3);        // mov rdx, arg3
+    emit8(0x48); emit8(0xB8); emitPtr(func);        // mov rax, func
+#else
+    emit8(0x89); emit8(0x2C); emit8(0x24);          // mov [esp], ebp
+    if (arg2InEax) {
+        emit8(0x89); emit8(0x44); emit8(0x24); emit8(0x04); // mov [esp+4], eax
+    } else {
+        emit8(0xC7); emit8(0x44); emit8(0x24); emit8(0x04); emit32(arg2); // mov [esp+4], arg2
+    }
+    emit8(0xC7); emit8(0x44); emit8(0x24); emit8(0x08); emitPtr(arg3); // mov [esp+8], arg3
+    emit8(0xB8); emitPtr(func);                     // mov eax, func
+#endif
+    emit8(0xFF); emit8(0xD0);                       // call eax
+}
+
+/* Calls a helper and leaves the block if it fails */
+void MIPS32Jit::emitCheckedCall(const void *func, bool arg2InEax, uint32_t arg2, const void *arg3)
+{
+    emitCall(func, arg2InEax, arg2, arg3);
+    emit8(0x85); emit8(0xC0);                       // test eax, eax
+    patchJump(emitJump(0x0F, 0x84), errorExit);     // jz errorExit
+}
+
+void MIPS32Jit::emitExitCount(uint32_t lastPc, uint32_t instCount)
+{
+    emitRegMem(0xC7, 0, lastPcDisp);                // mov [jitLastPc], lastPc
+    emit32(lastPc);
+    emitRegMem(0x81, 0, instCountDisp);             // add [instCount], instCount
+    emit32(instCount);
+    emitRegMem(0x83, 2, instCountDisp + 4);         // adc [instCount + 4], 0
+    emit8(0);
+}
+
+/* Exit to a constant target.  If the target is not compiled yet, the
+ * "mov eax, target" is later replaced by a jump to the target block.
+ */
+void MIPS32Jit::emitExit(uint32_t target, uint32_t lastPc, uint32_t instCount)
+{
+    emitExitCount(lastPc, instCount);
+
+    if (chaining && (target < codeSize) && (blocks[target] != NULL)) {
+        patchJump(emitJump(0xE9, 0), blocks[target] + prologueSize);
+        return;
+    }
+
+    if (chaining && (target < codeSize))
+        pendingExits.insert(make_pair(target, cur));
+
+    emit8(0xB8); emit32(target);                    // mov eax, target
+    patchJump(emitJump(0xE9, 0), epilogue);         // jmp epilogue
+}
+
+/* Exit to the target in eax */
+void MIPS32Jit::emitDynamicExit(uint32_t lastPc, uint32_t instCount)
+{
+    emitExitCount(lastPc, instCount);
+    patchJump(emitJump(0xE9, 0), epilogue);
+}
+
+int MIPS32Jit::execHelper(MIPS32Sim *sim, uint32_t unused, const MDecodedInst *di)
+{
+    sim->runtimeCtx->line = di->line;
+
+    return sim->execDecoded(*di)? 1 : 0;
+}
+
+int MIPS32Jit::readWordHelper(MIPS32Sim *sim, uint32_t vaddr, const MDecodedInst *di)
+{
+    uint32_t result;
+
+    sim->runtimeCtx->line = di->line;
+    if (!sim->readWord(vaddr, result)) {
+        reportRuntimeError("Invalid virtual address '%08X', try increasing the physical memory\n", vaddr);
+        return 0;
+    }
+    sim->reg[di->r0] = result;
+
+    return 1;
+}
+
+int MIPS32Jit::writeWordHelper(MIPS32Sim *sim, uint32_t vaddr, const MDecodedInst *di)
+{
+    sim->runtimeCtx->line = di->line;
+    if (!sim->writeWord(vaddr, sim->reg[di->r0])) {
+        reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
+        return 0;
+    }
+
+    return 1;
+}
+
+int MIPS32Jit::nativeCallHelper(MIPS32Sim *sim, uint32_t funcAddr, const MDecodedInst *di)
+{
+    sim->runtimeCtx->line = di->line;
+
+    return sim->doNativeCall(funcAddr)? 1 : 0;
+}
+
+int MIPS32Jit::addOverflowHelper(MIPS32Sim *sim, uint32_t unused, const MDecodedInst *di)
+{
+    sim->runtimeCtx->line = di->line;
+    reportRuntimeError("Aritmethic overflow in 'add' operation\n");
+
+    return 1;
+}
@@ -0,0 +1,91 @@
+/*
+ * File:   mips32_jit.h
+ *
+ * Basic block compiler from decoded MIPS32 instructions to host x86 code.
+ */
+
+#ifndef MIPS32_JIT_H
+#define MIPS32_JIT_H
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include "mips32_sim.h"
+
+using namespace std;
+
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__unix__)
+#define MJIT_SUPPORTED
+#endif
+
+#define MJIT_CODE_BUFFER_SIZE   (1024 * 1024)
+#define MJIT_HOT_THRESHOLD      50      //Executions before a block gets compiled
+#define MJIT_MAX_BLOCK_INSTS    64
+#define MJIT_MAX_INST_BYTES     128     //Upper bound of the code emitted by one instruction
+#define MJIT_NO_BLOCK           0xFFFFFFFF //Hit count of blocks that cannot be compiled
+#define MJIT_ERROR              0xFFFFFFFF //Returned by a block when an instruction failed
+
+/* Compiled block entry.  It returns the index of the next instruction to
+ * execute, or MJIT_ERROR.
+ */
+typedef uint32_t (*MJitBlockFn)(MIPS32Sim *sim, uint32_t *regs);
+
+class MIPS32Jit
+{
+public:
+    MIPS32Jit(MIPS32Sim *sim);
+    ~MIPS32Jit();
+
+    bool isAvailable() { return buffer != NULL; }
+    MJitBlockFn getBlock(vector<MDecodedInst> &code, uint32_t pc);
+    void reset();
+    void setChaining(bool enable);
+
+private:
+    static int execHelper(MIPS32Sim *sim, uint32_t unused, const MDecodedInst *di);
+    static int readWordHelper(MIPS32Sim *sim, uint32_t vaddr, const MDecodedInst *di);
+    static int writeWordHelper(MIPS32Sim *sim, uint32_t vaddr, const MDecodedInst *di);
+    static int nativeCallHelper(MIPS32Sim *sim, uint32_t funcAddr, const MDecodedInst *di);
+    static int addOverflowHelper(MIPS32Sim *sim, uint32_t unused, const MDecodedInst *di);
+
+    void flush();
+    bool compile(uint32_t pc);
+    int compileInstruction(uint32_t pc);
+
+    void emit8(uint8_t value) { *cur++ = value; }
+    void emit32(uint32_t value) { *(uint32_t *)cur = value; cur += 4; }
+    void emitPtr(const void *value) {
+        *(const void **)cur = value;
+        cur += sizeof(void *);
+    }
+    void emitRegMem(uint8_t opcode, uint8_t hostReg, int32_t disp);
+    void emitLoadReg(uint8_t hostReg, unsigned mipsReg);
+    void emitStoreReg(uint8_t hostReg, unsigned mipsReg);
+    uint8_t *emitJump(uint8_t opcode1, uint8_t opcode2);
+    void patchJump(uint8_t *rel, uint8_t *target);
+    void emitCall(const void *func, bool arg2InEax, uint32_t arg2, const void *arg3);
+    void emitCheckedCall(const void *func, bool arg2InEax, uint32_t arg2, const void *arg3);
+    void emitExitCount(uint32_t lastPc, uint32_t instCount);
+    void emitExit(uint32_t target, uint32_t lastPc, uint32_t instCount);
+    void emitDynamicExit(uint32_t lastPc, uint32_t instCount);
+
+private:
+    MIPS32Sim *sim;
+    const MDecodedInst *codeBase;
+    uint32_t codeSize;
+    vector<uint8_t *> blocks;   //Block entry by guest pc
+    vector<uint32_t> hits;      //Executions of each guest pc in the interpreter
+    multimap<uint32_t, uint8_t *> pendingExits; //Exits to be chained when the target is compiled
+    uint8_t *buffer;
+    uint8_t *cur;
+    uint8_t *epilogue;
+    uint8_t *errorExit;
+    int32_t hiloDisp;           //Offsets from MIPS32Sim::reg
+    int32_t instCountDisp;
+    int32_t lastPcDisp;
+    unsigned prologueSize;
+    unsigned blockInstCount;    //Instructions emitted in the current block
+    bool chaining;              //Exits with a constant target jump to the target block
+};
+
+#endif // MIPS32_JIT_H
@@ -0,0 +1,603 @@
+/*
+ * File:   mips32_lanes.cpp
+ *
+ * Lockstep execution of one MIPS32 program over many lanes.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "mips32_lanes.h"
+#include "util.h"
+
+void reportRuntimeError(const char *format, ...);
+
+/* A vector of lanes.  The GCC vector extensions are lowered to the
+ * instructions of the target of each clone of the kernel: AVX2, SSE2 or
+ * plain integer code.
+ */
+typedef uint32_t MLaneVec __attribute__((vector_size(MLANE_VECTOR_LANES * 4)));
+typedef int32_t MLaneSVec __attribute__((vector_size(MLANE_VECTOR_LANES * 4)));
+
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__i386__) || defined(__x86_64__)) && defined(__linux__)
+#define MLANE_CLONES
+#define MLANE_KERNEL __attribute__((target_clones("avx2", "sse2", "default")))
+#else
+#define MLANE_KERNEL
+#endif
+
+/* Registers of one lane, as seen by the handlers */
+struct MLaneRegs {
+    uint32_t *base;
+    uint32_t stride;
+
+    uint32_t &operator[](unsigned index) { return base[index * stride]; }
+};
+
+/* Runs an ALU instruction on n vectors of lanes.  Returns false without
+ * writing anything if an 'add' overflows in some lane, those are left to
+ * the handler that reports the error.
+ */
+MLANE_KERNEL
+static bool aluKernel(uint16_t opcode, MLaneVec *d, const MLaneVec *a, const MLaneVec *b, uint32_t imm, uint32_t n)
+{
+    MLaneVec k = {};
+    uint32_t i;
+
+    k += imm;
+    switch (opcode) {
+        case FN_ADD: {
+            MLaneVec ovfl = {};
+
+            for (i = 0; i < n; i++)
+                ovfl |= ~(a[i] ^ b[i]) & (a[i] ^ (a[i] + b[i]));
+            for (i = 0; i < MLANE_VECTOR_LANES; i++) {
+                if ((ovfl[i] & 0x80000000) != 0)
+                    return false;
+            }
+            for (i = 0; i < n; i++)
+                d[i] = a[i] + b[i];
+            break;
+        }
+        case FN_ADDU:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] + b[i];
+            break;
+        case FN_SUB:
+        case FN_SUBU:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] - b[i];
+            break;
+        case FN_AND:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] & b[i];
+            break;
+        case FN_OR:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] | b[i];
+            break;
+        case FN_XOR:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] ^ b[i];
+            break;
+        case FN_NOR:
+            for (i = 0; i < n; i++)
+                d[i] = ~(a[i] | b[i]);
+            break;
+        case FN_SLT:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)((MLaneSVec)a[i] < (MLaneSVec)b[i]) & 1;
+            break;
+        case FN_SLTU:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)(a[i] < b[i]) & 1;
+            break;
+        case FN_SLL:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] << imm;
+            break;
+        case FN_SRL:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] >> imm;
+            break;
+        case FN_SRA:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)((MLaneSVec)a[i] >> imm);
+            break;
+        //The x86 shift instructions use the low 5 bits of the count
+        case FN_SLLV:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] << (b[i] & 0x1F);
+            break;
+        case FN_SRLV:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] >> (b[i] & 0x1F);
+            break;
+        case FN_SRAV:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)((MLaneSVec)a[i] >> (MLaneSVec)(b[i] & 0x1F));
+            break;
+        case FN_ADDI:
+        case FN_ADDIU:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] + k;
+            break;
+        case FN_ANDI:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] & k;
+            break;
+        case FN_ORI:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] | k;
+            break;
+        case FN_XORI:
+            for (i = 0; i < n; i++)
+                d[i] = a[i] ^ k;
+            break;
+        case FN_SLTI:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)((MLaneSVec)a[i] < (MLaneSVec)k) & 1;
+            break;
+        case FN_SLTIU:
+            for (i = 0; i < n; i++)
+                d[i] = (MLaneVec)(a[i] < k) & 1;
+            break;
+        case FN_LUI:
+            for (i = 0; i < n; i++)
+                d[i] = k;
+            break;
+        case FN_MOVE:
+            for (i = 0; i < n; i++)
+                d[i] = a[i];
+            break;
+    }
+
+    return true;
+}
+
+MIPS32LaneSim::MIPS32LaneSim()
+{
+    regs = NULL;
+    stride = 0;
+    curLane = 0;
+    laneSim = NULL;
+    maxSteps = 0;
+    convergedSteps = 0;
+}
+
+MIPS32LaneSim::~MIPS32LaneSim()
+{
+    for (size_t i = 0; i < lanes.size(); i++)
+        delete lanes[i].sim;
+    free(regs);
+}
+
+const char *MIPS32LaneSim::getVectorIsa()
+{
+#ifdef MLANE_CLONES
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+    if (__builtin_cpu_supports("sse2"))
+        return "sse2";
+#endif
+    return "scalar";
+}
+
+bool MIPS32LaneSim::loadFile(istream *in)
+{
+    NodePoolScope nodes(&pool);
+
+    code.clear();
+    labelMap.clear();
+
+    return loader.loadFile(in, code, labelMap);
+}
+
+/* The lane reads from inputFd and writes its output and its errors to
+ * the given streams, errors can be NULL.
+ */
+uint32_t MIPS32LaneSim::addLane(int inputFd, FILE *output, FILE *errors)
+{
+    MLane lane;
+
+    lane.sim = new MIPS32Sim();
+    lane.sim->setInputFd(inputFd);
+    lane.sim->setOutput(output);
+    lane.sim->setErrorOutput(errors);
+    lane.steps = 0;
+    lane.status = MLANE_OK;
+    lanes.push_back(lane);
+
+    return lanes.size() - 1;
+}
+
+/* Copies the registers of the lane to its simulator */
+void MIPS32LaneSim::saveRegisters(uint32_t lane)
+{
+    MIPS32Sim *sim = lanes[lane].sim;
+
+    for (int i = 0; i < 32; i++)
+        sim->reg[i] = regs[i * stride + lane];
+    sim->hi_lo = hiLo[lane];
+}
+
+void MIPS32LaneSim::loadRegisters(uint32_t lane)
+{
+    MIPS32Sim *sim = lanes[lane].sim;
+
+    for (int i = 0; i < 32; i++)
+        regs[i * stride + lane] = sim->reg[i];
+    hiLo[lane] = sim->hi_lo;
+}
+
+void MIPS32LaneSim::startLane(uint32_t lane)
+{
+    MLane &ln = lanes[lane];
+    MIPS32Sim *sim = ln.sim;
+    SimScope scope(sim);
+
+    sim->dataImage = loader.dataImage;
+    sim->nativeSlots = loader.nativeSlots;
+    sim->runtimeCtx = &ln.ctx;
+    sim->jumpTable = &labelMap;
+    sim->lastResult.init();
+    sim->stepLimitHit = false;
+    ln.ctx.pc = 0;
+    ln.ctx.line = 0;
+    ln.ctx.stop = false;
+    ln.steps = 0;
+    ln.status = MLANE_RUNNING;
+    loadRegisters(lane);
+
+    if (!sim->loadData())
+        ln.status = MLANE_RUNTIME_ERROR;
+}
+
+/* The final registers go back to the simulator and the column is cleared,
+ * so the vector operations don't see the values of a finished lane.
+ */
+void MIPS32LaneSim::finishLane(uint32_t lane)
+{
+    MLane &ln = lanes[lane];
+    MIPS32Sim *sim = ln.sim;
+
+    saveRegisters(lane);
+    for (int i = 0; i < 32; i++)
+        regs[i * stride + lane] = 0;
+    sim->instCount = ln.steps;
+    sim->stepLimitHit = (ln.status == MLANE_STEP_LIMIT);
+    sim->runtimeCtx = NULL;
+    sim->jumpTable = NULL;
+    fflush(sim->getOutput());
+}
+
+/* Removes the lanes that reached the end of the program, failed or used
+ * all their steps.
+ */
+void MIPS32LaneSim::retireLanes()
+{
+    uint32_t count = code.size();
+    size_t n = 0;
+
+    for (size_t i = 0; i < running.size(); i++) {
+        uint32_t lane = running[i];
+        MLane &ln = lanes[lane];
+
+        if (ln.status == MLANE_RUNNING) {
+            if (ln.ctx.stop || ln.ctx.pc >= count) {
+                ln.status = MLANE_OK;
+            } else if (maxSteps != 0 && ln.steps >= maxSteps) {
+                SimScope scope(ln.sim);
+
+                reportRuntimeError("Execution stopped after %llu instructions\n", (unsigned long long)maxSteps);
+                ln.status = MLANE_STEP_LIMIT;
+            }
+        }
+
+        if (ln.status == MLANE_RUNNING)
+            running[n++] = lane;
+        else
+            finishLane(lane);
+    }
+    running.resize(n);
+}
+
+bool MIPS32LaneSim::isConverged()
+{
+    uint32_t pc = lanes[running[0]].ctx.pc;
+
+    for (size_t i = 1; i < running.size(); i++) {
+        if (lanes[running[i]].ctx.pc != pc)
+            return false;
+    }
+
+    return true;
+}
+
+/* Runs an instruction on every lane at once, returns false if it has to
+ * run lane by lane.
+ */
+bool MIPS32LaneSim::runVector(const MDecodedInst *di)
+{
+    MLaneVec *d = (MLaneVec *)&regs[di->r0 * stride];
+    MLaneVec *a = (MLaneVec *)&regs[di->r1 * stride];
+    MLaneVec *b = (MLaneVec *)&regs[di->r2 * stride];
+
+    switch (di->opcode) {
+        case FN_ADD: case FN_ADDU: case FN_SUB: case FN_SUBU:
+        case FN_AND: case FN_OR: case FN_XOR: case FN_NOR:
+        case FN_SLT: case FN_SLTU: case FN_SLL: case FN_SRL: case FN_SRA:
+        case FN_SLLV: case FN_SRLV: case FN_SRAV:
+        case FN_ADDI: case FN_ADDIU: case FN_ANDI: case FN_ORI: case FN_XORI:
+        case FN_SLTI: case FN_SLTIU: case FN_LUI: case FN_MOVE:
+            return aluKernel(di->opcode, d, a, b, di->imm, stride / MLANE_VECTOR_LANES);
+        case FN_BREAK: case FN_MTHI: case FN_MTLO: case FN_LWC1: case FN_SWC1:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool branchTaken(uint16_t opcode, uint32_t a, uint32_t b)
+{
+    switch (opcode) {
+        case FN_BEQ: return a == b;
+        case FN_BNE: return a != b;
+        case FN_BLEZ: return (int32_t)a <= 0;
+        case FN_BGEZ: return (int32_t)a >= 0;
+        case FN_BLTZ: return (int32_t)a < 0;
+        case FN_BGTZ: return (int32_t)a > 0;
+        default: return false;
+    }
+}
+
+/* Conditional branch of the running lanes.  If they all go the same way
+ * pc is the target and the result is true, otherwise the pc of each lane
+ * is set.
+ */
+bool MIPS32LaneSim::runBranch(const MDecodedInst *di, uint32_t &pc)
+{
+    const uint32_t *a = &regs[di->r0 * stride];
+    const uint32_t *b = &regs[di->r1 * stride];
+    size_t taken = 0;
+
+    for (size_t i = 0; i < running.size(); i++) {
+        uint32_t lane = running[i];
+
+        if (branchTaken(di->opcode, a[lane], b[lane]))
+            taken++;
+    }
+
+    if (taken == 0 || taken == running.size()) {
+        if (taken != 0)
+            pc = di->imm;
+        return true;
+    }
+
+    for (size_t i = 0; i < running.size(); i++) {
+        uint32_t lane = running[i];
+
+        lanes[lane].ctx.pc = branchTaken(di->opcode, a[lane], b[lane])? di->imm : pc;
+    }
+
+    return false;
+}
+
+/* All the running lanes are at the same pc.  The ALU instructions run as
+ * vector operations, the others lane by lane, until the lanes don't
+ * reach the same pc or one of them ends.
+ */
+void MIPS32LaneSim::runConverged()
+{
+    uint32_t count = code.size();
+    uint32_t pc = lanes[running[0]].ctx.pc;
+    uint64_t budget = UINT64_MAX;
+    uint64_t done = 0;
+    const MDecodedInst *last = NULL;
+    bool diverged = false;
+
+    if (maxSteps != 0) {
+        for (size_t i = 0; i < running.size(); i++)
+            budget = min(budget, maxSteps - lanes[running[i]].steps);
+    }
+
+    while (!diverged && done < budget && pc < count) {
+        last = &code[pc];
+        pc++;
+        done++;
+        if (runVector(last))
+            continue;
+
+        switch (last->opcode) {
+            case FN_BEQ: case FN_BNE: case FN_BLEZ: case FN_BGEZ: case FN_BLTZ: case FN_BGTZ:
+                if (!runBranch(last, pc))
+                    diverged = true;
+                continue;
+        }
+
+        for (size_t i = 0; i < running.size(); i++) {
+            MLane &ln = lanes[running[i]];
+
+            ln.ctx.pc = pc;
+            if (!execLane(running[i], last))
+                ln.status = MLANE_RUNTIME_ERROR;
+        }
+
+        pc = lanes[running[0]].ctx.pc;
+        for (size_t i = 0; i < running.size(); i++) {
+            MLane &ln = lanes[running[i]];
+
+            if (ln.status != MLANE_RUNNING || ln.ctx.stop || ln.ctx.pc != pc) {
+                diverged = true;
+                break;
+            }
+        }
+    }
+
+    convergedSteps += done;
+    for (size_t i = 0; i < running.size(); i++) {
+        MLane &ln = lanes[running[i]];
+
+        ln.steps += done;
+        if (!diverged)
+            ln.ctx.pc = pc;
+        if (last != NULL)
+            ln.ctx.line = last->line;
+    }
+}
+
+/* Runs the lanes at the lowest pc while they stay together, until they
+ * reach the pc of the next waiting lane.  The other lanes wait for them.
+ */
+void MIPS32LaneSim::runDivergent()
+{
+    uint32_t count = code.size();
+    uint32_t pc = UINT32_MAX, next = UINT32_MAX;
+    bool together = true;
+
+    for (size_t i = 0; i < running.size(); i++)
+        pc = min(pc, lanes[running[i]].ctx.pc);
+
+    group.clear();
+    for (size_t i = 0; i < running.size(); i++) {
+        uint32_t lane_pc = lanes[running[i]].ctx.pc;
+
+        if (lane_pc == pc)
+            group.push_back(running[i]);
+        else
+            next = min(next, lane_pc);
+    }
+
+    while (together && pc < next && pc < count) {
+        const MDecodedInst *di = &code[pc];
+
+        for (size_t i = 0; i < group.size(); i++) {
+            MLane &ln = lanes[group[i]];
+
+            ln.ctx.pc++;
+            ln.steps++;
+            if (!execLane(group[i], di))
+                ln.status = MLANE_RUNTIME_ERROR;
+        }
+
+        pc = lanes[group[0]].ctx.pc;
+        for (size_t i = 0; i < group.size(); i++) {
+            MLane &ln = lanes[group[i]];
+
+            if (ln.status != MLANE_RUNNING || ln.ctx.stop || ln.ctx.pc != pc ||
+                (maxSteps != 0 && ln.steps >= maxSteps)) {
+                together = false;
+                break;
+            }
+        }
+    }
+}
+
+/* Scalar execution of an instruction, with the handlers of the
+ * interpreter.  ctx->pc is the index of the next instruction.
+ */
+bool MIPS32LaneSim::execLane(uint32_t lane, const MDecodedInst *decoded)
+{
+    MLane &ln = lanes[lane];
+    MRtContext *ctx = &ln.ctx;
+    const MDecodedInst *di = decoded;
+    MLaneRegs reg = { &regs[lane], stride };
+    uint64_t &hi_lo = hiLo[lane];
+    FILE *output = ln.sim->getOutput();
+    uint32_t *p0 = &reg[di->r0];
+    uint32_t *p1 = &reg[di->r1];
+    uint32_t *p2 = &reg[di->r2];
+    uint32_t imm = di->imm;
+    SimScope scope(ln.sim);
+
+    curLane = lane;
+    laneSim = ln.sim;
+    ctx->line = di->line;
+
+    switch (di->opcode) {
+#define MIPS32_OP(op, ...) case op: { __VA_ARGS__ } break;
+#include "mips32_exec.inc"
+#undef MIPS32_OP
+    }
+
+    return true;
+}
+
+/* The system calls, native calls and commands work on the registers of
+ * the simulator of the lane.
+ */
+bool MIPS32LaneSim::doSyscall()
+{
+    bool result;
+
+    saveRegisters(curLane);
+    result = laneSim->doSyscall();
+    loadRegisters(curLane);
+
+    return result;
+}
+
+bool MIPS32LaneSim::doNativeCall(uint32_t funcAddr)
+{
+    bool result;
+
+    saveRegisters(curLane);
+    result = laneSim->doNativeCall(funcAddr);
+    loadRegisters(curLane);
+
+    return result;
+}
+
+bool MIPS32LaneSim::execInstruction(MInstruction *inst)
+{
+    bool result;
+
+    saveRegisters(curLane);
+    result = laneSim->execInstruction(inst);
+    loadRegisters(curLane);
+
+    return result;
+}
+
+uint32_t MIPS32LaneSim::run()
+{
+    NodePoolScope nodes(&pool);
+    uint32_t failed = 0;
+
+    stride = (lanes.size() + MLANE_VECTOR_LANES - 1) / MLANE_VECTOR_LANES * MLANE_VECTOR_LANES;
+    free(regs);
+    regs = NULL;
+    if (stride == 0)
+        return 0;
+
+    if (posix_memalign((void **)&regs, MLANE_VECTOR_LANES * 4, 32 * stride * sizeof(uint32_t)) != 0) {
+        regs = NULL;
+        return lanes.size();
+    }
+    memset(regs, 0, 32 * stride * sizeof(uint32_t));
+    hiLo.assign(stride, 0);
+    convergedSteps = 0;
+
+    running.clear();
+    for (uint32_t i = 0; i < lanes.size(); i++) {
+        startLane(i);
+        running.push_back(i);
+    }
+
+    while (true) {
+        retireLanes();
+        if (running.empty())
+            break;
+
+        if (isConverged())
+            runConverged();
+        else
+            runDivergent();
+    }
+
+    for (size_t i = 0; i < lanes.size(); i++) {
+        if (lanes[i].status != MLANE_OK)
+            failed++;
+    }
+
+    return failed;
+}
@@ -0,0 +1,110 @@
+/*
+ * File:   mips32_lanes.h
+ *
+ * Runs many copies of one MIPS32 program in lockstep, one copy per lane.
+ */
+
+#ifndef MIPS32_LANES_H
+#define MIPS32_LANES_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <istream>
+#include <vector>
+#include <map>
+#include "mips32_sim.h"
+#include "mempool.h"
+
+using namespace std;
+
+#define MLANE_VECTOR_LANES  8       //32-bit lanes of the widest vector (AVX2)
+
+/* Status of a lane, the same values as the status of a batch program */
+#define MLANE_OK            0
+#define MLANE_RUNNING       1
+#define MLANE_RUNTIME_ERROR 3
+#define MLANE_STEP_LIMIT    4
+
+struct MLane {
+    MIPS32Sim *sim;     //Memory, input, output and exit code of the lane
+    MRtContext ctx;
+    uint64_t steps;
+    int status;
+};
+
+/* The program is decoded once and each lane has its own guest memory,
+ * input and output.  The registers are kept as a structure of arrays,
+ * regs[r * stride + lane], so while all the lanes are at the same pc an
+ * ALU instruction runs as a vector operation over every lane.  Memory
+ * accesses, branches and system calls run lane by lane.  When a branch
+ * sends the lanes to different places they run one by one, the lanes at
+ * the lowest pc first, until they meet at the same pc again.
+ */
+class MIPS32LaneSim
+{
+public:
+    MIPS32LaneSim();
+    ~MIPS32LaneSim();
+
+    bool loadFile(istream *in);
+    uint32_t addLane(int inputFd, FILE *output, FILE *errors);
+    uint32_t getLaneCount() { return lanes.size(); }
+    void setMaxSteps(uint64_t steps) { maxSteps = steps; }
+
+    //Returns the number of lanes that didn't end normally
+    uint32_t run();
+
+    //Final state of a lane: registers, exit code and instruction count
+    MIPS32Sim *getLaneSim(uint32_t lane) { return lanes[lane].sim; }
+    int getLaneStatus(uint32_t lane) { return lanes[lane].status; }
+    uint64_t getLaneSteps(uint32_t lane) { return lanes[lane].steps; }
+
+    //Instructions executed once for all the lanes together
+    uint64_t getConvergedSteps() { return convergedSteps; }
+    static const char *getVectorIsa();
+
+private:
+    void startLane(uint32_t lane);
+    void finishLane(uint32_t lane);
+    void retireLanes();
+    bool isConverged();
+    void runConverged();
+    void runDivergent();
+    bool runVector(const MDecodedInst *di);
+    bool runBranch(const MDecodedInst *di, uint32_t &pc);
+    bool execLane(uint32_t lane, const MDecodedInst *di);
+    void saveRegisters(uint32_t lane);
+    void loadRegisters(uint32_t lane);
+
+    //Used by the handlers of mips32_exec.inc on the lane being executed
+    bool readWord(unsigned int vaddr, uint32_t &result) { return laneSim->readWord(vaddr, result); }
+    bool readHalfWord(unsigned int vaddr, uint32_t &result, bool sign_extend) {
+        return laneSim->readHalfWord(vaddr, result, sign_extend);
+    }
+    bool readByte(unsigned int vaddr, uint32_t &result, bool sign_extend) {
+        return laneSim->readByte(vaddr, result, sign_extend);
+    }
+    bool writeWord(unsigned int vaddr, uint32_t value) { return laneSim->writeWord(vaddr, value); }
+    bool writeHalfWord(unsigned int vaddr, uint16_t value) { return laneSim->writeHalfWord(vaddr, value); }
+    bool writeByte(unsigned int vaddr, uint8_t value) { return laneSim->writeByte(vaddr, value); }
+    bool doSyscall();
+    bool doNativeCall(uint32_t funcAddr);
+    bool execInstruction(MInstruction *inst);
+
+    MemPool pool;           //Nodes of the program
+    MIPS32Sim loader;       //Decodes the program and keeps its native libraries open
+    vector<MDecodedInst> code;
+    map<string, uint32_t> labelMap;
+    vector<MLane> lanes;
+    vector<uint32_t> running;   //Lanes not finished yet
+    vector<uint32_t> group;     //Lanes run together by runDivergent
+    uint32_t *regs;
+    vector<uint64_t> hiLo;
+    uint32_t stride;        //Lanes of a register row, a multiple of MLANE_VECTOR_LANES
+    uint32_t curLane;       //Lane executed by execLane
+    MIPS32Sim *laneSim;
+    uint64_t maxSteps;      //Instructions allowed to each lane, 0 for no limit
+    uint64_t convergedSteps;
+};
+
+#endif /* MIPS32_LANES_H */
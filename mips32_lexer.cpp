@@ -13,23 +13,18 @@ using namespace std;
 
 #define RETURN_TOKEN(tk)    \
     do {                    \
-        tokenInfo.set(tkText, currentLine); \
+        tokenInfo.set(start, buffer.position() - start, currentLine); \
         return tk; \
     } while (0)
 	
-#define APPEND_SEQUENCE(cond, sb) \
+#define SKIP_SEQUENCE(cond) \
             do { \
                 while ( (cond) ) {  \
-                    sb += (char)ch; \
                     ch = nextChar();\
                 }                   \
                 ungetChar(ch); \
             } while (0)
 
-#if defined(_MSC_VER)
-#define strcasecmp _stricmp
-#endif
-
 struct MKeyword {
     const char *name;
     int tokenKind;
@@ -47,6 +42,8 @@ static MKeyword m_keywords[] = {
         {"hword", MKW_HWORD},
         {"word", MKW_WORD},
         {"memory", MCKW_MEM},
+        {"at", MCKW_AT},
+        {"readonly", MCKW_READONLY},
 };
 const int KWCount = sizeof(m_keywords)/sizeof(MKeyword);
 
@@ -58,6 +55,8 @@ static MKeyword m_commands[] = {
         {"#paddr", MCKW_PADDR},
         {"#hihw", MCKW_HIHW},
         {"#lohw", MCKW_LOHW},
+        {"#map", MCKW_MAP},
+        {"#snapshot", MCKW_SNAPSHOT},
 };
 
 const char *reg_names[] = { "$zero", "$at", "$v0", "$v1",
@@ -82,37 +81,48 @@ const char *reg_names1[] = { "$r0", "$r1", "$r2", "$r3",
 
 const int KWCmdCount = sizeof(m_commands)/sizeof(MKeyword);
 
-static int lookUpWord(MKeyword kw[], int size, string str)
+static MKeyword m_directives[] = {
+    {".data", MDIR_DATA},
+    {".text", MDIR_TEXT},
+    {".word", MDIR_WORD},
+    {".half", MDIR_HALF},
+    {".byte", MDIR_BYTE},
+    {".space", MDIR_SPACE},
+    {".asciiz", MDIR_ASCIIZ},
+    {".align", MDIR_ALIGN},
+};
+
+const int DirCount = sizeof(m_directives)/sizeof(MKeyword);
+
+static KeywordTable kwTable(m_keywords, KWCount, MTK_ID);
+static KeywordTable cmdTable(m_commands, KWCmdCount, MTK_ID);
+static KeywordTable dirTable(m_directives, DirCount, MTK_DOT);
+
+/* Both register name tables, register names are case sensitive */
+static KeywordTable *buildRegisterTable()
 {
-    for (int i=0; i<size; i++) {
-        if (strcasecmp(str.c_str(), kw[i].name) == 0)
-            return kw[i].tokenKind;
+    KeywordTable *table = new KeywordTable(-1, false);
+    int count = sizeof(reg_names) / sizeof(reg_names[0]);
+
+    for (int i = 0; i < count; i++) {
+        table->add(reg_names[i], i);
+        table->add(reg_names1[i], i);
     }
+    table->build();
 
-    return MTK_ID;
+    return table;
 }
 
-static int _getRegisterIndex(const char *name, const char *reg_names[], int size)
-{
-    for (int i = 0; i<size; i++) {
-        if (strcmp(name, reg_names[i]) == 0) {
-            return i;
-        }
-    }
+static KeywordTable *regTable = buildRegisterTable();
 
-    return -1;
+int mips32_getRegisterIndex(const char *rname, uint32_t length) 
+{
+    return regTable->lookUp(rname, length);
 }
 
 int mips32_getRegisterIndex(const char *rname) 
 {
-    int count = sizeof(reg_names) / sizeof(reg_names[0]);
-	int index;
-    
-	index = _getRegisterIndex(rname, reg_names, count);
-	if (index != -1)
-		return index;
-
-	return _getRegisterIndex(rname, reg_names1, count);
+    return mips32_getRegisterIndex(rname, strlen(rname));
 }
 
 string mips32_getRegisterName(unsigned int regIndex)
@@ -120,28 +130,31 @@ string mips32_getRegisterName(unsigned int regIndex)
     return ((regIndex<=31)? reg_names[regIndex] : "");
 }
 
-Mips32Lexer::Mips32Lexer(istream *in)
+Mips32Lexer::Mips32Lexer(istream *in): buffer(in)
 {
-    this->in = in;
     currentLine = 1;
 }
 
+int Mips32Lexer::errorToken(string message)
+{
+    errorText = message;
+    tokenInfo.set(errorText.c_str(), errorText.length(), currentLine);
+
+    return MTK_ERROR;
+}
+
 int Mips32Lexer::getNextToken()
 {
+    const char *start;
     int ch;
-    string tkText;
-
-    tkText.reserve(MAX_TOKEN_LENGTH);
-    tkText = "";
 
     while (1) {
+        start = buffer.position();
         ch = nextChar();
 
         if (ch == ' ' || ch == '\t')
             continue;
 
-        tkText += (char)ch;
-
         switch (ch) {
             case EOF: RETURN_TOKEN(MTK_EOF);
             case '(': RETURN_TOKEN(MTK_LPAREN);
@@ -153,14 +166,29 @@ int Mips32Lexer::getNextToken()
             case '[': RETURN_TOKEN(MTK_LBRACKET);
             case ']': RETURN_TOKEN(MTK_RBRACKET);
             case '@': RETURN_TOKEN(MTK_AT);
-            case '.': RETURN_TOKEN(MTK_DOT);
+            case '.': {
+                ch = nextChar();
+                SKIP_SEQUENCE(isalpha(ch));
+
+                tokenInfo.set(start, buffer.position() - start, currentLine);
+
+                int tokenDir = dirTable.lookUp(tokenInfo.text, tokenInfo.length);
+
+                if (tokenDir != MTK_DOT)
+                    return tokenDir;
+
+                //Not a directive, the name is scanned again as an identifier
+                buffer.rewind(start + 1);
+                RETURN_TOKEN(MTK_DOT);
+            }
             case ';': {
                 ch = nextChar();
                 while (ch != '\n' && ch != EOF) {
                     ch = nextChar();
                 }
                 currentLine ++;
-                RETURN_TOKEN(MTK_EOL);
+                tokenInfo.set(start, 1, currentLine);
+                return MTK_EOL;
             }
             case '\r': {
                 ch = nextChar();
@@ -169,71 +197,64 @@ int Mips32Lexer::getNextToken()
                     ungetChar(ch);
 
                 currentLine ++;
-                RETURN_TOKEN(MTK_EOL);
+                tokenInfo.set(start, 1, currentLine);
+                return MTK_EOL;
             }
             case '\n': {
                 currentLine ++;
                 RETURN_TOKEN(MTK_EOL);
             }
             case '$': {
-                tkText = "$";
-                
                 ch = nextChar();
-                APPEND_SEQUENCE(isalnum(ch), tkText);
-                tokenInfo.intValue = mips32_getRegisterIndex(tkText.c_str());
+                SKIP_SEQUENCE(isalnum(ch));
+                tokenInfo.intValue = mips32_getRegisterIndex(start, buffer.position() - start);
                 RETURN_TOKEN(MTK_REGISTER);
             }
             case '"': {
-                tkText.clear();
+                start = buffer.position();
                 ch = nextChar();
-                APPEND_SEQUENCE((ch != '"') && (ch != EOF), tkText);
+                SKIP_SEQUENCE((ch != '"') && (ch != EOF));
+
+                uint32_t length = buffer.position() - start;
+
                 ch = nextChar();
-                
-                if (ch == EOF) {
-                    tokenInfo.set(string("unterminated string \"") + tkText + string("\""), currentLine);
-                    return MTK_ERROR;
-                }
-                tokenInfo.set(tkText, currentLine);
+                if (ch == EOF)
+                    return errorToken(string("unterminated string \"") + string(start, length) + string("\""));
+
+                tokenInfo.set(start, length, currentLine);
                 
                 return MSTR_LITERAL;
             }
             case '\'': {
-                tkText.clear();
+                start = buffer.position();
                 ch = nextChar();
-                APPEND_SEQUENCE((ch != '\'') && (ch != EOF), tkText);
+                SKIP_SEQUENCE((ch != '\'') && (ch != EOF));
+
+                uint32_t length = buffer.position() - start;
+
                 ch = nextChar();
-                
-                if (ch == EOF) {
-                    tokenInfo.set(string("unterminated character constant '") + tkText + string("'"), currentLine);
-                    return MTK_ERROR;
-                }
-                if (tkText.length() != 1) {
-                    tokenInfo.set("character constant '" + tkText + "'", currentLine);
-                    return MTK_ERROR;
-                }
+                if (ch == EOF)
+                    return errorToken(string("unterminated character constant '") + string(start, length) + string("'"));
+                if (length != 1)
+                    return errorToken("character constant '" + string(start, length) + "'");
 
-                tokenInfo.set(tkText, currentLine);
-                tokenInfo.intValue = (int)tkText[0];
+                tokenInfo.set(start, length, currentLine);
+                tokenInfo.intValue = (int)start[0];
                 
                 return MTK_CHAR_CONSTANT;
             }
             case '#': {
-                tkText.clear();
-                
-                tkText += (char)ch;
                 ch = nextChar();
-                APPEND_SEQUENCE(isalpha(ch), tkText);
+                SKIP_SEQUENCE(isalpha(ch));
                 
-                tokenInfo.set(tkText, currentLine);
+                tokenInfo.set(start, buffer.position() - start, currentLine);
                 
-                int tokenKW = lookUpWord(m_commands, KWCmdCount, tkText);
+                int tokenKW = cmdTable.lookUp(tokenInfo.text, tokenInfo.length);
                 
                 if (tokenKW != MTK_ID) 
                     return tokenKW;
-                else {
-                    tokenInfo.set("command name '" + tkText + "'", currentLine);
-                    return MTK_ERROR;
-                }
+                else
+                    return errorToken("command name '" + tokenInfo.lexeme() + "'");
             }
 
             default: {
@@ -242,61 +263,56 @@ int Mips32Lexer::getNextToken()
                     ch = nextChar();
 
                     if (prevCh == '0' && (ch == 'b' || ch == 'B')) {
-                        tkText.clear();
+                        start = buffer.position();
 
                         ch = nextChar();
-                        APPEND_SEQUENCE((ch=='0') || (ch=='1'), tkText);
+                        SKIP_SEQUENCE((ch=='0') || (ch=='1'));
 						
-                        if (tkText.empty()) {
-                            tokenInfo.set("binary constant '0b'", currentLine);
-                            return MTK_ERROR;
-                        }
+                        if (buffer.position() == start)
+                            return errorToken("binary constant '0b'");
 
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = strtoul(tkText.c_str(), NULL, 2);
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 2);
 
                         return MTK_BIN_CONSTANT;
 
                     } else if (prevCh == '0' && (ch == 'x' || ch == 'X')) {
-                        tkText.clear();
+                        start = buffer.position();
 
                         ch = nextChar();
-                        APPEND_SEQUENCE(isxdigit(ch), tkText);
+                        SKIP_SEQUENCE(isxdigit(ch));
 
-                        if (tkText.empty()) {
-                            tokenInfo.set("hexadecimal constant '0x'", currentLine);
-                            return MTK_ERROR;
-                        }
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = strtoul(tkText.c_str(), NULL, 16);
+                        if (buffer.position() == start)
+                            return errorToken("hexadecimal constant '0x'");
+
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 16);
 
                         return MTK_HEX_CONSTANT;
                     } else if (isdigit(ch)) {
 						
-                        APPEND_SEQUENCE(isdigit(ch), tkText);
+                        SKIP_SEQUENCE(isdigit(ch));
 
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = atol(tkText.c_str());
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 10);
 
                         return MTK_DEC_CONSTANT;
                     } else {
                         ungetChar(ch);
 
-                        tokenInfo.tokenLexeme += prevCh;
+                        tokenInfo.set(start, 1, currentLine);
                         tokenInfo.intValue = prevCh - '0';
 
                         return MTK_DEC_CONSTANT;
                     }
                 } else if (isalpha(ch) || ch == '_') {
-                    tkText.clear();
-                    APPEND_SEQUENCE( (isalnum(ch) || ch == '_') && (ch != EOF), tkText );
+                    SKIP_SEQUENCE( (isalnum(ch) || ch == '_') && (ch != EOF) );
 
-                    tokenInfo.set(tkText, currentLine);
-                    return lookUpWord(m_keywords, KWCount, tkText);
+                    tokenInfo.set(start, buffer.position() - start, currentLine);
+                    return kwTable.lookUp(tokenInfo.text, tokenInfo.length);
 
                 } else {
-                    tokenInfo.set(string("symbol '") + ((char)ch) + string("'"), currentLine);
-                    return MTK_ERROR;
+                    return errorToken(string("symbol '") + ((char)ch) + string("'"));
                 }
             }
         }
@@ -327,6 +343,16 @@ string Mips32Lexer::getTokenString(int token, TokenInfo *info)
     case MTK_DEC_CONSTANT: tokenName = "decimal constant"; break;
     case MTK_HEX_CONSTANT: tokenName = "hexadecimal constant"; break;
     case MTK_BIN_CONSTANT: tokenName = "binary constant"; break;
+    case MDIR_DATA:
+    case MDIR_TEXT:
+    case MDIR_WORD:
+    case MDIR_HALF:
+    case MDIR_BYTE:
+    case MDIR_SPACE:
+    case MDIR_ASCIIZ:
+    case MDIR_ALIGN:
+        tokenName = "directive";
+        break;
     default:
         tokenName = ::convertToString(token);
     }
@@ -336,13 +362,13 @@ string Mips32Lexer::getTokenString(int token, TokenInfo *info)
     if (info != NULL) {
         switch (token) {
             case MTK_ERROR:
-                result += info->tokenLexeme;
+                result += info->lexeme();
                 break;
             case MTK_EOL:
             case MTK_EOF:
                 break;
             default:
-                result += " '" + info->tokenLexeme + "'";
+                result += " '" + info->lexeme() + "'";
         }
     }
 
@@ -26,25 +26,24 @@ public:
 
     int getCurrentLine() { return currentLine; }
     
-    void getTokenInfo(TokenInfo *ti) {
-        ti->intValue = tokenInfo.intValue;
-        ti->tokenLexeme = tokenInfo.tokenLexeme;
-        ti->line = tokenInfo.line;
-    }
+    void getTokenInfo(TokenInfo *ti) { *ti = tokenInfo; }
 
     static string getTokenString(int token, TokenInfo *info);
 
 private:
-	int nextChar() { return in->get(); }
-	void ungetChar(int c) { in->putback(c); }
-	
+    int nextChar() { return buffer.nextChar(); }
+    void ungetChar(int c) { buffer.ungetChar(c); }
+    int errorToken(string message);
+
 private:
-    istream *in;
+    ScanBuffer buffer;
     int currentLine;
     TokenInfo tokenInfo;
+    string errorText; //Lexeme of the last error token
 };
 
 int mips32_getRegisterIndex(const char *rname);
+int mips32_getRegisterIndex(const char *rname, uint32_t length);
 string mips32_getRegisterName(unsigned int regIndex);
 
 #endif // MIP32LEXER_H
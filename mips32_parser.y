@@ -35,6 +35,8 @@ void reportError(const char *format, ...);
 %type set_rvalue {MArgumentList *}
 %type constant_list {MArgumentList *}
 %type opt_count {MArgument *}
+%type opt_readonly {bool}
+%type data_list {list<int> *}
 
 %name Mips32Parse
 
@@ -52,25 +54,64 @@ void reportError(const char *format, ...);
 
 input ::= statements MTK_EOF. { /* Noting to do here */ }
         
-statements ::= statements MTK_EOL statement(S). { ctx->instList.push_back((MInstruction *)S); }
-statements ::= statement(S) .                   { ctx->instList.push_back((MInstruction *)S); }
+statements ::= statements MTK_EOL statement(S). { ctx->addStatement((MInstruction *)S); }
+statements ::= statement(S) .                   { ctx->addStatement((MInstruction *)S); }
         
 statement(R) ::= instruction(I).  { R = I; }
 statement(R) ::= command(C).      { R = C; }
-statement(R)::= MTK_ID(I) MTK_COLON. { R = new MInstTagged(I->tokenLexeme, NULL); R->line = I->line; }
+statement(R) ::= directive.       { R = NULL; }
+statement(R)::= MTK_ID(I) MTK_COLON. {
+    if (ctx->inData) {
+        ctx->addDataLabel(I->lexeme(), I->line);
+        R = NULL;
+    } else {
+        R = new MInstTagged(I->lexeme(), NULL);
+        R->line = I->line;
+    }
+}
+statement(R)::= data_tag directive. { R = NULL; }
 statement(R)::= MTK_ID(I) MTK_COLON instruction(T). 
-                { R = new MInstTagged(I->tokenLexeme, (MInstruction *)T); R->line = I->line; }
+                { R = new MInstTagged(I->lexeme(), (MInstruction *)T); R->line = I->line; }
 statement(R)::= MTK_ID(I) MTK_COLON command(C). 
-                { R = new MInstTagged(I->tokenLexeme, (MInstruction *)C); R->line = I->line; }
+                { R = new MInstTagged(I->lexeme(), (MInstruction *)C); R->line = I->line; }
+
+data_tag ::= MTK_ID(I) MTK_COLON. { ctx->addDataLabel(I->lexeme(), I->line); }
+
+directive ::= MDIR_DATA. { ctx->inData = true; }
+directive ::= MDIR_TEXT. { ctx->inData = false; }
+directive ::= MDIR_WORD(D) data_list(L). { ctx->addData(*L, 4, D->line); delete L; }
+directive ::= MDIR_HALF(D) data_list(L). { ctx->addData(*L, 2, D->line); delete L; }
+directive ::= MDIR_BYTE(D) data_list(L). { ctx->addData(*L, 1, D->line); delete L; }
+directive ::= MDIR_SPACE(D) constant(C). { ctx->addSpace(((MArgConstant *)C)->value, D->line); }
+directive ::= MDIR_ASCIIZ(D) MSTR_LITERAL(S). { ctx->addString(S->lexeme(), D->line); }
+directive ::= MDIR_ALIGN(D) constant(C). { ctx->addAlign(((MArgConstant *)C)->value, D->line); }
+
+data_list(R) ::= data_list(L) MTK_COMMA constant(C). { R = L; R->push_back(((MArgConstant *)C)->value); }
+data_list(R) ::= constant(C). { R = new list<int>; R->push_back(((MArgConstant *)C)->value); }
 
 command(R) ::= MCKW_SHOW(I) cmd_argument(A) opt_data_format(F).  
-               { R = new MCmd_Show(I->tokenLexeme, A, F); R->line = I->line; }
+               { R = new MCmd_Show(I->lexeme(), A, F); R->line = I->line; }
 command(R) ::= MCKW_SET(I) cmd_argument(A) MTK_OPEQUAL set_rvalue(V).
-               { R = new MCmd_Set(I->tokenLexeme, A, *V); R->line = I->line; delete V; }
+               { R = new MCmd_Set(I->lexeme(), A, *V); R->line = I->line; delete V; }
 command(R) ::= MCKW_EXEC(I) MSTR_LITERAL(S). 
-               { R = new MCmd_Exec(I->tokenLexeme, S->tokenLexeme); R->line = I->line; }
+               { R = new MCmd_Exec(I->lexeme(), S->lexeme()); R->line = I->line; }
 command(R) ::= MCKW_STOP(I). 
                { R = new MCmd_Stop(); R->line = I->line; }
+command(R) ::= MCKW_MAP(I) MSTR_LITERAL(S) MCKW_AT constant(C) opt_readonly(F).
+               { R = new MCmd_Map(I->lexeme(), S->lexeme(), ((MArgConstant *)C)->value, F); R->line = I->line; }
+
+command(R) ::= MCKW_SNAPSHOT(I) MTK_ID(A) MTK_ID(S). {
+    string action = A->lexeme();
+
+    if (action != "save" && action != "restore") {
+        reportError("Line %d: Invalid snapshot action '%s', expected save or restore\n", A->line, action.c_str());
+        ctx->error++;
+    }
+    R = new MCmd_Snapshot(I->lexeme(), action == "save", S->lexeme()); R->line = I->line;
+}
+
+opt_readonly(R) ::= MCKW_READONLY. { R = true; }
+opt_readonly(R) ::= . { R = false; }
         
 set_rvalue(R) ::= constant_arg(C). { R = new MArgumentList; R->push_back((MArgument *)C); }
 set_rvalue(R) ::= MTK_LBRACKET constant_list(L) MTK_RBRACKET. { R = L; }
@@ -106,21 +147,35 @@ data_format(R) ::= MCKW_ASCII.                { R = F_Ascii; }
 
 instruction(R) ::= MTK_ID(I) argument(A1) MTK_COMMA argument(A2) MTK_COMMA argument(A3). 
                    { 
-                        R = new MInst_3Arg(I->tokenLexeme, A1, A2, A3); 
+                        R = new MInst_3Arg(I->lexeme(), A1, A2, A3); 
 			R->line = I->line; 
                     }
 instruction(R) ::= MTK_ID(I) argument(A1) MTK_COMMA argument(A2).
-                   { R = new MInst_2Arg(I->tokenLexeme, A1, A2); R->line = I->line; }
-instruction(R) ::= MTK_ID(I) argument(A1). { R = new MInst_1Arg(I->tokenLexeme, A1); R->line = I->line; }
+                   { R = new MInst_2Arg(I->lexeme(), A1, A2); R->line = I->line; }
+instruction(R) ::= MTK_ID(I) argument(A1). { R = new MInst_1Arg(I->lexeme(), A1); R->line = I->line; }
+instruction(R) ::= MTK_ID(I). { R = new MInst_0Arg(I->lexeme()); R->line = I->line; }
 instruction(R) ::= MTK_ID(I) argument(A1) MTK_COMMA constant(A2) MTK_LPAREN argument(A3) MTK_RPAREN.
-                   { R = new MInst_3Arg(I->tokenLexeme, A1, A3, A2); R->line = I->line; }
+                   { R = new MInst_3Arg(I->lexeme(), A1, A3, A2); R->line = I->line; }
+instruction(R) ::= MTK_ID(I) argument(A1) MTK_COMMA MTK_ID(L) MTK_LPAREN argument(A3) MTK_RPAREN.
+                   {
+                        MArgIdentifier *label = new MArgIdentifier(L->lexeme());
+
+                        ctx->addLabelRef(label->name, label->target, L->line);
+                        R = new MInst_3Arg(I->lexeme(), A1, A3, label);
+                        R->line = I->line;
+                   }
 
-argument(R) ::= MTK_REGISTER(R1).   { R = new MArgRegister(R1->tokenLexeme, R1->intValue); }
+argument(R) ::= MTK_REGISTER(R1).   { R = new MArgRegister(R1->lexeme(), R1->intValue); }
 argument(R) ::= constant_arg(A).    { R = (MArgument *)A; }
 
 constant_arg(R) ::= constant(C). { R = C; }
-constant_arg(R) ::= MTK_ID(I). { R = new MArgIdentifier(I->tokenLexeme); }
-constant_arg(R) ::= MTK_AT MTK_ID(I1) MTK_DOT MTK_ID(I2). { R = new MArgExternalFuntionId(I1->tokenLexeme, I2->tokenLexeme); }
+constant_arg(R) ::= MTK_ID(I). { 
+    MArgIdentifier *ident = new MArgIdentifier(I->lexeme());
+
+    ctx->addLabelRef(ident->name, ident->target, I->line);
+    R = ident;
+}
+constant_arg(R) ::= MTK_AT MTK_ID(I1) MTK_DOT MTK_ID(I2). { R = new MArgExternalFuntionId(I1->lexeme(), I2->lexeme()); }
 constant_arg(R) ::= MCKW_HIHW MTK_LPAREN constant_arg(A) MTK_RPAREN. { R = new MArgHighHalfWord((MArgument *)A); }
 constant_arg(R) ::= MCKW_LOHW MTK_LPAREN constant_arg(A) MTK_RPAREN. { R = new MArgLowHalfWord((MArgument *)A); }
 constant_arg(R) ::= MCKW_PADDR MTK_LPAREN address_expr(E) MTK_RPAREN. { R = new MArgPhyAddress(E); }
@@ -132,7 +187,12 @@ constant(R) ::= MTK_BIN_CONSTANT(C).  { R = new MArgConstant(NBF_Binary, C->intV
 constant(R) ::= MTK_CHAR_CONSTANT(C). { R = new MArgConstant(NBF_Ascii, C->intValue); }
 
 address_expr(R) ::= constant(C). { R = new MAddrExprConstant(C); }
-address_expr(R) ::= MTK_ID(I). { R = new MAddrExprIdentifier(I->tokenLexeme); }
+address_expr(R) ::= MTK_ID(I). { 
+    MAddrExprIdentifier *ident = new MAddrExprIdentifier(I->lexeme());
+
+    ctx->addLabelRef(ident->ident, ident->target, I->line);
+    R = ident;
+}
 address_expr(R) ::= MTK_REGISTER(T) . { R = new MAddrExprRegister(T->intValue); }
 address_expr(R) ::= constant(C) MTK_LPAREN MTK_REGISTER(T) MTK_RPAREN. 
                     { R = new MAddrExprBaseOffset(C, T->intValue); }
\ No newline at end of file
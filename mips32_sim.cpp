@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <cstring>
 #include <map>
 #include <vector>
+#include <sstream>
+#include <fstream>
 #include "mips32_sim.h"
 #include "mips32_dbg.h"
 #include "mips32_lexer.h"
@@ -11,6 +14,7 @@
 #include "mempool.h"
 #include "util.h"
 #include "native_lib.h"
+#include "mips32_jit.h"
 
 struct MIPS32Function functions[] = {
 	{"add", R_FORMAT, MKOPCODE2(0x00, 0x20), 3, 0},
@@ -72,10 +76,9 @@ struct MIPS32Function functions[] = {
 
 const int function_count = sizeof(functions) / sizeof(functions[0]);
 
-extern MemPool *mpool;
-extern map<uint32_t, void *> externalFuncHandles;
 
 void reportRuntimeError(const char *format, ...);
+extern const char *reg_names[];
 
 /* Parser related functions */
 void *Mips32ParseAlloc(void *(*mallocProc)(size_t));
@@ -89,52 +92,189 @@ MIPS32Sim::MIPS32Sim()
 
     reg[SP_INDEX] = M_VIRTUAL_STACK_END_ADDR;
     reg[GP_INDEX] = M_VIRTUAL_GLOBAL_START_ADDR;
-    stack_start_address = M_VIRTUAL_STACK_END_ADDR - (M_STACK_SIZE_WORDS * 4);
+    memory.mapRegion(M_VIRTUAL_GLOBAL_START_ADDR, M_GLOBAL_MEM_WORD_COUNT * 4);
+    memory.mapRegion(M_VIRTUAL_HEAP_START_ADDR, M_HEAP_SIZE_WORDS * 4);
+    memory.mapRegion(M_VIRTUAL_STACK_END_ADDR - M_STACK_SIZE_WORDS * 4, M_STACK_SIZE_WORDS * 4);
     runtimeCtx = NULL;
+    jumpTable = NULL;
     dbg = NULL;
+    threadedDispatch = false;
+    instCount = 0;
+    jit = NULL;
+    jitLastPc = 0;
+    heapBreak = M_VIRTUAL_HEAP_START_ADDR;
+    exitCode = 0;
+    inputFd = STDIN_FILENO;
+    maxSteps = 0;
+    stepLimit = UINT64_MAX;
+    stepLimitHit = false;
 }
 
-AsmDebugger *MIPS32Sim::getDebugger()
+MIPS32Sim::~MIPS32Sim()
 {
-    return dbg;
+    delete jit;
 }
 
-bool MIPS32Sim::translateVirtualToPhysical(uint32_t vaddr, uint32_t &paddr)
+const char *MIPS32Sim::getRegisterName(int regIndex)
 {
-    if (vaddr >= M_VIRTUAL_GLOBAL_START_ADDR && vaddr <= M_VIRTUAL_GLOBAL_END_ADDR) {
-        paddr = vaddr - M_VIRTUAL_GLOBAL_START_ADDR;
-    } else if (vaddr >= stack_start_address && vaddr < M_VIRTUAL_STACK_END_ADDR) {
-        paddr = (vaddr - stack_start_address) + (M_GLOBAL_MEM_WORD_COUNT * 4);
-    } else {
-        reportRuntimeError("Runtime exception: fetch address out of limit 0x%x\n", vaddr);
+    return (regIndex >= 0 && regIndex <= 31)? reg_names[regIndex] : NULL;
+}
+
+/* Saves the registers and the memory, a snapshot with the same name is
+ * replaced.
+ */
+void MIPS32Sim::saveSnapshot(const string &name)
+{
+    MRegSnapshot &regs = snapshotRegs[name];
+
+    memcpy(regs.reg, reg, sizeof(reg));
+    regs.hi_lo = hi_lo;
+    regs.heapBreak = heapBreak;
+    memory.saveSnapshot(name);
+}
+
+bool MIPS32Sim::restoreSnapshot(const string &name)
+{
+    map<string, MRegSnapshot>::iterator it = snapshotRegs.find(name);
+
+    if (it == snapshotRegs.end() || !memory.restoreSnapshot(name))
+        return false;
+
+    memcpy(reg, it->second.reg, sizeof(reg));
+    hi_lo = it->second.hi_lo;
+    heapBreak = it->second.heapBreak;
+
+    return true;
+}
+
+bool MIPS32Sim::deleteSnapshot(const string &name)
+{
+    snapshotRegs.erase(name);
+
+    return memory.deleteSnapshot(name);
+}
+
+/* Guest address of a native function, each function gets its own address
+ * the first time it's used.
+ */
+bool MIPS32Sim::getNativeFunction(const string &lib_name, const string &func_name, uint32_t &addr)
+{
+    if (!checkNativeCalls())
+        return false;
+
+    string name = "@" + lib_name + "." + func_name;
+    map<string, uint32_t>::iterator it = nativeFuncAddrs.find(name);
+
+    if (it != nativeFuncAddrs.end()) {
+        addr = it->second;
+        return true;
+    }
+
+    HFUNC hfunc;
+    int error = nativeLibs.resolve(lib_name, func_name, hfunc);
+
+    if (error == NLIB_CANNOT_OPEN) {
+        reportRuntimeError("Cannot open library '%s'.\n", getLibFullName(lib_name).c_str());
+        return false;
+    } else if (error == NLIB_NO_FUNCTION) {
+        reportRuntimeError("Function '%s' doesn't exist in library '%s'.\n", func_name.c_str(), getLibFullName(lib_name).c_str());
         return false;
     }
-    
+
+    MNativeSlot slot;
+    int arity = getNativeArity(lib_name, func_name);
+
+    slot.hfunc = hfunc;
+    slot.arity = (arity >= 0 && arity <= GMEM_NATIVE_ARG_WORDS)? arity : GMEM_NATIVE_ARG_WORDS;
+
+    addr = M_VIRTUAL_EXTFUNC_START_ADDR + nativeSlots.size() * 4;
+    nativeFuncAddrs[name] = addr;
+    nativeSlots.push_back(slot);
+
+    return true;
+}
+
+/* Compile hot blocks to host code.  Returns false if the host doesn't
+ * support it.
+ */
+bool MIPS32Sim::setJit(bool enable)
+{
+    if (!enable) {
+        delete jit;
+        jit = NULL;
+        return true;
+    }
+
+    if (jit == NULL) {
+        jit = new MIPS32Jit(this);
+
+        if (!jit->isAvailable()) {
+            delete jit;
+            jit = NULL;
+            return false;
+        }
+        jit->setChaining(maxSteps == 0);
+    }
+
     return true;
 }
 
+/* Stops each run after the number of instructions, the compiled blocks
+ * are not chained so the limit is checked between them.
+ */
+void MIPS32Sim::setMaxSteps(uint64_t steps)
+{
+    maxSteps = steps;
+    if (jit != NULL)
+        jit->setChaining(steps == 0);
+}
+
+AsmDebugger *MIPS32Sim::getDebugger()
+{
+    return dbg;
+}
+
+/* Host address of the word that holds vaddr, the writes are recorded for
+ * the snapshots.
+ */
+uint32_t *MIPS32Sim::getWordPtr(uint32_t vaddr, bool write)
+{
+    uint32_t *pword;
+
+    if (!memory.checkAccess(vaddr & ~3, write)) {
+        reportRuntimeError(memory.getFaultMessage(), vaddr);
+        return NULL;
+    }
+
+    pword = (uint32_t *)(write? memory.getWritePtr(vaddr & ~3) : memory.getPtr(vaddr & ~3));
+    if (pword == NULL)
+        reportRuntimeError("Runtime exception: fetch address out of limit 0x%x\n", vaddr);
+
+    return pword;
+}
+
 bool MIPS32Sim::readWord(unsigned int vaddr, uint32_t &result)
 {
-    uint32_t paddr;
+    uint32_t *pword;
     
     if ((vaddr % 4) != 0) {
         reportRuntimeError("Runtime exception: fetch address not aligned on word boundary 0x%x\n", vaddr);
 	    return false;
     }
     
-    if (!translateVirtualToPhysical(vaddr, paddr))
-        return 0;
+    if ((pword = getWordPtr(vaddr)) == NULL)
+        return false;
 
-    result = mem[paddr / 4];
+    result = *pword;
     
     return true;
 }
 
 bool MIPS32Sim::readByte(unsigned int vaddr, uint32_t &result, bool sign_extend)
 {
-    uint32_t paddr;
+    uint32_t *pword;
 
-    if (!translateVirtualToPhysical(vaddr, paddr))
+    if ((pword = getWordPtr(vaddr)) == NULL)
         return false;
     
     uint32_t byteToRead = vaddr % 4;
@@ -149,7 +289,7 @@ bool MIPS32Sim::readByte(unsigned int vaddr, uint32_t &result, bool sign_extend)
     }
 
     int shift = (3 - byteToRead) * 8;
-    result = (mem[paddr / 4] & byteMask) >> shift;
+    result = (*pword & byteMask) >> shift;
 
     if (sign_extend && ((result & (1 << 7))!=0))
         result |= 0xFFFFFF00;
@@ -160,9 +300,9 @@ bool MIPS32Sim::readByte(unsigned int vaddr, uint32_t &result, bool sign_extend)
 
 bool MIPS32Sim::readHalfWord(unsigned int vaddr, uint32_t &result, bool sign_extend)
 {
-    uint32_t paddr;
+    uint32_t *pword;
 
-    if (!translateVirtualToPhysical(vaddr, paddr))
+    if ((pword = getWordPtr(vaddr)) == NULL)
         return false;
         
     uint32_t hwordToRead = vaddr - (vaddr/4)*4, shift;
@@ -179,7 +319,7 @@ bool MIPS32Sim::readHalfWord(unsigned int vaddr, uint32_t &result, bool sign_ext
         case 2: hwordMask = 0x0000FFFF; shift = 0; break;
     }
 
-    uint32_t word = mem[paddr / 4];
+    uint32_t word = *pword;
     result = (word & hwordMask) >> shift;
 
     if (sign_extend && (SIGN_BIT(result, 16) == 1))
@@ -190,20 +330,20 @@ bool MIPS32Sim::readHalfWord(unsigned int vaddr, uint32_t &result, bool sign_ext
 
 bool MIPS32Sim::writeWord(unsigned int vaddr, uint32_t value)
 {
-    uint32_t paddr;
+    uint32_t *pword;
 
-    if (!translateVirtualToPhysical(vaddr, paddr))
+    if ((pword = getWordPtr(vaddr, true)) == NULL)
         return false;
 
-    mem[paddr / 4] = value;
+    *pword = value;
     return true;
 }
 
 bool MIPS32Sim::writeHalfWord(unsigned int vaddr, uint16_t value)
 {
-    uint32_t paddr;
+    uint32_t *pword;
 
-    if (!translateVirtualToPhysical(vaddr, paddr))
+    if ((pword = getWordPtr(vaddr, true)) == NULL)
         return false;
         
     int pos = vaddr - (vaddr / 4) * 4;
@@ -215,17 +355,17 @@ bool MIPS32Sim::writeHalfWord(unsigned int vaddr, uint16_t value)
         case 2: mask = 0xFFFF0000; shift = 0; break;
     }
 
-    uint32_t word = mem[paddr / 4];
-    mem[paddr / 4] = (word & mask) | (((uint32_t)(value)) << shift);
+    uint32_t word = *pword;
+    *pword = (word & mask) | (((uint32_t)(value)) << shift);
 
     return true;
 }
 
 bool MIPS32Sim::writeByte(unsigned int vaddr, uint8_t value)
 {
-    uint32_t paddr;
+    uint32_t *pword;
 
-    if (!translateVirtualToPhysical(vaddr, paddr))
+    if ((pword = getWordPtr(vaddr, true)) == NULL)
         return false;
     
     int bytePos = vaddr % 4;
@@ -238,9 +378,9 @@ bool MIPS32Sim::writeByte(unsigned int vaddr, uint8_t value)
         case 3: mask = 0xFFFFFF00; shift = 0; break;
     }
 
-    uint32_t word = mem[paddr / 4];
+    uint32_t word = *pword;
 
-    mem[paddr / 4] = (word & mask) | (((uint32_t)(value)) << shift);
+    *pword = (word & mask) | (((uint32_t)(value)) << shift);
 
     return true;
 }
@@ -281,8 +421,10 @@ bool MIPS32Sim::parseFile(istream *in, MParserContext &ctx)
     TokenInfo *tokenInfo;
     int token;
     void* pParser = Mips32ParseAlloc (malloc);
+    ThreadBinding<MemPool> tokens(tk_pool, &ctx.tokenPool);
     
-    tk_pool = &(ctx.tokenPool);
+    ctx.bigEndian = true;   //Same byte order as readByte and readHalfWord
+    ctx.dataMaxSize = M_DATA_MAX_SIZE;
 
     while ((token = lexer.getNextToken()) == MTK_EOL);
 
@@ -320,7 +462,6 @@ bool MIPS32Sim::parseFile(istream *in, MParserContext &ctx)
     Mips32ParseFree(pParser, free);
 
     tk_pool->freeAll();
-    tk_pool = NULL;
 
     return (ctx.error == 0);
 }
@@ -366,70 +507,430 @@ bool MIPS32Sim::resolveLabels(list<MInstruction *> &linst, vector<MInstruction *
     return true;
 }
 
-bool MIPS32Sim::loadFile(istream *in, vector<MInstruction *> &instList, map<string, uint32_t> &labelMap)
+/* The label operands of the branches and jumps, they must be code labels */
+void MIPS32Sim::markJumpTargets(vector<MInstruction *> &vinst, MParserContext &ctx)
+{
+    for (size_t i = 0; i < vinst.size(); i++) {
+        MInstruction *inst = vinst[i];
+        MIPS32Function *f = getFunctionByName(inst->name.c_str());
+        MArgument *target = NULL;
+
+        if (f == NULL)
+            continue;
+
+        switch (f->opcode) {
+            case FN_J:
+            case FN_JAL:
+                if (inst->isA(MINST_1ARG))
+                    target = ((MInst_1Arg *)inst)->arg1;
+                break;
+            case FN_BLEZ:
+            case FN_BGTZ:
+            case FN_BLTZ:
+            case FN_BGEZ:
+                if (inst->isA(MINST_2ARG))
+                    target = ((MInst_2Arg *)inst)->arg2;
+                break;
+            case FN_BEQ:
+            case FN_BNE:
+                if (inst->isA(MINST_3ARG))
+                    target = ((MInst_3Arg *)inst)->arg3;
+                break;
+        }
+
+        if (target != NULL && target->isA(MARG_IDENTIFIER))
+            ctx.markJumpTarget(((MArgIdentifier *)target)->name);
+    }
+}
+
+bool MIPS32Sim::loadFile(istream *in, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap)
+{
+    SimScope scope(this);
+
+    //The compiled blocks belong to the program loaded before, which may
+    //have used the same vector
+    if (jit != NULL)
+        jit->reset();
+
+    //Only the programs read from a file are cached, not the lines typed in the console
+    if (cacheDir.empty() || dynamic_cast<ifstream *>(in) == NULL)
+        return loadSource(in, code, labelMap);
+
+    ProgramCache cache(cacheDir, PCACHE_ISA_MIPS32, sizeof(MCachedInst));
+
+    cache.readSource(in);
+    if (cache.open() && loadCached(cache, code, labelMap))
+        return true;
+
+    istringstream src(cache.getSource());
+
+    code.clear();
+    labelMap.clear();
+    if (!loadSource(&src, code, labelMap))
+        return false;
+
+    saveCached(cache, code, labelMap);
+
+    return true;
+}
+
+bool MIPS32Sim::loadSource(istream *in, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap)
 {
     MParserContext parser_ctx;
+    vector<MInstruction *> instList;
     
     if (!parseFile(in, parser_ctx)) {
         return false;
     }
     
-    if (!resolveLabels(parser_ctx.instList, instList, labelMap)) {
+    if (!resolveLabels(parser_ctx.instList, instList, labelMap))
+        return false;
+
+    markJumpTargets(instList, parser_ctx);
+    if (!parser_ctx.placeData(M_VIRTUAL_DATA_START_ADDR, M_DATA_MAX_SIZE, labelMap, dataImage) ||
+        !parser_ctx.bindLabels(labelMap)) {
         return false;
     }
     
+    MRtContext *prev_ctx = runtimeCtx;
+    MRtContext ctx;
+    bool result;
+
+    runtimeCtx = &ctx;
+    ctx.pc = 0;
+    ctx.line = 0;
+    ctx.stop = false;
+
+    result = decode(instList, code);
+
+    runtimeCtx = prev_ctx;
+
+    return result;
+}
+
+/* Copies the data section of the program to the guest memory */
+bool MIPS32Sim::loadData()
+{
+    if (dataImage.empty())
+        return true;
+
+    if (!memory.write(M_VIRTUAL_DATA_START_ADDR, &dataImage[0], dataImage.size())) {
+        reportRuntimeError("Cannot write the data section at 0x%X\n", M_VIRTUAL_DATA_START_ADDR);
+        return false;
+    }
+
     return true;
 }
 
-bool MIPS32Sim::exec(istream *in)
+/* Parses a single source line of a cached program */
+MInstruction *MIPS32Sim::parseLine(const string &text, int line, map<string, uint32_t> &labelMap)
+{
+    MParserContext parser_ctx;
+    istringstream in(text);
+
+    if (!parseFile(&in, parser_ctx) || !parser_ctx.bindLabels(labelMap) || parser_ctx.instList.size() != 1)
+        return NULL;
+
+    MInstruction *inst = parser_ctx.instList.front();
+
+    if (inst->isA(MINST_TAGGED))
+        inst = ((MInstTagged *)inst)->inst;
+
+    if (inst != NULL)
+        inst->line = line;
+
+    return inst;
+}
+
+/* True if the record holds an instruction the handlers know */
+static bool isValidCachedInst(const MCachedInst &rec)
 {
-    MParserContext parse_ctx;
+    if (rec.r0 > 31 || rec.r1 > 31 || rec.r2 > 31)
+        return false;
 
-    mpool = &(parse_ctx.parserPool);
-    if (!parseFile(in, parse_ctx)) {
+    if (rec.format != R_FORMAT && rec.format != I_FORMAT && rec.format != J_FORMAT)
         return false;
+
+    switch (rec.opcode) {
+#define MIPS32_OP(op, ...) case op: return true;
+#include "mips32_exec.inc"
+#undef MIPS32_OP
+        default:
+            return false;
     }
-    
-    vector<MInstruction *> vinst;
-    map<string, uint32_t> jmpTbl;
-    
-    if (!resolveLabels(parse_ctx.instList, vinst, jmpTbl)) {
+}
+
+bool MIPS32Sim::loadCached(ProgramCache &cache, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap)
+{
+    const MCachedInst *rec = (const MCachedInst *)cache.getRecords();
+    uint32_t count = cache.getRecordCount();
+
+    if (!cache.getLabels(labelMap))
         return false;
+    cache.getImage(dataImage);
+
+    MRtContext *prev_ctx = runtimeCtx;
+    MRtContext ctx;
+    bool result = true;
+
+    runtimeCtx = &ctx;
+    ctx.pc = 0;
+    ctx.stop = false;
+
+    code.resize(count);
+    for (uint32_t i = 0; i < count && result; i++) {
+        MDecodedInst &di = code[i];
+
+        if (!isValidCachedInst(rec[i])) {
+            result = false;
+            break;
+        }
+
+        di.opcode = rec[i].opcode;
+        di.format = rec[i].format;
+        di.r0 = rec[i].r0;
+        di.r1 = rec[i].r1;
+        di.r2 = rec[i].r2;
+        di.imm = rec[i].imm;
+        di.line = rec[i].line;
+        di.inst = NULL;
+        di.handler = NULL;
+
+        if (rec[i].reparse) {
+            ctx.line = di.line;
+            di.inst = parseLine(cache.getSourceLine(di.line), di.line, labelMap);
+
+            if (di.inst == NULL)
+                result = false;
+            else if ((di.opcode != FN_COMMAND) && (di.opcode != FN_GENERIC))
+                result = decodeInstruction(di.inst, di);
+        }
     }
-    
-    unsigned count = vinst.size();
+
+    runtimeCtx = prev_ctx;
+
+    if (!result) {
+        code.clear();
+        labelMap.clear();
+    }
+
+    return result;
+}
+
+void MIPS32Sim::saveCached(ProgramCache &cache, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap)
+{
+    vector<MCachedInst> rec(code.size());
+
+    for (unsigned i = 0; i < code.size(); i++) {
+        MDecodedInst &di = code[i];
+
+        memset(&rec[i], 0, sizeof(MCachedInst));
+        rec[i].opcode = di.opcode;
+        rec[i].format = di.format;
+        rec[i].r0 = di.r0;
+        rec[i].r1 = di.r1;
+        rec[i].r2 = di.r2;
+        rec[i].imm = di.imm;
+        rec[i].line = di.line;
+
+        //Native function addresses are assigned when the program is loaded
+        rec[i].reparse = (di.opcode == FN_COMMAND) || (di.opcode == FN_GENERIC) ||
+                         ((di.imm >= M_VIRTUAL_EXTFUNC_START_ADDR) && (di.imm < M_VIRTUAL_GLOBAL_START_ADDR));
+    }
+
+    cache.save(rec.empty()? NULL : &rec[0], rec.size(), labelMap, dataImage);
+}
+
+bool MIPS32Sim::exec(istream *in)
+{
+    MemPool pool;
+    NodePoolScope nodes(&pool);
+    SimScope scope(this);
+    vector<MDecodedInst> code;
+    map<string, uint32_t> jmpTbl;
+    bool result;
+
+    result = loadFile(in, code, jmpTbl) && run(code, jmpTbl);
+
+    //The compiled blocks belong to the code being released
+    if (jit != NULL)
+        jit->reset();
+
+    return result;
+}
+
+bool MIPS32Sim::run(vector<MDecodedInst> &code, map<string, uint32_t> &jmpTbl)
+{
     MRtContext *prev_ctx = runtimeCtx;
     map<string, uint32_t> *prev_jmpTbl = jumpTable;
     MRtContext ctx;
-    bool result = true;
+    const MDecodedInst *last = NULL;
+    sigjmp_buf fault_target, *old_fault_target;
+    SimScope scope(this);
+    bool result, old_unchecked;
 
     runtimeCtx = &ctx;
     jumpTable = &jmpTbl;
 
     ctx.pc = 0;
     ctx.stop = false;
+    exitCode = 0;
     lastResult.init();
-    while ((ctx.pc < count) && !ctx.stop) {
-        MInstruction *inst = vinst[ctx.pc];
-        
-        ctx.line = inst->line;
-        ctx.pc++;
-        if (!execInstruction(inst)) {
-            result = false;
-            break;
-        }
+    stepLimit = (maxSteps != 0)? instCount + maxSteps : UINT64_MAX;
+    stepLimitHit = false;
+
+    //The decoded instructions leave the faults of the flat backend to the handler
+    old_fault_target = memory.setFaultTarget(&fault_target);
+    old_unchecked = memory.setUnchecked(true);
+    if (sigsetjmp(fault_target, 0) != 0) {
+        reportRuntimeError(memory.getFaultMessage(), memory.getFaultAddress());
+        result = false;
+    } else if (!loadData())
+        result = false;
+    else if (jit != NULL)
+        result = runJit(code, last);
+    else if (threadedDispatch)
+        result = runThreaded(code, last);
+    else
+        result = runSwitch(code, last);
+    memory.setUnchecked(old_unchecked);
+    memory.setFaultTarget(old_fault_target);
+
+    if (result && (instCount >= stepLimit) && (ctx.pc < code.size()) && !ctx.stop) {
+        reportRuntimeError("Execution stopped after %llu instructions\n", (unsigned long long)maxSteps);
+        stepLimitHit = true;
+        result = false;
+    }
+
+    //The REPL shows the register written by the last machine instruction
+    if (result && (last != NULL) && (last->opcode != FN_COMMAND) && 
+        (last->opcode != FN_GENERIC) && (last->format != J_FORMAT)) {
+        lastResult.setSim(this);
+        lastResult.setRegIndex(last->r0);
     }
     
     runtimeCtx = prev_ctx;
-    mpool = NULL;
+    jumpTable = prev_jmpTbl;
 
     return result;
 }
 
+bool MIPS32Sim::runSwitch(vector<MDecodedInst> &code, const MDecodedInst *&last)
+{
+    MRtContext *ctx = runtimeCtx;
+    unsigned count = code.size();
+
+    while ((ctx->pc < count) && !ctx->stop && (instCount < stepLimit)) {
+        last = &code[ctx->pc];
+        
+        ctx->line = last->line;
+        ctx->pc++;
+        instCount++;
+        if (!execDecoded(*last)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Interprets cold code and runs the blocks compiled by the JIT */
+bool MIPS32Sim::runJit(vector<MDecodedInst> &code, const MDecodedInst *&last)
+{
+    MRtContext *ctx = runtimeCtx;
+    unsigned count = code.size();
+
+    while ((ctx->pc < count) && !ctx->stop && (instCount < stepLimit)) {
+        MJitBlockFn block = jit->getBlock(code, ctx->pc);
+
+        if (block != NULL) {
+            uint32_t next = block(this, reg);
+
+            if (next == MJIT_ERROR)
+                return false;
+
+            last = &code[jitLastPc];
+            ctx->pc = next;
+            continue;
+        }
+
+        last = &code[ctx->pc];
+        ctx->line = last->line;
+        ctx->pc++;
+        instCount++;
+        if (!execDecoded(*last)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Threaded code dispatch.  Every decoded instruction keeps the address of
+ * its handler, and each handler jumps straight to the handler of the next
+ * instruction, instead of going back to a single switch.  This needs the
+ * GCC "labels as values" extension, other compilers use the switch loop.
+ */
+bool MIPS32Sim::runThreaded(vector<MDecodedInst> &code, const MDecodedInst *&last)
+{
+#if defined(__GNUC__)
+    MRtContext *ctx = runtimeCtx;
+    unsigned count = code.size();
+    const MDecodedInst *di;
+    uint32_t *p0, *p1, *p2;
+    uint32_t imm;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (code[i].handler != NULL)
+            continue;
+
+        switch (code[i].opcode) {
+#define MIPS32_OP(op, ...) case op: code[i].handler = &&L_##op; break;
+#include "mips32_exec.inc"
+#undef MIPS32_OP
+            default:
+                code[i].handler = &&L_invalid;
+        }
+    }
+
+#define DISPATCH()                                  \
+    do {                                            \
+        if ((ctx->pc >= count) || ctx->stop ||      \
+            (instCount >= stepLimit))               \
+            return true;                            \
+        di = last = &code[ctx->pc];                 \
+        ctx->line = di->line;                       \
+        ctx->pc++;                                  \
+        instCount++;                                \
+        p0 = &reg[di->r0];                          \
+        p1 = &reg[di->r1];                          \
+        p2 = &reg[di->r2];                          \
+        imm = di->imm;                              \
+        goto *di->handler;                          \
+    } while (0)
+
+    DISPATCH();
+
+#define MIPS32_OP(op, ...) L_##op: { __VA_ARGS__ } DISPATCH();
+#include "mips32_exec.inc"
+#undef MIPS32_OP
+
+L_invalid:
+    reportRuntimeError("%d: BUG in machine\n", __LINE__);
+    return false;
+
+#undef DISPATCH
+#else
+    return runSwitch(code, last);
+#endif
+}
+
 bool MIPS32Sim::debug(string asm_file) 
 {
+    SimScope scope(this);
+
     if (dbg != NULL) {
-        printf("The simulator is in debug mode already.\n");
+        reportRuntimeError("The simulator is in debug mode already.\n");
         return false;
     }
     
@@ -438,18 +939,23 @@ bool MIPS32Sim::debug(string asm_file)
     in.open(asm_file.c_str(), ifstream::in|ifstream::binary);
 
     if (!in.is_open()) {
-        printf("Cannot open file '%s'\n", asm_file.c_str());
+        reportRuntimeError("Cannot open file '%s'\n", asm_file.c_str());
         return false;
     }
     
-    vector<MInstruction *> instList;
+    vector<MDecodedInst> code;
+    MemPool *pool = new MemPool();  //Released by the debugger
+    NodePoolScope nodes(pool);
 
     jumpTable = new map<string, uint32_t>;
-    mpool = new MemPool();
+    runtimeCtx = new MRtContext;
     
-    if (!loadFile(&in, instList, *jumpTable)) {
+    if (!loadFile(&in, code, *jumpTable)) {
         delete jumpTable;
-        delete mpool;
+        delete runtimeCtx;
+        delete pool;
+        jumpTable = NULL;
+        runtimeCtx = NULL;
         
         return false;
     }
@@ -460,7 +966,7 @@ bool MIPS32Sim::debug(string asm_file)
     in.seekg(0);
     
     if (in.fail()) {
-        cout << "Oops. Fail." << endl;
+        reportRuntimeError("Oops. Fail.\n");
         dbg->stop();
         return false;
     }
@@ -471,9 +977,8 @@ bool MIPS32Sim::debug(string asm_file)
         sourceLines.push_back(line);
     };
     
-    runtimeCtx = new MRtContext;
-    
-    dbg = new MIPS32Debugger(this, instList, mpool);
+    loadData();
+    dbg = new MIPS32Debugger(this, code, pool);
     dbg->setSourceLines(sourceLines);
         
     in.close();
@@ -481,109 +986,300 @@ bool MIPS32Sim::debug(string asm_file)
     return true;
 }
 
+/* The arguments go from the registers to the host stack, only the
+ * functions with more than four argument words read the guest stack.
+ */
 bool MIPS32Sim::doNativeCall(uint32_t funcAddr)
 {
-    uint32_t r_sp, r_v0, r_v1;
-    uint32_t p_index;
-    void *old_stack_ptr, *new_stack_ptr;
+    uint32_t slot_index = (funcAddr - M_VIRTUAL_EXTFUNC_START_ADDR) / 4;
+    uint32_t r_v0, r_v1;
+    void *stack_ptr;
     HFUNC hfunc;
 
-    r_sp = reg[SP_INDEX];
-
-    //Push a0, a1, a2, a4
-    r_sp -= 4;
-
-    if (!writeWord(r_sp, reg[A3_INDEX]))
-        return false;
-    
-    r_sp -= 4;
-    
-    if (!writeWord(r_sp, reg[A2_INDEX]))
+    if (slot_index >= nativeSlots.size()) {
+        reportRuntimeError("Invalid native function address 0x%X\n", funcAddr);
         return false;
+    }
 
-    r_sp -= 4;
+    const MNativeSlot &slot = nativeSlots[slot_index];
+    uint32_t *frame = memory.nativeFrame();
 
-    if (!writeWord(r_sp, reg[A1_INDEX]))
-        return false;
+    if (slot.arity <= 4)
+        memcpy(frame, &reg[A0_INDEX], slot.arity * 4);
+    else {
+        memcpy(frame, &reg[A0_INDEX], 16);
+        for (int i = 4; i < slot.arity; i++) {
+            uint32_t vaddr = reg[SP_INDEX] + (i - 4) * 4;
+            uint8_t *p = memory.isMapped(vaddr)? memory.getPtr(vaddr) : NULL;
 
-    r_sp -= 4;
+            frame[i] = (p != NULL && (vaddr & GMEM_PAGE_MASK) <= GMEM_PAGE_SIZE - 4)? *(uint32_t *)p : 0;
+        }
+    }
 
-    if (!writeWord(r_sp, reg[A0_INDEX]))
-        return false;
-    
-    
-    if (!translateVirtualToPhysical(r_sp, p_index))
-        return false;
-    
-    new_stack_ptr = (void *)(&mem[p_index / 4]);
-    hfunc = externalFuncHandles[funcAddr];
+    stack_ptr = frame;
+    hfunc = slot.hfunc;
+
+#if !GMEM_NATIVE_CALLS
+    reportRuntimeError(GMEM_NO_NATIVE_CALLS_MSG);
+    return false;
+#elif defined(_WIN32)
+    void *old_stack_ptr;
 
-#ifdef _WIN32
     __asm {
         mov old_stack_ptr, esp
-        mov esp, new_stack_ptr
+        mov esp, stack_ptr
         call [hfunc]
         mov r_v0, eax
         mov r_v1, edx
         mov esp, old_stack_ptr
     };
-#elif __linux__
-#if defined(__i386__) || defined(__x86_64__)
-    asm volatile ("xchg %%esp, %0\n\t"
-      : "=r"(old_stack_ptr) /* output */
-      : "0"(new_stack_ptr) /* input */
-    );
-
-    asm volatile ("call *%2\n" : "=a"(r_v0), "=d"(r_v1) : "r"(hfunc));
-    asm volatile ("mov %0, %%esp\n\t" : : "r"(old_stack_ptr) );
 #else
-# error Native call not supported in this architecture.
+    //One block, so nothing touches the stack while it's switched.  The
+    //old stack pointer is kept in esi, saved by the callee.
+    asm volatile ("xchg %%esp, %2\n\t"
+                  "call *%3\n\t"
+                  "mov %2, %%esp\n\t"
+                  : "=a"(r_v0), "=d"(r_v1), "+S"(stack_ptr)
+                  : "r"(hfunc)
+                  : "ecx", "memory", "cc");
 #endif
 
-#else
-#error "Unknownk compiler"
-#endif
-    
     reg[V0_INDEX] = r_v0;
     reg[V1_INDEX] = r_v1;
     
-    readWord(r_sp, reg[A0_INDEX]);
-    r_sp += 4;
-    readWord(r_sp, reg[A1_INDEX]);
-    r_sp += 4;
-    readWord(r_sp, reg[A2_INDEX]);
-    r_sp += 4;
-    readWord(r_sp, reg[A3_INDEX]);
-    
     return true;
 }
 
-bool MIPS32Sim::execInstruction(MInstruction *inst)
+const MIPS32Sim::SyscallFn MIPS32Sim::syscallTable[MSYS_COUNT] = {
+    NULL, &MIPS32Sim::sysPrintInt, NULL, NULL,
+    &MIPS32Sim::sysPrintString, &MIPS32Sim::sysReadInt, NULL, NULL,
+    &MIPS32Sim::sysReadString, &MIPS32Sim::sysSbrk, &MIPS32Sim::sysExit, &MIPS32Sim::sysPrintChar,
+    &MIPS32Sim::sysReadChar, NULL, NULL, NULL,
+    NULL, &MIPS32Sim::sysExit2
+};
+
+/* The services run in the simulator, the output goes through the stdout
+ * buffer, like the output of the commands, and it's flushed before reading.
+ * The input is read without the stdin buffer, the lines after the input
+ * of the program belong to the command line.
+ */
+bool MIPS32Sim::doSyscall()
 {
-    int count1, count2, argcount;
-    MIPS32Function *f;
-    uint32_t values[3];
-    MRtContext *ctx = runtimeCtx;
-    
-    lastResult.init();
-    
-    if (inst->isA(MCMD_Show)) {
-        MCmd_Show *shCmd = (MCmd_Show *)inst;
-       
-        return shCmd->exec(this);
-    } else if (inst->isA(MCMD_Set)) {
-        MCmd_Set *cmd = (MCmd_Set *)inst;
-       
-        return cmd->exec(this);
-    } else if (inst->isA(MCMD_Exec)) {
-        MCmd_Exec *cmd = (MCmd_Exec *)inst;
-        
-        return cmd->exec(this);
-    } else if (inst->isA(MCMD_Stop)) {
-        ctx->stop = true;
+    uint32_t service = reg[V0_INDEX];
+
+    if (service >= MSYS_COUNT || syscallTable[service] == NULL) {
+        reportRuntimeError("Runtime exception: invalid syscall service %d\n", service);
+        return false;
+    }
+
+    bool old_unchecked = memory.setUnchecked(false);
+    bool result = (this->*syscallTable[service])();
+
+    memory.setUnchecked(old_unchecked);
+
+    return result;
+}
+
+/* Reads up to size - 1 characters, the newline included, like fgets.
+ * Returns the length of the line, -1 at the end of the input.
+ */
+int MIPS32Sim::readInputLine(char *buf, int size)
+{
+    int len = 0;
+
+    fflush(output);
+    while (len < size - 1) {
+        if (read(inputFd, &buf[len], 1) != 1) {
+            if (len == 0)
+                return -1;
+            break;
+        }
+
+        if (buf[len++] == '\n')
+            break;
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+bool MIPS32Sim::sysPrintInt()
+{
+    fprintf(output, "%d", (int32_t)reg[A0_INDEX]);
+
+    return true;
+}
+
+bool MIPS32Sim::sysPrintString()
+{
+    char buf[256];
+    uint32_t vaddr = reg[A0_INDEX], ch;
+    size_t len = 0;
+
+    while (true) {
+        if (!readByte(vaddr++, ch, false))
+            return false;
+
+        if (ch == 0)
+            break;
+
+        buf[len++] = ch;
+        if (len == sizeof(buf)) {
+            fwrite(buf, 1, len, output);
+            len = 0;
+        }
+    }
+    fwrite(buf, 1, len, output);
+
+    return true;
+}
+
+bool MIPS32Sim::sysReadInt()
+{
+    char line[64];
+
+    reg[V0_INDEX] = (readInputLine(line, sizeof(line)) > 0)? strtol(line, NULL, 10) : 0;
+
+    return true;
+}
+
+/* Reads up to $a1 - 1 characters, the newline included, like fgets.  The
+ * line is written to the guest memory in chunks, so the host memory used
+ * doesn't depend on $a1.
+ */
+bool MIPS32Sim::sysReadString()
+{
+    char buf[256];
+    int32_t size = reg[A1_INDEX];
+    uint32_t vaddr = reg[A0_INDEX];
+
+    if (size < 1)
         return true;
+
+    for (int32_t left = size - 1; left > 0; ) {
+        int len = readInputLine(buf, min(left + 1, (int32_t)sizeof(buf)));
+
+        if (len <= 0)
+            break;
+
+        for (int i = 0; i < len; i++) {
+            if (!writeByte(vaddr++, buf[i]))
+                return false;
+        }
+        left -= len;
+        if (buf[len - 1] == '\n')
+            break;
+    }
+
+    return writeByte(vaddr, 0);
+}
+
+/* The heap grows by whole words */
+bool MIPS32Sim::sysSbrk()
+{
+    int32_t amount = reg[A0_INDEX];
+    uint64_t new_break;
+
+    if (amount < 0) {
+        reportRuntimeError("Runtime exception: sbrk cannot allocate %d bytes\n", amount);
+        return false;
     }
 
+    new_break = (uint64_t)heapBreak + (((uint64_t)amount + 3) & ~(uint64_t)3);
+    if (new_break > M_VIRTUAL_HEAP_END_ADDR) {
+        reportRuntimeError("Runtime exception: sbrk cannot allocate %d bytes\n", amount);
+        return false;
+    }
+
+    reg[V0_INDEX] = heapBreak;
+    heapBreak = new_break;
+
+    return true;
+}
+
+bool MIPS32Sim::sysExit()
+{
+    exitCode = 0;
+    runtimeCtx->stop = true;
+    fflush(output);
+
+    return true;
+}
+
+bool MIPS32Sim::sysPrintChar()
+{
+    fputc(reg[A0_INDEX] & 0xFF, output);
+
+    return true;
+}
+
+bool MIPS32Sim::sysReadChar()
+{
+    unsigned char ch;
+
+    fflush(output);
+    reg[V0_INDEX] = (read(inputFd, &ch, 1) == 1)? ch : 0;
+
+    return true;
+}
+
+bool MIPS32Sim::sysExit2()
+{
+    exitCode = reg[A0_INDEX];
+    runtimeCtx->stop = true;
+    fflush(output);
+
+    return true;
+}
+
+static bool isRuntimeArgument(MArgument *arg)
+{
+    switch (arg->getKind()) {
+        case MARG_PHY_ADDR: return true;
+        case MARG_HIGH_HWORD: return isRuntimeArgument(((MArgHighHalfWord *)arg)->arg);
+        case MARG_LOW_HWORD: return isRuntimeArgument(((MArgLowHalfWord *)arg)->arg);
+        default:
+            return false;
+    }
+}
+
+static bool hasRuntimeArguments(MInstruction *inst)
+{
+    switch (inst->getKind()) {
+        case MINST_1ARG: {
+            MInst_1Arg *i1 = (MInst_1Arg *)inst;
+
+            return isRuntimeArgument(i1->arg1);
+        }
+        case MINST_2ARG: {
+            MInst_2Arg *i2 = (MInst_2Arg *)inst;
+
+            return isRuntimeArgument(i2->arg1) || isRuntimeArgument(i2->arg2);
+        }
+        case MINST_3ARG: {
+            MInst_3Arg *i3 = (MInst_3Arg *)inst;
+
+            return isRuntimeArgument(i3->arg1) || isRuntimeArgument(i3->arg2) || isRuntimeArgument(i3->arg3);
+        }
+        default:
+            return false;
+    }
+}
+
+static inline bool isCommand(MInstruction *inst)
+{
+    int kind = inst->getKind();
+
+    return (kind == MCMD_Show) || (kind == MCMD_Set) || (kind == MCMD_Exec) || (kind == MCMD_Stop)
+           || (kind == MCMD_Map) || (kind == MCMD_Snapshot);
+}
+
+bool MIPS32Sim::decodeInstruction(MInstruction *inst, MDecodedInst &di)
+{
+    int count1, count2, argcount;
+    MIPS32Function *f;
+    uint32_t values[3] = {0, 0, 0};
+
     f = getFunctionByName(inst->name.c_str());
     
     if (f == NULL) {
@@ -600,67 +1296,59 @@ bool MIPS32Sim::execInstruction(MInstruction *inst)
                 f->name, f->argcount, argcount);
         return false;
     }
-    if (!inst->resolveArguments(this, values)) {
+    if (!inst->resolveArguments(this, f, values)) {
         return false;
     }
 
-    int rd; //Index of destination register
-    uint32_t *p0, *p1, *p2; //Maximum 3 registers arguments
-    uint32_t imm; //Immediate argument value
+    di.opcode = f->opcode;
+    di.format = f->format;
+    di.r0 = di.r1 = di.r2 = 0;
+    di.imm = 0;
+    di.line = inst->line;
+    di.inst = inst;
+    di.handler = NULL;
 
-    rd = values[0];
     switch (f->format) {
         case R_FORMAT:
         {
             switch (argcount) {
                 case 3: {
-                    if (isShiftFunction(f->opcode)) {
-                        imm = values[2];
-                        p1 = &(reg[values[1]]);
-                        p0 = &(reg[values[0]]);
-                    } else {
-                        p2 = &(reg[values[2]]);
-                        p1 = &(reg[values[1]]);
-                        p0 = &(reg[values[0]]);
-                    }
+                    di.r0 = values[0];
+                    di.r1 = values[1];
+                    if (isShiftFunction(f->opcode))
+                        di.imm = values[2];
+                    else
+                        di.r2 = values[2];
                     break;
                 }
                 case 2: {
-                    p1 = &(reg[values[1]]);
-                    p0 = &(reg[values[0]]);                    
+                    di.r0 = values[0];
+                    di.r1 = values[1];
                     break;
                 }
                 case 1: {
-                    p0 = &(reg[values[0]]);
+                    di.r0 = values[0];
+                    break;
                 }
             }
             break;
         }
         case I_FORMAT:
-        {            
-            switch (f->argcount) {
-                case 3: {
-                    imm = values[2];
-                    p1 = &(reg[values[1]]);
-                    p0 = &(reg[values[0]]);                      
-                    break;
-                }
-                case 2: {
-                    imm = values[1];
-                    p0 = &(reg[values[0]]);
-                    break;
-                }
-                
-                default:
-                    reportRuntimeError("%d: BUG in machine\n", __LINE__);
-                    return false;
+        {
+            di.r0 = values[0];
+
+            if (argcount == 3) {
+                di.r1 = values[1];
+                di.imm = values[2];
+            } else {
+                //Memory access with an absolute address, the base register is $zero
+                di.imm = values[1];
             }
-            
             break;
         }
         case J_FORMAT:
         {
-            imm = values[0];
+            di.imm = values[0];
             break;
         }
         default:
@@ -668,289 +1356,138 @@ bool MIPS32Sim::execInstruction(MInstruction *inst)
             return false;
     }
 
-    bool write_register = f->opcode != FN_BEQ && 
+    bool write_register = f->argcount != 0 &&
+                          f->opcode != FN_BEQ && 
                           f->opcode != FN_BNE && 
                           f->opcode != FN_SW &&
                           f->opcode != FN_SH &&
                           f->opcode != FN_SB;
     
-    if (rd == 0 && write_register) {
+    if ((f->format != J_FORMAT) && (di.r0 == 0) && write_register) {
         reportRuntimeError("Register $zero cannot be used as target in instruction '%s'\n", f->name);
         return false;
     }
 
+    //Extend the immediate value once, so the run loop can use it as is
     switch (f->opcode) {
-        case FN_ADD:    // add rd, rs, rt ; R Format
-        { 
-            unsigned int result = *p1 + *p2;
-            if (ARITH_OVFL(result, *p1, *p2, 32)) {
-                reportRuntimeError("Aritmethic overflow in 'add' operation\n");
-            } else {
-                *p0 = result;
-            }
-            break;
-        }
-        case FN_SLL: // sll rd,rt,sa ; R Format
-            *p0 = *p1 << imm;
-            break;
-        case FN_ADDU: // addu rd,rs,rt ; R Format
-            *p0 = *p1 + *p2;
-            break;
-        case FN_SRL: // srl rd,rt,sa ; R Format
-            *p0 = *p1 >> imm;
-            break;
-        case FN_AND: // and rd,rs,rt ; R Format
-            *p0 = *p1 & *p2;
-            break;
-        case FN_SRA: // sra rd,rt,sa ; R Format
-            *p0 = ((int32_t)*p1) >> imm;
-            break;            
-        case FN_BREAK: // break  ; R Format
-            break;
-        case FN_SLLV: // sllv rd,rt,rs ; R Format
-            *p0 = *p1 << *p2;
-            break;
-        case FN_DIV: // div rs,rt ; R Format
-            hi_lo = ((int32_t)*p0 / (int32_t)*p1);
-            hi_lo &= 0x00000000FFFFFFFF;
-            hi_lo = (((uint64_t) ((int32_t)*p0 % (int32_t)*p1)) << 32) | hi_lo;
-            break;
-        case FN_SRLV: // srlv rd,rt,rs ; R Format
-            *p0 = *p1 >> *p2;
-            break;
-        case FN_DIVU: // divu rs,rt ; R Format
-            hi_lo = *p0 / *p1;
-            hi_lo &= 0x00000000FFFFFFFF;
-            hi_lo = ((uint64_t)(*p0 % *p1) << 32) | hi_lo;
-            printf("%u\n", (*p0 % *p1)); 
+        case FN_ADDI:
+        case FN_ADDIU:
+        case FN_SLTI:
+            di.imm = (uint32_t)((int16_t)di.imm);
             break;
-        case FN_SRAV: // srav rd,rt,rs ; R Format
-            *p0 = ((int32_t)*p1) >> *p2;
+        case FN_ANDI:
+        case FN_ORI:
+        case FN_XORI:
+            di.imm &= 0xFFFF;
             break;
-        case FN_JALR: // jalr rs ; R Format
-            reg[RA_INDEX] = ctx->pc;
-            if ((*p0 >= M_VIRTUAL_EXTFUNC_START_ADDR) && (*p0 < M_VIRTUAL_GLOBAL_START_ADDR)) {
-                return doNativeCall(*p0);
-            } else {
-                ctx->pc = *p0;
-            }
-            break;
-        case FN_JR: // jr rs ; R Format
-            if ((*p0 >= M_VIRTUAL_EXTFUNC_START_ADDR) && (*p0 < M_VIRTUAL_GLOBAL_START_ADDR)) {
-                reportRuntimeError("Jump to native functions are not valid. Use JALR if you want to call a native function.\n");
-                return false;
-            } else {
-                ctx->pc = *p0;
-            }
-            break;
-        case FN_MFHI: // mfhi rd ; R Format
-            *p0 = (uint32_t)(hi_lo >> 32);
-            break;
-        case FN_SYSCALL: // syscall  ; R Format
-            break;
-        case FN_MFLO: // mflo rd ; R Format
-            *p0 = (uint32_t)(hi_lo & 0xFFFFFFFF);
-            break;
-        case FN_MTHI: // mthi rs ; R Format
-            break;
-        case FN_MTLO: // mtlo rs ; R Format
-            break;
-        case FN_MULT: // mult rs, rt ; R Format
-            hi_lo = (int64_t)( ((int32_t)*p0) * ((int32_t)*p1) );
-            break;
-        case FN_MULTU: // multu rs, rt ; R Format
-            hi_lo = (uint64_t)( (*p0) * (*p1) );
-            break;
-        case FN_NOR: // nor rd,rs,rt ; R Format
-            *p0 = ~(*p1 | *p2);
-            break;
-        case FN_OR: // or rd,rs,rt ; R Format
-            *p0 = *p1 | *p2;
-            break;
-        case FN_SLT: // slt rd,rs,rt ; R Format
-            *p0 = ((int32_t)*p1 < (int32_t)*p2);
-            break;
-        case FN_SLTU: // sltu rd,rs,rt ; R Format
-            *p0 = *p1 < *p2;
-            break;
-        case FN_SUB: // sub rd,rs,rt ; R Format
-            *p0 = (int32_t)*p1 - (int32_t)*p2;
-            break;
-        case FN_SUBU: // subu rd,rs,rt ; R Format
-            *p0 = *p1 - *p2;
-            break;
-        case FN_XOR: // xor rd,rs,rt ; R Format
-            *p0 = *p1 ^ *p2;
-            break;
-        case FN_ADDI: // addi rt,rs,immediate ; I Format
-            *p0 = (int32_t)*p1 + (int32_t)((int16_t)imm);
-            break;
-        case FN_ADDIU: // addiu rt, rs, immediate ; I Format
-            *p0 = *p1 + (uint32_t)((int16_t)imm);
-            break;
-        case FN_ANDI: // andi rt,rs,immediate ; I Format
-            *p0 = *p1 & (imm & 0xFFFF);
-            break;
-        case FN_BEQ: // beq rs, rt, label ; I Format
-            if (*p0 == *p1)
-                ctx->pc = imm;
-            break;
-        case FN_BNE: // bne rs,rt ; I Format
-            if (*p0 != *p1)
-                ctx->pc = imm;
-            break;
-        case FN_BLEZ: // blez rs, label ; I Format
-            if (*((int32_t *)p0) <= 0)
-                ctx->pc = imm;
-            break;
-        case FN_BGEZ: // bgez rs, label ; I Format
-            if (*((int32_t *)p0) >= 0)
-                ctx->pc = imm;            
-            break;
-        case FN_BLTZ: // bltz rs, label ; I Format
-            if (*((int32_t *)p0) < 0)
-                ctx->pc = imm;
-            break;            
-        case FN_BGTZ: // bgtz rs, label ; I Format
-            if (*((int32_t *)p0) > 0)
-                ctx->pc = imm;            
-            break;
-        case FN_SLTI: // slti rt, rs, immediate ; I Format
-            *p0 = (int32_t)*p1 < (int32_t)((int16_t)imm);
-            break;
-        case FN_SLTIU: // slti rt, rs, immediate ; I Format
-            *p0 = (uint32_t)*p1 < (uint32_t)imm;
-            break;
-        case FN_LB:   // lb rt, immediate(rs) ; I Format
-        {
-            unsigned int vaddr = *p1 + imm;
-            uint32_t result;
-            if (!readByte(vaddr, result, true)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            } else {
-                *p0 = result;
-            }
+        case FN_LUI:
+            di.imm = (di.imm & 0xFFFF) << 16;
             break;
-        }
-        case FN_LBU:    // lbu rt, immediate(rs) ; I Format
-        { 
-            unsigned int vaddr = *p1 + imm;
-            uint32_t result;
-            
-            if (!readByte(vaddr, result, false)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            } else {
-                *p0 = result;
-            }
-            break;
-        }
-        case FN_LH: // lh rt, immediate(rs) ; I Format
-        {
-            unsigned int vaddr = *p1 + imm;
-            uint32_t result;
-            if (!readHalfWord(vaddr, result, true)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            } else {
-                *p0 = result;
-            }
-            break;
-        }
-        case FN_ORI: // ori rt,rs,immediate ; I Format
-            *p0 = *p1 | (imm & 0xFFFF);
-            break;
-        case FN_LHU: // lhu rt, immediate(rs) ; I Format
-        {
-            unsigned int vaddr = *p1 + imm;
-            uint32_t result;
-            if (!readHalfWord(vaddr, result, false)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            } else {
-                *p0 = result;
-            }
-            break;
-        }
-        case FN_XORI: // xori rt,rs,immediate ; I Format
-            *p0 = *p1 ^ (imm & 0xFFFF);
-            break;
-        case FN_LUI: // lui rt,immediate ; I Format
-            *p0 = (imm & 0xFFFF) << 16;
-            break;
-        case FN_LW: // lw rt, immediate(rs) ; I Format
-        { 
-            unsigned int vaddr = *p1 + imm;
-            uint32_t result;
-            
-            if (!readWord(vaddr, result)) {
-                reportRuntimeError("Invalid virtual address '%08X', try increasing the physical memory\n", vaddr);
-                return false;
-            } else {
-                *p0 = result;
-            }
-            break;
-        }
-        case FN_LWC1: // lwc1 rt, immediate(rs) ; I Format
-            break;
-        case FN_SB:  // sb rt, immediate(rs) ; I Format
-        { 
-            int32_t vaddr = (int32_t)*p1 + (int32_t)imm;
-            uint8_t value = (uint8_t) (*p0 & 0xFF);
+    }
 
-            if (!writeByte(vaddr, value)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            }
-            break;
-        }
-        case FN_SH: // sh rt, immediate(rs) ; I Format
-        { 
-            int32_t vaddr = (int32_t)*p1 + (int32_t)imm;
-            uint16_t value = (uint16_t) (*p0 & 0xFFFF);
+    return true;
+}
 
-            if (!writeHalfWord(vaddr, value)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            }
-            break;
-        }
-        case FN_SW:
-        { // sw rt, immediate(rs) ; I Format
-            unsigned int vaddr = *p1 + imm;
-            
-            if (!writeWord(vaddr, *p0)) {
-                reportRuntimeError("Invalid virtual address '%08X'\n", vaddr);
-                return false;
-            }
-            break;
+bool MIPS32Sim::decode(vector<MInstruction *> &vinst, vector<MDecodedInst> &code)
+{
+    code.resize(vinst.size());
+
+    for (unsigned i = 0; i < vinst.size(); i++) {
+        MInstruction *inst = vinst[i];
+        MDecodedInst &di = code[i];
+
+        runtimeCtx->line = inst->line;
+
+        if (isCommand(inst) || hasRuntimeArguments(inst)) {
+            di.opcode = isCommand(inst)? FN_COMMAND : FN_GENERIC;
+            di.format = R_FORMAT;
+            di.r0 = di.r1 = di.r2 = 0;
+            di.imm = 0;
+            di.line = inst->line;
+            di.inst = inst;
+            di.handler = NULL;
+        } else if (!decodeInstruction(inst, di)) {
+            return false;
         }
-        case FN_SWC1: // swc1 rt, immediate(rs) ; I Format
-            break;
-        case FN_J: // j label
-            if ((imm >= M_VIRTUAL_EXTFUNC_START_ADDR) && (imm < M_VIRTUAL_GLOBAL_START_ADDR)) {
-                reportRuntimeError("Jump to native functions are not valid. Use JAL if you want to call a native function.\n");
-                return false;
-            } else {
-                ctx->pc = imm;
-            }
-            break;
-        case FN_JAL: // jal label
-            reg[RA_INDEX] = ctx->pc;
-            if ((imm >= M_VIRTUAL_EXTFUNC_START_ADDR) && (imm < M_VIRTUAL_GLOBAL_START_ADDR)) {
-                return doNativeCall(imm);
-            } else {
-                ctx->pc = imm;
-            }
-            break;
-        case FN_MOVE: // move rd, rt
-            *p0 = *p1;
-            break;
     }
 
-    lastResult.setSim(this);
-    lastResult.setRegIndex(rd);
+    return true;
+}
+
+/* The commands and the instructions that aren't decoded check their
+ * accesses, a fault of the flat backend cannot unwind their frames.
+ */
+bool MIPS32Sim::execInstruction(MInstruction *inst)
+{
+    bool old_unchecked = memory.setUnchecked(false);
+    bool result = execTreeInstruction(inst);
+
+    memory.setUnchecked(old_unchecked);
+
+    return result;
+}
+
+bool MIPS32Sim::execTreeInstruction(MInstruction *inst)
+{
+    MRtContext *ctx = runtimeCtx;
+    
+    lastResult.init();
+    
+    if (inst->isA(MCMD_Show)) {
+        MCmd_Show *shCmd = (MCmd_Show *)inst;
+       
+        return shCmd->exec(this);
+    } else if (inst->isA(MCMD_Set)) {
+        MCmd_Set *cmd = (MCmd_Set *)inst;
+       
+        return cmd->exec(this);
+    } else if (inst->isA(MCMD_Exec)) {
+        MCmd_Exec *cmd = (MCmd_Exec *)inst;
+        
+        return cmd->exec(this);
+    } else if (inst->isA(MCMD_Map)) {
+        MCmd_Map *cmd = (MCmd_Map *)inst;
+
+        return cmd->exec(this);
+    } else if (inst->isA(MCMD_Snapshot)) {
+        MCmd_Snapshot *cmd = (MCmd_Snapshot *)inst;
+
+        return cmd->exec(this);
+    } else if (inst->isA(MCMD_Stop)) {
+        ctx->stop = true;
+        return true;
+    }
+
+    MDecodedInst di;
+
+    if (!decodeInstruction(inst, di))
+        return false;
+
+    if (!execDecoded(di))
+        return false;
+
+    if (di.format != J_FORMAT) {
+        lastResult.setSim(this);
+        lastResult.setRegIndex(di.r0);
+    }
+    
+    return true;
+}
+
+bool MIPS32Sim::execDecoded(const MDecodedInst &decoded)
+{
+    MRtContext *ctx = runtimeCtx;
+    const MDecodedInst *di = &decoded;
+    uint32_t *p0 = &reg[di->r0];
+    uint32_t *p1 = &reg[di->r1];
+    uint32_t *p2 = &reg[di->r2];
+    uint32_t imm = di->imm;
+
+    switch (di->opcode) {
+#define MIPS32_OP(op, ...) case op: { __VA_ARGS__ } break;
+#include "mips32_exec.inc"
+#undef MIPS32_OP
+    }
     
     return true;
 }
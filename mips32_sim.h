@@ -10,6 +10,10 @@
 #include "mips32_lexer.h"
 #include "mips32_tree.h"
 #include "adbg.h"
+#include "asim.h"
+#include "prog_cache.h"
+#include "guest_mem.h"
+#include "native_lib.h"
 
 using namespace std;
 
@@ -20,12 +24,29 @@ using namespace std;
 #define I_FORMAT	2
 #define J_FORMAT	3
 
-#define M_GLOBAL_MEM_WORD_COUNT 256
-#define M_STACK_SIZE_WORDS      256
+#define M_GLOBAL_MEM_WORD_COUNT (256 * 1024)
+#define M_HEAP_SIZE_WORDS       (64 * 1024 * 1024)
+#define M_STACK_SIZE_WORDS      (2 * 1024 * 1024)
 #define M_VIRTUAL_GLOBAL_START_ADDR	0x10000000
-#define M_VIRTUAL_GLOBAL_END_ADDR	(M_VIRTUAL_GLOBAL_START_ADDR + M_GLOBAL_MEM_WORD_COUNT - 1)
+#define M_VIRTUAL_GLOBAL_END_ADDR	(M_VIRTUAL_GLOBAL_START_ADDR + M_GLOBAL_MEM_WORD_COUNT * 4 - 1)
+#define M_VIRTUAL_HEAP_START_ADDR	(M_VIRTUAL_GLOBAL_END_ADDR + 1)
 #define M_VIRTUAL_STACK_END_ADDR	0x7FFFEFFC
 #define M_VIRTUAL_EXTFUNC_START_ADDR    0x01400000
+#define M_VIRTUAL_DATA_START_ADDR       0x10010000  //Data section, inside the globals
+#define M_DATA_MAX_SIZE                 (M_VIRTUAL_GLOBAL_END_ADDR + 1 - M_VIRTUAL_DATA_START_ADDR)
+#define M_VIRTUAL_HEAP_END_ADDR         (M_VIRTUAL_HEAP_START_ADDR + M_HEAP_SIZE_WORDS * 4)
+
+/* SPIM system call services, selected by $v0 */
+#define MSYS_PRINT_INT      1
+#define MSYS_PRINT_STRING   4
+#define MSYS_READ_INT       5
+#define MSYS_READ_STRING    8
+#define MSYS_SBRK           9
+#define MSYS_EXIT           10
+#define MSYS_PRINT_CHAR     11
+#define MSYS_READ_CHAR      12
+#define MSYS_EXIT2          17
+#define MSYS_COUNT          18
 
 #define A_REGISTER	1
 #define A_IMMEDIATE	2
@@ -63,6 +84,10 @@ using namespace std;
 //MIPS32 Pseudo functions
 #define FN_MOVE MKOPCODE2(0xFF, 0x01)
 
+//Simulator pseudo functions used by decoded instructions
+#define FN_COMMAND MKOPCODE2(0xFF, 0x3E) //Simulator command (#show, #set, ...)
+#define FN_GENERIC MKOPCODE2(0xFF, 0x3F) //Instruction with arguments evaluated at runtime (#paddr)
+
 //MIPS 32 Immediate Format functions
 #define FN_ADDI MKOPCODE1(0x08)
 #define FN_BLTZ MKOPCODE2(0x01, 0x0)
@@ -153,6 +178,37 @@ struct MIPS32Instruction;
 class MNode;
 class MInstruction;
 
+/* Instruction decoded once at load time, so the run loop doesn't have to
+ * look up the function by name or walk the argument nodes on every step.
+ * r0, r1 and r2 are the register indexes of the first, second and third
+ * register arguments.  imm is already sign or zero extended as required
+ * by the function.
+ */
+struct MDecodedInst
+{
+    uint16_t opcode;    // FN_* value
+    uint8_t format;     // R_FORMAT, I_FORMAT or J_FORMAT
+    uint8_t r0, r1, r2;
+    uint32_t imm;
+    int line;           // Source line
+    MInstruction *inst; // Instruction node, used by commands and FN_GENERIC
+    const void *handler; // Label of the handler, used by the threaded dispatch
+};
+
+/* Decoded instruction as stored in the program cache.  The instructions
+ * that need their node (commands, generic instructions and references
+ * to native functions) are parsed again from their source line.
+ */
+struct MCachedInst
+{
+    uint16_t opcode;
+    uint8_t format;
+    uint8_t r0, r1, r2;
+    uint8_t reparse;
+    uint32_t imm;
+    int32_t line;
+};
+
 struct MRtContext
 {
     unsigned pc;    // Program counter	
@@ -163,8 +219,26 @@ struct MRtContext
 enum MRefType { MRT_Reg, MRT_Mem, MRT_Const, MRT_None };
 
 class MIPS32Debugger;
+class MIPS32Jit;
+class MIPS32LaneSim;
 class MIPS32Sim;
 
+/* Native function called through its guest address, the address selects
+ * the slot.  arity is the number of argument words copied to the host stack,
+ * $a0..$a3 and then the words at the top of the guest stack.
+ */
+struct MNativeSlot {
+    HFUNC hfunc;
+    int arity;
+};
+
+/* Registers saved with a snapshot of the memory */
+struct MRegSnapshot {
+    uint32_t reg[32];
+    uint64_t hi_lo;
+    uint32_t heapBreak;
+};
+
 class MReference 
 {
 public:
@@ -228,20 +302,49 @@ protected:
     } u;
 };
 
-class MIPS32Sim 
+class MIPS32Sim: public AsmSimulator
 {
     friend class MIPS32Debugger;
+    friend class MIPS32Jit;
+    friend class MIPS32LaneSim;
 private:
-    bool loadFile(istream *in, vector<MInstruction *> &instList, map<string, uint32_t> &jmpTbl);
     bool resolveLabels(list<MInstruction *> &linst, vector<MInstruction *> &vinst, map<string, uint32_t> &jmpTbl);
+    void markJumpTargets(vector<MInstruction *> &vinst, MParserContext &ctx);
+    bool decode(vector<MInstruction *> &vinst, vector<MDecodedInst> &code);
+    bool decodeInstruction(MInstruction *inst, MDecodedInst &di);
+    bool loadSource(istream *in, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap);
+    bool loadCached(ProgramCache &cache, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap);
+    void saveCached(ProgramCache &cache, vector<MDecodedInst> &code, map<string, uint32_t> &labelMap);
+    MInstruction *parseLine(const string &text, int line, map<string, uint32_t> &labelMap);
+    bool loadData();
     bool doNativeCall(uint32_t funcAddr);
+    bool execTreeInstruction(MInstruction *inst);
+    typedef bool (MIPS32Sim::*SyscallFn)();
+    static const SyscallFn syscallTable[MSYS_COUNT];
+
+    bool doSyscall();
+    int readInputLine(char *buf, int size);
+    bool sysPrintInt();
+    bool sysPrintString();
+    bool sysReadInt();
+    bool sysReadString();
+    bool sysSbrk();
+    bool sysExit();
+    bool sysPrintChar();
+    bool sysReadChar();
+    bool sysExit2();
+    bool runSwitch(vector<MDecodedInst> &code, const MDecodedInst *&last);
+    bool runThreaded(vector<MDecodedInst> &code, const MDecodedInst *&last);
+    bool runJit(vector<MDecodedInst> &code, const MDecodedInst *&last);
 public:
     MIPS32Sim();
+    ~MIPS32Sim();
     
     static const char *getRegisterName(int regIndex);
 
     AsmDebugger *getDebugger();
-    bool translateVirtualToPhysical(uint32_t vaddr, uint32_t &paddr);
+    GuestMemory *getMemory() { return &memory; }
+    uint32_t *getWordPtr(uint32_t vaddr, bool write = false);
     bool readWord(unsigned int vaddr, uint32_t &result);
     bool readHalfWord(unsigned int vaddr, uint32_t &result, bool sign_extend);
     bool readByte(unsigned int vaddr, uint32_t &result, bool sign_extend);
@@ -250,18 +353,34 @@ public:
     bool writeByte(unsigned int vaddr, uint8_t value);
     bool getRegisterValue(string name, uint32_t &value);
     bool setRegisterValue(string name, uint32_t value);
-    int getSourceLine() { return runtimeCtx->line; }
+    int getSourceLine() { return (runtimeCtx != NULL)? runtimeCtx->line : 0; }
     bool exec(istream *in);
+    bool loadFile(istream *in, vector<MDecodedInst> &code, map<string, uint32_t> &jmpTbl);
+    bool run(vector<MDecodedInst> &code, map<string, uint32_t> &jmpTbl);
     bool debug(string asm_file);
     bool execInstruction(MInstruction *inst);
+    bool execDecoded(const MDecodedInst &decoded);
     MReference getLastResult() { return lastResult; }
     bool getLabel(string label, uint32_t &target);
     bool parseFile(istream *in, MParserContext &ctx);
+    void setThreadedDispatch(bool enable) { threadedDispatch = enable; }
+    void setCacheDirectory(const string &dir) { cacheDir = dir; }
+    bool setJit(bool enable);
+    uint64_t getInstructionCount() { return instCount; }
+    void setMaxSteps(uint64_t steps);
+    bool stepLimitReached() { return stepLimitHit; }
+    int getExitCode() { return exitCode; }
+    uint64_t getHiLo() { return hi_lo; }
+    void setHiLo(uint64_t value) { hi_lo = value; }
+    void setInputFd(int fd) { inputFd = fd; }
+    void saveSnapshot(const string &name);
+    bool restoreSnapshot(const string &name);
+    bool deleteSnapshot(const string &name);
+    bool getNativeFunction(const string &lib_name, const string &func_name, uint32_t &addr);
     
     uint32_t reg[32]; //MIPS32 uses 32 registers, 32 bits each one
-    uint32_t mem[M_GLOBAL_MEM_WORD_COUNT + M_STACK_SIZE_WORDS]; //Words of physical memory
+    GuestMemory memory; //Words are stored in host byte order
     uint64_t hi_lo; //Low and High registers
-    uint32_t stack_start_address;
 
 public:
     MRtContext *runtimeCtx;
@@ -269,6 +388,22 @@ public:
 private:
     map<string, uint32_t> *jumpTable;
     MIPS32Debugger *dbg;
+    bool threadedDispatch;
+    uint64_t instCount; //Instructions executed by run()
+    MIPS32Jit *jit;
+    uint32_t jitLastPc; //Last instruction executed by a compiled block
+    string cacheDir;    //Program cache, disabled when empty
+    vector<uint8_t> dataImage;  //Data section of the last program loaded, copied on each run
+    map<string, MRegSnapshot> snapshotRegs;
+    NativeLibCache nativeLibs;  //Libraries are closed with the simulator
+    map<string, uint32_t> nativeFuncAddrs;  //Guest addresses of the native functions, by "@lib.func"
+    vector<MNativeSlot> nativeSlots;        //By (address - M_VIRTUAL_EXTFUNC_START_ADDR) / 4
+    uint32_t heapBreak;     //End of the memory given by sbrk
+    int exitCode;           //Set by the exit system calls
+    int inputFd;            //Read by the input system calls
+    uint64_t maxSteps;      //Instructions allowed in each run, 0 for no limit
+    uint64_t stepLimit;     //Value of instCount that stops the current run
+    bool stepLimitHit;      //The last run was stopped by the limit
 };
 
 enum MIPS32ArgumentType { M32ARG_Register, M32ARG_Immediate };
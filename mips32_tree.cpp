@@ -7,11 +7,6 @@
 
 using namespace std;
 
-MemPool *mpool;
-
-map<string, uint32_t> externalFunctions;
-map<uint32_t, void *> externalFuncHandles;
-uint32_t externalFuncAddr = 0x01400000;
 
 static inline int isShiftInstruction(int opcode) {
     return ((opcode==FN_SLL) || (opcode==FN_SRL) || (opcode==FN_SRA));
@@ -120,7 +115,8 @@ bool MAddrExprConstant::eval(MIPS32Sim *sim, uint32_t &value) {
 }
 
 bool MAddrExprIdentifier::eval(MIPS32Sim *sim, uint32_t &value) { 
-    return sim->getLabel(ident, value);
+    value = target;
+    return true;
 }
 
 bool MAddrExprRegister::eval(MIPS32Sim *sim, uint32_t &value) {
@@ -215,13 +211,6 @@ bool MArgMemRef::getReference(MIPS32Sim *sim, MReference &ref) {
 }
 
 bool MArgIdentifier::getReference(MIPS32Sim *sim, MReference &ref) {
-    uint32_t target;
-
-    if (!sim->getLabel(name, target)) {
-        reportRuntimeError("Invalid label name '%s'.", name.c_str());
-        return false;
-    }
-
     ref.setSim(sim);
     ref.setConstValue(target);
 
@@ -272,49 +261,35 @@ bool MArgLowHalfWord::getReference(MIPS32Sim *sim, MReference &ref) {
 }
 
 bool MArgPhyAddress::getReference(MIPS32Sim *sim, MReference &ref) {
-    uint32_t vaddr, paddr;
+#if GMEM_NATIVE_CALLS
+    uint32_t vaddr, *pword;
 
     if (!expr->eval(sim, vaddr))
         return false;
 
-    if (!sim->translateVirtualToPhysical(vaddr, paddr))
+    //The native functions can write through the address
+    if ((pword = sim->getWordPtr(vaddr, true)) == NULL)
         return false;
 
     ref.setSim(sim);
-    ref.setConstValue((uint32_t)&sim->mem[paddr / 4]);
+    ref.setConstValue((uint32_t)pword);
     
     return true;
+#else
+    reportRuntimeError(GMEM_NO_NATIVE_CALLS_MSG);
+    return false;
+#endif
 }
 
 bool MArgExternalFuntionId::getReference(MIPS32Sim *sim, MReference &ref)
 {
-    string funcName = toString();
-    map<string, uint32_t>::iterator it = externalFunctions.find(funcName);
-    
+    uint32_t addr;
+
+    if (!sim->getNativeFunction(name1, name2, addr))
+        return false;
+
     ref.setSim(sim);
-    
-    if (it != externalFunctions.end()) {
-        ref.setConstValue(it->second);
-    } else {
-        string libFullName = getLibFullName(name1);
-        HLIB lhandle = openLibrary(libFullName.c_str());
-        
-        if (lhandle == NULL) {
-            reportRuntimeError("Cannot open library '%s'.\n", libFullName.c_str());
-            return false;
-        }
-                
-        HFUNC hfunc = getFunctionAddr(lhandle, name2.c_str());
-        
-        if (hfunc == NULL) {
-            reportRuntimeError("Function '%s' doesn't exist in library '%s'.\n", name2.c_str(), libFullName.c_str());
-            return false;
-        }
-        ref.setConstValue(externalFuncAddr);
-        externalFunctions[funcName] = externalFuncAddr;
-        externalFuncHandles[externalFuncAddr] = hfunc;
-        externalFuncAddr += 4;
-    }
+    ref.setConstValue(addr);
 
     return true;
 }
@@ -322,17 +297,18 @@ bool MArgExternalFuntionId::getReference(MIPS32Sim *sim, MReference &ref)
 /*** MNode operator new and delete overloading ***/
 void *MNode::operator new(size_t sz)
 {
-    return mpool->memAlloc(sz);
+    return node_pool->memAlloc(sz);
 }
 
 void MNode::operator delete(void *ptrb)
 {
-    mpool->memFree(ptrb);
+    node_pool->memFree(ptrb);
 }
 
 bool MCmd_Show::exec(MIPS32Sim *sim)
 {
     MReference aref;
+    FILE *out = sim->getOutput();
     
     sim->lastResult.init();
 
@@ -346,9 +322,9 @@ bool MCmd_Show::exec(MIPS32Sim *sim)
             if (!aref.deref(value))
                 return false;
 
-            cout << ((MArgRegister *)arg)->regName << " = ";
-            printNumber(value, 32, dataFormat);
-            cout << endl;
+            fprintf(out, "%s = ", ((MArgRegister *)arg)->regName.c_str());
+            printNumber(out, value, 32, dataFormat);
+            fputc('\n', out);
 
             return true;
         }
@@ -376,8 +352,8 @@ bool MCmd_Show::exec(MIPS32Sim *sim)
                         if (!sim->readByte(address, value, 0))
                             return false;
 
-                        printf("byte (0x%X) ", address);
-                        printNumber(value, 8, dataFormat);
+                        fprintf(out, "byte (0x%X) ", address);
+                        printNumber(out, value, 8, dataFormat);
 
                         address++;
 
@@ -387,8 +363,8 @@ bool MCmd_Show::exec(MIPS32Sim *sim)
                         if (!sim->readHalfWord(address, value, false))
                             return false;
 
-                        printf("half word (0x%X) ", address);
-                        printNumber(value, 16, dataFormat);
+                        fprintf(out, "half word (0x%X) ", address);
+                        printNumber(out, value, 16, dataFormat);
 
                         address += 2;
 
@@ -398,8 +374,8 @@ bool MCmd_Show::exec(MIPS32Sim *sim)
                         if (!sim->readWord(address, value))
                             return false;
 
-                        printf("word (0x%X) ", address);
-                        printNumber(value, 32, dataFormat);
+                        fprintf(out, "word (0x%X) ", address);
+                        printNumber(out, value, 32, dataFormat);
 
                         address += 4;
 
@@ -407,27 +383,27 @@ bool MCmd_Show::exec(MIPS32Sim *sim)
                     }
                 }
 
-                cout << endl;
+                fputc('\n', out);
             } 
 
             return true;
         }
         case MARG_IMMEDIATE: {
-            printNumber(aref.getConstValue(), 32, dataFormat);
-            cout << endl;
+            printNumber(out, aref.getConstValue(), 32, dataFormat);
+            fputc('\n', out);
             break;
         }
         case MARG_IDENTIFIER: {
             string ident = ((MArgIdentifier *)arg)->name;
         
-            cout << "Label '" << ident << "' points to 0x" << hex << aref.getConstValue() << dec << endl;
+            fprintf(out, "Label '%s' points to 0x%x\n", ident.c_str(), aref.getConstValue());
             break;
         }
         default: {
             if (aref.isConst()) {
-                cout << arg->toString() << " = ";
-                printNumber(aref.getConstValue(), 32, dataFormat);
-                cout << endl;
+                fprintf(out, "%s = ", arg->toString().c_str());
+                printNumber(out, aref.getConstValue(), 32, dataFormat);
+                fputc('\n', out);
             } else {
                 reportRuntimeError("Invalid argument '%s' for #show command.\n", arg->toString().c_str());
                 return false;
@@ -543,9 +519,32 @@ bool MCmd_Exec::exec(MIPS32Sim *sim)
     return result;
 }
 
-bool MInst_1Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
+bool MCmd_Map::exec(MIPS32Sim *sim)
+{
+    int error = sim->getMemory()->mapFile(file_path.c_str(), address, readOnly);
+
+    if (error != GMEM_MAP_OK) {
+        reportRuntimeError(GuestMemory::mapErrorMessage(error), file_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool MCmd_Snapshot::exec(MIPS32Sim *sim)
+{
+    if (save)
+        sim->saveSnapshot(snapshot);
+    else if (!sim->restoreSnapshot(snapshot)) {
+        reportRuntimeError("Snapshot '%s' doesn't exist\n", snapshot.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool MInst_1Arg::resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[])
 {
-    MIPS32Function *f = getFunctionByName(name.c_str());
     MReference a_ref;
     
     if (!arg1->getReference(sim, a_ref))
@@ -574,9 +573,8 @@ bool MInst_1Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
     return true;
 }
 
-bool MInst_2Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
+bool MInst_2Arg::resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[])
 {
-    MIPS32Function *f = getFunctionByName(name.c_str());
     MReference a_ref1, a_ref2;
     
     if (!arg1->getReference(sim, a_ref1))
@@ -609,7 +607,11 @@ bool MInst_2Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
                 return false;
             }
             values[0] = a_ref1.getRegIndex();
-            values[1] = a_ref2.getConstValue() & 0x0000FFFF;
+            values[1] = a_ref2.getConstValue();
+
+            //A data label used as a memory operand keeps its whole address
+            if (!f->is_mem_access || !arg2->isA(MARG_IDENTIFIER))
+                values[1] &= 0x0000FFFF;
             break;
         }
     }
@@ -617,9 +619,8 @@ bool MInst_2Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
     return true;
 }
 
-bool MInst_3Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[]) 
+bool MInst_3Arg::resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[])
 {
-    MIPS32Function *f = getFunctionByName(name.c_str());
     MReference a_ref1, a_ref2, a_ref3;
     
     if (!arg1->getReference(sim, a_ref1))
@@ -678,7 +679,10 @@ bool MInst_3Arg::resolveArguments(MIPS32Sim *sim, uint32_t values[])
             }
             values[0] = a_ref1.getRegIndex();
             values[1] = a_ref2.getRegIndex();
-            values[2] = a_ref3.getConstValue() & 0x0000ffff;           
+            values[2] = a_ref3.getConstValue();
+
+            if (!f->is_mem_access || !arg3->isA(MARG_IDENTIFIER))
+                values[2] &= 0x0000ffff;
             
             break;
         }
@@ -41,10 +41,13 @@ void reportRuntimeError(const char *format, ...);
 #define MCMD_Set         201
 #define MCMD_Exec        202
 #define MCMD_Stop        203
+#define MCMD_Map         204
+#define MCMD_Snapshot    205
 #define MINST_1ARG       300
 #define MINST_2ARG       301
 #define MINST_3ARG       302
 #define MINST_TAGGED     303
+#define MINST_0ARG       304
 
 /* Address Expression kinds */
 #define MADDR_EXPR             400
@@ -56,6 +59,7 @@ void reportRuntimeError(const char *format, ...);
 class MIPS32Sim;
 class MReference;
 class MArgument;
+struct MIPS32Function;
 
 enum NumberBaseFormat { 
     NBF_SignedDecimal,
@@ -113,6 +117,7 @@ class MAddrExprIdentifier: public MAddrExpr {
 public:
     MAddrExprIdentifier(string ident) {
         this->ident = ident;
+        this->target = 0;
     }
     
     int getKind() { return MADDR_EXPR_IDENT; }
@@ -120,6 +125,7 @@ public:
     string toString();
     
     string ident;
+    uint32_t target; //Bound at load time
 };
 
 class MAddrExprRegister: public MAddrExpr {
@@ -204,6 +210,7 @@ class MArgIdentifier: public MArgument
 public:
     MArgIdentifier(string name) {
         this->name = name;
+        this->target = 0;
     }
 
     int getKind() { return MARG_IDENTIFIER; }
@@ -212,6 +219,7 @@ public:
     
 public:
     string name;
+    uint32_t target; //Instruction index or data address, bound at load time
 };
 
 class MArgConstant: public MArgument
@@ -327,7 +335,7 @@ protected:
     
 public:
     virtual int getArgumentCount() = 0;
-    virtual bool resolveArguments(MIPS32Sim *sim, uint32_t values[]) { return false; }
+    virtual bool resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[]) { return false; }
 
     string name;
 };
@@ -387,6 +395,46 @@ public:
     string file_path;
 };
 
+class MCmd_Map: public MInstruction {
+public:
+    MCmd_Map(string name, string file_path, uint32_t address, bool readOnly): MInstruction() {
+        this->name = name;
+        this->file_path = file_path;
+        this->address = address;
+        this->readOnly = readOnly;
+    }
+
+    string toString() { return "#map"; }
+    int getKind() { return MCMD_Map; }
+    int getArgumentCount() { return 2; }
+
+    bool exec(MIPS32Sim *sim);
+
+public:
+    string file_path;
+    uint32_t address;
+    bool readOnly;
+};
+
+class MCmd_Snapshot: public MInstruction {
+public:
+    MCmd_Snapshot(string name, bool save, string snapshot): MInstruction() {
+        this->name = name;
+        this->save = save;
+        this->snapshot = snapshot;
+    }
+
+    string toString() { return "#snapshot"; }
+    int getKind() { return MCMD_Snapshot; }
+    int getArgumentCount() { return 2; }
+
+    bool exec(MIPS32Sim *sim);
+
+public:
+    bool save;      //False to restore
+    string snapshot;
+};
+
 class MCmd_Stop: public MInstruction {
 public:
     MCmd_Stop() {}
@@ -415,6 +463,18 @@ public:
     MInstruction *inst;
 };
 
+class MInst_0Arg: public MInstruction {
+public:
+    MInst_0Arg(string name): MInstruction() {
+        this->name = name;
+    }
+
+    string toString() { return name; }
+    int getKind() { return MINST_0ARG; }
+    int getArgumentCount() { return 0; }
+    bool resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[]) { return true; }
+};
+
 class MInst_1Arg: public MInstruction {
 public:
     MInst_1Arg(string name, MArgument *arg): MInstruction() {
@@ -425,7 +485,7 @@ public:
     string toString() { return name; }
     int getKind() { return MINST_1ARG; }
     int getArgumentCount() { return 1; }
-    bool resolveArguments(MIPS32Sim *sim, uint32_t values[]);
+    bool resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[]);
     
 public:
     MArgument *arg1;
@@ -442,7 +502,7 @@ public:
     string toString() { return name; }
     int getKind() { return MINST_2ARG; }
     int getArgumentCount() { return 2; }
-    bool resolveArguments(MIPS32Sim *sim, uint32_t values[]);
+    bool resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[]);
     
 public:
     MArgument *arg1;
@@ -461,7 +521,7 @@ public:
     string toString() { return name; }
     int getKind() { return MINST_3ARG; }
     int getArgumentCount() { return 3; }
-    bool resolveArguments(MIPS32Sim *sim, uint32_t values[]);
+    bool resolveArguments(MIPS32Sim *sim, MIPS32Function *f, uint32_t values[]);
     
 public:
     MArgument *arg1;
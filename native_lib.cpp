@@ -50,3 +50,82 @@ string getLibFullName(string lib_name)
 }
 
 #endif
+
+struct NativeArity {
+    const char *name;
+    int arity;
+};
+
+/* Argument words of common libc functions with a fixed number of
+ * arguments, the calls to them don't need to copy the whole frame.
+ */
+static NativeArity nativeArities[] = {
+    {"abs", 1}, {"labs", 1}, {"atoi", 1}, {"atol", 1},
+    {"rand", 0}, {"srand", 1}, {"time", 1}, {"getpid", 0},
+    {"malloc", 1}, {"calloc", 2}, {"realloc", 2}, {"free", 1},
+    {"putchar", 1}, {"getchar", 0}, {"puts", 1}, {"fflush", 1},
+    {"strlen", 1}, {"strcpy", 2}, {"strncpy", 3}, {"strcat", 2},
+    {"strcmp", 2}, {"strncmp", 3}, {"strchr", 2}, {"strdup", 1},
+    {"memcpy", 3}, {"memmove", 3}, {"memset", 3}, {"memcmp", 3},
+    {"toupper", 1}, {"tolower", 1}, {"isdigit", 1}, {"isalpha", 1},
+    {"exit", 1},
+};
+
+/* Returns -1 if the arity is not known, like the variadic functions.  The
+ * table is only for libc, a function of another library may have the same
+ * name with other arguments.
+ */
+int getNativeArity(const string &lib_name, const string &func_name)
+{
+    int count = sizeof(nativeArities) / sizeof(nativeArities[0]);
+
+    if (lib_name != "libc")
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (func_name == nativeArities[i].name)
+            return nativeArities[i].arity;
+    }
+
+    return -1;
+}
+
+NativeLibCache::~NativeLibCache()
+{
+    map<string, HLIB>::iterator it;
+
+    for (it = libs.begin(); it != libs.end(); it++)
+        closeLibrary(it->second);
+}
+
+int NativeLibCache::resolve(const string &lib_name, const string &func_name, HFUNC &hfunc)
+{
+    string key = lib_name + "." + func_name;
+    map<string, HFUNC>::iterator fit = funcs.find(key);
+
+    if (fit != funcs.end()) {
+        hfunc = fit->second;
+        return NLIB_OK;
+    }
+
+    map<string, HLIB>::iterator lit = libs.find(lib_name);
+    HLIB lhandle;
+
+    if (lit != libs.end())
+        lhandle = lit->second;
+    else {
+        lhandle = openLibrary(getLibFullName(lib_name).c_str());
+        if (lhandle == NULL)
+            return NLIB_CANNOT_OPEN;
+
+        libs[lib_name] = lhandle;
+    }
+
+    hfunc = getFunctionAddr(lhandle, func_name.c_str());
+    if (hfunc == NULL)
+        return NLIB_NO_FUNCTION;
+
+    funcs[key] = hfunc;
+
+    return NLIB_OK;
+}
@@ -8,6 +8,7 @@
 #ifndef ELIB_H
 #define ELIB_H
 #include <string>
+#include <map>
 
 using namespace std;
 
@@ -27,6 +28,29 @@ HLIB openLibrary(const char *lib_name);
 HFUNC getFunctionAddr(HLIB lhandle, const char *func_name);
 void closeLibrary(HLIB lhandle);
 string getLibFullName(string lib_name);
+int getNativeArity(const string &lib_name, const string &func_name);
+
+/* Results of NativeLibCache::resolve */
+#define NLIB_OK             0
+#define NLIB_CANNOT_OPEN    1
+#define NLIB_NO_FUNCTION    2
+
+/* Libraries and functions used by the native calls of a simulator.  Each
+ * library is opened once and stays open until the cache is destroyed, each
+ * function is looked up once.
+ */
+class NativeLibCache
+{
+public:
+    NativeLibCache() {}
+    ~NativeLibCache();
+
+    int resolve(const string &lib_name, const string &func_name, HFUNC &hfunc);
+
+private:
+    map<string, HLIB> libs;     //By short name
+    map<string, HFUNC> funcs;   //By "lib.func"
+};
 
 #endif /* ELIB_H */
 
@@ -1,7 +1,18 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+#endif
 #include "mempool.h"
 #include "parser_common.h"
 
-MemPool *tk_pool;
+#define SCAN_CHUNK_SIZE (64 * 1024)
+#define KWTABLE_MAX_DISP    1024    //Displacements tried for a bucket
+#define KWTABLE_MAX_SEEDS   64      //Seeds tried before growing the table
 
 void *TokenInfo::operator new(size_t sz)
 {
@@ -11,4 +22,125 @@ void *TokenInfo::operator new(size_t sz)
 void TokenInfo::operator delete(void *ptrb)
 {
     tk_pool->memFree(ptrb);
-}
\ No newline at end of file
+}
+
+ScanBuffer::ScanBuffer(istream *in)
+{
+    streambuf *sb = in->rdbuf();
+    char chunk[SCAN_CHUNK_SIZE];
+    streamsize count;
+
+    while ((count = sb->sgetn(chunk, SCAN_CHUNK_SIZE)) > 0)
+        text.append(chunk, count);
+
+    in->setstate(ios::eofbit);
+    cur = text.c_str();
+    end = cur + text.length();
+}
+
+/* Numeric lexemes are converted from a NUL terminated copy, so the
+ * conversion stops at the end of the token.
+ */
+uint32_t lexemeToInt(const char *text, uint32_t length, int base)
+{
+    char str[MAX_TOKEN_LENGTH + 1];
+
+    if (length > MAX_TOKEN_LENGTH)
+        length = MAX_TOKEN_LENGTH;
+
+    memcpy(str, text, length);
+    str[length] = '\0';
+
+    return (base == 10)? atol(str) : strtoul(str, NULL, base);
+}
+
+void KeywordTable::add(const char *name, int value)
+{
+    uint32_t length = strlen(name);
+
+    //The first entry wins, like in a linear search
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i].length == length && compare(keys[i].name, name, length))
+            return;
+    }
+
+    Slot key = { name, length, value };
+    keys.push_back(key);
+}
+
+bool KeywordTable::compare(const char *name, const char *text, uint32_t length)
+{
+    if (ignoreCase)
+        return strncasecmp(name, text, length) == 0;
+    else
+        return strncmp(name, text, length) == 0;
+}
+
+void KeywordTable::build()
+{
+    uint32_t slot_count = 2;
+
+    while (slot_count < 2 * keys.size())
+        slot_count <<= 1;
+
+    while (1) {
+        for (seed = 0; seed < KWTABLE_MAX_SEEDS; seed++) {
+            slotMask = slot_count - 1;
+            bucketMask = (slot_count / 2) - 1;
+            if (place(slot_count))
+                return;
+        }
+        slot_count <<= 1;
+    }
+}
+
+/* Tries to find a displacement for every bucket with the current seed,
+ * the biggest buckets are placed first.
+ */
+bool KeywordTable::place(uint32_t slot_count)
+{
+    vector< vector<int> > buckets(bucketMask + 1);
+    vector< pair<size_t, uint32_t> > order;
+    Slot empty = { NULL, 0, 0 };
+
+    slots.assign(slot_count, empty);
+    disp.assign(bucketMask + 1, 0);
+
+    for (size_t i = 0; i < keys.size(); i++)
+        buckets[hash(keys[i].name, keys[i].length, seed) & bucketMask].push_back(i);
+
+    for (uint32_t b = 0; b <= bucketMask; b++) {
+        if (!buckets[b].empty())
+            order.push_back(make_pair(buckets[b].size(), b));
+    }
+    sort(order.rbegin(), order.rend());
+
+    for (size_t i = 0; i < order.size(); i++) {
+        vector<int> &bucket = buckets[order[i].second];
+        vector<uint32_t> pos(bucket.size());
+        uint32_t d;
+
+        for (d = 0; d < KWTABLE_MAX_DISP; d++) {
+            bool ok = true;
+
+            for (size_t k = 0; k < bucket.size() && ok; k++) {
+                uint32_t h = hash(keys[bucket[k]].name, keys[bucket[k]].length, seed);
+
+                pos[k] = (h + d * ((h >> 16) | 1)) & slotMask;
+                ok = (slots[pos[k]].name == NULL);
+                for (size_t j = 0; j < k && ok; j++)
+                    ok = (pos[j] != pos[k]);
+            }
+            if (ok)
+                break;
+        }
+        if (d == KWTABLE_MAX_DISP)
+            return false;
+
+        disp[order[i].second] = d;
+        for (size_t k = 0; k < bucket.size(); k++)
+            slots[pos[k]] = keys[bucket[k]];
+    }
+
+    return true;
+}
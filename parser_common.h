@@ -9,20 +9,28 @@
 #define PARSER_COMMON_H
 
 #include <stdint.h>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <iostream>
 #include "mempool.h"
+#include "asim.h"
 
 using namespace std;
 
-class MemPool;
-
-extern MemPool *tk_pool;
+void reportError(const char *format, ...);
 
 #define MAX_TOKEN_LENGTH    256
+#define MAX_DATA_ALIGN_BITS 12  //.align up to a page
 
+/* The lexeme is a slice of the lexer buffer, it's not NUL terminated */
 struct TokenInfo {
-    string tokenLexeme;
+    const char *text;
+    uint32_t length;
     uint32_t intValue;
     int line;
 
@@ -30,15 +38,119 @@ struct TokenInfo {
     static void operator delete(void* ptrb);
 
     TokenInfo() {
-	tokenLexeme = "";
-	intValue = 0;
+        text = "";
+        length = 0;
+        intValue = 0;
         line = 0;
     }
 
-    void set(string str, int line) { 
-        this->tokenLexeme = str; 
+    void set(const char *text, uint32_t length, int line) { 
+        this->text = text;
+        this->length = length;
         this->line = line; 
     }
+
+    string lexeme() { return string(text, length); }
+};
+
+/* Source text read at once, the lexers scan it in place */
+class ScanBuffer
+{
+public:
+    ScanBuffer(istream *in);
+
+    int nextChar() { return (cur < end)? (unsigned char)*cur++ : EOF; }
+    void ungetChar(int c) { if (c != EOF) cur--; }
+    const char *position() { return cur; }
+    void rewind(const char *pos) { cur = pos; }
+
+private:
+    string text;
+    const char *cur;
+    const char *end;
+};
+
+uint32_t lexemeToInt(const char *text, uint32_t length, int base);
+
+/* Perfect hash of the keywords, built once when the lexer module is
+ * initialized.  A first hash picks a bucket, and the displacement of the
+ * bucket sends each of its keys to its own slot, so a lookup costs one
+ * hash and one string comparison.
+ */
+class KeywordTable
+{
+public:
+    KeywordTable(int notFound, bool ignoreCase) {
+        this->notFound = notFound;
+        this->ignoreCase = ignoreCase;
+        seed = 0;
+        bucketMask = slotMask = 0;
+    }
+
+    template <typename T>
+    KeywordTable(T kw[], int count, int notFound, bool ignoreCase = true) {
+        this->notFound = notFound;
+        this->ignoreCase = ignoreCase;
+
+        for (int i = 0; i < count; i++)
+            add(kw[i].name, kw[i].tokenKind);
+        build();
+    }
+
+    void add(const char *name, int value);
+    void build();
+
+    int lookUp(const char *text, uint32_t length) {
+        uint32_t h = hash(text, length, seed);
+        const Slot &slot = slots[(h + disp[h & bucketMask] * ((h >> 16) | 1)) & slotMask];
+
+        if (slot.length == length && slot.name != NULL && compare(slot.name, text, length))
+            return slot.value;
+
+        return notFound;
+    }
+
+private:
+    struct Slot {
+        const char *name;
+        uint32_t length;
+        int value;
+    };
+
+    uint32_t hash(const char *text, uint32_t length, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+
+        for (uint32_t i = 0; i < length; i++) {
+            uint32_t c = (unsigned char)text[i];
+
+            if (ignoreCase && c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            h = (h ^ c) * 16777619u;
+        }
+
+        return h ^ (h >> 13);
+    }
+
+    bool compare(const char *name, const char *text, uint32_t length);
+    bool place(uint32_t slotCount);
+
+    vector<Slot> keys;
+    vector<Slot> slots;
+    vector<uint32_t> disp;      //Displacement of each bucket
+    uint32_t seed;
+    uint32_t bucketMask;
+    uint32_t slotMask;
+    int notFound;
+    bool ignoreCase;
+};
+
+/* Label operand found by the parser.  The target is bound to the
+ * instruction index of the label once all the labels are known.
+ */
+struct LabelRef {
+    string *name;
+    uint32_t *target;
+    int line;
 };
 
 template <typename T>
@@ -56,15 +168,217 @@ struct ParserContext {
     
     void init() {
         instList.clear();
+        labelRefs.clear();
         tokenPool.freeAll();
         parserPool.freeAll();
         error = 0;
+        inData = false;
+        bigEndian = false;
+        dataMaxSize = UINT32_MAX;
+        data.clear();
+        dataLabels.clear();
+        dataLabelLines.clear();
+        jumpTargets.clear();
+    }
+
+    void addStatement(T *stmt) {
+        if (stmt == NULL)
+            return;
+
+        if (inData) {
+            reportError("Line %d: Instructions are not allowed in the data section\n", stmt->line);
+            error++;
+        } else
+            instList.push_back(stmt);
+    }
+
+    void addLabelRef(string &name, uint32_t &target, int line) {
+        LabelRef ref = { &name, &target, line };
+
+        labelRefs.push_back(ref);
+    }
+
+    /* The label operand is the target of a branch, jump or call, so it
+     * cannot be a data label.
+     */
+    void markJumpTarget(string &name) {
+        jumpTargets.insert(&name);
+    }
+
+    /* Binds every label operand, reports the labels that are not defined */
+    bool bindLabels(map<string, uint32_t> &lblMap) {
+        list<LabelRef>::iterator it;
+        bool result = true;
+
+        for (it = labelRefs.begin(); it != labelRefs.end(); it++) {
+            map<string, uint32_t>::iterator lit = lblMap.find(*it->name);
+
+            if (lit == lblMap.end()) {
+                reportError("Line %d: Invalid label '%s'\n", it->line, it->name->c_str());
+                result = false;
+            } else if (jumpTargets.count(it->name) != 0 && dataLabels.count(*it->name) != 0) {
+                reportError("Line %d: '%s' is a data label, it cannot be the target of a branch, jump or call\n",
+                            it->line, it->name->c_str());
+                result = false;
+            } else
+                *it->target = lit->second;
+        }
+
+        return result;
     }
     
+    /* Data directives.  The data section is laid out in an image while
+     * parsing, the data labels hold offsets in the image until the loader
+     * places it.
+     */
+    bool checkData(int line) {
+        if (!inData) {
+            reportError("Line %d: Data directive outside of the data section\n", line);
+            error++;
+        }
+
+        return inData;
+    }
+
+    void addDataLabel(const string &name, int line) {
+        if (dataLabels.count(name) != 0) {
+            reportError("Line %d: Label '%s' is already defined\n", line, name.c_str());
+            error++;
+            return;
+        }
+        dataLabels[name] = data.size();
+        dataLabelLines[name] = line;
+    }
+
+    void alignData(uint32_t alignment) {
+        while (data.size() % alignment != 0)
+            data.push_back(0);
+    }
+
+    uint32_t alignPadding(uint32_t alignment) {
+        return (alignment - data.size() % alignment) % alignment;
+    }
+
+    /* The size is checked before the image grows, so a large directive
+     * is a parse error instead of a failed allocation.
+     */
+    bool checkDataSize(uint64_t size, int line) {
+        if (data.size() + size > dataMaxSize) {
+            reportError("Line %d: The data section is too large, the limit is %u bytes\n", line, dataMaxSize);
+            error++;
+            return false;
+        }
+
+        return true;
+    }
+
+    void addData(list<int> &values, int size, int line) {
+        if (!checkData(line) || !checkDataSize(alignPadding(size) + (uint64_t)values.size() * size, line))
+            return;
+
+        alignData(size);
+        for (list<int>::iterator it = values.begin(); it != values.end(); it++) {
+            for (int i = 0; i < size; i++) {
+                int shift = bigEndian? (size - 1 - i) * 8 : i * 8;
+
+                data.push_back((uint32_t)*it >> shift);
+            }
+        }
+    }
+
+    void addAlign(uint32_t bits, int line) {
+        if (!checkData(line))
+            return;
+
+        if (bits > MAX_DATA_ALIGN_BITS) {
+            reportError("Line %d: Invalid alignment %u, the maximum is %d\n", line, bits, MAX_DATA_ALIGN_BITS);
+            error++;
+        } else if (checkDataSize(alignPadding(1 << bits), line))
+            alignData(1 << bits);
+    }
+
+    void addSpace(uint32_t size, int line) {
+        if (checkData(line) && checkDataSize(size, line))
+            data.resize(data.size() + size, 0);
+    }
+
+    /* The string is stored with a terminating NUL, the common escape
+     * sequences are replaced.
+     */
+    void addString(const string &text, int line) {
+        if (!checkData(line) || !checkDataSize(text.length() + 1, line))
+            return;
+
+        for (size_t i = 0; i < text.length(); i++) {
+            char ch = text[i];
+
+            if (ch == '\\' && i + 1 < text.length()) {
+                switch (text[++i]) {
+                    case 'n': ch = '\n'; break;
+                    case 't': ch = '\t'; break;
+                    case 'r': ch = '\r'; break;
+                    case '0': ch = '\0'; break;
+                    default: ch = text[i];
+                }
+            }
+            data.push_back(ch);
+        }
+        data.push_back(0);
+    }
+
+    /* Adds the data labels to the label map, which holds the code labels,
+     * the image is placed at the start address.
+     */
+    bool placeData(uint32_t start, uint32_t maxSize, map<string, uint32_t> &lblMap, vector<uint8_t> &image) {
+        if (data.size() > maxSize) {
+            reportError("The data section is too large, it has %u bytes and the limit is %u bytes\n",
+                        (uint32_t)data.size(), maxSize);
+            return false;
+        }
+
+        map<string, uint32_t>::iterator it;
+        bool result = true;
+
+        for (it = dataLabels.begin(); it != dataLabels.end(); it++) {
+            if (lblMap.count(it->first) != 0) {
+                reportError("Line %d: Label '%s' is already defined in the code\n", dataLabelLines[it->first],
+                            it->first.c_str());
+                result = false;
+            }
+        }
+        if (!result)
+            return false;
+
+        for (it = dataLabels.begin(); it != dataLabels.end(); it++)
+            lblMap[it->first] = start + it->second;
+
+        //The memory holds host words, the bytes are big endian inside them
+        if (bigEndian) {
+            alignData(4);
+            for (size_t i = 0; i < data.size(); i += 4) {
+                uint32_t word = (data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
+
+                memcpy(&data[i], &word, 4);
+            }
+        }
+
+        image.swap(data);
+
+        return true;
+    }
+
     list<T *> instList;
+    list<LabelRef> labelRefs;
     MemPool tokenPool;
     MemPool parserPool;
     int error;
+    bool inData;                    //The parser is in the data section
+    bool bigEndian;                 //Byte order of the data
+    uint32_t dataMaxSize;           //Largest data section of the ISA
+    vector<uint8_t> data;           //Image of the data section
+    map<string, uint32_t> dataLabels;
+    map<string, int> dataLabelLines;
+    set<string *> jumpTargets;      //Label operands of branches, jumps and calls
 };
 
 
@@ -0,0 +1,229 @@
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "prog_cache.h"
+
+#define PCACHE_READ_CHUNK (64 * 1024)
+
+ProgramCache::ProgramCache(const string &dir, uint32_t isa, uint32_t recordSize)
+{
+    this->dir = dir;
+    this->isa = isa;
+    this->recordSize = recordSize;
+    sourceHash = 0;
+    data = NULL;
+    dataSize = 0;
+    records = NULL;
+    recordCount = 0;
+    imageSize = 0;
+}
+
+ProgramCache::~ProgramCache()
+{
+    close();
+}
+
+/* FNV-1a, 64 bits */
+uint64_t ProgramCache::hash(const string &text)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < text.length(); i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+bool ProgramCache::readSource(istream *in)
+{
+    streambuf *sb = in->rdbuf();
+    char chunk[PCACHE_READ_CHUNK];
+    streamsize count;
+
+    source.clear();
+    while ((count = sb->sgetn(chunk, PCACHE_READ_CHUNK)) > 0)
+        source.append(chunk, count);
+
+    in->setstate(ios::eofbit);
+    sourceHash = hash(source);
+    lineStart.clear();
+
+    return true;
+}
+
+string ProgramCache::getSourceLine(int line)
+{
+    if (lineStart.empty()) {
+        lineStart.push_back(0);
+        for (size_t i = 0; i < source.length(); i++) {
+            if (source[i] == '\n')
+                lineStart.push_back(i + 1);
+        }
+    }
+
+    if (line < 1 || line > (int)lineStart.size())
+        return "";
+
+    size_t start = lineStart[line - 1];
+    size_t end = source.find('\n', start);
+
+    return source.substr(start, (end == string::npos)? string::npos : end - start);
+}
+
+string ProgramCache::getPath()
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "/%s-%016llx.bin", (isa == PCACHE_ISA_X86)? "x86" : "mips32",
+             (unsigned long long)sourceHash);
+
+    return dir + name;
+}
+
+void ProgramCache::close()
+{
+    if (data != NULL)
+        munmap(data, dataSize);
+
+    data = NULL;
+    records = NULL;
+    recordCount = 0;
+    imageSize = 0;
+}
+
+/* Maps the cache file of the source, it's only used when the header
+ * matches the source and the format of this simulator.
+ */
+bool ProgramCache::open()
+{
+    struct stat st;
+    int fd;
+
+    close();
+
+    fd = ::open(getPath().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PCacheHeader)) {
+        ::close(fd);
+        return false;
+    }
+
+    dataSize = st.st_size;
+    data = (uint8_t *)mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        data = NULL;
+        return false;
+    }
+
+    const PCacheHeader *hdr = (const PCacheHeader *)data;
+
+    if (memcmp(hdr->magic, PCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != PCACHE_FORMAT_VERSION || hdr->isa != isa ||
+        hdr->sourceHash != sourceHash || hdr->sourceLength != source.length() ||
+        hdr->recordSize != recordSize ||
+        sizeof(PCacheHeader) + (uint64_t)hdr->recordCount * recordSize + hdr->imageSize + source.length() > dataSize ||
+        memcmp(data + dataSize - source.length(), source.data(), source.length()) != 0) {
+        close();
+        return false;
+    }
+
+    records = data + sizeof(PCacheHeader);
+    recordCount = hdr->recordCount;
+    imageSize = hdr->imageSize;
+
+    return true;
+}
+
+bool ProgramCache::getLabels(map<string, uint32_t> &labelMap)
+{
+    const PCacheHeader *hdr = (const PCacheHeader *)data;
+    const uint8_t *p = (const uint8_t *)records + (size_t)recordCount * recordSize + imageSize;
+    const uint8_t *end = data + dataSize - source.length();
+
+    for (uint32_t i = 0; i < hdr->labelCount; i++) {
+        uint32_t index, length;
+
+        if (p + 2 * sizeof(uint32_t) > end)
+            return false;
+
+        memcpy(&index, p, sizeof(uint32_t));
+        memcpy(&length, p + sizeof(uint32_t), sizeof(uint32_t));
+        p += 2 * sizeof(uint32_t);
+
+        if (length > (size_t)(end - p))
+            return false;
+
+        labelMap[string((const char *)p, length)] = index;
+        p += length;
+    }
+
+    return true;
+}
+
+void ProgramCache::getImage(vector<uint8_t> &image)
+{
+    const uint8_t *p = (const uint8_t *)records + (size_t)recordCount * recordSize;
+
+    image.assign(p, p + imageSize);
+}
+
+/* The file is written with another name and then renamed, so a reader
+ * never maps a partial file.  The name is unique for each writer, the
+ * simulators of other threads may be saving the same program.
+ */
+bool ProgramCache::save(const void *records, uint32_t count, map<string, uint32_t> &labelMap, const vector<uint8_t> &image)
+{
+    PCacheHeader hdr;
+    string path = getPath();
+    stringstream tmp_name;
+    FILE *f;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = PCACHE_FORMAT_VERSION;
+    hdr.isa = isa;
+    hdr.sourceHash = sourceHash;
+    hdr.sourceLength = source.length();
+    hdr.recordSize = recordSize;
+    hdr.recordCount = count;
+    hdr.labelCount = labelMap.size();
+    hdr.imageSize = image.size();
+
+    tmp_name << path << "." << getpid() << "." << (void *)this << ".tmp";
+    f = fopen(tmp_name.str().c_str(), "wb");
+    if (f == NULL)
+        return false;
+
+    bool result = (fwrite(&hdr, sizeof(hdr), 1, f) == 1) &&
+                  (count == 0 || fwrite(records, recordSize, count, f) == count) &&
+                  (image.empty() || fwrite(&image[0], 1, image.size(), f) == image.size());
+
+    map<string, uint32_t>::iterator it;
+
+    for (it = labelMap.begin(); result && it != labelMap.end(); it++) {
+        uint32_t pair[2] = { it->second, (uint32_t)it->first.length() };
+
+        result = (fwrite(pair, sizeof(pair), 1, f) == 1) &&
+                 (fwrite(it->first.data(), 1, it->first.length(), f) == it->first.length());
+    }
+    if (result && !source.empty())
+        result = (fwrite(source.data(), 1, source.length(), f) == source.length());
+
+    result = (fclose(f) == 0) && result;
+    if (result)
+        result = (rename(tmp_name.str().c_str(), path.c_str()) == 0);
+    if (!result)
+        remove(tmp_name.str().c_str());
+
+    return result;
+}
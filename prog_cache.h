@@ -0,0 +1,78 @@
+/*
+ * File:   prog_cache.h
+ *
+ * On-disk cache of decoded programs, keyed by the hash of the source text.
+ */
+
+#ifndef PROG_CACHE_H
+#define PROG_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+#define PCACHE_MAGIC            "EASMPC1"
+#define PCACHE_FORMAT_VERSION   5   //Increment when a decoded instruction format changes
+#define PCACHE_ISA_X86          1
+#define PCACHE_ISA_MIPS32       2
+
+/* The file holds the header, the instruction records, the image of the
+ * data section, the labels and the source.  Each label is stored as its
+ * value, its length and its characters.  The source is compared with the
+ * one being loaded, two sources with the same hash don't share a program.
+ */
+struct PCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t isa;
+    uint64_t sourceHash;
+    uint32_t sourceLength;
+    uint32_t recordSize;
+    uint32_t recordCount;
+    uint32_t labelCount;
+    uint32_t imageSize;
+};
+
+class ProgramCache
+{
+public:
+    ProgramCache(const string &dir, uint32_t isa, uint32_t recordSize);
+    ~ProgramCache();
+
+    bool readSource(istream *in);
+    const string &getSource() { return source; }
+    string getSourceLine(int line);
+
+    bool open();
+    const void *getRecords() { return records; }
+    uint32_t getRecordCount() { return recordCount; }
+    bool getLabels(map<string, uint32_t> &labelMap);
+    void getImage(vector<uint8_t> &image);
+
+    bool save(const void *records, uint32_t count, map<string, uint32_t> &labelMap, const vector<uint8_t> &image);
+
+    static uint64_t hash(const string &text);
+
+private:
+    string getPath();
+    void close();
+
+private:
+    string dir;
+    uint32_t isa;
+    uint32_t recordSize;
+    string source;
+    vector<uint32_t> lineStart; //Offset of each source line, built on demand
+    uint64_t sourceHash;
+    uint8_t *data;      //Mapped cache file
+    size_t dataSize;
+    const void *records;
+    uint32_t recordCount;
+    uint32_t imageSize;
+};
+
+#endif // PROG_CACHE_H
@@ -0,0 +1,949 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include "server.h"
+#include "work_pool.h"
+#include "prog_cache.h"
+#include "x86_tree.h"
+#include "util.h"
+
+//epoll tokens of the descriptors that aren't connections
+#define SERVER_TOKEN_LISTEN     0
+#define SERVER_TOKEN_WAKE       1
+#define SERVER_TOKEN_SIGNAL     2
+#define SERVER_FIRST_CONN       3
+
+#define SERVER_MAX_EVENTS       64
+#define SERVER_READ_CHUNK       65536
+
+ServerSim::ServerSim()
+{
+    msim = NULL;
+    xsim = NULL;
+    sim = NULL;
+    inputFd = -1;
+    used = false;
+}
+
+ServerSim::~ServerSim()
+{
+    //The code refers to the nodes, it goes before the pool
+    mcode.clear();
+    xcode.clear();
+    delete msim;
+    delete xsim;
+    if (inputFd >= 0)
+        close(inputFd);
+}
+
+SimServer::SimServer(const BatchOptions &options)
+{
+    this->options = options;
+    listenFd = -1;
+    epollFd = -1;
+    wakeFd = -1;
+    signalFd = -1;
+    nextConn = SERVER_FIRST_CONN;
+    stopping = false;
+    pthread_mutex_init(&jobLock, NULL);
+    pthread_cond_init(&jobReady, NULL);
+    pthread_mutex_init(&simLock, NULL);
+}
+
+SimServer::~SimServer()
+{
+    for (map<uint64_t, ServerConn *>::iterator it = conns.begin(); it != conns.end(); ++it) {
+        close(it->second->fd);
+        delete it->second;
+    }
+    for (size_t i = 0; i < jobs.size(); i++)
+        delete jobs[i];
+    for (size_t i = 0; i < done.size(); i++)
+        delete done[i];
+    for (list<ServerSim *>::iterator it = idle.begin(); it != idle.end(); ++it)
+        delete *it;
+
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    if (epollFd >= 0)
+        close(epollFd);
+    if (wakeFd >= 0)
+        close(wakeFd);
+    if (signalFd >= 0)
+        close(signalFd);
+
+    pthread_mutex_destroy(&jobLock);
+    pthread_cond_destroy(&jobReady);
+    pthread_mutex_destroy(&simLock);
+}
+
+const char *SimServer::statusName(int status)
+{
+    switch (status) {
+        case SERVER_BAD_REQUEST: return "bad_request";
+        case SERVER_UNKNOWN_PROGRAM: return "unknown_program";
+        default: return BatchRunner::statusName(status);
+    }
+}
+
+static bool addToEpoll(int epoll_fd, int fd, uint64_t token, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = token;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/* A socket left by a server that is gone can be removed, a socket that
+ * accepts a connection or anything else at the path is left alone and
+ * errno tells why.
+ */
+static bool removeStaleSocket(const struct sockaddr_un &addr)
+{
+    struct stat st;
+    int fd, saved;
+
+    if (lstat(addr.sun_path, &st) != 0)
+        return errno == ENOENT;
+
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return false;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return false;
+    }
+    saved = errno;
+    close(fd);
+    if (saved != ECONNREFUSED) {
+        errno = saved;
+        return false;
+    }
+
+    return unlink(addr.sun_path) == 0;
+}
+
+/* SIGINT and SIGTERM are read from a descriptor, so they're blocked before
+ * the workers are created and the workers inherit the mask.
+ */
+bool SimServer::listen(const string &path)
+{
+    struct sockaddr_un addr;
+    sigset_t mask;
+
+    if (path.length() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    if (!removeStaleSocket(addr))
+        return false;
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+        return false;
+
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+        int saved = errno;
+
+        close(listenFd);
+        listenFd = -1;
+        errno = saved;
+        return false;
+    }
+    this->path = path;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    return epollFd >= 0 && wakeFd >= 0 && signalFd >= 0 &&
+           addToEpoll(epollFd, listenFd, SERVER_TOKEN_LISTEN, EPOLLIN) &&
+           addToEpoll(epollFd, wakeFd, SERVER_TOKEN_WAKE, EPOLLIN) &&
+           addToEpoll(epollFd, signalFd, SERVER_TOKEN_SIGNAL, EPOLLIN);
+}
+
+void SimServer::stop()
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&jobLock);
+    stopping = true;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&jobLock);
+
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        //The counter is already set, the loop will wake up anyway
+    }
+}
+
+bool SimServer::run()
+{
+    int count = (options.threads > 0)? options.threads : WorkPool::getCoreCount();
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    bool result = true;
+
+    if (epollFd < 0)
+        return false;
+
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, workerMain, this) != 0)
+            break;
+        workers.push_back(thread);
+    }
+    if (workers.empty())
+        return false;
+
+    while (true) {
+        pthread_mutex_lock(&jobLock);
+        bool stop_now = stopping;
+        pthread_mutex_unlock(&jobLock);
+
+        if (stop_now)
+            break;
+
+        int n = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            result = false;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t token = events[i].data.u64;
+
+            if (token == SERVER_TOKEN_LISTEN) {
+                acceptClients();
+            } else if (token == SERVER_TOKEN_WAKE) {
+                finishJobs();
+            } else if (token == SERVER_TOKEN_SIGNAL) {
+                struct signalfd_siginfo info;
+
+                while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+                    stop();
+            } else {
+                //A connection closed by an earlier event has no entry
+                map<uint64_t, ServerConn *>::iterator it = conns.find(token);
+
+                if (it == conns.end())
+                    continue;
+
+                ServerConn *conn = it->second;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeClient(conn);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !writeClient(conn))
+                    continue;
+                if (events[i].events & EPOLLIN)
+                    readClient(conn);
+            }
+        }
+    }
+
+    stop();
+    for (size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    workers.clear();
+
+    return result;
+}
+
+void *SimServer::workerMain(void *arg)
+{
+    SimServer *server = (SimServer *)arg;
+
+    server->work();
+
+    return NULL;
+}
+
+void SimServer::work()
+{
+    uint64_t one = 1;
+
+    while (true) {
+        pthread_mutex_lock(&jobLock);
+        while (jobs.empty() && !stopping)
+            pthread_cond_wait(&jobReady, &jobLock);
+        if (stopping) {
+            pthread_mutex_unlock(&jobLock);
+            break;
+        }
+        ServerJob *job = jobs.front();
+        jobs.pop_front();
+        pthread_mutex_unlock(&jobLock);
+
+        execute(job);
+
+        pthread_mutex_lock(&jobLock);
+        done.push_back(job);
+        pthread_mutex_unlock(&jobLock);
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            //The counter is already set, the loop will see this job too
+        }
+    }
+}
+
+/* Reads a field name and its value up to the end of the line */
+static bool readField(const string &frame, size_t &pos, string &name, string &value)
+{
+    size_t end = frame.find('\n', pos);
+
+    if (end == string::npos)
+        end = frame.length();
+
+    string line = frame.substr(pos, end - pos);
+    size_t space = line.find(' ');
+
+    pos = (end < frame.length())? end + 1 : end;
+    if (space == string::npos) {
+        name = line;
+        value.clear();
+    } else {
+        name = line.substr(0, space);
+        value = line.substr(space + 1);
+    }
+
+    return !name.empty();
+}
+
+static bool parseNumber(const string &text, int base, uint64_t &value)
+{
+    char *end;
+
+    if (text.empty())
+        return false;
+
+    errno = 0;
+    value = strtoull(text.c_str(), &end, base);
+
+    return *end == '\0' && errno == 0;
+}
+
+bool SimServer::parseRequest(const string &frame, ServerRequest &req)
+{
+    string name, value;
+    bool has_program = false;
+    size_t pos = 0;
+
+    req.isa = -1;
+    req.hash = 0;
+    req.hasSource = false;
+    req.source.clear();
+    req.input.clear();
+    req.maxSteps = 0;
+
+    while (pos < frame.length()) {
+        if (!readField(frame, pos, name, value))
+            return false;
+
+        if (name == "isa") {
+            if (value == "mips32")
+                req.isa = SERVER_ISA_MIPS32;
+            else if (value == "x86")
+                req.isa = SERVER_ISA_X86;
+            else
+                return false;
+        } else if (name == "steps") {
+            if (!parseNumber(value, 10, req.maxSteps))
+                return false;
+        } else if (name == "program") {
+            if (value.length() != 16 || !parseNumber(value, 16, req.hash))
+                return false;
+            has_program = true;
+        } else if (name == "source" || name == "input") {
+            uint64_t size;
+
+            if (!parseNumber(value, 10, size) || size > frame.length() - pos)
+                return false;
+
+            if (name == "source") {
+                req.source = frame.substr(pos, size);
+                req.hasSource = true;
+            } else {
+                req.input = frame.substr(pos, size);
+            }
+            pos += size;
+        } else {
+            return false;
+        }
+    }
+
+    if (req.hasSource)
+        req.hash = ProgramCache::hash(req.source);
+
+    return req.hasSource || has_program;
+}
+
+/* A file in memory for the input of the read system calls */
+static int createInputFd()
+{
+#ifdef MFD_CLOEXEC
+    return memfd_create("easyasm-input", MFD_CLOEXEC);
+#else
+    FILE *tmp = tmpfile();
+    int fd = (tmp != NULL)? dup(fileno(tmp)) : -1;
+
+    if (tmp != NULL)
+        fclose(tmp);
+
+    return fd;
+#endif
+}
+
+static bool setInput(int fd, const string &input)
+{
+    const char *data = input.data();
+    size_t size = input.size();
+
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+        return false;
+
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+
+    return lseek(fd, 0, SEEK_SET) == 0;
+}
+
+bool SimServer::findSource(const ServerRequest &req, string &source)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&simLock);
+    map<pair<int, uint64_t>, string>::iterator it = sources.find(make_pair(req.isa, req.hash));
+
+    if (it != sources.end()) {
+        source = it->second;
+        found = true;
+    }
+    pthread_mutex_unlock(&simLock);
+
+    return found;
+}
+
+/* Keeps the source of the request and returns the id of its program, the
+ * hash of the source unless another source has it.  A clash takes the next
+ * free id, so an id always names one source.  The oldest sources are
+ * forgotten first.
+ */
+uint64_t SimServer::keepSource(const ServerRequest &req)
+{
+    pair<int, uint64_t> key = make_pair(req.isa, req.hash);
+
+    pthread_mutex_lock(&simLock);
+    while (true) {
+        map<pair<int, uint64_t>, string>::iterator it = sources.find(key);
+
+        if (it == sources.end()) {
+            sources[key] = req.source;
+            sourceOrder.push_back(key);
+            if (sourceOrder.size() > SERVER_MAX_SOURCES) {
+                sources.erase(sourceOrder.front());
+                sourceOrder.pop_front();
+            }
+            break;
+        }
+        if (it->second == req.source)
+            break;
+        key.second++;
+    }
+    pthread_mutex_unlock(&simLock);
+
+    return key.second;
+}
+
+/* An idle simulator with the program loaded, or a new one.  NULL when the
+ * program cannot be loaded, the reply is already written.
+ */
+ServerSim *SimServer::takeSim(const ServerRequest &req, ServerJob *job)
+{
+    ServerSim *ssim = NULL;
+    string source;
+
+    if (req.hasSource)
+        source = req.source;
+    else if (!findSource(req, source)) {
+        writeReply(job, NULL, SERVER_UNKNOWN_PROGRAM, 0, "", "");
+        return NULL;
+    }
+
+    //The source is compared too, the id of a forgotten source can be given to another
+    pthread_mutex_lock(&simLock);
+    for (list<ServerSim *>::iterator it = idle.begin(); it != idle.end(); ++it) {
+        if ((*it)->isa == req.isa && (*it)->hash == req.hash && (*it)->source == source) {
+            ssim = *it;
+            idle.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&simLock);
+
+    if (ssim != NULL)
+        return ssim;
+
+    OutputCapture err_cap(BATCH_MAX_OUTPUT);
+    FILE *prog_err = err_cap.open();
+    istringstream in(source);
+    bool loaded;
+
+    ssim = new ServerSim();
+    ssim->isa = req.isa;
+    ssim->hash = req.hash;
+    ssim->source = source;
+    ssim->inputFd = createInputFd();
+
+    NodePoolScope nodes(&ssim->pool);
+
+    if (req.isa == SERVER_ISA_MIPS32) {
+        ssim->msim = new MIPS32Sim();
+        ssim->msim->setThreadedDispatch(options.threadedDispatch);
+        if (options.jit)
+            ssim->msim->setJit(true);
+        if (options.flatMem)
+            ssim->msim->getMemory()->setFlat();
+        ssim->msim->setInputFd(ssim->inputFd);
+        ssim->msim->saveSnapshot(SERVER_RESET_SNAPSHOT);
+        ssim->msim->setErrorOutput(prog_err);
+        ssim->msim->setNativeCalls(false);
+        loaded = ssim->msim->loadFile(&in, ssim->mcode, ssim->labelMap);
+        ssim->sim = ssim->msim;
+    } else {
+        ssim->xsim = new X86Sim();
+        ssim->xsim->setThreadedDispatch(options.threadedDispatch);
+        ssim->xsim->setLazyFlags(options.lazyFlags);
+        if (options.flatMem)
+            ssim->xsim->getMemory()->setFlat();
+        ssim->xsim->saveSnapshot(SERVER_RESET_SNAPSHOT);
+        ssim->xsim->setErrorOutput(prog_err);
+        ssim->xsim->setNativeCalls(false);
+        loaded = ssim->xsim->loadFile(&in, ssim->xcode, ssim->labelMap);
+        ssim->sim = ssim->xsim;
+    }
+    ssim->sim->setErrorOutput(NULL);
+
+    string errors;
+
+    if (prog_err == NULL) {
+        loaded = false;
+        errors = "Cannot capture the errors of the program\n";
+    } else {
+        fclose(prog_err);
+        errors.swap(err_cap.data);
+    }
+
+    if (!loaded || ssim->inputFd < 0) {
+        if (loaded)
+            errors = "Cannot create the input of the program\n";
+        writeReply(job, NULL, BATCH_LOAD_ERROR, 0, "", errors, err_cap.truncated);
+        delete ssim;
+        return NULL;
+    }
+
+    return ssim;
+}
+
+//The least recently used simulators are deleted when there are too many
+void SimServer::releaseSim(ServerSim *ssim)
+{
+    ServerSim *evicted = NULL;
+
+    pthread_mutex_lock(&simLock);
+    idle.push_front(ssim);
+    if (idle.size() > SERVER_MAX_IDLE_SIMS) {
+        evicted = idle.back();
+        idle.pop_back();
+    }
+    pthread_mutex_unlock(&simLock);
+
+    delete evicted;
+}
+
+void SimServer::execute(ServerJob *job)
+{
+    ServerRequest &req = job->req;
+
+    if (req.isa < 0)
+        req.isa = options.mips32? SERVER_ISA_MIPS32 : SERVER_ISA_X86;
+    if (req.hasSource)
+        req.hash = keepSource(req);
+
+    ServerSim *ssim = takeSim(req, job);
+
+    if (ssim == NULL)
+        return;
+
+    OutputCapture out_cap(BATCH_MAX_OUTPUT), err_cap(BATCH_MAX_OUTPUT);
+    FILE *prog_out = out_cap.open();
+    FILE *prog_err = err_cap.open();
+    uint64_t max_steps = (req.maxSteps != 0)? req.maxSteps :
+                         (options.maxSteps != 0)? options.maxSteps : BATCH_DEFAULT_MAX_STEPS;
+    uint64_t steps = 0;
+    string errors;
+    int status;
+
+    //Only the pages written by the previous run are copied back
+    if (ssim->used) {
+        if (ssim->msim != NULL)
+            ssim->msim->restoreSnapshot(SERVER_RESET_SNAPSHOT);
+        else
+            ssim->xsim->restoreSnapshot(SERVER_RESET_SNAPSHOT);
+    }
+    ssim->used = true;
+
+    if (prog_out == NULL || prog_err == NULL) {
+        status = BATCH_RUNTIME_ERROR;
+        errors = "Cannot capture the output of the program\n";
+    } else if (ssim->msim != NULL && !setInput(ssim->inputFd, req.input)) {
+        status = BATCH_RUNTIME_ERROR;
+        errors = "Cannot set the input of the program\n";
+    } else {
+        NodePoolScope nodes(&ssim->pool);
+        bool result, step_limit;
+
+        ssim->sim->setOutput(prog_out);
+        ssim->sim->setErrorOutput(prog_err);
+        if (ssim->msim != NULL) {
+            uint64_t start = ssim->msim->getInstructionCount();
+
+            ssim->msim->setMaxSteps(max_steps);
+            result = ssim->msim->run(ssim->mcode, ssim->labelMap);
+            step_limit = ssim->msim->stepLimitReached();
+            steps = ssim->msim->getInstructionCount() - start;
+        } else {
+            uint64_t start = ssim->xsim->getInstructionCount();
+
+            ssim->xsim->setMaxSteps(max_steps);
+            result = ssim->xsim->run(ssim->xcode, ssim->labelMap);
+            step_limit = ssim->xsim->stepLimitReached();
+            steps = ssim->xsim->getInstructionCount() - start;
+        }
+        ssim->sim->setOutput(stdout);
+        ssim->sim->setErrorOutput(NULL);
+        status = result? BATCH_OK : (step_limit? BATCH_STEP_LIMIT : BATCH_RUNTIME_ERROR);
+    }
+
+    string output;
+
+    if (prog_out != NULL) {
+        fclose(prog_out);
+        output.swap(out_cap.data);
+    }
+    if (prog_err != NULL) {
+        fclose(prog_err);
+        errors.append(err_cap.data);
+    }
+
+    writeReply(job, ssim, status, steps, output, errors, out_cap.truncated || err_cap.truncated);
+    releaseSim(ssim);
+}
+
+/* The registers are written when the program was loaded, exit_code in
+ * MIPS32 mode only.  The output and the errors are at most
+ * BATCH_MAX_OUTPUT bytes each, even escaped they fit in a frame.
+ */
+void SimServer::writeReply(ServerJob *job, ServerSim *ssim, int status, uint64_t steps, const string &output,
+                           const string &errors, bool truncated)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+
+    if (out == NULL) {
+        job->reply = "{\"status\":\"runtime_error\",\"errors\":\"Cannot write the reply\\n\"}";
+        return;
+    }
+
+    fprintf(out, "{\"status\":\"%s\",\"program\":\"%016llx\"", statusName(status), (unsigned long long)job->req.hash);
+    if (status != SERVER_BAD_REQUEST && status != SERVER_UNKNOWN_PROGRAM && status != BATCH_LOAD_ERROR) {
+        fprintf(out, ",\"steps\":%llu", (unsigned long long)steps);
+        if (ssim->msim != NULL)
+            fprintf(out, ",\"exit_code\":%d", ssim->msim->getExitCode());
+    }
+    fputs(",\"output\":", out);
+    writeJsonString(out, output);
+    fputs(",\"errors\":", out);
+    writeJsonString(out, errors);
+    if (truncated)
+        fputs(",\"truncated\":true", out);
+
+    if (ssim != NULL && ssim->msim != NULL) {
+        MIPS32Sim *msim = ssim->msim;
+
+        fputs(",\"regs\":{", out);
+        for (int r = 0; r < 32; r++)
+            fprintf(out, "\"%s\":\"0x%08X\",", MIPS32Sim::getRegisterName(r), msim->reg[r]);
+        fprintf(out, "\"hi\":\"0x%08X\",\"lo\":\"0x%08X\"}", (uint32_t)(msim->getHiLo() >> 32), (uint32_t)msim->getHiLo());
+    } else if (ssim != NULL) {
+        fputs(",\"regs\":{", out);
+        for (int r = R_EAX; r <= R_EFLAGS; r++) {
+            uint32_t value;
+
+            ssim->xsim->getRegValue(r, value);
+            fprintf(out, "%s\"%s\":\"0x%08X\"", (r == R_EAX)? "" : ",", xreg[r], value);
+        }
+        fputs("}", out);
+    }
+    fputs("}", out);
+    fclose(out);
+
+    job->reply.assign(buf, size);
+    free(buf);
+}
+
+void SimServer::acceptClients()
+{
+    while (true) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+            return;
+
+        ServerConn *conn = new ServerConn();
+
+        conn->fd = fd;
+        conn->id = nextConn++;
+        conn->outPos = 0;
+        conn->nextSeq = 0;
+        conn->nextReply = 0;
+        conn->pending = 0;
+        conn->eof = false;
+        conn->polling = false;
+        if (!addToEpoll(epollFd, fd, conn->id, EPOLLIN)) {
+            close(fd);
+            delete conn;
+            continue;
+        }
+        conns[conn->id] = conn;
+    }
+}
+
+/* Queues the complete requests in the buffer of the client.  Returns false
+ * if the connection is closed because a frame is too long.
+ */
+bool SimServer::takeFrames(ServerConn *conn)
+{
+    size_t pos = 0;
+
+    while (conn->in.length() - pos >= 4) {
+        uint32_t length;
+
+        memcpy(&length, conn->in.data() + pos, 4);
+        length = ntohl(length);
+        if (length > SERVER_MAX_FRAME) {
+            closeClient(conn);
+            return false;
+        }
+        if (conn->in.length() - pos - 4 < length)
+            break;
+
+        ServerJob *job = new ServerJob();
+
+        job->conn = conn->id;
+        job->seq = conn->nextSeq++;
+        if (!parseRequest(conn->in.substr(pos + 4, length), job->req)) {
+            job->req.hash = 0;
+            writeReply(job, NULL, SERVER_BAD_REQUEST, 0, "", "Invalid request\n");
+            queueReply(conn, job->seq, job->reply);
+            delete job;
+        } else {
+            conn->pending++;
+            pthread_mutex_lock(&jobLock);
+            jobs.push_back(job);
+            pthread_cond_signal(&jobReady);
+            pthread_mutex_unlock(&jobLock);
+        }
+        pos += 4 + length;
+    }
+    conn->in.erase(0, pos);
+
+    return true;
+}
+
+/* Reads what the client sent and queues its complete requests.  The frames
+ * are taken after each read, so the buffer never holds more than one frame
+ * and a read, and a frame too long closes the connection at its header.
+ */
+void SimServer::readClient(ServerConn *conn)
+{
+    char buf[SERVER_READ_CHUNK];
+
+    while (true) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+
+        if (n > 0) {
+            conn->in.append(buf, n);
+            if (!takeFrames(conn))
+                return;
+            continue;
+        }
+        if (n == 0)
+            conn->eof = true;
+        else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            closeClient(conn);
+            return;
+        }
+        break;
+    }
+
+    //The client won't send more, the socket is watched only to write the replies
+    if (conn->eof) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->polling? EPOLLOUT : 0;
+        ev.data.u64 = conn->id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+
+    writeClient(conn);
+}
+
+/* Sends what can be sent without blocking, a client that won't send more
+ * requests is closed after its last reply.  Returns false if the
+ * connection was closed.
+ */
+bool SimServer::writeClient(ServerConn *conn)
+{
+    while (conn->outPos < conn->out.length()) {
+        ssize_t n = send(conn->fd, conn->out.data() + conn->outPos, conn->out.length() - conn->outPos,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n > 0) {
+            conn->outPos += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!conn->polling) {
+                struct epoll_event ev;
+
+                memset(&ev, 0, sizeof(ev));
+                ev.events = (conn->eof? 0 : EPOLLIN) | EPOLLOUT;
+                ev.data.u64 = conn->id;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+                conn->polling = true;
+            }
+            return true;
+        }
+        closeClient(conn);
+        return false;
+    }
+
+    conn->out.clear();
+    conn->outPos = 0;
+    if (conn->polling) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->eof? 0 : EPOLLIN;
+        ev.data.u64 = conn->id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->polling = false;
+    }
+    if (conn->eof && conn->pending == 0) {
+        closeClient(conn);
+        return false;
+    }
+
+    return true;
+}
+
+//The replies are framed in the order of the requests, writeClient sends them
+void SimServer::queueReply(ServerConn *conn, uint32_t seq, const string &reply)
+{
+    conn->ready[seq] = reply;
+
+    map<uint32_t, string>::iterator it;
+
+    while ((it = conn->ready.find(conn->nextReply)) != conn->ready.end()) {
+        uint32_t length = htonl(it->second.length());
+
+        conn->out.append((const char *)&length, 4);
+        conn->out.append(it->second);
+        conn->ready.erase(it);
+        conn->nextReply++;
+    }
+}
+
+void SimServer::finishJobs()
+{
+    uint64_t count;
+    vector<ServerJob *> finished;
+
+    if (read(wakeFd, &count, sizeof(count)) < 0) {
+        //Nothing to read, the jobs were taken by an earlier wake up
+    }
+
+    pthread_mutex_lock(&jobLock);
+    finished.swap(done);
+    pthread_mutex_unlock(&jobLock);
+
+    for (size_t i = 0; i < finished.size(); i++) {
+        ServerJob *job = finished[i];
+        map<uint64_t, ServerConn *>::iterator it = conns.find(job->conn);
+
+        //The reply is dropped if the client has gone
+        if (it != conns.end()) {
+            it->second->pending--;
+            queueReply(it->second, job->seq, job->reply);
+            writeClient(it->second);
+        }
+        delete job;
+    }
+}
+
+void SimServer::closeClient(ServerConn *conn)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conns.erase(conn->id);
+    delete conn;
+}
@@ -0,0 +1,169 @@
+/*
+ * File:   server.h
+ *
+ * Runs the programs sent by clients through a Unix domain socket.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include "batch.h"
+#include "mips32_sim.h"
+#include "x86_sim.h"
+#include "mempool.h"
+
+using namespace std;
+
+/* Status of a request, the first ones are the status of a batch program */
+#define SERVER_BAD_REQUEST      6   //The request cannot be parsed
+#define SERVER_UNKNOWN_PROGRAM  7   //No source with the id of the request
+
+#define SERVER_ISA_MIPS32       0
+#define SERVER_ISA_X86          1
+
+#define SERVER_MAX_FRAME        (16 << 20)  //Largest request or reply
+#define SERVER_MAX_SOURCES      1024        //Sources kept to be run by their id
+#define SERVER_MAX_IDLE_SIMS    64          //Warm simulators kept between requests
+#define SERVER_RESET_SNAPSHOT   "server.reset"
+
+struct ServerRequest {
+    int isa;
+    uint64_t hash;      //Id of the program, the hash of the source unless another source has it
+    bool hasSource;
+    string source;
+    string input;       //Input of the read system calls (MIPS32)
+    uint64_t maxSteps;
+};
+
+/* A simulator with a program already loaded.  Its state after being
+ * created is saved as a snapshot, so it's reset by copying back only the
+ * pages written by the previous run.
+ */
+struct ServerSim {
+    int isa;
+    uint64_t hash;
+    string source;
+    MemPool pool;       //Nodes of the program
+    MIPS32Sim *msim;
+    X86Sim *xsim;
+    AsmSimulator *sim;
+    vector<MDecodedInst> mcode;
+    vector<XMicroOp> xcode;
+    map<string, uint32_t> labelMap;
+    int inputFd;
+    bool used;          //Run since the last reset
+
+    ServerSim();
+    ~ServerSim();
+};
+
+struct ServerJob {
+    uint64_t conn;
+    uint32_t seq;
+    ServerRequest req;
+    string reply;
+};
+
+struct ServerConn {
+    int fd;
+    uint64_t id;
+    string in;
+    string out;
+    size_t outPos;
+    uint32_t nextSeq;               //Sequence number of the next request
+    uint32_t nextReply;             //Replies are sent in the order of the requests
+    map<uint32_t, string> ready;
+    uint32_t pending;               //Requests being run
+    bool eof;
+    bool polling;                   //Waiting for the socket to be writable
+};
+
+/* Each request and reply is a frame, a 32-bit length in network byte order
+ * followed by that many bytes.  A request has a field per line, the source
+ * and the input are followed by their bytes:
+ *
+ *   isa mips32|x86
+ *   steps <count>
+ *   program <16 hex digits>
+ *   source <size>\n<bytes>
+ *   input <size>\n<bytes>
+ *
+ * Every field is optional but one of program and source.  The ISA of the
+ * server options is used when there's no isa and the step limit of the
+ * batch mode when there are no steps.  A reply is a JSON object with the
+ * fields of a batch record, the registers and the id of the program, so
+ * the next requests can send only the id.  The id is the hash of the
+ * source, a source whose hash is taken by another gets the next free id:
+ *
+ *   {"status":"ok","program":"cbf29ce484222325","steps":120,"exit_code":0,
+ *    "output":"...","errors":"","regs":{"$zero":"0x00000000",...}}
+ *
+ * Only the first BATCH_MAX_OUTPUT bytes of the output and of the errors
+ * are sent, when more were written the reply has "truncated":true.
+ *
+ * The connections are served by one thread with epoll and the programs
+ * are run by a pool of threads.  A client can send many requests without
+ * waiting for the replies, they come back in the same order.
+ */
+class SimServer
+{
+public:
+    SimServer(const BatchOptions &options);
+    ~SimServer();
+
+    bool listen(const string &path);    //Replaces only a socket nobody listens on
+    bool run();     //Until stop is called or SIGINT/SIGTERM is received
+    void stop();
+
+    static const char *statusName(int status);
+    static bool parseRequest(const string &frame, ServerRequest &req);
+
+private:
+    static void *workerMain(void *arg);
+    void work();
+    void execute(ServerJob *job);
+    ServerSim *takeSim(const ServerRequest &req, ServerJob *job);
+    void releaseSim(ServerSim *ssim);
+    bool findSource(const ServerRequest &req, string &source);
+    uint64_t keepSource(const ServerRequest &req);
+    void writeReply(ServerJob *job, ServerSim *ssim, int status, uint64_t steps, const string &output,
+                    const string &errors, bool truncated = false);
+
+    void acceptClients();
+    void readClient(ServerConn *conn);
+    bool takeFrames(ServerConn *conn);
+    bool writeClient(ServerConn *conn);
+    void queueReply(ServerConn *conn, uint32_t seq, const string &reply);
+    void finishJobs();
+    void closeClient(ServerConn *conn);
+
+    BatchOptions options;
+    string path;
+    int listenFd;
+    int epollFd;
+    int wakeFd;         //Written by the workers when a job is done
+    int signalFd;
+    vector<pthread_t> workers;
+    uint64_t nextConn;
+    map<uint64_t, ServerConn *> conns;
+    bool stopping;
+
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobReady;
+    deque<ServerJob *> jobs;
+    vector<ServerJob *> done;
+
+    pthread_mutex_t simLock;
+    list<ServerSim *> idle;             //Most recently used first
+    map<pair<int, uint64_t>, string> sources;
+    deque<pair<int, uint64_t> > sourceOrder;
+};
+
+#endif /* SERVER_H */
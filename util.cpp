@@ -1,6 +1,8 @@
 #include <cstdio>
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <algorithm>
 #include "util.h"
 
 uint32_t signExtend(uint32_t value, int inBitSize, int outBitSize)
@@ -28,17 +30,17 @@ string numberToBinaryString(uint32_t x, int bs)
     return result;
 }
 
-void printNumber(uint32_t value, int bitSize, PrintFormat format)
+void printNumber(FILE *out, uint32_t value, int bitSize, PrintFormat format)
 {
     static const char *hexFmt[] = {"%02X", "%04X", "%08X"};
 
     switch (format) {
         case F_SignedDecimal:
-            printf("%d", signExtend(value, bitSize, 32));
+            fprintf(out, "%d", signExtend(value, bitSize, 32));
             break;
         case F_Unspecified:
         case F_UnsignedDecimal:
-            printf("%u", value);
+            fprintf(out, "%u", value);
             break;
         case F_Hexadecimal: {
             const char *fmt;
@@ -47,20 +49,20 @@ void printNumber(uint32_t value, int bitSize, PrintFormat format)
                 case 16: fmt = hexFmt[1]; break;
                 case 32: fmt = hexFmt[2]; break;
             }
-            printf(fmt, value);
+            fprintf(out, fmt, value);
             break;
         }
         case F_Octal:
-            printf("%o", value);
+            fprintf(out, "%o", value);
             break;
         case F_Binary: {
             string s = numberToBinaryString(value, bitSize);
 
-            cout << s;
+            fputs(s.c_str(), out);
             break;
         }
         case F_Ascii: {
-            printf("%c", (char)value);
+            fputc((char)value, out);
             break;
         }
         default:
@@ -122,4 +124,69 @@ bool tokenizeString(string str, vector<string> &strList)
         strList.push_back(currentToken);
     
     return true;
-}
\ No newline at end of file
+}
+/* A file with an item per line, the empty lines and the ones starting
+ * with '#' are skipped.
+ */
+bool readListFile(const string &path, vector<string> &items)
+{
+    ifstream list(path.c_str());
+    string line;
+
+    if (!list.is_open())
+        return false;
+
+    while (getline(list, line)) {
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (!line.empty() && line[0] != '#')
+            items.push_back(line);
+    }
+
+    return true;
+}
+
+/* JSON string, the control characters are escaped */
+void writeJsonString(FILE *out, const string &text)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < text.length(); i++) {
+        unsigned char ch = text[i];
+
+        switch (ch) {
+            case '"': fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (ch < 0x20 || ch == 0x7F)
+                    fprintf(out, "\\u%04x", ch);
+                else
+                    fputc(ch, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static ssize_t captureWrite(void *cookie, const char *buf, size_t size)
+{
+    OutputCapture *capture = (OutputCapture *)cookie;
+    size_t room = capture->limit - min(capture->limit, capture->data.size());
+
+    if (size > room) {
+        capture->data.append(buf, room);
+        capture->truncated = true;
+    } else {
+        capture->data.append(buf, size);
+    }
+
+    return size;
+}
+
+FILE *OutputCapture::open()
+{
+    cookie_io_functions_t funcs = { NULL, captureWrite, NULL, NULL };
+
+    return fopencookie(this, "w", funcs);
+}
@@ -2,6 +2,7 @@
 #define ARITH_UTIL_H
 
 #include <stdint.h>
+#include <cstdio>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -35,7 +36,21 @@ enum PrintFormat {
 };
 
 uint32_t signExtend(uint32_t value, int inBitSize, int outBitSize);
-void printNumber(uint32_t value, int bitSize, PrintFormat format);
+void printNumber(FILE *out, uint32_t value, int bitSize, PrintFormat format);
 string numberToBinaryString(uint32_t x, int bs);
 bool tokenizeString(string str, vector<string> &strList);
+bool readListFile(const string &path, vector<string> &items);
+void writeJsonString(FILE *out, const string &text);
+
+/* A stream that keeps what is written in data, up to limit bytes.  The
+ * rest is dropped and truncated is set, the writes don't fail.
+ */
+struct OutputCapture {
+    string data;
+    size_t limit;
+    bool truncated;
+
+    OutputCapture(size_t limit) { this->limit = limit; truncated = false; }
+    FILE *open();   //Closed with fclose
+};
 #endif // ARITH_UTIL_H
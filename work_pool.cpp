@@ -0,0 +1,122 @@
+#include <unistd.h>
+#include "work_pool.h"
+
+WorkPool::WorkPool(int threadCount)
+{
+    this->threadCount = (threadCount > 0)? threadCount : 1;
+    workers.resize(this->threadCount);
+    for (int i = 0; i < this->threadCount; i++) {
+        workers[i].pool = this;
+        workers[i].index = i;
+        workers[i].steals = 0;
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+    jobFn = NULL;
+    jobArg = NULL;
+    stealCount = 0;
+}
+
+WorkPool::~WorkPool()
+{
+    for (int i = 0; i < threadCount; i++)
+        pthread_mutex_destroy(&workers[i].lock);
+}
+
+int WorkPool::getCoreCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0)? count : 1;
+}
+
+bool WorkPool::run(uint32_t jobCount, JobFn fn, void *arg)
+{
+    int started = 1;
+    bool result = true;
+
+    jobFn = fn;
+    jobArg = arg;
+    for (int i = 0; i < threadCount; i++) {
+        uint32_t first = (uint64_t)jobCount * i / threadCount;
+        uint32_t last = (uint64_t)jobCount * (i + 1) / threadCount;
+
+        workers[i].steals = 0;
+        workers[i].jobs.clear();
+        for (uint32_t job = first; job < last; job++)
+            workers[i].jobs.push_back(job);
+    }
+
+    //If a thread cannot be created its jobs are stolen by the others
+    for (; started < threadCount; started++) {
+        if (pthread_create(&workers[started].thread, NULL, workerMain, &workers[started]) != 0) {
+            result = false;
+            break;
+        }
+    }
+
+    work(&workers[0]);
+
+    stealCount = workers[0].steals;
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        stealCount += workers[i].steals;
+    }
+
+    return result;
+}
+
+void *WorkPool::workerMain(void *arg)
+{
+    Worker *w = (Worker *)arg;
+
+    w->pool->work(w);
+
+    return NULL;
+}
+
+void WorkPool::work(Worker *w)
+{
+    uint32_t job;
+
+    //No jobs are added while running, so when nothing can be stolen all of them are taken
+    while (takeJob(w, job) || stealJob(w, job))
+        jobFn(jobArg, job);
+}
+
+bool WorkPool::takeJob(Worker *w, uint32_t &job)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&w->lock);
+    if (!w->jobs.empty()) {
+        job = w->jobs.front();
+        w->jobs.pop_front();
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return found;
+}
+
+bool WorkPool::stealJob(Worker *w, uint32_t &job)
+{
+    for (int i = 1; i < threadCount; i++) {
+        Worker *victim = &workers[(w->index + i) % threadCount];
+        bool found = false;
+
+        pthread_mutex_lock(&victim->lock);
+        if (!victim->jobs.empty()) {
+            job = victim->jobs.back();
+            victim->jobs.pop_back();
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found) {
+            w->steals++;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,62 @@
+/*
+ * File:   work_pool.h
+ *
+ * Work-stealing pool of threads for independent jobs.
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+/* The jobs are numbered from 0.  Each worker starts with a contiguous
+ * range of the jobs in its own deque and takes them in order from the
+ * front, a worker with an empty deque steals from the back of the others,
+ * so a few long jobs don't leave the rest of the workers idle and the
+ * first jobs of each range finish first.  The calling thread is the first
+ * worker.
+ */
+class WorkPool
+{
+public:
+    typedef void (*JobFn)(void *arg, uint32_t job);
+
+    WorkPool(int threadCount);
+    ~WorkPool();
+
+    int getThreadCount() { return threadCount; }
+    uint64_t getStealCount() { return stealCount; }
+
+    //Returns when all the jobs are done
+    bool run(uint32_t jobCount, JobFn fn, void *arg);
+
+    static int getCoreCount();
+
+private:
+    struct Worker {
+        WorkPool *pool;
+        int index;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        deque<uint32_t> jobs;
+        uint64_t steals;
+    };
+
+    static void *workerMain(void *arg);
+    void work(Worker *w);
+    bool takeJob(Worker *w, uint32_t &job);
+    bool stealJob(Worker *w, uint32_t &job);
+
+    int threadCount;
+    vector<Worker> workers;
+    JobFn jobFn;
+    void *jobArg;
+    uint64_t stealCount;
+};
+
+#endif /* WORK_POOL_H */
@@ -6,9 +6,9 @@
 void X86Debugger::showStatus()
 {
     XRtContext *ctx = sim->runtimeCtx;
-    XInstruction *inst = instList[ctx->ip];
+    const XMicroOp &uop = code[ctx->ip];
     
-    cout << inst->line << ": " <<  sourceLines[inst->line - 1] << endl;
+    cout << uop.line << ": " <<  sourceLines[uop.line - 1] << endl;
 }
 
 void X86Debugger::start()
@@ -19,16 +19,19 @@ void X86Debugger::start()
 
 bool X86Debugger::next()
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     XRtContext *ctx = sim->runtimeCtx;
-    XInstruction *inst = instList[ctx->ip];
-    int count = instList.size();
+    const XMicroOp &uop = code[ctx->ip];
+    int count = code.size();
         
-    ctx->line = inst->line;
+    ctx->line = uop.line;
     ctx->ip ++;
     
-    if (!inst->exec(sim, sim->lastResult)) {
+    if (!sim->execMicroOp(uop)) {
         return false;
     }
+    sim->setLastResult(uop);
         
     if (ctx->stop || (ctx->ip >= count)) {
         finished = true;
@@ -39,29 +42,32 @@ bool X86Debugger::next()
 
 bool X86Debugger::run()
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     XRtContext *ctx = sim->runtimeCtx;
-    int count = instList.size();
+    int count = code.size();
         
     while (1) {
-        XInstruction *inst = instList[ctx->ip];
+        const XMicroOp &uop = code[ctx->ip];
         
-        if (breakpoints.find(inst->line) != breakpoints.end()) {
+        if (breakpoints.find(uop.line) != breakpoints.end()) {
             if (inBreakpoint)
                 inBreakpoint = false;
             else {
-                cout << "Program paused due to breakpoint at line " << inst->line << endl;
+                cout << "Program paused due to breakpoint at line " << uop.line << endl;
                 
                 inBreakpoint = true;
                 return false;
             }
         }
         
-        ctx->line = inst->line;
+        ctx->line = uop.line;
         ctx->ip ++;
 
-        if (!inst->exec(sim, sim->lastResult)) {
+        if (!sim->execMicroOp(uop)) {
             return false;
         }
+        sim->setLastResult(uop);
 
         if (ctx->stop || (ctx->ip >= count)) {
             finished = true;
@@ -88,6 +94,8 @@ void X86Debugger::stop()
 
 bool X86Debugger::doSimCommand(string cmd)
 {
+    SimScope scope(sim);
+    NodePoolScope nodes(mPool);
     stringstream in;
             
     in.str(cmd);
@@ -14,19 +14,18 @@
 #include <map>
 #include <set>
 #include "adbg.h"
+#include "x86_sim.h"
 
 using namespace std;
 
 class MemPool;
-class XInstruction;
-class X86Sim;
 
 class X86Debugger: public AsmDebugger
 {
 public:    
-    X86Debugger(X86Sim *sim, vector<XInstruction *> instList, MemPool *mPool) {
+    X86Debugger(X86Sim *sim, vector<XMicroOp> &code, MemPool *mPool) {
         this->sim = sim;
-        this->instList = instList;
+        this->code = code;
         this->mPool = mPool;
         inBreakpoint = false;
         finished = false;
@@ -49,7 +48,7 @@ private:
     bool inBreakpoint;
     bool finished;
     vector<string> sourceLines;
-    vector<XInstruction *> instList;
+    vector<XMicroOp> code;
     set<int> breakpoints;
     X86Sim *sim;
     MemPool *mPool;
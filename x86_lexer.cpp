@@ -12,14 +12,13 @@ void reportRuntimeError(const char *format, ...);
 
 #define RETURN_TOKEN(tk)    \
     do {                    \
-        tokenInfo.set(tkText, currentLine); \
+        tokenInfo.set(start, buffer.position() - start, currentLine); \
         return tk; \
     } while (0)
 	
-#define APPEND_SEQUENCE(cond, sb) \
+#define SKIP_SEQUENCE(cond) \
             do { \
                 while ( (cond) ) { \
-                    sb += (char)ch;\
                     ch = nextChar();\
 			    } \
                 ungetChar(ch); \
@@ -39,6 +38,8 @@ static XKeyword kw[] = {
     {"binary", XCKW_BIN },
     {"octal", XCKW_OCT },
     {"ascii", XCKW_ASCII},
+    {"at", XCKW_AT},
+    {"readonly", XCKW_READONLY},
     {"mov", XKW_MOV},
     {"movzx", XKW_MOVZX},
     {"movsx", XKW_MOVSX},
@@ -135,46 +136,54 @@ static XKeyword x_commands[] = {
         {"debug", XCKW_DEBUG},
         {"stop", XCKW_STOP },
 	{"paddr", XCKW_PADDR},
+	{"map", XCKW_MAP},
+	{"snapshot", XCKW_SNAPSHOT},
 };
 
 const int KWCmdCount = sizeof(x_commands)/sizeof(XKeyword);
 
-#if defined(_MSC_VER)
-#define strcasecmp _stricmp
-#endif
+static XKeyword x_directives[] = {
+    {".data", XDIR_DATA},
+    {".text", XDIR_TEXT},
+    {".word", XDIR_WORD},
+    {".half", XDIR_HALF},
+    {".byte", XDIR_BYTE},
+    {".space", XDIR_SPACE},
+    {".asciiz", XDIR_ASCIIZ},
+    {".align", XDIR_ALIGN},
+};
 
-static int lookUpWord(XKeyword kw[], int size, string str)
-{
-    for (int i=0; i<size; i++) {
-        if (strcasecmp(str.c_str(), kw[i].name) == 0)
-            return kw[i].tokenKind;
-    }
+const int DirCount = sizeof(x_directives)/sizeof(XKeyword);
 
-    return XTK_ID;
-}
+static KeywordTable kwTable(kw, KWCount, XTK_ID);
+static KeywordTable cmdTable(x_commands, KWCmdCount, XTK_ID);
+static KeywordTable dirTable(x_directives, DirCount, XTK_DOT);
 
-X86Lexer::X86Lexer(istream *in)
+X86Lexer::X86Lexer(istream *in): buffer(in)
 {
-    this->in = in;
     currentLine = 1;
 }
 
+int X86Lexer::errorToken(string message)
+{
+    errorText = message;
+    tokenInfo.set(errorText.c_str(), errorText.length(), currentLine);
+
+    return XTK_ERROR;
+}
+
 int X86Lexer::getNextToken()
 {
+    const char *start;
 	int ch;
-    string tkText;
-
-    tkText.reserve(MAX_TOKEN_LENGTH);
-    tkText = "";
 
     while (1) {
+        start = buffer.position();
         ch = nextChar();
 
         if (ch == ' ' || ch == '\t')
             continue;
 
-        tkText += (char)ch;
-
         switch (ch) {
             case EOF: RETURN_TOKEN(XTK_EOF);
             case '[': RETURN_TOKEN(XTK_LBRACKET);
@@ -188,14 +197,29 @@ int X86Lexer::getNextToken()
             case '*': RETURN_TOKEN(XTK_OP_MULT);
             case '=': RETURN_TOKEN(XTK_OP_EQUAL);
             case '@': RETURN_TOKEN(XTK_AT);
-            case '.': RETURN_TOKEN(XTK_DOT);
+            case '.': {
+                ch = nextChar();
+                SKIP_SEQUENCE(isalpha(ch));
+
+                tokenInfo.set(start, buffer.position() - start, currentLine);
+
+                int tokenDir = dirTable.lookUp(tokenInfo.text, tokenInfo.length);
+
+                if (tokenDir != XTK_DOT)
+                    return tokenDir;
+
+                //Not a directive, the name is scanned again as an identifier
+                buffer.rewind(start + 1);
+                RETURN_TOKEN(XTK_DOT);
+            }
             case ';': {
                 ch = nextChar();
                 while (ch != '\n' && ch != EOF) {
                     ch = nextChar();
                 }
                 currentLine ++;
-                RETURN_TOKEN(XTK_EOL);
+                tokenInfo.set(start, 1, currentLine);
+                return XTK_EOL;
             }
             case '\r': {
                 ch = nextChar();
@@ -204,53 +228,53 @@ int X86Lexer::getNextToken()
                     ungetChar(ch);
 
                 currentLine ++;
-                RETURN_TOKEN(XTK_EOL);
+                tokenInfo.set(start, 1, currentLine);
+                return XTK_EOL;
             }
             case '\n': {
                 currentLine ++;
                 RETURN_TOKEN(XTK_EOL);
             }
             case '"': {
-                tkText.clear();
+                start = buffer.position();
                 ch = nextChar();
-                APPEND_SEQUENCE((ch != '"') && (ch != EOF), tkText);
+                SKIP_SEQUENCE((ch != '"') && (ch != EOF));
+
+                uint32_t length = buffer.position() - start;
+
                 ch = nextChar();
-                
-                if (ch == EOF) {
-                    tokenInfo.set(string("unterminated string \"") + tkText + string("\""), currentLine);
-                    return XTK_ERROR;
-                }                
-                tokenInfo.set(tkText, currentLine);
+                if (ch == EOF)
+                    return errorToken(string("unterminated string \"") + string(start, length) + string("\""));
+
+                tokenInfo.set(start, length, currentLine);
                 
                 return XSTR_LITERAL;
             }
             case '\'': {
-                tkText.clear();
+                start = buffer.position();
                 ch = nextChar();
-                APPEND_SEQUENCE((ch != '\'') && (ch != EOF), tkText);
+                SKIP_SEQUENCE((ch != '\'') && (ch != EOF));
+
+                uint32_t length = buffer.position() - start;
+
                 ch = nextChar();
+                if (ch == EOF)
+                    return errorToken(string("unterminated character constant '") + string(start, length) + string("'"));
+                if (length != 1)
+                    return errorToken("character constant '" + string(start, length) + "'");
                 
-                if (ch == EOF) {
-                    tokenInfo.set(string("unterminated character constant '") + tkText + string("'"), currentLine);
-                    return XTK_ERROR;
-                }
-                if (tkText.length() != 1) {
-                    tokenInfo.set("character constant '" + tkText + "'", currentLine);
-                    return XTK_ERROR;
-                }
-                
-                tokenInfo.set(tkText, currentLine);
-                tokenInfo.intValue = (int)tkText[0];
+                tokenInfo.set(start, length, currentLine);
+                tokenInfo.intValue = (int)start[0];
                 
                 return XTK_CHAR_CONSTANT;
             }
             case '#': {
-                tkText.clear();
+                start = buffer.position();
                 ch = nextChar();
-                APPEND_SEQUENCE(isalpha(ch), tkText);
+                SKIP_SEQUENCE(isalpha(ch));
 
-                tokenInfo.set(tkText, currentLine);
-                return lookUpWord(x_commands, KWCmdCount, tkText);
+                tokenInfo.set(start, buffer.position() - start, currentLine);
+                return cmdTable.lookUp(tokenInfo.text, tokenInfo.length);
             }
             default: {
                 if (isdigit(ch)) {
@@ -258,49 +282,44 @@ int X86Lexer::getNextToken()
                     ch = nextChar();
 
                     if (prevCh == '0' && (ch == 'b' || ch == 'B')) {
-                        tkText.clear();
+                        start = buffer.position();
 
                         ch = nextChar();
-                        APPEND_SEQUENCE((ch=='0') || (ch=='1'), tkText);
+                        SKIP_SEQUENCE((ch=='0') || (ch=='1'));
 						
-                        if (tkText.empty()) {
-                            tokenInfo.set("binary constant '0b'", currentLine);
-                            
-                            return XTK_ERROR;
-                        }
+                        if (buffer.position() == start)
+                            return errorToken("binary constant '0b'");
 
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = strtoul(tkText.c_str(), NULL, 2);
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 2);
 
                         return XTK_BIN_CONSTANT;
 
                     } else if (prevCh == '0' && (ch == 'x' || ch == 'X')) {
-                        tkText.clear();
+                        start = buffer.position();
 
                         ch = nextChar();
-                        APPEND_SEQUENCE(isxdigit(ch), tkText);
+                        SKIP_SEQUENCE(isxdigit(ch));
+
+                        if (buffer.position() == start)
+                            return errorToken("hexadecimal constant '0x'");
 
-                        if (tkText.empty()) {
-                            tokenInfo.set("hexadecimal constant '0x'", currentLine);
-                            
-                            return XTK_ERROR;
-                        }
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = strtoul(tkText.c_str(), NULL, 16);
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 16);
 
                         return XTK_HEX_CONSTANT;
                     } else if (isdigit(ch)) {
 						
-                        APPEND_SEQUENCE(isdigit(ch), tkText);
+                        SKIP_SEQUENCE(isdigit(ch));
 
-                        tokenInfo.set(tkText, currentLine);
-                        tokenInfo.intValue = atol(tkText.c_str());
+                        tokenInfo.set(start, buffer.position() - start, currentLine);
+                        tokenInfo.intValue = lexemeToInt(tokenInfo.text, tokenInfo.length, 10);
 
                         return XTK_DEC_CONSTANT;
                     } else {
                         ungetChar(ch);
 
-			tokenInfo.set(tkText, currentLine);
+			tokenInfo.set(start, 1, currentLine);
                         tokenInfo.intValue = prevCh - '0';
 
                         return XTK_DEC_CONSTANT;
@@ -308,14 +327,13 @@ int X86Lexer::getNextToken()
                 } else if (isalpha(ch) || ch == '_') {
 
                     ch = nextChar();
-                    APPEND_SEQUENCE( (isalnum(ch) || ch == '_') && (ch != EOF), tkText );
+                    SKIP_SEQUENCE( (isalnum(ch) || ch == '_') && (ch != EOF) );
 
-                    tokenInfo.set(tkText, currentLine);
-                    return lookUpWord(kw, KWCount, tkText);
+                    tokenInfo.set(start, buffer.position() - start, currentLine);
+                    return kwTable.lookUp(tokenInfo.text, tokenInfo.length);
 
                 } else {
-                    tokenInfo.set(string("symbol '") + ((char)ch) + string("'"), currentLine);
-                    return XTK_ERROR;
+                    return errorToken(string("symbol '") + ((char)ch) + string("'"));
                 }
             }
         }
@@ -335,6 +353,10 @@ string X86Lexer::getTokenString(int token, TokenInfo *info)
     case XCKW_SET:
     case XCKW_SHOW:
     case XCKW_PADDR:
+    case XCKW_MAP:
+    case XCKW_SNAPSHOT:
+    case XCKW_AT:
+    case XCKW_READONLY:
     case XCKW_HEX:
     case XCKW_SIGNED:
     case XCKW_UNSIGNED:
@@ -379,6 +401,16 @@ string X86Lexer::getTokenString(int token, TokenInfo *info)
     case XKW_PTR:
         tokenName = "keyword";
         break;
+    case XDIR_DATA:
+    case XDIR_TEXT:
+    case XDIR_WORD:
+    case XDIR_HALF:
+    case XDIR_BYTE:
+    case XDIR_SPACE:
+    case XDIR_ASCIIZ:
+    case XDIR_ALIGN:
+        tokenName = "directive";
+        break;
     case TK_AL:
     case TK_AH:
     case TK_BL:
@@ -430,13 +462,13 @@ string X86Lexer::getTokenString(int token, TokenInfo *info)
     if (info != NULL) {
         switch (token) {
             case XTK_ERROR:
-                result += info->tokenLexeme;
+                result += info->lexeme();
                 break;
             case XTK_EOL:
             case XTK_EOF:
                 break;
             default:
-                result += " '" + info->tokenLexeme + "'";
+                result += " '" + info->lexeme() + "'";
         }
     }
 
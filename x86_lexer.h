@@ -26,22 +26,20 @@ public:
 
     int getCurrentLine() { return currentLine; }
     
-    void getTokenInfo(TokenInfo *ti) {
-        ti->intValue = tokenInfo.intValue;
-        ti->tokenLexeme = tokenInfo.tokenLexeme;
-        ti->line = tokenInfo.line;
-    }
+    void getTokenInfo(TokenInfo *ti) { *ti = tokenInfo; }
 
     static string getTokenString(int token, TokenInfo *info);
 
 private:
-	int nextChar() { return in->get(); }
-	void ungetChar(int c) { in->putback(c); }
-	
+    int nextChar() { return buffer.nextChar(); }
+    void ungetChar(int c) { buffer.ungetChar(c); }
+    int errorToken(string message);
+
 private:
-    istream *in;
+    ScanBuffer buffer;
     int currentLine;
     TokenInfo tokenInfo;
+    string errorText; //Lexeme of the last error token
 };
 
 #endif // X86LEXER_H
@@ -45,6 +45,7 @@ void reportError(const char *format, ...);
 %type r_value {list<int> *}
 %type constant_list {list<int> *}
 %type opt_count {int}
+%type opt_readonly {bool}
 %type tag {string *}
    
 %syntax_error {
@@ -61,23 +62,60 @@ void reportError(const char *format, ...);
 
 input ::= statements XTK_EOF. { /* Noting to do here */ }
 
-statements ::= statements XTK_EOL statement(S). { ctx->instList.push_back((XInstruction *)S); }
-statements ::= statement(S) .                   { ctx->instList.push_back((XInstruction *)S); }
+statements ::= statements XTK_EOL statement(S). { ctx->addStatement((XInstruction *)S); }
+statements ::= statement(S) .                   { ctx->addStatement((XInstruction *)S); }
 
 statement(R) ::= instruction(I).  { R = I; }
 statement(R) ::= command(C).     { R = C; }
-statement(R)::= tag(L) XTK_COLON(C). { R = new XInstTagged(*L, NULL); R->line = C->line; delete L; }
+statement(R) ::= directive.      { R = NULL; }
+statement(R)::= tag(L) XTK_COLON(C). {
+    if (ctx->inData) {
+        ctx->addDataLabel(*L, C->line);
+        R = NULL;
+    } else {
+        R = new XInstTagged(*L, NULL);
+        R->line = C->line;
+    }
+    delete L;
+}
+statement(R)::= data_tag directive. { R = NULL; }
 statement(R)::= tag(L) XTK_COLON(C) instruction(T). { R = new XInstTagged(*L, (XInstruction *)T); R->line = C->line; delete L; }
 statement(R)::= tag(L) XTK_COLON(C) command(CMD). { R = new XInstTagged(*L, (XInstruction *)CMD); R->line = C->line; delete L; }
 
-tag(R) ::= XTK_ID(I). { R = new string(I->tokenLexeme); }
-tag(R) ::= XTK_DOT XTK_ID(I). { R = new string("." + I->tokenLexeme); }
+tag(R) ::= XTK_ID(I). { R = new string(I->lexeme()); }
+tag(R) ::= XTK_DOT XTK_ID(I). { R = new string("." + I->lexeme()); }
+
+data_tag ::= tag(L) XTK_COLON(C). { ctx->addDataLabel(*L, C->line); delete L; }
+
+directive ::= XDIR_DATA. { ctx->inData = true; }
+directive ::= XDIR_TEXT. { ctx->inData = false; }
+directive ::= XDIR_WORD(D) constant_list(L). { ctx->addData(*L, 4, D->line); delete L; }
+directive ::= XDIR_HALF(D) constant_list(L). { ctx->addData(*L, 2, D->line); delete L; }
+directive ::= XDIR_BYTE(D) constant_list(L). { ctx->addData(*L, 1, D->line); delete L; }
+directive ::= XDIR_SPACE(D) constant(C).     { ctx->addSpace(C, D->line); }
+directive ::= XDIR_ASCIIZ(D) XSTR_LITERAL(S). { ctx->addString(S->lexeme(), D->line); }
+directive ::= XDIR_ALIGN(D) constant(C).     { ctx->addAlign(C, D->line); }
 
 command(R) ::= XCKW_SET(N) cmd_argument(A) XTK_OP_EQUAL r_value(V).  { R = new XCmdSet(A, *V); delete V; R->line = N->line; }
 command(R) ::= XCKW_SHOW(N) cmd_argument(A) opt_data_format(F).  { R = new XCmdShow(A, F); R->line = N->line; }
-command(R) ::= XCKW_EXEC(N) XSTR_LITERAL(S). { R = new XCmdExec(S->tokenLexeme); R->line = N->line; }
-command(R) ::= XCKW_DEBUG(N) XSTR_LITERAL(S). { R = new XCmdDebug(S->tokenLexeme); R->line = N->line; }
+command(R) ::= XCKW_EXEC(N) XSTR_LITERAL(S). { R = new XCmdExec(S->lexeme()); R->line = N->line; }
+command(R) ::= XCKW_DEBUG(N) XSTR_LITERAL(S). { R = new XCmdDebug(S->lexeme()); R->line = N->line; }
 command(R) ::= XCKW_STOP(N). { R = new XCmdStop(); R->line = N->line; }
+command(R) ::= XCKW_MAP(N) XSTR_LITERAL(S) XCKW_AT constant(C) opt_readonly(F).
+               { R = new XCmdMap(S->lexeme(), C, F); R->line = N->line; }
+
+command(R) ::= XCKW_SNAPSHOT(N) XTK_ID(A) XTK_ID(S). {
+    string action = A->lexeme();
+
+    if (action != "save" && action != "restore") {
+        reportError("Line %d: Invalid snapshot action '%s', expected save or restore\n", A->line, action.c_str());
+        ctx->error++;
+    }
+    R = new XCmdSnapshot(action == "save", S->lexeme()); R->line = N->line;
+}
+
+opt_readonly(R) ::= XCKW_READONLY. { R = true; }
+opt_readonly(R) ::= . { R = false; }
 
 r_value(R) ::= constant(C). { R = new list<int>; R->push_back(C); }
 r_value(R) ::= XTK_LBRACKET constant_list(L) XTK_RBRACKET. { R = L; }
@@ -190,13 +228,23 @@ opt_argument(R) ::= argument(A). { R = A; }
 opt_argument(R) ::=  .           { R = NULL; }
 
 call_argument(R) ::= argument(A). { R = A; }
-call_argument(R) ::= XTK_AT XTK_ID(I1) XTK_DOT XTK_ID(I2). { R = new XArgExternalFuntionName(I1->tokenLexeme, I2->tokenLexeme); }
+call_argument(R) ::= XTK_AT XTK_ID(I1) XTK_DOT XTK_ID(I2). { R = new XArgExternalFuntionName(I1->lexeme(), I2->lexeme()); }
 
 argument(R) ::= register(R1). { R = R1; }
 argument(R) ::= memory(M).    { R = M; }
 argument(R) ::= constant(C).  { R = new XArgConstant((unsigned int)C); }
-argument(R) ::= XTK_ID(I).        { R = new XArgIdentifier(I->tokenLexeme); }
-argument(R) ::= XTK_DOT XTK_ID(I).{ R = new XArgIdentifier("." + I->tokenLexeme); }
+argument(R) ::= XTK_ID(I).        { 
+    XArgIdentifier *ident = new XArgIdentifier(I->lexeme());
+
+    ctx->addLabelRef(ident->name, ident->target, I->line);
+    R = ident;
+}
+argument(R) ::= XTK_DOT XTK_ID(I).{ 
+    XArgIdentifier *ident = new XArgIdentifier("." + I->lexeme());
+
+    ctx->addLabelRef(ident->name, ident->target, I->line);
+    R = ident;
+}
 argument(R) ::= XCKW_PADDR XTK_LPAREN address_expr(E) XTK_RPAREN. { R = new XArgPhyAddress(E); }
 
 register(R) ::= register8(R1).     { R = R1; }
@@ -252,6 +300,12 @@ address_term(R) ::= address_factor(F). { R = F; }
 
 address_factor(R) ::= register (R1).  { R = new XAddrExprReg(R1); }
 address_factor(R) ::= constant (C).   { R = new XAddrExprConst(C); }
+address_factor(R) ::= XTK_ID(I). {
+    XAddrExprLabel *label = new XAddrExprLabel(I->lexeme());
+
+    ctx->addLabelRef(label->name, label->address(), I->line);
+    R = label;
+}
 
 expr_op(R) ::= XTK_OP_PLUS.  { R = XOP_PLUS; }
 expr_op(R) ::= XTK_OP_MINUS. { R = XOP_MINUS; }
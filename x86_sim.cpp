@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <sstream>
+#include <fstream>
 #include <map>
 #include "x86_sim.h"
 #include "x86_dbg.h"
@@ -15,8 +16,6 @@ const char *xreg[] = { "eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp", "
                        "al", "ah", "bl", "bh", "cl", "ch", "dl", "dh"
                      };
 
-extern MemPool *xpool;
-
 /* Parser related functions */
 void *ParseAlloc(void *(*mallocProc)(size_t));
 void ParseFree(void *p, void (*freeProc)(void*));
@@ -29,9 +28,15 @@ bool XReference::deref(uint32_t &value)
             case RT_Reg: return sim->getRegValue(address, value);
             case RT_Mem: return sim->readMem(address, value, bitSize);
             case RT_PMem: {
-                value = (uint32_t)sim->getMemPtr(address);
+#if GMEM_NATIVE_CALLS
+                //The native functions can write through the address
+                value = (uint32_t)sim->getMemPtr(address, true);
              
                 return value != 0;
+#else
+                reportRuntimeError(GMEM_NO_NATIVE_CALLS_MSG);
+                return false;
+#endif
             }
             case RT_Const: value = address; break;
             default:
@@ -56,11 +61,69 @@ bool XReference::assign(uint32_t value)
 //X86Sim methods
 X86Sim::X86Sim()
 {
+    memset(gpr, 0, sizeof(gpr));
     gpr[R_ESP] = X_VIRTUAL_STACK_END_ADDR;
-    stackStartAddress = X_VIRTUAL_STACK_END_ADDR - (X_STACK_SIZE_WORDS * 4);
+    memory.mapRegion(X_VIRTUAL_GLOBAL_START_ADDR, X_GLOBAL_MEM_WORD_COUNT * 4);
+    memory.mapRegion(X_VIRTUAL_HEAP_START_ADDR, X_HEAP_SIZE_WORDS * 4);
+    memory.mapRegion(X_VIRTUAL_STACK_END_ADDR - X_STACK_SIZE_WORDS * 4, X_STACK_SIZE_WORDS * 4);
     runtimeCtx = NULL;
     jumpTbl = NULL;
     dbg = NULL;
+    threadedDispatch = false;
+    instCount = 0;
+    lazyFlags = false;
+    flagsPending = false;
+    flagsDeferred = 0;
+    flagsMaterialized = 0;
+    lastCached = NULL;
+    maxSteps = 0;
+    stepLimit = UINT64_MAX;
+    stepLimitHit = false;
+}
+
+X86Sim::~X86Sim()
+{
+    delete lastCached;
+}
+
+void X86Sim::setLazyFlags(bool enable)
+{
+    if (flagsPending)
+        materializeFlags();
+
+    lazyFlags = enable;
+}
+
+/* Saves the registers and the memory, a snapshot with the same name is
+ * replaced.
+ */
+void X86Sim::saveSnapshot(const string &name)
+{
+    XRegSnapshot &regs = snapshotRegs[name];
+
+    eflagsValue();
+    memcpy(regs.gpr, gpr, sizeof(gpr));
+    memory.saveSnapshot(name);
+}
+
+bool X86Sim::restoreSnapshot(const string &name)
+{
+    map<string, XRegSnapshot>::iterator it = snapshotRegs.find(name);
+
+    if (it == snapshotRegs.end() || !memory.restoreSnapshot(name))
+        return false;
+
+    memcpy(gpr, it->second.gpr, sizeof(gpr));
+    flagsPending = false;
+
+    return true;
+}
+
+bool X86Sim::deleteSnapshot(const string &name)
+{
+    snapshotRegs.erase(name);
+
+    return memory.deleteSnapshot(name);
 }
 
 AsmDebugger *X86Sim::getDebugger()
@@ -70,7 +133,11 @@ AsmDebugger *X86Sim::getDebugger()
 
 bool X86Sim::getRegValue(int regId, uint32_t &value)
 {
-    if ((regId >= R_EAX) && (regId <= R_EFLAGS)) {
+    if (regId == R_EFLAGS) {
+        value = eflagsValue();
+
+        return true;
+    } else if ((regId >= R_EAX) && (regId < R_EFLAGS)) {
         value = gpr[regId];
 
         return true;
@@ -107,7 +174,10 @@ bool X86Sim::getRegValue(int regId, uint32_t &value)
 
 bool X86Sim::setRegValue(int regId, uint32_t value)
 {
-    if ((regId >= R_EAX) && (regId <= R_EFLAGS)) {
+    if (regId == R_EFLAGS) {
+        setEflags(value);
+    }
+    else if ((regId >= R_EAX) && (regId < R_EFLAGS)) {
         gpr[regId] = value;
     }
     else if ((regId >= R_AX) && (regId <= R_DX)) {
@@ -142,6 +212,20 @@ bool X86Sim::setRegValue(int regId, uint32_t value)
 
 bool X86Sim::readMem(uint32_t vaddr, uint32_t &result, XBitSize bitSize)
 {
+    if ((vaddr & GMEM_PAGE_MASK) > (uint32_t)(GMEM_PAGE_SIZE - bitSize / 8)) {
+        //The value crosses a page boundary, read it one byte at a time
+        uint32_t value = 0, byte;
+
+        for (int i = bitSize / 8 - 1; i >= 0; i--) {
+            if (!readMem(vaddr + i, byte, BS_8))
+                return false;
+            value = (value << 8) | byte;
+        }
+        result = value;
+
+        return true;
+    }
+
     uint8_t *pmem = getMemPtr(vaddr);
 
     if (pmem == NULL)
@@ -170,7 +254,16 @@ bool X86Sim::readMem(uint32_t vaddr, uint32_t &result, XBitSize bitSize)
 
 bool X86Sim::writeMem(uint32_t vaddr, uint32_t value, XBitSize bitSize)
 {
-    uint8_t *pmem = getMemPtr(vaddr);
+    if ((vaddr & GMEM_PAGE_MASK) > (uint32_t)(GMEM_PAGE_SIZE - bitSize / 8)) {
+        for (int i = 0; i < bitSize / 8; i++) {
+            if (!writeMem(vaddr + i, (value >> (i * 8)) & 0xFF, BS_8))
+                return false;
+        }
+
+        return true;
+    }
+
+    uint8_t *pmem = getMemPtr(vaddr, true);
 
     if (pmem == NULL)
         return false;
@@ -195,17 +288,15 @@ bool X86Sim::writeMem(uint32_t vaddr, uint32_t value, XBitSize bitSize)
     return true;
 }
 
-bool translateVirtualToPhysical(uint32_t vaddr, uint32_t &paddr);
-
 bool X86Sim::parseFile(istream *in, XParserContext &ctx)
 {
     X86Lexer lexer(in);
     TokenInfo *tokenInfo;
     int token;
     void* pParser = ParseAlloc (malloc);
-    
-    tk_pool = &(ctx.tokenPool);
+    ThreadBinding<MemPool> tokens(tk_pool, &ctx.tokenPool);
 
+    ctx.dataMaxSize = X_DATA_MAX_SIZE;
     while ((token = lexer.getNextToken()) == XTK_EOL);
 
     while (token != XTK_EOF) {
@@ -275,55 +366,109 @@ bool X86Sim::resolveLabels(list<XInstruction *> &linst, vector<XInstruction *> &
     return true;
 }
     
+/* The label operands of the jumps and calls, they must be code labels */
+void X86Sim::markJumpTargets(vector<XInstruction *> &vinst, XParserContext &ctx)
+{
+    for (size_t i = 0; i < vinst.size(); i++) {
+        XInstruction *inst = vinst[i];
+        int kind = inst->getKind();
+
+        if (kind < XINST_Jmp || kind > XINST_Call)
+            continue;
+
+        XArgument *arg = ((XInst1Arg *)inst)->arg;
+
+        if (arg != NULL && arg->isA(XARG_IDENTIFIER))
+            ctx.markJumpTarget(((XArgIdentifier *)arg)->name);
+    }
+}
+
+bool X86Sim::lower(vector<XInstruction *> &vinst, vector<XMicroOp> &code)
+{
+    code.resize(vinst.size());
+
+    for (unsigned i = 0; i < vinst.size(); i++) {
+        XInstruction *inst = vinst[i];
+        XMicroOp &uop = code[i];
+
+        uop.op = XUOP_Generic;
+        uop.fn = 0;
+        uop.flags = 0;
+        uop.dst.kind = uop.src.kind = XOPD_None;
+        uop.line = inst->line;
+        uop.inst = inst;
+        uop.handler = NULL;
+
+        runtimeCtx->line = inst->line;
+        if (!inst->lower(this, uop))
+            return false;
+
+        //The instruction node can write any flag
+        if (uop.op == XUOP_Generic)
+            uop.flags = XFLAGS_ALL;
+    }
+
+    return true;
+}
+
 bool X86Sim::exec(istream *in)
 {
+    SimScope scope(this);
+
     if (dbg != NULL) {
         reportRuntimeError("The simulator is in debug mode.\n");
         return false;
     }
     
+    MemPool pool;
+    NodePoolScope nodes(&pool);
+    vector<XMicroOp> code;
+    map<string, uint32_t> lbl_map;
+
+    return loadFile(in, code, lbl_map) && run(code, lbl_map);
+}
+
+bool X86Sim::run(vector<XMicroOp> &code, map<string, uint32_t> &labelMap)
+{
     XRtContext rt_ctx, *old_rt_ctx;
-    XParserContext parser_ctx;
-    
-    old_rt_ctx = runtimeCtx;
-    xpool = &(parser_ctx.parserPool);
+    map<string, uint32_t> *old_label_map;
+    const XMicroOp *last = NULL;
+    sigjmp_buf fault_target, *old_fault_target;
+    SimScope scope(this);
+    bool result, old_unchecked;
 
-    runtimeCtx = NULL;
-    
-    if (!parseFile(in, parser_ctx)) {
-        runtimeCtx = old_rt_ctx;
-        return false;
-    }
-    
-    vector<XInstruction *> vinst;
-    map<string, uint32_t> lbl_map, *old_label_map;
-    
-    runtimeCtx = &rt_ctx;
-    
-    if (!resolveLabels(parser_ctx.instList, vinst, lbl_map)) {
-        runtimeCtx = old_rt_ctx;
-        return false;
-    }
-    
-    bool result = true;
-    int count = vinst.size();
-    
+    old_rt_ctx = runtimeCtx;
     old_label_map = jumpTbl;
-    jumpTbl = &lbl_map;
-    
-    rt_ctx.ip = 0;
-    rt_ctx.stop = false;
+    runtimeCtx = &rt_ctx;
+    jumpTbl = &labelMap;
+
     lastResult.type = RT_None;
-    while ((rt_ctx.ip < count) && !rt_ctx.stop) {
-        XInstruction *inst = vinst[rt_ctx.ip];
-        
-        rt_ctx.line = inst->line;
-        rt_ctx.ip ++;
-        if (!inst->exec(this, lastResult)) {
-            result = false;
-            break;
-        }
+    stepLimit = (maxSteps != 0)? instCount + maxSteps : UINT64_MAX;
+    stepLimitHit = false;
+
+    //The micro-ops leave the faults of the flat backend to the handler
+    old_fault_target = memory.setFaultTarget(&fault_target);
+    old_unchecked = memory.setUnchecked(true);
+    if (sigsetjmp(fault_target, 0) != 0) {
+        reportRuntimeError(memory.getFaultMessage(), memory.getFaultAddress());
+        result = false;
+    } else if (!loadData())
+        result = false;
+    else if (threadedDispatch)
+        result = runThreaded(code, last);
+    else
+        result = runSwitch(code, last);
+    memory.setUnchecked(old_unchecked);
+    memory.setFaultTarget(old_fault_target);
+
+    if (result && (instCount >= stepLimit) && (rt_ctx.ip < (int)code.size()) && !rt_ctx.stop) {
+        reportRuntimeError("Execution stopped after %llu instructions\n", (unsigned long long)maxSteps);
+        stepLimitHit = true;
+        result = false;
     }
+
+    if (result && (last != NULL))
+        setLastResult(*last);
     
     runtimeCtx = old_rt_ctx;
     jumpTbl = old_label_map;
@@ -331,8 +476,80 @@ bool X86Sim::exec(istream *in)
     return result;
 }
 
+bool X86Sim::runSwitch(vector<XMicroOp> &code, const XMicroOp *&last)
+{
+    XRtContext *ctx = runtimeCtx;
+    int count = code.size();
+
+    while ((ctx->ip < count) && !ctx->stop && (instCount < stepLimit)) {
+        last = &code[ctx->ip];
+        
+        ctx->line = last->line;
+        ctx->ip ++;
+        instCount++;
+        if (!execMicroOp(*last)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Threaded code dispatch, see MIPS32Sim::runThreaded.  Needs the GCC
+ * "labels as values" extension, other compilers use the switch loop.
+ */
+bool X86Sim::runThreaded(vector<XMicroOp> &code, const XMicroOp *&last)
+{
+#if defined(__GNUC__)
+    XRtContext *ctx = runtimeCtx;
+    int count = code.size();
+    const XMicroOp *uop;
+
+    for (int i = 0; i < count; i++) {
+        if (code[i].handler != NULL)
+            continue;
+
+        switch (code[i].op) {
+#define X86_UOP(op, ...) case op: code[i].handler = &&L_##op; break;
+#include "x86_exec.inc"
+#undef X86_UOP
+            default:
+                code[i].handler = &&L_invalid;
+        }
+    }
+
+#define DISPATCH()                                  \
+    do {                                            \
+        if ((ctx->ip >= count) || ctx->stop ||      \
+            (instCount >= stepLimit))               \
+            return true;                            \
+        uop = last = &code[ctx->ip];                \
+        ctx->line = uop->line;                      \
+        ctx->ip ++;                                 \
+        instCount++;                                \
+        goto *uop->handler;                         \
+    } while (0)
+
+    DISPATCH();
+
+#define X86_UOP(op, ...) L_##op: { __VA_ARGS__ } DISPATCH();
+#include "x86_exec.inc"
+#undef X86_UOP
+
+L_invalid:
+    reportRuntimeError("%d: BUG in machine\n", __LINE__);
+    return false;
+
+#undef DISPATCH
+#else
+    return runSwitch(code, last);
+#endif
+}
+
 bool X86Sim::debug(string asm_file) 
 {
+    SimScope scope(this);
+
     if (dbg != NULL) {
         reportRuntimeError("The simulator is in debug mode already.\n");
         return false;
@@ -347,14 +564,19 @@ bool X86Sim::debug(string asm_file)
         return false;
     }
     
-    vector<XInstruction *> instList;
+    vector<XMicroOp> code;
+    MemPool *pool = new MemPool();  //Released by the debugger
+    NodePoolScope nodes(pool);
 
     jumpTbl = new map<string, uint32_t>;
-    xpool = new MemPool();
+    runtimeCtx = new XRtContext;
     
-    if (!loadFile(&in, instList, *jumpTbl)) {
+    if (!loadFile(&in, code, *jumpTbl)) {
         delete jumpTbl;
-        delete xpool;
+        delete runtimeCtx;
+        delete pool;
+        jumpTbl = NULL;
+        runtimeCtx = NULL;
         
         return false;
     }
@@ -376,9 +598,8 @@ bool X86Sim::debug(string asm_file)
         sourceLines.push_back(line);
     };
     
-    runtimeCtx = new XRtContext;
-    
-    dbg = new X86Debugger(this, instList, xpool);
+    loadData();
+    dbg = new X86Debugger(this, code, pool);
     dbg->setSourceLines(sourceLines);
         
     in.close();
@@ -386,23 +607,375 @@ bool X86Sim::debug(string asm_file)
     return true;
 }
 
-bool X86Sim::loadFile(istream *in, vector<XInstruction *> &instList, map<string, uint32_t> &labelMap)
+bool X86Sim::loadFile(istream *in, vector<XMicroOp> &code, map<string, uint32_t> &labelMap)
+{
+    SimScope scope(this);
+
+    //Only the programs read from a file are cached, not the lines typed in the console
+    if (cacheDir.empty() || dynamic_cast<ifstream *>(in) == NULL)
+        return loadSource(in, code, labelMap);
+
+    ProgramCache *cache = new ProgramCache(cacheDir, PCACHE_ISA_X86, sizeof(XCachedMicroOp));
+
+    cache->readSource(in);
+    if (cache->open() && loadCached(*cache, code, labelMap)) {
+        delete lastCached;
+        lastCached = cache;
+        return true;
+    }
+
+    istringstream src(cache->getSource());
+    bool result;
+
+    code.clear();
+    labelMap.clear();
+    result = loadSource(&src, code, labelMap);
+    if (result)
+        saveCached(*cache, code, labelMap);
+
+    delete cache;
+
+    return result;
+}
+
+bool X86Sim::loadSource(istream *in, vector<XMicroOp> &code, map<string, uint32_t> &labelMap)
 {
     XParserContext parser_ctx;
+    vector<XInstruction *> instList;
     
     if (!parseFile(in, parser_ctx)) {
         return false;
     }
     
-    if (!resolveLabels(parser_ctx.instList, instList, labelMap)) {
+    if (!resolveLabels(parser_ctx.instList, instList, labelMap))
+        return false;
+
+    markJumpTargets(instList, parser_ctx);
+    if (!parser_ctx.placeData(X_VIRTUAL_DATA_START_ADDR, X_DATA_MAX_SIZE, labelMap, dataImage) ||
+        !parser_ctx.bindLabels(labelMap)) {
         return false;
     }
     
+    XRtContext rt_ctx, *old_rt_ctx = runtimeCtx;
+    bool result;
+
+    runtimeCtx = &rt_ctx;
+    result = lower(instList, code);
+    runtimeCtx = old_rt_ctx;
+
+    return result;
+}
+
+/* Copies the data section of the program to the guest memory */
+bool X86Sim::loadData()
+{
+    if (dataImage.empty())
+        return true;
+
+    if (!memory.write(X_VIRTUAL_DATA_START_ADDR, &dataImage[0], dataImage.size())) {
+        reportRuntimeError("Cannot write the data section at 0x%X\n", X_VIRTUAL_DATA_START_ADDR);
+        return false;
+    }
+
     return true;
 }
 
-void X86Sim::updateFlags(uint8_t op, uint8_t sign1, uint8_t sign2, uint32_t arg1, uint32_t arg2, uint32_t result, XBitSize bitSize)
+/* Parses a single source line of a cached program */
+XInstruction *X86Sim::parseLine(const string &text, int line, map<string, uint32_t> &labelMap)
+{
+    XParserContext parser_ctx;
+    istringstream in(text);
+
+    if (!parseFile(&in, parser_ctx) || !parser_ctx.bindLabels(labelMap) || parser_ctx.instList.size() != 1)
+        return NULL;
+
+    XInstruction *inst = parser_ctx.instList.front();
+
+    if (inst->isA(XINST_Tagged))
+        inst = ((XInstTagged *)inst)->inst;
+
+    if (inst != NULL)
+        inst->line = line;
+
+    return inst;
+}
+
+/* Instruction node of a micro-op.  The micro-ops loaded from the cache
+ * don't have one, it's parsed from the source when an error is reported.
+ */
+XInstruction *X86Sim::instructionOf(const XMicroOp *uop)
+{
+    if (uop->inst == NULL && lastCached != NULL) {
+        map<string, uint32_t> empty_map;
+
+        ((XMicroOp *)uop)->inst = parseLine(lastCached->getSourceLine(uop->line), uop->line,
+                                            (jumpTbl != NULL)? *jumpTbl : empty_map);
+    }
+
+    return uop->inst;
+}
+
+static bool isValidBitSize(uint8_t bitSize)
+{
+    return bitSize == 0 || bitSize == BS_8 || bitSize == BS_16 || bitSize == BS_32;
+}
+
+static bool isValidCachedOperand(const XOperand &op)
+{
+    switch (op.kind) {
+        case XOPD_None:
+            return true;
+        case XOPD_Reg:
+            return op.reg <= R_DH && isValidBitSize(op.bitSize);
+        case XOPD_Mem:
+            return (op.reg == XREG_NONE || op.reg <= R_DH) && (op.index == XREG_NONE || op.index <= R_DH) &&
+                   (op.scale == 1 || op.scale == 2 || op.scale == 4 || op.scale == 8) &&
+                   isValidBitSize(op.bitSize);
+        case XOPD_Imm:
+            return isValidBitSize(op.bitSize);
+        default:
+            return false;
+    }
+}
+
+/* True if the record holds a micro-op the handlers know */
+static bool isValidCachedMicroOp(const XCachedMicroOp &rec)
+{
+    if (rec.op > XUOP_Leave || (rec.flags & ~XFLAGS_ALL) != 0 ||
+        !isValidCachedOperand(rec.dst) || !isValidCachedOperand(rec.src))
+        return false;
+
+    switch (rec.op) {
+        case XUOP_Alu:
+            switch (rec.fn) {
+                case XFN_AND: case XFN_OR: case XFN_XOR: case XFN_NOT: case XFN_NEG:
+                case XFN_SHL: case XFN_SHR: case XFN_TEST: case XFN_CMP: case XFN_ADD:
+                case XFN_SUB: case XFN_IMUL: case XFN_IDIV:
+                    return true;
+                default:
+                    return false;
+            }
+        case XUOP_Jcc:
+        case XUOP_Setcc:
+            return rec.fn <= XCC_NP;
+        default:
+            return true;
+    }
+}
+
+bool X86Sim::loadCached(ProgramCache &cache, vector<XMicroOp> &code, map<string, uint32_t> &labelMap)
+{
+    const XCachedMicroOp *rec = (const XCachedMicroOp *)cache.getRecords();
+    uint32_t count = cache.getRecordCount();
+
+    if (!cache.getLabels(labelMap))
+        return false;
+    cache.getImage(dataImage);
+
+    XRtContext rt_ctx, *old_rt_ctx = runtimeCtx;
+    bool result = true;
+
+    runtimeCtx = &rt_ctx;
+
+    code.resize(count);
+    for (uint32_t i = 0; i < count && result; i++) {
+        XMicroOp &uop = code[i];
+
+        if (!isValidCachedMicroOp(rec[i])) {
+            result = false;
+            break;
+        }
+
+        uop.op = rec[i].op;
+        uop.fn = rec[i].fn;
+        uop.flags = rec[i].flags;
+        uop.dst = rec[i].dst;
+        uop.src = rec[i].src;
+        uop.line = rec[i].line;
+        uop.inst = NULL;
+        uop.handler = NULL;
+
+        if (uop.op == XUOP_Generic) {
+            rt_ctx.line = uop.line;
+            uop.inst = parseLine(cache.getSourceLine(uop.line), uop.line, labelMap);
+            result = (uop.inst != NULL);
+        }
+    }
+
+    runtimeCtx = old_rt_ctx;
+
+    if (!result) {
+        code.clear();
+        labelMap.clear();
+    }
+
+    return result;
+}
+
+void X86Sim::saveCached(ProgramCache &cache, vector<XMicroOp> &code, map<string, uint32_t> &labelMap)
 {
+    vector<XCachedMicroOp> rec(code.size());
+
+    for (unsigned i = 0; i < code.size(); i++) {
+        memset(&rec[i], 0, sizeof(XCachedMicroOp));
+        rec[i].op = code[i].op;
+        rec[i].fn = code[i].fn;
+        rec[i].flags = code[i].flags;
+        rec[i].dst = code[i].dst;
+        rec[i].src = code[i].src;
+        rec[i].line = code[i].line;
+    }
+
+    cache.save(rec.empty()? NULL : &rec[0], rec.size(), labelMap, dataImage);
+}
+
+void X86Sim::operandReference(const XOperand &op, XReference &ref)
+{
+    ref.sim = this;
+    ref.bitSize = op.bitSize;
+
+    switch (op.kind) {
+        case XOPD_Reg:
+            ref.type = RT_Reg;
+            ref.address = op.reg;
+            break;
+        case XOPD_Mem:
+            ref.type = RT_Mem;
+            ref.address = operandAddress(op);
+            break;
+        case XOPD_Imm:
+            ref.type = RT_Const;
+            ref.address = op.value;
+            break;
+        default:
+            ref.type = RT_None;
+    }
+}
+
+bool X86Sim::readOperand(const XOperand &op, uint32_t &value)
+{
+    switch (op.kind) {
+        case XOPD_Reg: return getRegValue(op.reg, value);
+        case XOPD_Mem: return readMem(operandAddress(op), value, op.bitSize);
+        case XOPD_Imm: value = op.value; return true;
+        default:
+            return false;
+    }
+}
+
+bool X86Sim::testCondition(uint8_t cc)
+{
+    switch (cc) {
+        case XCC_Z: return isFlagSet(ZF_MASK);
+        case XCC_NZ: return !isFlagSet(ZF_MASK);
+        case XCC_L: return isFlagSet(SF_MASK) != isFlagSet(OF_MASK);
+        case XCC_G: return !isFlagSet(ZF_MASK) && (isFlagSet(SF_MASK) == isFlagSet(OF_MASK));
+        case XCC_LE: return isFlagSet(ZF_MASK) || (isFlagSet(SF_MASK) != isFlagSet(OF_MASK));
+        case XCC_GE: return isFlagSet(SF_MASK) == isFlagSet(OF_MASK);
+        case XCC_B: return isFlagSet(CF_MASK);
+        case XCC_A: return !isFlagSet(CF_MASK) && !isFlagSet(ZF_MASK);
+        case XCC_BE: return isFlagSet(CF_MASK) || isFlagSet(ZF_MASK);
+        case XCC_AE: return !isFlagSet(CF_MASK);
+        case XCC_O: return isFlagSet(OF_MASK);
+        case XCC_NO: return !isFlagSet(OF_MASK);
+        case XCC_S: return isFlagSet(SF_MASK);
+        case XCC_NS: return !isFlagSet(SF_MASK);
+        case XCC_P: return isFlagSet(PF_MASK);
+        case XCC_NP: return !isFlagSet(PF_MASK);
+        default:
+            return false;
+    }
+}
+
+/* Sets the result shown by the REPL for the last micro-op executed */
+void X86Sim::setLastResult(const XMicroOp &uop)
+{
+    switch (uop.op) {
+        case XUOP_Alu:
+            if ((uop.fn == XFN_CMP) || (uop.fn == XFN_TEST)) {
+                lastResult.type = RT_None;
+                break;
+            }
+        case XUOP_Mov:
+        case XUOP_Movsx:
+        case XUOP_Movzx:
+        case XUOP_Lea:
+        case XUOP_Pop:
+        case XUOP_Imul2:
+        case XUOP_Setcc:
+            operandReference(uop.dst, lastResult);
+            break;
+        case XUOP_Push:
+            lastResult.type = RT_Mem;
+            lastResult.bitSize = uop.dst.bitSize;
+            lastResult.address = gpr[R_ESP];
+            break;
+        case XUOP_Cdq:
+            lastResult.type = RT_Reg;
+            lastResult.address = R_EDX;
+            break;
+        case XUOP_Call:
+            lastResult.type = RT_None;
+            break;
+        default:
+            break;
+    }
+}
+
+bool X86Sim::execMicroOp(const XMicroOp &micro_op)
+{
+    const XMicroOp *uop = &micro_op;
+
+    switch (uop->op) {
+#define X86_UOP(op, ...) case op: { __VA_ARGS__ } break;
+#include "x86_exec.inc"
+#undef X86_UOP
+        default:
+            reportRuntimeError("%d: BUG in machine\n", __LINE__);
+            return false;
+    }
+
+    return true;
+}
+
+void X86Sim::updateFlags(uint8_t op, uint8_t sign1, uint8_t sign2, uint32_t arg1, uint32_t arg2, uint32_t result,
+                         XBitSize bitSize, uint16_t mask)
+{
+    if (mask == 0)
+        return;
+
+    //Only an operation that keeps some flags needs the ones pending
+    if (mask != XFLAGS_ALL && flagsPending)
+        materializeFlags();
+
+    uint32_t kept = (flagsPending? pendingFlags.kept : gpr[R_EFLAGS]) & ~(uint32_t)mask;
+
+    if (!lazyFlags) {
+        XFlagsOp fop = { op, sign1, sign2, bitSize, arg1, arg2, result, mask, kept };
+
+        gpr[R_EFLAGS] = computeFlags(fop);
+        return;
+    }
+
+    //Pending flags that nobody read are simply replaced
+    pendingFlags.op = op;
+    pendingFlags.sign1 = sign1;
+    pendingFlags.sign2 = sign2;
+    pendingFlags.bitSize = bitSize;
+    pendingFlags.arg1 = arg1;
+    pendingFlags.arg2 = arg2;
+    pendingFlags.result = result;
+    pendingFlags.mask = mask;
+    pendingFlags.kept = kept;
+    flagsPending = true;
+    flagsDeferred++;
+}
+
+uint32_t X86Sim::computeFlags(const XFlagsOp &fop)
+{
+    uint8_t op = fop.op;
+    uint32_t arg1 = fop.arg1, arg2 = fop.arg2, result = fop.result;
+    XBitSize bitSize = fop.bitSize;
     uint32_t eflags = 0;
 
     //Update carry flag (overflow for unsigned add, borrow for sub)
@@ -439,14 +1012,15 @@ void X86Sim::updateFlags(uint8_t op, uint8_t sign1, uint8_t sign2, uint32_t arg1
         //if (ARITH_OVFL(result, arg1, arg2, bitSize))
         unsigned char result_sign = SIGN_BIT (result, bitSize) != 0;
         
-	if ( (sign1 == sign2) && (sign1 != result_sign) )
+	if ( (fop.sign1 == fop.sign2) && (fop.sign1 != result_sign) )
             eflags |= OF_MASK;
     }
 
-    gpr[R_EFLAGS] = eflags;
+    return (eflags & fop.mask) | fop.kept;
 }
 
-bool X86Sim::doOperation(unsigned char op, XReference &ref1, uint32_t value2)
+/* flags are the EFLAGS bits the instruction writes */
+bool X86Sim::doOperation(unsigned char op, XReference &ref1, uint32_t value2, uint16_t flags)
 {
     uint32_t value1;
         
@@ -506,7 +1080,7 @@ bool X86Sim::doOperation(unsigned char op, XReference &ref1, uint32_t value2)
     uint32_t mask = MASK_FOR(ref1.bitSize);
     result &= mask;
 
-    updateFlags(op, sign1, sign2, value1, value2, result, ref1.bitSize);
+    updateFlags(op, sign1, sign2, value1, value2, result, ref1.bitSize, flags);
 
     if ((op != XFN_CMP) && (op != XFN_TEST)) {
         ref1.assign(result);
@@ -515,29 +1089,34 @@ bool X86Sim::doOperation(unsigned char op, XReference &ref1, uint32_t value2)
     return true;
 }
 
-bool X86Sim::translateVirtualToPhysical(uint32_t vaddr, uint32_t &paddr)
+/* The writes are recorded for the snapshots */
+uint8_t *X86Sim::getMemPtr(uint32_t vaddr, bool write)
 {
-    if (vaddr >= X_VIRTUAL_GLOBAL_START_ADDR && vaddr <= X_VIRTUAL_GLOBAL_END_ADDR) {
-        paddr = vaddr - X_VIRTUAL_GLOBAL_START_ADDR;
-    } else if (vaddr >= stackStartAddress && vaddr < X_VIRTUAL_STACK_END_ADDR) {
-        paddr = (vaddr - stackStartAddress) + (X_GLOBAL_MEM_WORD_COUNT * 4);
-    } else {
-        reportRuntimeError("Runtime exception: fetch address out of limit 0x%x\n", vaddr);
-        return false;
+    uint8_t *pmem;
+
+    if (!memory.checkAccess(vaddr, write)) {
+        reportRuntimeError(memory.getFaultMessage(), vaddr);
+        return NULL;
     }
-    
-    return true;
+
+    pmem = write? memory.getWritePtr(vaddr) : memory.getPtr(vaddr);
+    if (pmem == NULL)
+        reportRuntimeError("Runtime exception: fetch address out of limit 0x%x\n", vaddr);
+
+    return pmem;
 }
 
-uint8_t *X86Sim::getMemPtr(uint32_t vaddr)
+/* The commands and the instructions that aren't lowered check their
+ * accesses, a fault of the flat backend cannot unwind their frames.
+ */
+bool X86Sim::execTree(XInstruction *inst)
 {
-    uint32_t offset;
-    
-    if (!translateVirtualToPhysical(vaddr, offset)) {
-        return NULL;
-    }
+    bool old_unchecked = memory.setUnchecked(false);
+    bool result = inst->exec(this, lastResult);
 
-    return (uint8_t *)(((uint8_t *)mem) + offset);
+    memory.setUnchecked(old_unchecked);
+
+    return result;
 }
 
 bool X86Sim::hasEvenParity(uint8_t value)
@@ -7,13 +7,21 @@
 #include <vector>
 #include <map>
 #include "util.h"
+#include "asim.h"
 #include "x86_lexer.h"
+#include "prog_cache.h"
+#include "guest_mem.h"
+#include "native_lib.h"
 
-#define X_GLOBAL_MEM_WORD_COUNT 256
-#define X_STACK_SIZE_WORDS      256
+#define X_GLOBAL_MEM_WORD_COUNT (256 * 1024)
+#define X_HEAP_SIZE_WORDS       (64 * 1024 * 1024)
+#define X_STACK_SIZE_WORDS      (2 * 1024 * 1024)
 #define X_VIRTUAL_GLOBAL_START_ADDR 0x10000000
-#define X_VIRTUAL_GLOBAL_END_ADDR   (X_VIRTUAL_GLOBAL_START_ADDR + X_GLOBAL_MEM_WORD_COUNT - 1)
+#define X_VIRTUAL_GLOBAL_END_ADDR   (X_VIRTUAL_GLOBAL_START_ADDR + X_GLOBAL_MEM_WORD_COUNT * 4 - 1)
+#define X_VIRTUAL_HEAP_START_ADDR   (X_VIRTUAL_GLOBAL_END_ADDR + 1)
 #define X_VIRTUAL_STACK_END_ADDR    0x7FFFEFFC
+#define X_VIRTUAL_DATA_START_ADDR   0x10010000  //Data section, inside the globals
+#define X_DATA_MAX_SIZE             (X_VIRTUAL_GLOBAL_END_ADDR + 1 - X_VIRTUAL_DATA_START_ADDR)
 
 using namespace std;
 
@@ -87,6 +95,110 @@ struct XReference {
 class XNode;
 class XInstruction;
 
+/* EFLAGS bits written by the operations.  inc and dec keep CF, not and the
+ * moves write none.
+ */
+#define XFLAGS_ALL      (CF_MASK | PF_MASK | AF_MASK | ZF_MASK | SF_MASK | OF_MASK)
+#define XFLAGS_INC_DEC  (XFLAGS_ALL & ~CF_MASK)
+
+/* Micro-op operand kinds */
+#define XOPD_None   0
+#define XOPD_Reg    1
+#define XOPD_Mem    2
+#define XOPD_Imm    3
+
+#define XREG_NONE   0xFF
+
+/* Micro-op codes */
+#define XUOP_Generic 0  //Executed by the instruction node (commands, native calls, ...)
+#define XUOP_Mov     1
+#define XUOP_Movsx   2
+#define XUOP_Movzx   3
+#define XUOP_Lea     4
+#define XUOP_Push    5
+#define XUOP_Pop     6
+#define XUOP_Alu     7  //fn is the XFN_* operation
+#define XUOP_Imul2   8
+#define XUOP_Jmp     9
+#define XUOP_Jcc     10 //fn is the XCC_* condition
+#define XUOP_Call    11
+#define XUOP_Ret     12
+#define XUOP_Setcc   13 //fn is the XCC_* condition
+#define XUOP_Cdq     14
+#define XUOP_Leave   15
+
+/* Condition codes */
+#define XCC_Z   0
+#define XCC_NZ  1
+#define XCC_L   2
+#define XCC_G   3
+#define XCC_LE  4
+#define XCC_GE  5
+#define XCC_B   6
+#define XCC_A   7
+#define XCC_BE  8
+#define XCC_AE  9
+#define XCC_O   10
+#define XCC_NO  11
+#define XCC_S   12
+#define XCC_NS  13
+#define XCC_P   14
+#define XCC_NP  15
+
+/* Micro-op operand.  Memory operands are reg + index*scale + value,
+ * register fields not used are set to XREG_NONE.
+ */
+struct XOperand {
+    uint8_t kind;       // XOPD_* value
+    uint8_t bitSize;    // Operand size, 0 for memory without size directive
+    uint8_t reg;        // Register (XOPD_Reg) or base register (XOPD_Mem)
+    uint8_t index;      // Index register (XOPD_Mem)
+    uint8_t scale;
+    uint32_t value;     // Displacement (XOPD_Mem) or immediate value (XOPD_Imm)
+};
+
+/* Instruction lowered once at load time.  The operands are already
+ * validated, so executing it doesn't walk the instruction tree.
+ */
+struct XMicroOp {
+    uint8_t op;         // XUOP_* value
+    uint8_t fn;         // XFN_* operation or XCC_* condition
+    uint16_t flags;     // EFLAGS bits written, XFLAGS_ALL for XUOP_Generic
+    XOperand dst;
+    XOperand src;
+    int line;           // Source line
+    XInstruction *inst; // Instruction node, used by XUOP_Generic
+    const void *handler; // Label of the handler, used by the threaded dispatch
+};
+
+/* Micro-op as stored in the program cache.  Generic micro-ops are parsed
+ * again from their source line, the other ones get their node only when
+ * an error message needs it.
+ */
+struct XCachedMicroOp {
+    uint8_t op;
+    uint8_t fn;
+    uint16_t flags;
+    XOperand dst;
+    XOperand src;
+    int32_t line;
+};
+
+/* Operation that last set the flags.  In lazy flags mode EFLAGS is only
+ * computed from it when something reads the flags.
+ */
+struct XFlagsOp {
+    uint8_t op;         // XFN_* operation
+    uint8_t sign1;
+    uint8_t sign2;
+    XBitSize bitSize;
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t result;
+    uint16_t mask;      // Bits written by the operation
+    uint32_t kept;      // The other bits of EFLAGS
+};
+
 struct XRtContext
 {
     XRtContext() {
@@ -103,7 +215,12 @@ struct XRtContext
 class AsmDebugger;
 class X86Debugger;
 
-class X86Sim
+/* Registers saved with a snapshot of the memory */
+struct XRegSnapshot {
+    uint32_t gpr[9];
+};
+
+class X86Sim: public AsmSimulator
 {    
     friend class X86Debugger;
     friend class XArgPhyAddress;
@@ -111,17 +228,72 @@ class X86Sim
     friend class XI_Call;
 
 private:
-    uint8_t *getMemPtr(uint32_t vaddr);
+    uint8_t *getMemPtr(uint32_t vaddr, bool write = false);
+    bool execTree(XInstruction *inst);
     bool hasEvenParity(uint8_t value);
     bool resolveLabels(list<XInstruction *> &linst, vector<XInstruction *> &vinst, map<string, uint32_t> &lbl_map);
-    bool loadFile(istream *in, vector<XInstruction *> &instList, map<string, uint32_t> &labelMap);
-    bool translateVirtualToPhysical(uint32_t vaddr, uint32_t &paddr);
+    void markJumpTargets(vector<XInstruction *> &vinst, XParserContext &ctx);
+    bool lower(vector<XInstruction *> &vinst, vector<XMicroOp> &code);
+    bool testCondition(uint8_t cc);
+    void setLastResult(const XMicroOp &uop);
+    bool runSwitch(vector<XMicroOp> &code, const XMicroOp *&last);
+    bool runThreaded(vector<XMicroOp> &code, const XMicroOp *&last);
+
+    uint32_t regValue(uint8_t regId) {
+        uint32_t value;
+
+        if (regId < R_EFLAGS)
+            return gpr[regId];
+
+        getRegValue(regId, value);
+        return value;
+    }
+
+    uint32_t operandAddress(const XOperand &op) {
+        uint32_t vaddr = op.value;
+
+        if (op.reg != XREG_NONE) vaddr += regValue(op.reg);
+        if (op.index != XREG_NONE) vaddr += regValue(op.index) * op.scale;
+
+        return vaddr;
+    }
+
+    uint32_t computeFlags(const XFlagsOp &fop);
+
+    void materializeFlags() {
+        gpr[R_EFLAGS] = computeFlags(pendingFlags);
+        flagsPending = false;
+        flagsMaterialized++;
+    }
+
+    uint32_t eflagsValue() {
+        if (flagsPending)
+            materializeFlags();
+
+        return gpr[R_EFLAGS];
+    }
+
+    void setEflags(uint32_t value) {
+        flagsPending = false;
+        gpr[R_EFLAGS] = value;
+    }
+
+    bool loadSource(istream *in, vector<XMicroOp> &code, map<string, uint32_t> &labelMap);
+    bool loadCached(ProgramCache &cache, vector<XMicroOp> &code, map<string, uint32_t> &labelMap);
+    void saveCached(ProgramCache &cache, vector<XMicroOp> &code, map<string, uint32_t> &labelMap);
+    XInstruction *parseLine(const string &text, int line, map<string, uint32_t> &labelMap);
+    XInstruction *instructionOf(const XMicroOp *uop);
+    bool loadData();
+
+    void operandReference(const XOperand &op, XReference &ref);
+    bool readOperand(const XOperand &op, uint32_t &value);
 
 public:
     X86Sim();
+    ~X86Sim();
 
     XReference getLastResult() { return lastResult; }
-    int getSourceLine() { return runtimeCtx->line; }
+    int getSourceLine() { return (runtimeCtx != NULL)? runtimeCtx->line : 0; }
     
     bool getLabel(string label, uint32_t &target) { 
         if (jumpTbl != NULL) {
@@ -137,17 +309,33 @@ public:
     }
     
     AsmDebugger *getDebugger();
+    GuestMemory *getMemory() { return &memory; }
+    NativeLibCache *getNativeLibs() { return &nativeLibs; }
     bool getRegValue(int regId, uint32_t &value);
     bool setRegValue(int regId, uint32_t value);
     bool readMem(uint32_t vaddr, uint32_t &result, XBitSize bitSize);
     bool writeMem(uint32_t vaddr, uint32_t value, XBitSize bitSize);
-    bool doOperation(unsigned char op, XReference &ref1, uint32_t value2);
+    bool doOperation(unsigned char op, XReference &ref1, uint32_t value2, uint16_t flags = XFLAGS_ALL);
     bool parseFile(istream *in, XParserContext &ctx);
     bool exec(istream *in);
+    bool loadFile(istream *in, vector<XMicroOp> &code, map<string, uint32_t> &labelMap);
+    bool run(vector<XMicroOp> &code, map<string, uint32_t> &labelMap);
+    bool execMicroOp(const XMicroOp &micro_op);
     bool debug(string asm_file);
-    void updateFlags(uint8_t op, uint8_t sign1, uint8_t sign2, uint32_t arg1, uint32_t arg2, uint32_t result, XBitSize bitSize);
+    void setThreadedDispatch(bool enable) { threadedDispatch = enable; }
+    void setCacheDirectory(const string &dir) { cacheDir = dir; }
+    uint64_t getInstructionCount() { return instCount; }
+    void setMaxSteps(uint64_t steps) { maxSteps = steps; }
+    bool stepLimitReached() { return stepLimitHit; }
+    void setLazyFlags(bool enable);
+    void saveSnapshot(const string &name);
+    bool restoreSnapshot(const string &name);
+    bool deleteSnapshot(const string &name);
+    uint64_t getAvoidedFlagComputations() { return flagsDeferred - flagsMaterialized; }
+    void updateFlags(uint8_t op, uint8_t sign1, uint8_t sign2, uint32_t arg1, uint32_t arg2, uint32_t result,
+                     XBitSize bitSize, uint16_t mask);
 
-    bool isFlagSet(unsigned int flags) { return (gpr[R_EFLAGS] & flags) != 0; }
+    bool isFlagSet(unsigned int flags) { return (eflagsValue() & flags) != 0; }
     
     static inline const char *sizeDirectiveToString(XSizeDirective sd) {
         switch (sd) {
@@ -166,9 +354,23 @@ public:
     
 private:
     XReference lastResult;
-    uint32_t stackStartAddress;
     uint32_t gpr[9];
-    uint32_t mem[X_GLOBAL_MEM_WORD_COUNT + X_STACK_SIZE_WORDS];
+    GuestMemory memory;
+    bool threadedDispatch;
+    uint64_t instCount; //Instructions executed by run()
+    bool lazyFlags;
+    bool flagsPending;  //EFLAGS must be computed from pendingFlags
+    XFlagsOp pendingFlags;
+    uint64_t flagsDeferred;     //Flag computations recorded in lazy mode
+    uint64_t flagsMaterialized; //Recorded computations that were read
+    string cacheDir;            //Program cache, disabled when empty
+    ProgramCache *lastCached;   //Source of the last program loaded from the cache
+    vector<uint8_t> dataImage;  //Data section of the last program loaded, copied on each run
+    map<string, XRegSnapshot> snapshotRegs;
+    NativeLibCache nativeLibs;  //Libraries are closed with the simulator
+    uint64_t maxSteps;          //Instructions allowed in each run, 0 for no limit
+    uint64_t stepLimit;         //Value of instCount that stops the current run
+    bool stepLimitHit;          //The last run was stopped by the limit
 };
 
 #endif // X86_SIM_
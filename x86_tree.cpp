@@ -5,16 +5,14 @@
 
 using namespace std;
 
-MemPool *xpool;
-
 void *XNode::operator new(size_t sz)
 {
-    return xpool->memAlloc(sz);
+    return node_pool->memAlloc(sz);
 }
 
 void XNode::operator delete(void *ptrb)
 {
-    return xpool->memFree(ptrb);
+    return node_pool->memFree(ptrb);
 }
 
 #define IMPLEMENT_ALU_INSTRUCTION_2ARG(opname, opcode, function) \
@@ -164,6 +162,20 @@ bool XArgMemRef::getReference(X86Sim *xsim, XReference &ref)
     return true;
 }
 
+bool XArgExternalFuntionName::resolve(X86Sim *sim, bool report)
+{
+    int error = sim->getNativeLibs()->resolve(libName, funcName, hfunc);
+
+    if (error != NLIB_OK && report) {
+        if (error == NLIB_CANNOT_OPEN)
+            reportRuntimeError("Cannot open library '%s'.\n", getLibFullName(libName).c_str());
+        else
+            reportRuntimeError("Function '%s' doesn't exist in library '%s'.\n", funcName.c_str(), getLibFullName(libName).c_str());
+    }
+
+    return error == NLIB_OK;
+}
+
 bool XArgPhyAddress::getReference(X86Sim *sim, XReference &ref)
 {
     uint32_t vaddr;
@@ -1057,7 +1069,7 @@ IMPLEMENT_INSTRUCTION(Inc) {
         return false;
     }
 
-    if (!sim->doOperation(XFN_ADD, ref1, 1)) {
+    if (!sim->doOperation(XFN_ADD, ref1, 1, XFLAGS_INC_DEC)) {
         reportRuntimeError("Invalid argument in instruction '%s'.\n", getName());
         return false;
     }
@@ -1073,7 +1085,7 @@ IMPLEMENT_INSTRUCTION(Dec) {
     if (!arg->getReference(sim, ref1))
         return false;
 
-    if (!sim->doOperation(XFN_SUB, ref1, 1)) {
+    if (!sim->doOperation(XFN_SUB, ref1, 1, XFLAGS_INC_DEC)) {
         reportRuntimeError("Invalid argument for operation.\n");
         return false;
     }
@@ -1089,7 +1101,7 @@ IMPLEMENT_INSTRUCTION(Not) {
     if (!arg->getReference(sim, ref1))
         return false;
 
-    if (!sim->doOperation(XFN_NOT, ref1, 0)) {
+    if (!sim->doOperation(XFN_NOT, ref1, 0, 0)) {
         reportRuntimeError("Invalid argument for operation.\n");
         return false;
     }
@@ -1432,53 +1444,44 @@ IMPLEMENT_INSTRUCTION(Call) {
     
     if (arg->isA(XARG_EXT_FUNC)) {
         XArgExternalFuntionName *fn_arg = (XArgExternalFuntionName *)arg;
-	string libFullName = getLibFullName(fn_arg->libName);
-        HLIB lhandle = openLibrary(libFullName.c_str());
-        
-        if (lhandle == NULL) {
-            reportRuntimeError("Cannot open library '%s'.\n", libFullName.c_str());
+
+        //The cached programs run the call without lowering it
+        if (!sim->checkNativeCalls())
             return false;
-        }
-                
-        HFUNC hfunc = getFunctionAddr(lhandle, fn_arg->funcName.c_str());
-        
-        if (hfunc == NULL) {
-            reportRuntimeError("Function '%s' doesn't exist in library '%s'.\n", fn_arg->funcName.c_str(), libFullName.c_str());
+        if (fn_arg->hfunc == NULL && !fn_arg->resolve(sim, true))
             return false;
-        }
-        
+
+        HFUNC hfunc = fn_arg->hfunc;
         uint32_t esp, reg_eax;
-        void *old_stack_ptr, *new_stack_ptr;
+        void *stack_ptr;
         
         sim->getRegValue(R_ESP, esp);
         
-        new_stack_ptr = (void *)sim->getMemPtr(esp);
+        stack_ptr = sim->memory.nativeStack(esp);
+
+#if !GMEM_NATIVE_CALLS
+        reportRuntimeError(GMEM_NO_NATIVE_CALLS_MSG);
+        return false;
+#elif defined(_WIN32)
+        void *old_stack_ptr;
 
-#ifdef _WIN32
 		__asm {
 			mov old_stack_ptr, esp
-			mov esp, new_stack_ptr
+			mov esp, stack_ptr
 			call [hfunc]
 			mov reg_eax, eax
 			mov esp, old_stack_ptr
 		};
-#elif __linux__
-#if defined(__i386__) || defined(__x86_64__)
-    asm volatile ("xchg %%esp, %0\n\t"
-	  : "=r"(old_stack_ptr) /* output */
-	  : "0"(new_stack_ptr) /* input */
-	);
-        
-    asm volatile ("call *%1\n" : "=a"(reg_eax) : "r"(hfunc));
-    asm volatile ("mov %0, %%esp\n\t" : : "r"(old_stack_ptr) );
-#else
-# error Native call not supported in this architecture.
-#endif
 #else
-#error "Unknownk compiler"
+        //One block, so nothing touches the stack while it's switched.  The
+        //old stack pointer is kept in esi, saved by the callee.
+        asm volatile ("xchg %%esp, %1\n\t"
+                      "call *%2\n\t"
+                      "mov %1, %%esp\n\t"
+                      : "=a"(reg_eax), "+S"(stack_ptr)
+                      : "r"(hfunc)
+                      : "ecx", "edx", "memory", "cc");
 #endif
-        closeLibrary(lhandle);
-        
         sim->setRegValue(R_EAX, reg_eax);
         
         return true;
@@ -1892,6 +1895,7 @@ bool XCmdSet::exec(X86Sim *sim, XReference &result)
 bool XCmdShow::exec(X86Sim *sim, XReference &result)
 {
     XReference a_ref;
+    FILE *out = sim->getOutput();
     uint32_t value;
     
     result.type = RT_None;
@@ -1919,18 +1923,13 @@ bool XCmdShow::exec(X86Sim *sim, XReference &result)
                 
                 sim->getRegValue(R_EFLAGS, eflags);
                 
-                cout << "EFLAGS: "
-                     << "(CF=" << ((value & CF_MASK) != 0) << ", "
-                     << "PF=" << ((value & PF_MASK) != 0) << ", "
-                     << "AF=" << ((value & AF_MASK) != 0) << ", "
-                     << "ZF=" << ((value & ZF_MASK) != 0) << ", "
-                     << "SF=" << ((value & SF_MASK) != 0) << ", "
-                     << "OF=" << ((value & OF_MASK) != 0) << ")"
-                     << endl;
+                fprintf(out, "EFLAGS: (CF=%d, PF=%d, AF=%d, ZF=%d, SF=%d, OF=%d)\n",
+                        (value & CF_MASK) != 0, (value & PF_MASK) != 0, (value & AF_MASK) != 0,
+                        (value & ZF_MASK) != 0, (value & SF_MASK) != 0, (value & OF_MASK) != 0);
             } else {
-                cout << arg->toString() << " = ";
-                printNumber(value, a_ref.bitSize, dataFormat);
-                cout << endl;
+                fprintf(out, "%s = ", arg->toString().c_str());
+                printNumber(out, value, a_ref.bitSize, dataFormat);
+                fputc('\n', out);
             }
             return true;
         }
@@ -1951,9 +1950,9 @@ bool XCmdShow::exec(X86Sim *sim, XReference &result)
                     return false;
                 }
                                 
-                cout << X86Sim::sizeDirectiveToString(a_ref.bitSize) << " [0x" << hex << a_ref.address << dec << "] = ";
-                printNumber(value, a_ref.bitSize, dataFormat);
-                cout << endl;
+                fprintf(out, "%s [0x%x] = ", X86Sim::sizeDirectiveToString(a_ref.bitSize), a_ref.address);
+                printNumber(out, value, a_ref.bitSize, dataFormat);
+                fputc('\n', out);
                 
                 switch (a_ref.bitSize) {
                     case BS_8: a_ref.address ++; break;
@@ -1969,8 +1968,8 @@ bool XCmdShow::exec(X86Sim *sim, XReference &result)
         }
         case RT_Const: {
 			a_ref.deref(value);
-            printNumber(value, BS_32, dataFormat);
-            cout << endl;
+            printNumber(out, value, BS_32, dataFormat);
+            fputc('\n', out);
 
             return true;
         }
@@ -2013,6 +2012,34 @@ bool XCmdDebug::exec(X86Sim *sim, XReference &result)
     return false;
 }
 
+bool XCmdMap::exec(X86Sim *sim, XReference &result)
+{
+    result.type = RT_None;
+
+    int error = sim->getMemory()->mapFile(file_path.c_str(), address, readOnly);
+
+    if (error != GMEM_MAP_OK) {
+        reportRuntimeError(GuestMemory::mapErrorMessage(error), file_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool XCmdSnapshot::exec(X86Sim *sim, XReference &result)
+{
+    result.type = RT_None;
+
+    if (save)
+        sim->saveSnapshot(name);
+    else if (!sim->restoreSnapshot(name)) {
+        reportRuntimeError("Snapshot '%s' doesn't exist\n", name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
 bool XCmdStop::exec(X86Sim *sim, XReference &result)
 {
     result.type = RT_None;
@@ -2020,4 +2047,592 @@ bool XCmdStop::exec(X86Sim *sim, XReference &result)
     sim->runtimeCtx->stop = true;
     
     return true;
-}
\ No newline at end of file
+}
+/* Micro-op lowering.  The checks that only depend on the operands are done
+ * here, so they run once per program and not on every step.
+ */
+static bool addAddressRegister(XOperand &op, uint8_t regId, uint8_t scale)
+{
+    if ((scale == 1) && (op.reg == XREG_NONE)) {
+        op.reg = regId;
+    } else if (op.index == XREG_NONE) {
+        op.index = regId;
+        op.scale = scale;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool lowerAddrExpr(XAddrExpr *expr, bool negate, XOperand &op)
+{
+    switch (expr->getKind()) {
+        case XADDR_EXPR_REG: {
+            XAddrExprReg *e = (XAddrExprReg *)expr;
+
+            if (e->reg->getKind() != XARG_REGISTER) {
+                reportRuntimeError("Invalid register '%s' in memory address expression\n", e->reg->toString().c_str());
+                return false;
+            }
+            if (!addAddressRegister(op, ((XArgRegister *)e->reg)->regId, 1)) {
+                reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+                return false;
+            }
+            return true;
+        }
+        case XADDR_EXPR_CONST: {
+            XAddrExprConst *e = (XAddrExprConst *)expr;
+
+            op.value += negate? -e->value : e->value;
+            return true;
+        }
+        case XADDR_EXPR_2TERM: {
+            XAddrExpr2Term *e = (XAddrExpr2Term *)expr;
+            XAddrExpr *expr1 = e->expr1, *expr2 = e->expr2;
+
+            if ((e->op == XOP_MINUS) && !expr2->isA(XADDR_EXPR_CONST)) {
+                reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+                return false;
+            }
+            if ( (expr1->isA(XADDR_EXPR_REG) && expr2->isA(XADDR_EXPR_MULT)) ||
+                 (expr1->isA(XADDR_EXPR_REG) && expr2->isA(XADDR_EXPR_CONST)) ||
+                 (expr1->isA(XADDR_EXPR_REG) && expr2->isA(XADDR_EXPR_REG)) ||
+                 (expr1->isA(XADDR_EXPR_CONST) && expr2->isA(XADDR_EXPR_MULT)) ||
+                 (expr1->isA(XADDR_EXPR_CONST) && expr2->isA(XADDR_EXPR_CONST)) ||
+                 (expr1->isA(XADDR_EXPR_CONST) && expr2->isA(XADDR_EXPR_REG)) ||
+                 (expr1->isA(XADDR_EXPR_MULT) && expr2->isA(XADDR_EXPR_CONST)) ||
+                 (expr1->isA(XADDR_EXPR_MULT) && expr2->isA(XADDR_EXPR_REG)) ) {
+
+                return lowerAddrExpr(expr1, negate, op) &&
+                       lowerAddrExpr(expr2, negate != (e->op == XOP_MINUS), op);
+            }
+
+            reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+            return false;
+        }
+        case XADDR_EXPR_3TERM: {
+            XAddrExpr3Term *e = (XAddrExpr3Term *)expr;
+            XAddrExpr *expr1 = e->expr1, *expr2 = e->expr2, *expr3 = e->expr3;
+
+            if (((e->op1 == XOP_MINUS) && !expr2->isA(XADDR_EXPR_CONST)) ||
+                ((e->op2 == XOP_MINUS) && !expr3->isA(XADDR_EXPR_CONST))) {
+                reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+                return false;
+            }
+            if ( (expr1->isA(XADDR_EXPR_REG) && expr2->isA(XADDR_EXPR_MULT) && expr3->isA(XADDR_EXPR_CONST)) ||
+                 (expr1->isA(XADDR_EXPR_REG) && expr2->isA(XADDR_EXPR_CONST) && expr3->isA(XADDR_EXPR_MULT)) ||
+                 (expr1->isA(XADDR_EXPR_CONST) && expr2->isA(XADDR_EXPR_REG) && expr3->isA(XADDR_EXPR_MULT)) ||
+                 (expr1->isA(XADDR_EXPR_CONST) && expr2->isA(XADDR_EXPR_MULT) && expr3->isA(XADDR_EXPR_REG)) ||
+                 (expr1->isA(XADDR_EXPR_MULT) && expr2->isA(XADDR_EXPR_CONST) && expr3->isA(XADDR_EXPR_REG)) ||
+                 (expr1->isA(XADDR_EXPR_MULT) && expr2->isA(XADDR_EXPR_REG) && expr3->isA(XADDR_EXPR_CONST)) ) {
+
+                return lowerAddrExpr(expr1, negate, op) &&
+                       lowerAddrExpr(expr2, negate != (e->op1 == XOP_MINUS), op) &&
+                       lowerAddrExpr(expr3, negate != (e->op2 == XOP_MINUS), op);
+            }
+
+            reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+            return false;
+        }
+        case XADDR_EXPR_MULT: {
+            XAddrExprMult *e = (XAddrExprMult *)expr;
+            XAddrExpr *r, *c;
+
+            if (e->expr1->isA(XADDR_EXPR_REG) && e->expr2->isA(XADDR_EXPR_CONST)) {
+                r = e->expr1;
+                c = e->expr2;
+            } else if (e->expr1->isA(XADDR_EXPR_CONST) && e->expr2->isA(XADDR_EXPR_REG)) {
+                r = e->expr2;
+                c = e->expr1;
+            } else {
+                reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+                return false;
+            }
+
+            XArgument *reg = ((XAddrExprReg *)r)->reg;
+            int scale = ((XAddrExprConst *)c)->value;
+
+            if (reg->getKind() != XARG_REGISTER) {
+                reportRuntimeError("Invalid register '%s' in memory address expression\n", reg->toString().c_str());
+                return false;
+            }
+            if ((scale != 1) && (scale != 2) && (scale != 4) && (scale != 8)) {
+                reportRuntimeError("Invalid scalar multiplier %d in address expression '%s'. "
+                            "Valid values are 1, 2, 4, 8.", scale, expr->toString().c_str());
+                return false;
+            }
+            if (!addAddressRegister(op, ((XArgRegister *)reg)->regId, scale)) {
+                reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+                return false;
+            }
+            return true;
+        }
+        default:
+            reportRuntimeError("Invalid expression '%s' in memory reference.\n", expr->toString().c_str());
+            return false;
+    }
+}
+
+/* Lowers registers, memory references and constants.  Other arguments
+ * leave the operand kind as XOPD_None, so the caller can fall back to a
+ * generic micro-op.
+ */
+static bool lowerOperand(XArgument *arg, XOperand &op)
+{
+    op.kind = XOPD_None;
+    op.bitSize = 0;
+    op.reg = op.index = XREG_NONE;
+    op.scale = 1;
+    op.value = 0;
+
+    switch (arg->getKind()) {
+        case XARG_REGISTER: {
+            XArgRegister *r = (XArgRegister *)arg;
+
+            op.kind = XOPD_Reg;
+            op.bitSize = r->regSize;
+            op.reg = r->regId;
+            return true;
+        }
+        case XARG_MEMREF: {
+            XArgMemRef *m = (XArgMemRef *)arg;
+
+            op.kind = XOPD_Mem;
+            op.bitSize = m->sizeDirective;
+            return lowerAddrExpr(m->expr, false, op);
+        }
+        case XARG_CONST: {
+            op.kind = XOPD_Imm;
+            op.bitSize = BS_32;
+            op.value = ((XArgConstant *)arg)->value;
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+static void immediateOperand(XOperand &op, uint32_t value)
+{
+    op.kind = XOPD_Imm;
+    op.bitSize = BS_32;
+    op.reg = op.index = XREG_NONE;
+    op.scale = 1;
+    op.value = value;
+}
+
+/* Lowers a jump or call target: register, memory reference, constant or label */
+static bool lowerTarget(X86Sim *sim, XArgument *arg, XOperand &op)
+{
+    if (arg->isA(XARG_IDENTIFIER)) {
+        immediateOperand(op, ((XArgIdentifier *)arg)->target);
+        return true;
+    }
+
+    if (!lowerOperand(arg, op))
+        return false;
+
+    if (op.kind == XOPD_Reg && op.bitSize != BS_32) {
+        reportRuntimeError("Operand sizes do not match. Expected %d bits size.\n", BS_32);
+        return false;
+    }
+    if (op.kind == XOPD_Mem) {
+        if (op.bitSize == 0)
+            op.bitSize = BS_32;
+        else if (op.bitSize != BS_32) {
+            reportRuntimeError("Error: Operand sizes do not match. Expected %d bits size.\n", BS_32);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool lowerMove(X86Sim *sim, XInst2Arg *inst, uint8_t xtend, XMicroOp &uop)
+{
+    XArgument *arg2 = inst->arg2;
+
+    if (!lowerOperand(inst->arg1, uop.dst))
+        return false;
+
+    if ((uop.dst.kind != XOPD_Reg) && (uop.dst.kind != XOPD_Mem))
+        return true;
+
+    if ((uop.dst.kind == XOPD_Mem) && arg2->isA(XARG_MEMREF)) {
+        reportRuntimeError("Memory-Memory references are not allowed.\n");
+        return false;
+    }
+
+    int resultSize = uop.dst.bitSize;
+    bool valid = true;
+
+    switch (arg2->getKind()) {
+        case XARG_REGISTER:
+        case XARG_MEMREF: {
+            if (!lowerOperand(arg2, uop.src))
+                return false;
+
+            if (uop.src.kind == XOPD_Mem && uop.src.bitSize == 0)
+                uop.src.bitSize = resultSize;
+
+            if (!xtend && resultSize != uop.src.bitSize) {
+                reportRuntimeError("%sOperand sizes do not match. Expected %d bits size.\n",
+                            arg2->isA(XARG_MEMREF)? "Error: " : "", BIT_SIZE(resultSize));
+                valid = false;
+            } else if (xtend && uop.src.bitSize >= resultSize) {
+                if (arg2->isA(XARG_REGISTER))
+                    reportRuntimeError("Invalid size of operand '%s'. Size is %d bits.\n", arg2->toString().c_str(), uop.src.bitSize);
+                else
+                    reportRuntimeError("Invalid size of operand '%s'\n", arg2->toString().c_str());
+                valid = false;
+            }
+            break;
+        }
+        case XARG_CONST: {
+            if (xtend) {
+                reportRuntimeError("Invalid operand '%s'.\n", arg2->toString().c_str());
+                valid = false;
+                break;
+            }
+            uint32_t value = ((XArgConstant *)arg2)->value;
+
+            immediateOperand(uop.src, (resultSize != 0)? value & MASK_FOR(resultSize) : value);
+            break;
+        }
+        case XARG_IDENTIFIER: {
+            if (xtend)
+                return true;
+
+            if (!lowerTarget(sim, arg2, uop.src))
+                valid = false;
+            break;
+        }
+        default:
+            return true;
+    }
+
+    if (!valid) {
+        reportRuntimeError("Invalid argument '%s' in %s instruction.\n", arg2->toString().c_str(), inst->getName());
+        return false;
+    }
+
+    if (uop.dst.bitSize == 0) uop.dst.bitSize = BS_32;
+
+    uop.op = (xtend == 0)? XUOP_Mov : ((xtend == SX_MASK)? XUOP_Movsx : XUOP_Movzx);
+
+    return true;
+}
+
+static bool lowerAluInstruction(XInst2Arg *inst, const char *opname, uint8_t function, XMicroOp &uop)
+{
+    XArgument *arg1 = inst->arg1, *arg2 = inst->arg2;
+
+    if (arg1->isA(XARG_CONST)) {
+        reportRuntimeError("Invalid destination '%s' for %s instruction.\n", arg1->toString().c_str(), opname);
+        return false;
+    }
+    if (!lowerOperand(arg1, uop.dst) || !lowerOperand(arg2, uop.src))
+        return false;
+
+    if ((uop.dst.kind == XOPD_None) || (uop.src.kind == XOPD_None))
+        return true;
+
+    if ((uop.dst.kind == XOPD_Mem) && (uop.src.kind == XOPD_Mem)) {
+        reportRuntimeError("Memory-Memory references are not allowed.\n");
+        return false;
+    }
+    if (uop.dst.bitSize == 0) {
+        reportRuntimeError("Invalid arguments for operation.\n");
+        return false;
+    }
+    if (uop.src.bitSize == 0)
+        uop.src.bitSize = uop.dst.bitSize;
+
+    uop.op = XUOP_Alu;
+    uop.fn = function;
+    uop.flags = XFLAGS_ALL;
+
+    return true;
+}
+
+static bool lowerUnaryAluInstruction(XArgument *arg, uint8_t function, uint32_t value2, uint16_t flags, XMicroOp &uop)
+{
+    if (!lowerOperand(arg, uop.dst))
+        return false;
+
+    if ((uop.dst.kind != XOPD_Reg) && (uop.dst.kind != XOPD_Mem))
+        return true;
+
+    if (uop.dst.bitSize == 0) {
+        if (function == XFN_ADD)
+            reportRuntimeError("Memory reference argument '%s' requires size specification (byte, word or dword).\n",
+                        arg->toString().c_str());
+        else
+            reportRuntimeError("Invalid argument for operation.\n");
+        return false;
+    }
+
+    immediateOperand(uop.src, value2);
+    uop.op = XUOP_Alu;
+    uop.fn = function;
+    uop.flags = flags;
+
+    return true;
+}
+
+static bool lowerShiftInstruction(XInst2Arg *inst, uint8_t function, XMicroOp &uop)
+{
+    if (!lowerOperand(inst->arg1, uop.dst) || !lowerOperand(inst->arg2, uop.src))
+        return false;
+
+    if ((uop.dst.kind != XOPD_Reg) && (uop.dst.kind != XOPD_Mem))
+        return true;
+
+    switch (uop.src.kind) {
+        case XOPD_Reg:
+            if (uop.src.reg != R_CL) {
+                reportRuntimeError("Invalid argument for shift operation. Expected register 'cl'.\n");
+                return false;
+            }
+            break;
+        case XOPD_Imm:
+            break;
+        case XOPD_Mem:
+            reportRuntimeError("Invalid argument for shift operation. Expected register register or constant.\n");
+            return false;
+        default:
+            return true;
+    }
+
+    if (uop.dst.bitSize == 0) {
+        reportRuntimeError("Invalid argument for operation.\n");
+        return false;
+    }
+
+    uop.op = XUOP_Alu;
+    uop.fn = function;
+    uop.flags = XFLAGS_ALL;
+
+    return true;
+}
+
+static bool lowerConditionalJump(X86Sim *sim, XArgument *arg, uint8_t cc, XMicroOp &uop)
+{
+    if ((arg->getKind() != XARG_CONST && arg->getKind() != XARG_IDENTIFIER) ||
+        !lowerTarget(sim, arg, uop.src)) {
+        reportRuntimeError("Invalid argument for conditional branch instruction. Expected address, found '%s'.\n",
+                    arg->toString().c_str());
+        return false;
+    }
+
+    uop.op = XUOP_Jcc;
+    uop.fn = cc;
+
+    return true;
+}
+
+static bool lowerSetByte(XInst1Arg *inst, uint8_t cc, XMicroOp &uop)
+{
+    XArgument *arg = inst->arg;
+
+    if (arg->getKind() != XARG_MEMREF &&
+        arg->getKind() != XARG_REGISTER) {
+        reportRuntimeError("Invalid argument '%s' for instruction '%s'\n",
+                    arg->toString().c_str(), inst->getName());
+        return false;
+    }
+
+    if (!lowerOperand(arg, uop.dst))
+        return false;
+
+    if (uop.dst.bitSize != BS_8) {
+        reportRuntimeError("Invalid operand size in instruction '%s'\n", inst->getName());
+        return false;
+    }
+
+    uop.op = XUOP_Setcc;
+    uop.fn = cc;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Mov) { return lowerMove(sim, this, 0, uop); }
+IMPLEMENT_LOWERING(Movsx) { return lowerMove(sim, this, SX_MASK, uop); }
+IMPLEMENT_LOWERING(Movzx) { return lowerMove(sim, this, ZX_MASK, uop); }
+
+IMPLEMENT_LOWERING(Push) {
+    UNUSED(sim);
+
+    if (!lowerOperand(arg, uop.dst))
+        return false;
+
+    if (uop.dst.kind == XOPD_None)
+        return true;
+
+    if (uop.dst.bitSize < BS_16) {
+        reportRuntimeError("Expected 32 or 16 bits argument. Found %d bit size.\n", uop.dst.bitSize);
+        return false;
+    }
+
+    uop.op = XUOP_Push;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Pop) {
+    UNUSED(sim);
+
+    if (!lowerOperand(arg, uop.dst))
+        return false;
+
+    if ((uop.dst.kind != XOPD_Reg) && (uop.dst.kind != XOPD_Mem))
+        return true;
+
+    if (uop.dst.bitSize < BS_16) {
+        reportRuntimeError("Expected 32 or 16 bits argument. Found %d bit size.\n", uop.dst.bitSize);
+        return false;
+    }
+
+    uop.op = XUOP_Pop;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Lea) {
+    UNUSED(sim);
+
+    if (arg1->isA(XARG_MEMREF) || arg1->isA(XARG_CONST)) {
+        reportRuntimeError("Invalid destination '%s' for 'lea' instruction.\n", arg1->toString().c_str());
+        return false;
+    }
+    if (arg2->isA(XARG_REGISTER) || arg2->isA(XARG_CONST)) {
+        reportRuntimeError("Second argument of instruction 'lea' should be a memory reference.\n");
+        return false;
+    }
+
+    if (!lowerOperand(arg1, uop.dst) || !lowerOperand(arg2, uop.src))
+        return false;
+
+    if ((uop.dst.kind == XOPD_Reg) && (uop.src.kind == XOPD_Mem))
+        uop.op = XUOP_Lea;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Add) { UNUSED(sim); return lowerAluInstruction(this, "'add'", XFN_ADD, uop); }
+IMPLEMENT_LOWERING(Sub) { UNUSED(sim); return lowerAluInstruction(this, "'sub'", XFN_SUB, uop); }
+IMPLEMENT_LOWERING(And) { UNUSED(sim); return lowerAluInstruction(this, "'and'", XFN_AND, uop); }
+IMPLEMENT_LOWERING(Or) { UNUSED(sim); return lowerAluInstruction(this, "'or'", XFN_OR, uop); }
+IMPLEMENT_LOWERING(Xor) { UNUSED(sim); return lowerAluInstruction(this, "'xor'", XFN_XOR, uop); }
+IMPLEMENT_LOWERING(Cmp) { UNUSED(sim); return lowerAluInstruction(this, "'cmp'", XFN_CMP, uop); }
+IMPLEMENT_LOWERING(Test) { UNUSED(sim); return lowerAluInstruction(this, "'test'", XFN_TEST, uop); }
+IMPLEMENT_LOWERING(Shl) { UNUSED(sim); return lowerShiftInstruction(this, XFN_SHL, uop); }
+IMPLEMENT_LOWERING(Shr) { UNUSED(sim); return lowerShiftInstruction(this, XFN_SHR, uop); }
+IMPLEMENT_LOWERING(Inc) { UNUSED(sim); return lowerUnaryAluInstruction(arg, XFN_ADD, 1, XFLAGS_INC_DEC, uop); }
+IMPLEMENT_LOWERING(Dec) { UNUSED(sim); return lowerUnaryAluInstruction(arg, XFN_SUB, 1, XFLAGS_INC_DEC, uop); }
+IMPLEMENT_LOWERING(Not) { UNUSED(sim); return lowerUnaryAluInstruction(arg, XFN_NOT, 0, 0, uop); }
+IMPLEMENT_LOWERING(Neg) { UNUSED(sim); return lowerUnaryAluInstruction(arg, XFN_NEG, 1, XFLAGS_ALL, uop); }
+
+IMPLEMENT_LOWERING(Imul1) { return XInstruction::lower(sim, uop); }
+IMPLEMENT_LOWERING(Idiv) { return XInstruction::lower(sim, uop); }
+IMPLEMENT_LOWERING(Mul) { return XInstruction::lower(sim, uop); }
+IMPLEMENT_LOWERING(Div) { return XInstruction::lower(sim, uop); }
+
+IMPLEMENT_LOWERING(Imul2) {
+    UNUSED(sim);
+
+    if (arg1->isA(XARG_MEMREF) || arg1->isA(XARG_CONST) ||
+        (arg1->isA(XARG_REGISTER) && ((XArgRegister *)arg1)->regSize == BS_8)) {
+        reportRuntimeError("Invalid destination '%s' for IMUL instruction.\n", arg1->toString().c_str());
+        return false;
+    }
+
+    if (!lowerOperand(arg1, uop.dst) || !lowerOperand(arg2, uop.src))
+        return false;
+
+    if ((uop.dst.kind != XOPD_Reg) || (uop.src.kind == XOPD_None))
+        return true;
+
+    if (uop.src.bitSize == 0)
+        uop.src.bitSize = uop.dst.bitSize;
+
+    if ((uop.src.kind != XOPD_Imm) && (uop.src.bitSize != uop.dst.bitSize)) {
+        reportRuntimeError("Invalid arguments in IMUL instruction.  Both operands should be 16 bits or 32 bits.\n");
+        return false;
+    }
+
+    uop.op = XUOP_Imul2;
+    uop.flags = XFLAGS_ALL;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Jmp) {
+    if (!lowerTarget(sim, arg, uop.src)) {
+        reportRuntimeError("Invalid argument for jump instruction. Expected register, memory reference, label or constant, found '%s'.\n",
+                    arg->toString().c_str());
+        return false;
+    }
+
+    if (uop.src.kind != XOPD_None)
+        uop.op = XUOP_Jmp;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Jz) { return lowerConditionalJump(sim, arg, XCC_Z, uop); }
+IMPLEMENT_LOWERING(Jnz) { return lowerConditionalJump(sim, arg, XCC_NZ, uop); }
+IMPLEMENT_LOWERING(Jl) { return lowerConditionalJump(sim, arg, XCC_L, uop); }
+IMPLEMENT_LOWERING(Jg) { return lowerConditionalJump(sim, arg, XCC_G, uop); }
+IMPLEMENT_LOWERING(Jle) { return lowerConditionalJump(sim, arg, XCC_LE, uop); }
+IMPLEMENT_LOWERING(Jge) { return lowerConditionalJump(sim, arg, XCC_GE, uop); }
+IMPLEMENT_LOWERING(Jb) { return lowerConditionalJump(sim, arg, XCC_B, uop); }
+IMPLEMENT_LOWERING(Ja) { return lowerConditionalJump(sim, arg, XCC_A, uop); }
+IMPLEMENT_LOWERING(Jbe) { return lowerConditionalJump(sim, arg, XCC_BE, uop); }
+IMPLEMENT_LOWERING(Jae) { return lowerConditionalJump(sim, arg, XCC_AE, uop); }
+
+IMPLEMENT_LOWERING(Call) {
+    //Native calls are done by the instruction node, a function that is
+    //missing is reported when the call runs
+    if (arg->isA(XARG_EXT_FUNC)) {
+        if (!sim->checkNativeCalls())
+            return false;
+
+        ((XArgExternalFuntionName *)arg)->resolve(sim, false);
+        return true;
+    }
+
+    if (!lowerTarget(sim, arg, uop.src)) {
+        reportRuntimeError("Invalid argument for call instruction. Expected address, found '%s'.\n",
+                    arg->toString().c_str());
+        return false;
+    }
+
+    if (uop.src.kind != XOPD_None)
+        uop.op = XUOP_Call;
+
+    return true;
+}
+
+IMPLEMENT_LOWERING(Ret) { UNUSED(sim); uop.op = XUOP_Ret; return true; }
+
+IMPLEMENT_LOWERING(Seta) { UNUSED(sim); return lowerSetByte(this, XCC_A, uop); }
+IMPLEMENT_LOWERING(Setae) { UNUSED(sim); return lowerSetByte(this, XCC_AE, uop); }
+IMPLEMENT_LOWERING(Setb) { UNUSED(sim); return lowerSetByte(this, XCC_B, uop); }
+IMPLEMENT_LOWERING(Setbe) { UNUSED(sim); return lowerSetByte(this, XCC_BE, uop); }
+IMPLEMENT_LOWERING(Setg) { UNUSED(sim); return lowerSetByte(this, XCC_G, uop); }
+IMPLEMENT_LOWERING(Setge) { UNUSED(sim); return lowerSetByte(this, XCC_GE, uop); }
+IMPLEMENT_LOWERING(Setl) { UNUSED(sim); return lowerSetByte(this, XCC_L, uop); }
+IMPLEMENT_LOWERING(Setle) { UNUSED(sim); return lowerSetByte(this, XCC_LE, uop); }
+IMPLEMENT_LOWERING(Setno) { UNUSED(sim); return lowerSetByte(this, XCC_NO, uop); }
+IMPLEMENT_LOWERING(Setnp) { UNUSED(sim); return lowerSetByte(this, XCC_NP, uop); }
+IMPLEMENT_LOWERING(Setns) { UNUSED(sim); return lowerSetByte(this, XCC_NS, uop); }
+IMPLEMENT_LOWERING(Setnz) { UNUSED(sim); return lowerSetByte(this, XCC_NZ, uop); }
+IMPLEMENT_LOWERING(Seto) { UNUSED(sim); return lowerSetByte(this, XCC_O, uop); }
+IMPLEMENT_LOWERING(Setp) { UNUSED(sim); return lowerSetByte(this, XCC_P, uop); }
+IMPLEMENT_LOWERING(Sets) { UNUSED(sim); return lowerSetByte(this, XCC_S, uop); }
+IMPLEMENT_LOWERING(Setz) { UNUSED(sim); return lowerSetByte(this, XCC_Z, uop); }
+
+IMPLEMENT_LOWERING(Cdq) { UNUSED(sim); uop.op = XUOP_Cdq; return true; }
+IMPLEMENT_LOWERING(Leave) { UNUSED(sim); uop.op = XUOP_Leave; return true; }
@@ -134,6 +134,8 @@ void reportRuntimeError(const char *format, ...);
 #define XCMD_Exec        902
 #define XCMD_Stop        903
 #define XCMD_Debug       904
+#define XCMD_Map         905
+#define XCMD_Snapshot    906
 
 extern const char *xreg[];
 
@@ -232,24 +234,22 @@ class XArgIdentifier: public XArgument
 public:
     XArgIdentifier(string name) {
         this->name = name;
+        this->target = 0;
     }
 
     int getKind() { return XARG_IDENTIFIER; }
     string toString() { return name; }
 
     bool eval(X86Sim *xsim, int resultSize, uint8_t flags, uint32_t &result) {
-        if (!xsim->getLabel(name, result)) {
-            reportRuntimeError("Invalid label '%s'\n", name.c_str());
-            return false;
-        }
-        else 
-            return true;
+        result = target;
+        return true;
     }
 
     bool getReference(X86Sim *, XReference &) { return false; }
 
 public:
     string name;
+    uint32_t target; //Instruction index or data address, bound at load time
 };
 
 class XArgPhyAddress: public XArgument
@@ -275,6 +275,7 @@ public:
     XArgExternalFuntionName(string libName, string funcName) {
         this->libName = libName;
         this->funcName = funcName;
+        this->hfunc = NULL;
     }
 
     int getKind() { return XARG_EXT_FUNC; }
@@ -283,9 +284,12 @@ public:
     bool eval(X86Sim *xsim, int resultSize, uint8_t flags, uint32_t &result) { return false; }
     bool getReference(X86Sim *, XReference &) { return false; }
 
+    bool resolve(X86Sim *sim, bool report);
+
 public:
     string libName;
     string funcName;
+    HFUNC hfunc;    //Resolved when the program is loaded
 };
 
 class XArgConstant: public XArgument
@@ -339,6 +343,21 @@ public:
     int value;
 };
 
+/* Data label in an address expression, it's a constant once the label is
+ * bound to its address.
+ */
+class XAddrExprLabel: public XAddrExprConst
+{
+public:
+    XAddrExprLabel(string name): XAddrExprConst(0) { this->name = name; }
+
+    string toString() { return name; }
+    uint32_t &address() { return *(uint32_t *)&value; }
+
+public:
+    string name;
+};
+
 class XAddrExpr2Term: public XAddrExpr
 {
 public:
@@ -403,6 +422,13 @@ protected:
     XInstruction() {}
 public:
     virtual bool exec(X86Sim *sim, XReference &result) = 0;
+
+    //Converts the instruction to a micro-op.  By default the micro-op calls exec
+    virtual bool lower(X86Sim *sim, XMicroOp &uop) {
+        UNUSED(sim);
+        uop.op = XUOP_Generic;
+        return true;
+    }
 };
 
 class XCmdShow: public XInstruction {
@@ -465,6 +491,40 @@ public:
     string file_path;
 };
 
+class XCmdMap: public XInstruction {
+public:
+    XCmdMap(string file_path, uint32_t address, bool readOnly) {
+        this->file_path = file_path;
+        this->address = address;
+        this->readOnly = readOnly;
+    }
+
+    string toString() { return "#map \"" + file_path + "\""; }
+    int getKind() { return XCMD_Map; }
+    bool exec(X86Sim *sim, XReference &result);
+
+public:
+    string file_path;
+    uint32_t address;
+    bool readOnly;
+};
+
+class XCmdSnapshot: public XInstruction {
+public:
+    XCmdSnapshot(bool save, string name) {
+        this->save = save;
+        this->name = name;
+    }
+
+    string toString() { return string("#snapshot ") + (save? "save " : "restore ") + name; }
+    int getKind() { return XCMD_Snapshot; }
+    bool exec(X86Sim *sim, XReference &result);
+
+public:
+    bool save;      //False to restore
+    string name;
+};
+
 class XCmdStop: public XInstruction {
 public:
     XCmdStop() { }
@@ -572,6 +632,7 @@ public:
             const char *getName() { return name; } \
             int getKind() { return XINST_##opcode; } \
             bool exec(X86Sim *sim, XReference &result); \
+            bool lower(X86Sim *sim, XMicroOp &uop); \
         }
 
 #define DEFINE_INSTRUCTION_1ARG(name, opcode) \
@@ -581,6 +642,7 @@ public:
             const char *getName() { return name; } \
             int getKind() { return XINST_##opcode; } \
             bool exec(X86Sim *sim, XReference &result); \
+            bool lower(X86Sim *sim, XMicroOp &uop); \
         }
 
 #define DEFINE_INSTRUCTION_0ARG(name, opcode)    \
@@ -592,11 +654,15 @@ public:
             } \
             int getKind() { return XINST_##opcode; } \
             bool exec(X86Sim *sim, XReference &result); \
+            bool lower(X86Sim *sim, XMicroOp &uop); \
         }
 
 #define IMPLEMENT_INSTRUCTION(opcode) \
         bool XI_##opcode::exec(X86Sim *sim, XReference &result)
 
+#define IMPLEMENT_LOWERING(opcode) \
+        bool XI_##opcode::lower(X86Sim *sim, XMicroOp &uop)
+
 DEFINE_INSTRUCTION_2ARG("mov", Mov);
 DEFINE_INSTRUCTION_2ARG("movsx", Movsx);
 DEFINE_INSTRUCTION_2ARG("movzx", Movzx);